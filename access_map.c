@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "access_map.h"
+
+/* Log2 bins of reuse distance, the last one open-ended */
+#define REUSE_BINS 32
+
+/* Host addresses of consecutive accesses this close count as one page */
+#define PAGE_BYTES 4096
+
+/* The traffic to one segment identifier over the run. Identifiers are
+ * reused after an unmap, so one may stand for several segments
+ */
+struct seg_access {
+        uint64_t loads;
+        uint64_t stores;
+        uint64_t sequential;            /* one word past the last access */
+        uint64_t near;                  /* any other step under a line */
+        uint64_t far;
+        uint64_t l1_misses;
+        uint32_t last_offset;
+        bool touched;
+        uint32_t num_buckets;           /* up to the furthest line used */
+        uint32_t bucket_capacity;
+        uint64_t *buckets;              /* accesses per line of offsets */
+};
+
+/* One level of a simulated cache. A tag is its line number plus one, so
+ * that 0 marks an empty way
+ */
+struct cache_level {
+        uint32_t sets;
+        uint32_t ways;
+        uint64_t *tags;
+        uint64_t *stamps;
+        uint64_t hits;
+        uint64_t misses;
+};
+
+/* When each host line was last used, by open addressing */
+struct line_table {
+        uint64_t *lines;
+        uint64_t *times;
+        uint64_t capacity;
+        uint64_t count;
+};
+
+struct access_map {
+        struct seg_access *segs;
+        uint32_t num_segs;
+        uint64_t time;                  /* accesses so far */
+        uintptr_t last_address;
+        uint64_t same_line;             /* host distance from the last */
+        uint64_t same_page;
+        uint64_t other_page;
+        struct line_table lines;
+        uint64_t cold;                  /* first use of a line */
+        uint64_t reuse[REUSE_BINS];
+        bool simulate_caches;
+        struct cache_level l1;
+        struct cache_level l2;
+};
+
+static void *check_alloc(void *p)
+{
+        if (p == NULL) {
+                fprintf(stderr, "Error: Could not allocate access map\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+static void cache_init(struct cache_level *level, uint32_t bytes,
+                       uint32_t ways)
+{
+        level->ways = ways;
+        level->sets = bytes / ACCESS_LINE_BYTES / ways;
+        level->tags = check_alloc(calloc((size_t)level->sets * ways,
+                                         sizeof(uint64_t)));
+        level->stamps = check_alloc(calloc((size_t)level->sets * ways,
+                                           sizeof(uint64_t)));
+        level->hits = 0;
+        level->misses = 0;
+}
+
+/* Function: cache_access
+ * Does: Looks a line up in one level of the cache, filling it over the
+ *       least recently used way of its set when it is not there
+ * Paramters: struct cache_level*, uint64_t (line), uint64_t (time)
+ * Returns: bool (whether it hit)
+ */
+static bool cache_access(struct cache_level *level, uint64_t line,
+                         uint64_t now)
+{
+        size_t first = (size_t)(line % level->sets) * level->ways;
+        uint64_t *tags = &level->tags[first];
+        uint64_t *stamps = &level->stamps[first];
+        uint32_t victim = 0;
+
+        for (uint32_t way = 0; way < level->ways; way++) {
+                if (tags[way] == line + 1) {
+                        stamps[way] = now;
+                        level->hits++;
+                        return true;
+                }
+                if (stamps[way] < stamps[victim]) {
+                        victim = way;
+                }
+        }
+        tags[victim] = line + 1;
+        stamps[victim] = now;
+        level->misses++;
+        return false;
+}
+
+static uint64_t *line_slot(struct line_table *table, uint64_t line)
+{
+        uint64_t mask = table->capacity - 1;
+        uint64_t i = ((line * 0x9e3779b97f4a7c15ULL) >> 20) & mask;
+
+        while (table->lines[i] != 0 && table->lines[i] != line + 1) {
+                i = (i + 1) & mask;
+        }
+        return &table->lines[i];
+}
+
+static void line_table_grow(struct line_table *table)
+{
+        struct line_table old = *table;
+
+        table->capacity = old.capacity == 0 ? 4096 : old.capacity * 2;
+        table->lines = check_alloc(calloc(table->capacity, sizeof(uint64_t)));
+        table->times = check_alloc(malloc(table->capacity * sizeof(uint64_t)));
+        for (uint64_t i = 0; i < old.capacity; i++) {
+                if (old.lines[i] != 0) {
+                        uint64_t *slot = line_slot(table, old.lines[i] - 1);
+
+                        *slot = old.lines[i];
+                        table->times[slot - table->lines] = old.times[i];
+                }
+        }
+        free(old.lines);
+        free(old.times);
+}
+
+/* Function: note_reuse
+ * Does: Bins how many accesses have passed since a host line was last
+ *       used, and remembers that it was used now
+ * Paramters: access_map, uint64_t (line)
+ * Returns: None
+ */
+static void note_reuse(access_map map, uint64_t line)
+{
+        struct line_table *table = &map->lines;
+
+        if (2 * (table->count + 1) > table->capacity) {
+                line_table_grow(table);
+        }
+
+        uint64_t *slot = line_slot(table, line);
+        uint64_t *time = &table->times[slot - table->lines];
+
+        if (*slot == 0) {
+                *slot = line + 1;
+                table->count++;
+                map->cold++;
+        } else {
+                uint64_t distance = map->time - *time;
+                unsigned bin = 63 - __builtin_clzll(distance);
+
+                map->reuse[bin < REUSE_BINS ? bin : REUSE_BINS - 1]++;
+        }
+        *time = map->time;
+}
+
+static struct seg_access *seg_access_of(access_map map, uint32_t seg_num)
+{
+        if (seg_num >= map->num_segs) {
+                uint32_t num_segs = map->num_segs == 0 ? 64 : map->num_segs;
+
+                while (num_segs <= seg_num) {
+                        num_segs *= 2;
+                }
+                map->segs = check_alloc(realloc(map->segs, num_segs *
+                                                sizeof(*map->segs)));
+                memset(&map->segs[map->num_segs], 0,
+                       (num_segs - map->num_segs) * sizeof(*map->segs));
+                map->num_segs = num_segs;
+        }
+        return &map->segs[seg_num];
+}
+
+/* Function: access_map_new
+ * Does: Creates an empty access map, with simulated L1 and L2 caches if
+ *       asked for
+ * Paramters: bool
+ * Returns: access_map
+ */
+access_map access_map_new(bool simulate_caches)
+{
+        access_map map = check_alloc(calloc(1, sizeof(*map)));
+
+        map->simulate_caches = simulate_caches;
+        if (simulate_caches) {
+                cache_init(&map->l1, ACCESS_L1_BYTES, ACCESS_L1_WAYS);
+                cache_init(&map->l2, ACCESS_L2_BYTES, ACCESS_L2_WAYS);
+        }
+        return map;
+}
+
+/* Function: access_record
+ * Does: Records one segmented load or store that has just run: where in
+ *       its segment it fell, the step from the segment's last access, and
+ *       the host address of the word, for reuse and the simulated caches
+ * Paramters: access_map, uint32_t, uint32_t, const uint32_t*, bool
+ * Returns: None
+ */
+void access_record(access_map map, uint32_t seg_num, uint32_t offset,
+                   const uint32_t *word, bool store)
+{
+        struct seg_access *seg = seg_access_of(map, seg_num);
+        uint32_t bucket = offset / ACCESS_BUCKET_WORDS;
+        uintptr_t address = (uintptr_t)word;
+        uint64_t line = address / ACCESS_LINE_BYTES;
+
+        map->time++;
+        if (store) {
+                seg->stores++;
+        } else {
+                seg->loads++;
+        }
+
+        if (bucket >= seg->bucket_capacity) {
+                uint32_t capacity = 2 * seg->bucket_capacity;
+
+                if (capacity <= bucket) {
+                        capacity = bucket + 1;
+                }
+                seg->buckets = check_alloc(realloc(seg->buckets, capacity *
+                                                   sizeof(uint64_t)));
+                memset(&seg->buckets[seg->bucket_capacity], 0,
+                       (capacity - seg->bucket_capacity) * sizeof(uint64_t));
+                seg->bucket_capacity = capacity;
+        }
+        if (bucket >= seg->num_buckets) {
+                seg->num_buckets = bucket + 1;
+        }
+        seg->buckets[bucket]++;
+
+        if (seg->touched) {
+                int64_t step = (int64_t)offset - seg->last_offset;
+
+                if (step == 1) {
+                        seg->sequential++;
+                } else if (step > -ACCESS_BUCKET_WORDS &&
+                           step < ACCESS_BUCKET_WORDS) {
+                        seg->near++;
+                } else {
+                        seg->far++;
+                }
+        }
+        seg->touched = true;
+        seg->last_offset = offset;
+
+        if (map->time > 1) {
+                uintptr_t distance = address > map->last_address
+                                   ? address - map->last_address
+                                   : map->last_address - address;
+
+                if (line == map->last_address / ACCESS_LINE_BYTES) {
+                        map->same_line++;
+                } else if (distance < PAGE_BYTES) {
+                        map->same_page++;
+                } else {
+                        map->other_page++;
+                }
+        }
+        map->last_address = address;
+
+        note_reuse(map, line);
+        if (map->simulate_caches && !cache_access(&map->l1, line, map->time)) {
+                seg->l1_misses++;
+                cache_access(&map->l2, line, map->time);
+        }
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+        return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+static const struct seg_access *sort_segs;
+
+static uint64_t traffic(uint32_t seg_num)
+{
+        return sort_segs[seg_num].loads + sort_segs[seg_num].stores;
+}
+
+static int by_traffic(const void *x, const void *y)
+{
+        uint64_t tx = traffic(*(const uint32_t *)x);
+        uint64_t ty = traffic(*(const uint32_t *)y);
+
+        return (tx < ty) - (tx > ty);
+}
+
+/* Function: print_heat
+ * Does: Prints one segment's accesses across its offsets, lowest offset
+ *       first, as a row of characters from ' ' (none) to '@' (the busiest
+ *       cell of the row)
+ * Paramters: FILE*, const struct seg_access*
+ * Returns: None
+ */
+static void print_heat(FILE *out, const struct seg_access *seg)
+{
+        static const char shades[] = " .:-=+*#%@";
+        uint64_t cells[ACCESS_MAP_COLUMNS] = { 0 };
+        uint32_t columns = seg->num_buckets < ACCESS_MAP_COLUMNS
+                         ? seg->num_buckets : ACCESS_MAP_COLUMNS;
+        uint64_t busiest = 0;
+
+        for (uint32_t b = 0; b < seg->num_buckets; b++) {
+                cells[(uint64_t)b * columns / seg->num_buckets] +=
+                        seg->buckets[b];
+        }
+        for (uint32_t col = 0; col < columns; col++) {
+                if (cells[col] > busiest) {
+                        busiest = cells[col];
+                }
+        }
+
+        fputs("           |", out);
+        for (uint32_t col = 0; col < columns; col++) {
+                unsigned shade = (unsigned)((cells[col] * 9 + busiest - 1) /
+                                            busiest);
+
+                fputc(shades[shade], out);
+        }
+        fprintf(out, "| words 0-%u\n",
+                seg->num_buckets * ACCESS_BUCKET_WORDS - 1);
+}
+
+/* Function: access_report
+ * Does: Prints the hottest segments with how their accesses step through
+ *       them and a heat map of each, then how far apart consecutive
+ *       accesses fell in host memory, how soon lines were used again and,
+ *       if simulated, how the caches did
+ * Paramters: FILE*, access_map
+ * Returns: None
+ */
+void access_report(FILE *out, access_map map)
+{
+        uint32_t *ids = check_alloc(malloc((map->num_segs + 1) *
+                                           sizeof(uint32_t)));
+        uint32_t num_ids = 0;
+        uint64_t loads = 0;
+        uint64_t stores = 0;
+
+        for (uint32_t id = 0; id < map->num_segs; id++) {
+                if (map->segs[id].touched) {
+                        ids[num_ids++] = id;
+                        loads += map->segs[id].loads;
+                        stores += map->segs[id].stores;
+                }
+        }
+        sort_segs = map->segs;
+        qsort(ids, num_ids, sizeof(uint32_t), by_traffic);
+
+        fprintf(out, "Accesses: %llu loads, %llu stores to %u segment "
+                "identifiers\n", (unsigned long long)loads,
+                (unsigned long long)stores, num_ids);
+        fprintf(out, "%10s %14s %7s %6s %6s %6s %6s  %s\n", "segment",
+                "accesses", "share", "seq", "near", "far",
+                map->simulate_caches ? "L1miss" : "", "order");
+        for (uint32_t i = 0; i < num_ids && i < ACCESS_TOP; i++) {
+                const struct seg_access *seg = &map->segs[ids[i]];
+                uint64_t count = seg->loads + seg->stores;
+                uint64_t steps = seg->sequential + seg->near + seg->far;
+                double local = percent(seg->sequential + seg->near, steps);
+
+                fprintf(out, "%10u %14llu %6.2f%% %5.1f%% %5.1f%% %5.1f%% ",
+                        ids[i], (unsigned long long)count,
+                        percent(count, loads + stores),
+                        percent(seg->sequential, steps),
+                        percent(seg->near, steps), percent(seg->far, steps));
+                if (map->simulate_caches) {
+                        fprintf(out, "%5.1f%%", percent(seg->l1_misses, count));
+                } else {
+                        fprintf(out, "%6s", "");
+                }
+                fprintf(out, "  %s\n", steps == 0 ? "-"
+                        : local >= 90 ? "fits layout"
+                        : local >= 50 ? "mixed" : "scattered");
+                print_heat(out, seg);
+        }
+
+        uint64_t pairs = map->same_line + map->same_page + map->other_page;
+
+        fprintf(out, "Host distance from the previous access: %.1f%% same "
+                "line, %.1f%% same page, %.1f%% further\n",
+                percent(map->same_line, pairs), percent(map->same_page, pairs),
+                percent(map->other_page, pairs));
+
+        fprintf(out, "Reuse distance (accesses since the line was last "
+                "used):\n%22s %14llu\n", "first use",
+                (unsigned long long)map->cold);
+        for (unsigned bin = 0; bin < REUSE_BINS; bin++) {
+                if (map->reuse[bin] != 0) {
+                        char range[32];
+
+                        if (bin == 0) {
+                                snprintf(range, sizeof(range), "1");
+                        } else if (bin == REUSE_BINS - 1) {
+                                snprintf(range, sizeof(range), "%llu+",
+                                         1ULL << bin);
+                        } else {
+                                snprintf(range, sizeof(range), "%llu-%llu",
+                                         1ULL << bin, (2ULL << bin) - 1);
+                        }
+                        fprintf(out, "%22s %14llu %6.2f%%\n", range,
+                                (unsigned long long)map->reuse[bin],
+                                percent(map->reuse[bin], map->time));
+                }
+        }
+
+        if (map->simulate_caches) {
+                fprintf(out, "L1 (%uK, %u-way): %.2f%% hits; "
+                        "L2 (%uK, %u-way): %.2f%% hits, %llu misses\n",
+                        ACCESS_L1_BYTES >> 10, ACCESS_L1_WAYS,
+                        percent(map->l1.hits, map->l1.hits + map->l1.misses),
+                        ACCESS_L2_BYTES >> 10, ACCESS_L2_WAYS,
+                        percent(map->l2.hits, map->l2.hits + map->l2.misses),
+                        (unsigned long long)map->l2.misses);
+        }
+
+        free(ids);
+}
+
+/* Function: access_map_free
+ * Does: Frees an access map
+ * Paramters: access_map*
+ * Returns: None
+ */
+void access_map_free(access_map *map)
+{
+        for (uint32_t id = 0; id < (*map)->num_segs; id++) {
+                free((*map)->segs[id].buckets);
+        }
+        free((*map)->segs);
+        free((*map)->lines.lines);
+        free((*map)->lines.times);
+        if ((*map)->simulate_caches) {
+                free((*map)->l1.tags);
+                free((*map)->l1.stamps);
+                free((*map)->l2.tags);
+                free((*map)->l2.stamps);
+        }
+        free(*map);
+        *map = NULL;
+}
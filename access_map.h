@@ -0,0 +1,29 @@
+#ifndef ACCESS_MAP_INCLUDED
+#define ACCESS_MAP_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Host cache line, and the offsets per cell of the heat map (one line) */
+#define ACCESS_LINE_BYTES 64
+#define ACCESS_BUCKET_WORDS (ACCESS_LINE_BYTES / 4)
+
+/* The simulated caches: set-associative, LRU, 64-byte lines */
+#define ACCESS_L1_BYTES (32 << 10)
+#define ACCESS_L1_WAYS 8
+#define ACCESS_L2_BYTES (1 << 20)
+#define ACCESS_L2_WAYS 16
+
+/* Segments shown in the report, and the width of their heat map rows */
+#define ACCESS_TOP 10
+#define ACCESS_MAP_COLUMNS 48
+
+typedef struct access_map *access_map;
+
+access_map access_map_new(bool simulate_caches);
+void access_record(access_map map, uint32_t seg_num, uint32_t offset,
+                   const uint32_t *word, bool store);
+void access_report(FILE *out, access_map map);
+void access_map_free(access_map *map);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define PROFILE_HEADER "# um arena profile"
+
+struct arena_profile {
+        uint64_t maps;
+        uint8_t *hot;                   /* a bit per ordinal below maps */
+};
+
+struct arena_trace {
+        uint64_t *uses;                 /* by ordinal */
+        uint64_t capacity;
+};
+
+/* The chunk blocks are being carved from, and the free blocks, of hot or
+ * of cold segments
+ */
+struct side {
+        uint32_t *next;
+        uint32_t left;                  /* words past next in the chunk */
+        uint32_t *free[ARENA_CLASSES];  /* by size in grains */
+};
+
+struct arena {
+        struct side sides[2];           /* cold, hot */
+        arena_profile profile;          /* NULL to place all as cold */
+        uint32_t **chunks;
+        uint64_t num_chunks;
+        uint64_t capacity;
+        struct arena_counts counts;
+};
+
+static void *check_alloc(void *p)
+{
+        if (p == NULL) {
+                fprintf(stderr, "Error: Could not allocate arena\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+/* Function: arena_profile_read
+ * Does: Reads a profile written by arena_trace_write and marks the
+ *       ordinals used at least as often as the average segment hot
+ * Paramters: FILE*
+ * Returns: arena_profile (NULL if it is not one)
+ */
+arena_profile arena_profile_read(FILE *in)
+{
+        char header[64];
+        unsigned long long maps, ordinal, uses;
+
+        if (fgets(header, sizeof(header), in) == NULL ||
+            strncmp(header, PROFILE_HEADER, strlen(PROFILE_HEADER)) != 0 ||
+            fscanf(in, " maps %llu", &maps) != 1) {
+                return NULL;
+        }
+
+        uint64_t *counts = check_alloc(calloc(maps + 1, sizeof(uint64_t)));
+        uint64_t total = 0;
+        int got;
+
+        while ((got = fscanf(in, " %llu %llu", &ordinal, &uses)) == 2) {
+                if (ordinal >= maps) {
+                        break;
+                }
+                counts[ordinal] = uses;
+                total = uses > UINT64_MAX - total ? UINT64_MAX : total + uses;
+        }
+        if (got != EOF) {
+                free(counts);
+                return NULL;
+        }
+
+        arena_profile profile = check_alloc(malloc(sizeof(*profile)));
+
+        profile->maps = maps;
+        profile->hot = check_alloc(calloc(maps / 8 + 1, 1));
+
+        /* The average rounded up: counts[i] >= average is counts[i] * maps
+         * >= total without a product that could overflow
+         */
+        uint64_t average = maps == 0 ? 0 : total / maps + (total % maps != 0);
+
+        for (uint64_t i = 0; i < maps; i++) {
+                if (counts[i] != 0 && counts[i] >= average) {
+                        profile->hot[i / 8] |= 1 << (i % 8);
+                }
+        }
+        free(counts);
+        return profile;
+}
+
+/* Function: arena_profile_hot
+ * Does: Tells whether the segment mapped in a given order was hot
+ * Paramters: arena_profile, uint64_t
+ * Returns: bool (false past the end of the profile)
+ */
+bool arena_profile_hot(arena_profile profile, uint64_t ordinal)
+{
+        return ordinal < profile->maps &&
+               (profile->hot[ordinal / 8] & (1 << (ordinal % 8))) != 0;
+}
+
+void arena_profile_free(arena_profile *profile)
+{
+        free((*profile)->hot);
+        free(*profile);
+        *profile = NULL;
+}
+
+arena_trace arena_trace_new()
+{
+        arena_trace trace = check_alloc(malloc(sizeof(*trace)));
+
+        trace->capacity = 1024;
+        trace->uses = check_alloc(calloc(trace->capacity, sizeof(uint64_t)));
+        return trace;
+}
+
+/* Function: arena_trace_use
+ * Does: Counts a load or store of the segment mapped in a given order
+ * Paramters: arena_trace, uint64_t
+ * Returns: None
+ */
+void arena_trace_use(arena_trace trace, uint64_t ordinal)
+{
+        if (ordinal >= trace->capacity) {
+                uint64_t capacity = trace->capacity;
+
+                while (capacity <= ordinal) {
+                        capacity *= 2;
+                }
+                trace->uses = check_alloc(realloc(trace->uses, capacity *
+                                                  sizeof(uint64_t)));
+                memset(trace->uses + trace->capacity, 0,
+                       (capacity - trace->capacity) * sizeof(uint64_t));
+                trace->capacity = capacity;
+        }
+        trace->uses[ordinal]++;
+}
+
+/* Function: arena_trace_write
+ * Does: Writes the counts as a profile: a header, the number of segments
+ *       mapped, then the ordinal and count of each segment used
+ * Paramters: arena_trace, FILE*, uint64_t
+ * Returns: None
+ */
+void arena_trace_write(arena_trace trace, FILE *out, uint64_t maps)
+{
+        fprintf(out, "%s: maps, then ordinal and loads and stores\n",
+                PROFILE_HEADER);
+        fprintf(out, "maps %llu\n", (unsigned long long)maps);
+        for (uint64_t i = 0; i < trace->capacity && i < maps; i++) {
+                if (trace->uses[i] != 0) {
+                        fprintf(out, "%llu %llu\n", (unsigned long long)i,
+                                (unsigned long long)trace->uses[i]);
+                }
+        }
+}
+
+void arena_trace_free(arena_trace *trace)
+{
+        free((*trace)->uses);
+        free(*trace);
+        *trace = NULL;
+}
+
+/* Function: arena_new
+ * Does: Creates an empty arena, placing by a profile if one is given. The
+ *       arena owns the profile from here on
+ * Paramters: arena_profile (NULL for none)
+ * Returns: arena
+ */
+arena arena_new(arena_profile profile)
+{
+        arena a = check_alloc(calloc(1, sizeof(*a)));
+
+        a->profile = profile;
+        return a;
+}
+
+/* Starts carving a side from a fresh chunk; whatever was left of the last
+ * one is too short and stays unused
+ */
+static void new_chunk(arena a, struct side *side)
+{
+        if (a->num_chunks == a->capacity) {
+                a->capacity = a->capacity == 0 ? 64 : a->capacity * 2;
+                a->chunks = check_alloc(realloc(a->chunks, a->capacity *
+                                                sizeof(uint32_t *)));
+        }
+        side->next = check_alloc(calloc(1, ARENA_CHUNK_BYTES));
+        side->left = ARENA_CHUNK_BYTES / sizeof(uint32_t);
+        a->chunks[a->num_chunks++] = side->next;
+        a->counts.chunks++;
+}
+
+/* Function: arena_alloc
+ * Does: Gives num_words zeroed words for the segment mapped in a given
+ *       order: a free block of the same size if there is one, else the
+ *       next one carved from its side's chunk
+ * Paramters: arena, uint32_t, uint64_t
+ * Returns: uint32_t* (NULL if the segment is empty or too long)
+ */
+uint32_t *arena_alloc(arena a, uint32_t num_words, uint64_t ordinal)
+{
+        if (num_words == 0 || num_words > ARENA_MAX_WORDS) {
+                return NULL;
+        }
+
+        bool hot = a->profile != NULL &&
+                   arena_profile_hot(a->profile, ordinal);
+        struct side *side = &a->sides[hot];
+        uint32_t grains = (num_words + ARENA_GRAIN_WORDS - 1) /
+                          ARENA_GRAIN_WORDS;
+        uint32_t *words = side->free[grains];
+
+        a->counts.placed++;
+        a->counts.hot += hot;
+        if (words != NULL) {
+                memcpy(&side->free[grains], words, sizeof(uint32_t *));
+                memset(words, 0, grains * ARENA_GRAIN_WORDS *
+                       sizeof(uint32_t));
+                a->counts.reused++;
+                return words;
+        }
+
+        if (side->left < grains * ARENA_GRAIN_WORDS) {
+                new_chunk(a, side);
+        }
+        words = side->next;
+        side->next += grains * ARENA_GRAIN_WORDS;
+        side->left -= grains * ARENA_GRAIN_WORDS;
+        return words;
+}
+
+/* Function: arena_release
+ * Does: Puts an unmapped segment's block on the free list of its size and
+ *       side, for the next map of that size
+ * Paramters: arena, uint32_t*, uint32_t, uint64_t
+ * Returns: None
+ */
+void arena_release(arena a, uint32_t *words, uint32_t num_words,
+                   uint64_t ordinal)
+{
+        bool hot = a->profile != NULL &&
+                   arena_profile_hot(a->profile, ordinal);
+        struct side *side = &a->sides[hot];
+        uint32_t grains = (num_words + ARENA_GRAIN_WORDS - 1) /
+                          ARENA_GRAIN_WORDS;
+
+        memcpy(words, &side->free[grains], sizeof(uint32_t *));
+        side->free[grains] = words;
+}
+
+struct arena_counts arena_counts(arena a)
+{
+        return a->counts;
+}
+
+/* Function: arena_free
+ * Does: Frees an arena, its chunks (every block in it) and its profile
+ * Paramters: arena*
+ * Returns: None
+ */
+void arena_free(arena *a)
+{
+        for (uint64_t i = 0; i < (*a)->num_chunks; i++) {
+                free((*a)->chunks[i]);
+        }
+        free((*a)->chunks);
+        if ((*a)->profile != NULL) {
+                arena_profile_free(&(*a)->profile);
+        }
+        free(*a);
+        *a = NULL;
+}
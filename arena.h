@@ -0,0 +1,63 @@
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Segments up to this long are placed in arena chunks of this many bytes */
+#define ARENA_MAX_WORDS 64
+#define ARENA_CHUNK_BYTES (64 << 10)
+
+/* Blocks are a whole number of these, so that a free one can hold the
+ * pointer to the next
+ */
+#define ARENA_GRAIN_WORDS 2
+#define ARENA_CLASSES (ARENA_MAX_WORDS / ARENA_GRAIN_WORDS + 1)
+
+/* Which segments of a run were used most: the loads and stores of each,
+ * by the order it was mapped in (its ordinal), as a run with
+ * --arena-record writes them. A later run of the same program on the same
+ * input maps the same segments in the same order, and calls the ones used
+ * at least as often as the average hot.
+ */
+typedef struct arena_profile *arena_profile;
+
+arena_profile arena_profile_read(FILE *in);
+bool arena_profile_hot(arena_profile profile, uint64_t ordinal);
+void arena_profile_free(arena_profile *profile);
+
+/* Counts the loads and stores of each segment by ordinal, to be written
+ * as an arena_profile
+ */
+typedef struct arena_trace *arena_trace;
+
+arena_trace arena_trace_new();
+void arena_trace_use(arena_trace trace, uint64_t ordinal);
+void arena_trace_write(arena_trace trace, FILE *out, uint64_t maps);
+void arena_trace_free(arena_trace *trace);
+
+/* Where the words of short segments go instead of calloc: carved in the
+ * order they are mapped from chunks of ARENA_CHUNK_BYTES, so that
+ * segments mapped together (the nodes of a list, say) share cache lines
+ * and pages, with no allocator header between them. Unmapped blocks wait
+ * on a list per size for the next map of that size. With a profile, hot
+ * segments are carved from chunks of their own, kept apart from the cold
+ * ones. Only the thread running the UM may use it.
+ */
+typedef struct arena *arena;
+
+struct arena_counts {
+        uint64_t chunks;
+        uint64_t placed;                /* blocks carved or reused */
+        uint64_t reused;
+        uint64_t hot;                   /* placed as hot by the profile */
+};
+
+arena arena_new(arena_profile profile);
+uint32_t *arena_alloc(arena a, uint32_t num_words, uint64_t ordinal);
+void arena_release(arena a, uint32_t *words, uint32_t num_words,
+                   uint64_t ordinal);
+struct arena_counts arena_counts(arena a);
+void arena_free(arena *a);
+
+#endif
@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "callgraph.h"
+
+/* One routine in one calling context. Node 0 is the program's start */
+struct cg_node {
+        uint32_t entry;                 /* pc of its first word */
+        uint32_t parent;
+        uint32_t child;                 /* first callee, 0 for none */
+        uint32_t sibling;               /* next callee of the parent */
+        uint64_t calls;
+        uint64_t self;                  /* instructions run in it */
+        uint64_t total;                 /* with its callees, at report */
+};
+
+struct cg_frame {
+        uint32_t node;
+        uint32_t ret;                   /* return address */
+};
+
+struct call_graph {
+        struct cg_node *nodes;
+        uint32_t num_nodes;
+        uint32_t capacity;
+        struct cg_frame stack[CALLGRAPH_MAX_DEPTH];
+        uint32_t depth;
+        uint32_t max_depth;
+        uint64_t since;                 /* instructions at the last jump */
+        uint64_t calls;
+        uint64_t returns;
+};
+
+static void *grow(void *array, uint32_t *capacity, size_t size)
+{
+        *capacity = *capacity == 0 ? 256 : *capacity * 2;
+        array = realloc(array, *capacity * size);
+        if (array == NULL) {
+                fprintf(stderr, "Error: Could not allocate call graph\n");
+                exit(EXIT_FAILURE);
+        }
+        return array;
+}
+
+/* Function: callee
+ * Does: Finds, or adds, the node for a routine called from a node
+ * Paramters: call_graph, uint32_t (the caller), uint32_t (the entry)
+ * Returns: uint32_t
+ */
+static uint32_t callee(call_graph graph, uint32_t parent, uint32_t entry)
+{
+        for (uint32_t n = graph->nodes[parent].child; n != 0;
+             n = graph->nodes[n].sibling) {
+                if (graph->nodes[n].entry == entry) {
+                        return n;
+                }
+        }
+
+        if (graph->num_nodes == graph->capacity) {
+                graph->nodes = grow(graph->nodes, &graph->capacity,
+                                    sizeof(struct cg_node));
+        }
+
+        uint32_t n = graph->num_nodes++;
+
+        graph->nodes[n] = (struct cg_node){ 0 };
+        graph->nodes[n].entry = entry;
+        graph->nodes[n].parent = parent;
+        graph->nodes[n].sibling = graph->nodes[parent].child;
+        graph->nodes[parent].child = n;
+        return n;
+}
+
+/* Function: callgraph_new
+ * Does: Creates a call graph whose stack holds the program's start
+ * Paramters: None
+ * Returns: call_graph
+ */
+call_graph callgraph_new()
+{
+        call_graph graph = calloc(1, sizeof(*graph));
+
+        if (graph == NULL) {
+                fprintf(stderr, "Error: Could not allocate call graph\n");
+                exit(EXIT_FAILURE);
+        }
+        graph->nodes = grow(NULL, &graph->capacity, sizeof(struct cg_node));
+        graph->nodes[0] = (struct cg_node){ 0 };
+        graph->nodes[0].calls = 1;
+        graph->num_nodes = 1;
+        graph->stack[0].node = 0;
+        graph->stack[0].ret = UINT32_MAX;
+        graph->depth = 1;
+        graph->max_depth = 1;
+        return graph;
+}
+
+/* Function: derived
+ * Does: Says whether, running the words from first up to pc, register c
+ *       ends up computed from what register a holds at first. A jump
+ *       through a table right after it computes its target from its
+ *       address
+ * Paramters: const uint32_t*, uint32_t, uint32_t, unsigned, unsigned
+ * Returns: bool
+ */
+static bool derived(const uint32_t *words, uint32_t first, uint32_t pc,
+                    unsigned a, unsigned c)
+{
+        unsigned from = 1u << a;        /* registers computed from a */
+
+        for (uint32_t i = first; i < pc; i++) {
+                uint32_t word = words[i];
+                uint32_t opcode = word >> 28;
+                unsigned to = (word >> 6) & 0x7;
+                unsigned uses = (1u << ((word >> 3) & 0x7)) |
+                                (1u << (word & 0x7));
+
+                if (opcode == 13) {
+                        from &= ~(1u << ((word >> 25) & 0x7));
+                } else if (opcode == 1 || (opcode >= 3 && opcode <= 6) ||
+                           (opcode == 0 && (from & uses) != 0)) {
+                        from = (from & ~(1u << to)) |
+                               ((from & uses) != 0 ? 1u << to : 0);
+                } else if (opcode == 8) {
+                        from &= ~(1u << ((word >> 3) & 0x7));
+                } else if (opcode == 11) {
+                        from &= ~(1u << (word & 0x7));
+                }
+        }
+        return (from & (1u << c)) != 0;
+}
+
+/* Function: is_call
+ * Does: Says whether the jump at pc through register c calls a routine.
+ *       It does if, looking back through the words before it and no
+ *       further than the last jump or halt, a load_value put the address
+ *       of the word after the jump in a register that still holds it, and
+ *       the target was not computed from it. A conditional move into
+ *       register c first means a branch whose other way goes on at the
+ *       next word, which holds that address too
+ * Paramters: const uint32_t* (segment 0), uint32_t, unsigned,
+ *            const uint32_t* (registers)
+ * Returns: bool
+ */
+static bool is_call(const uint32_t *words, uint32_t pc, unsigned c,
+                    const uint32_t *r)
+{
+        uint32_t ret = pc + 1;
+
+        for (uint32_t k = 1; k <= CALLGRAPH_WINDOW && k <= pc; k++) {
+                uint32_t word = words[pc - k];
+                uint32_t opcode = word >> 28;
+
+                if (opcode == 13 && (word & 0x1ffffff) == ret) {
+                        unsigned a = (word >> 25) & 0x7;
+
+                        return a != c && r[a] == ret &&
+                               !derived(words, pc - k + 1, pc, a, c);
+                }
+                if ((opcode == 0 && ((word >> 6) & 0x7) == c) ||
+                    opcode == 7 || opcode == 12) {
+                        return false;
+                }
+        }
+        return false;
+}
+
+/* Function: callgraph_jump
+ * Does: Called as a load_program within segment 0 at pc is about to jump
+ *       to target through register c. Counts the instructions since the
+ *       last jump, this one included, to the routine running, then takes
+ *       the jump as a return, a call or neither
+ * Paramters: call_graph, const uint32_t* (segment 0), uint32_t, unsigned,
+ *            const uint32_t* (registers), uint64_t (instructions run so
+ *            far, this one included)
+ * Returns: None
+ */
+void callgraph_jump(call_graph graph, const uint32_t *words, uint32_t pc,
+                    unsigned c, const uint32_t *r, uint64_t instructions)
+{
+        struct cg_frame *top = &graph->stack[graph->depth - 1];
+        uint32_t target = r[c];
+
+        graph->nodes[top->node].self += instructions - graph->since;
+        graph->since = instructions;
+
+        uint32_t lowest = graph->depth > CALLGRAPH_UNWIND
+                          ? graph->depth - CALLGRAPH_UNWIND : 1;
+
+        for (uint32_t d = graph->depth; d > lowest; d--) {
+                if (graph->stack[d - 1].ret == target) {
+                        graph->depth = d - 1;
+                        graph->returns++;
+                        return;
+                }
+        }
+
+        if (graph->depth == CALLGRAPH_MAX_DEPTH ||
+            !is_call(words, pc, c, r)) {
+                return;
+        }
+
+        uint32_t n = callee(graph, top->node, target);
+
+        graph->nodes[n].calls++;
+        graph->stack[graph->depth].node = n;
+        graph->stack[graph->depth].ret = pc + 1;
+        graph->depth++;
+        graph->calls++;
+        if (graph->depth > graph->max_depth) {
+                graph->max_depth = graph->depth;
+        }
+}
+
+/* Writes the entries from the root down to a node, split by ';' */
+static void write_stack(FILE *out, call_graph graph, uint32_t n)
+{
+        if (n != 0) {
+                write_stack(out, graph, graph->nodes[n].parent);
+                fprintf(out, ";");
+        }
+        fprintf(out, "0x%x", graph->nodes[n].entry);
+}
+
+/* Whether a node's routine is also one of its callers', so that its
+ * instructions are already in the caller's total
+ */
+static bool recursive(call_graph graph, uint32_t n)
+{
+        uint32_t entry = graph->nodes[n].entry;
+
+        while (n != 0) {
+                n = graph->nodes[n].parent;
+                if (graph->nodes[n].entry == entry) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/* One routine, over all the contexts it ran in */
+struct cg_routine {
+        uint32_t entry;
+        uint64_t calls;
+        uint64_t self;
+        uint64_t total;
+};
+
+static int by_entry(const void *x, const void *y)
+{
+        uint32_t ex = ((const struct cg_routine *)x)->entry;
+        uint32_t ey = ((const struct cg_routine *)y)->entry;
+
+        return (ex > ey) - (ex < ey);
+}
+
+static int by_total(const void *x, const void *y)
+{
+        uint64_t tx = ((const struct cg_routine *)x)->total;
+        uint64_t ty = ((const struct cg_routine *)y)->total;
+
+        return (tx < ty) - (tx > ty);
+}
+
+/* Function: callgraph_report
+ * Does: Counts the instructions since the last jump to the routine
+ *       running, then writes one line per calling context that ran any
+ *       instruction of its own to folded, as flamegraph.pl reads them
+ *       ("0x0;0x1c;0x2a0 1234": the entries from the start down and the
+ *       instructions run in the last one itself), and a summary of the
+ *       busiest routines, with instructions run in each (exclusive) and
+ *       in it and what it called (inclusive), to summary. Either may be
+ *       NULL
+ * Paramters: FILE*, FILE*, call_graph, uint64_t (instructions at the end)
+ * Returns: None
+ */
+void callgraph_report(FILE *folded, FILE *summary, call_graph graph,
+                      uint64_t instructions)
+{
+        struct cg_node *nodes = graph->nodes;
+
+        nodes[graph->stack[graph->depth - 1].node].self +=
+                instructions - graph->since;
+        graph->since = instructions;
+
+        /* A callee always comes after its caller */
+        for (uint32_t n = 0; n < graph->num_nodes; n++) {
+                nodes[n].total = nodes[n].self;
+        }
+        for (uint32_t n = graph->num_nodes - 1; n > 0; n--) {
+                nodes[nodes[n].parent].total += nodes[n].total;
+        }
+
+        if (folded != NULL) {
+                for (uint32_t n = 0; n < graph->num_nodes; n++) {
+                        if (nodes[n].self == 0) {
+                                continue;
+                        }
+                        write_stack(folded, graph, n);
+                        fprintf(folded, " %llu\n",
+                                (unsigned long long)nodes[n].self);
+                }
+        }
+        if (summary == NULL) {
+                return;
+        }
+
+        struct cg_routine *routines = malloc(graph->num_nodes *
+                                             sizeof(*routines));
+        uint32_t num_routines = 0;
+
+        for (uint32_t n = 0; n < graph->num_nodes; n++) {
+                routines[n].entry = nodes[n].entry;
+                routines[n].calls = nodes[n].calls;
+                routines[n].self = nodes[n].self;
+                routines[n].total = recursive(graph, n) ? 0 : nodes[n].total;
+        }
+        qsort(routines, graph->num_nodes, sizeof(*routines), by_entry);
+        for (uint32_t n = 0; n < graph->num_nodes; n++) {
+                struct cg_routine *last = routines + num_routines;
+
+                if (num_routines > 0 && last[-1].entry == routines[n].entry) {
+                        last[-1].calls += routines[n].calls;
+                        last[-1].self += routines[n].self;
+                        last[-1].total += routines[n].total;
+                } else {
+                        *last = routines[n];
+                        num_routines++;
+                }
+        }
+        qsort(routines, num_routines, sizeof(*routines), by_total);
+
+        uint64_t all = nodes[0].total;
+
+        fprintf(summary, "Call graph: %u routines in %u contexts, %llu "
+                "calls, %llu returns, deepest stack %u\n", num_routines,
+                graph->num_nodes, (unsigned long long)graph->calls,
+                (unsigned long long)graph->returns, graph->max_depth);
+        fprintf(summary, "%10s %12s %14s %7s %14s %7s\n", "entry", "calls",
+                "inclusive", "", "exclusive", "");
+        for (uint32_t i = 0; i < num_routines && i < CALLGRAPH_TOP; i++) {
+                struct cg_routine *routine = &routines[i];
+
+                fprintf(summary, "%10u %12llu %14llu %6.2f%% %14llu "
+                        "%6.2f%%\n", routine->entry,
+                        (unsigned long long)routine->calls,
+                        (unsigned long long)routine->total,
+                        all == 0 ? 0.0 : 100.0 * routine->total / all,
+                        (unsigned long long)routine->self,
+                        all == 0 ? 0.0 : 100.0 * routine->self / all);
+        }
+
+        free(routines);
+}
+
+/* Function: callgraph_free
+ * Does: Frees a call graph
+ * Paramters: call_graph*
+ * Returns: None
+ */
+void callgraph_free(call_graph *graph)
+{
+        free((*graph)->nodes);
+        free(*graph);
+        *graph = NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef CALLGRAPH_INCLUDED
+#define CALLGRAPH_INCLUDED
+#include <stdio.h>
+#include <stdint.h>
+
+/* Calls deeper than this are counted in the routine making them */
+#define CALLGRAPH_MAX_DEPTH 1024
+
+/* Frames a return may unwind at once, looking for its return address */
+#define CALLGRAPH_UNWIND 16
+
+/* Words before a jump searched for the load_value of a return address */
+#define CALLGRAPH_WINDOW 16
+
+/* Routines shown in the summary */
+#define CALLGRAPH_TOP 20
+
+/* A calling-context tree of a UM, built from its jumps. Compiled UM code
+ * calls a routine by loading the return address (the word after the
+ * load_program) into a register, perhaps storing it, and jumping with
+ * load_program(0, entry); it returns with load_program(0, that address).
+ * So a jump is taken as a return if it goes to the return address of a
+ * frame on the shadow stack, as a call if a load_value shortly before it
+ * put the address of the word after it in a register that still holds it
+ * (see is_call), and as a jump within the routine otherwise. The
+ * instructions between two jumps are counted to the routine on top of the
+ * stack. The engines call callgraph_jump at each load_program within
+ * segment 0.
+ */
+typedef struct call_graph *call_graph;
+
+call_graph callgraph_new();
+void callgraph_jump(call_graph graph, const uint32_t *words, uint32_t pc,
+                    unsigned c, const uint32_t *r, uint64_t instructions);
+void callgraph_report(FILE *folded, FILE *summary, call_graph graph,
+                      uint64_t instructions);
+void callgraph_free(call_graph *graph);
+
+#endif
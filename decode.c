@@ -0,0 +1,490 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECODE_X86 1
+#endif
+
+#include "decode.h"
+#include "peephole.h"
+#include "specialise.h"
+#include "idiom.h"
+#include "write_barrier.h"
+
+typedef void (*decode_fn)(decoded_prog prog, const uint32_t *words,
+                          uint32_t first, uint32_t count);
+
+/* Function: decode_scalar
+ * Does: Decodes a run of words one at a time
+ * Paramters: decoded_prog, const uint32_t*, uint32_t, uint32_t
+ * Returns: None
+ */
+static void decode_scalar(decoded_prog prog, const uint32_t *words,
+                          uint32_t first, uint32_t count)
+{
+        for (uint32_t i = first; i < first + count; i++) {
+                uint32_t word = words[i];
+                uint32_t opcode = word >> 28;
+
+                prog->opcode[i] = opcode;
+                if (opcode == 13) {
+                        prog->a[i] = (word >> 25) & 7;
+                        prog->b[i] = 0;
+                        prog->c[i] = 0;
+                        prog->lvalue[i] = word & 0x1ffffff;
+                } else {
+                        prog->a[i] = (word >> 6) & 7;
+                        prog->b[i] = (word >> 3) & 7;
+                        prog->c[i] = word & 7;
+                        prog->lvalue[i] = 0;
+                }
+        }
+}
+
+#ifdef DECODE_X86
+/* Narrows four 32-bit lanes holding values below 256 to four bytes */
+__attribute__((target("sse2")))
+static inline uint32_t narrow4_sse2(__m128i v)
+{
+        __m128i packed = _mm_packs_epi32(v, v);
+
+        return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+}
+
+/* Function: decode_sse2
+ * Does: Decodes four words per step with SSE2 shifts and masks
+ * Paramters: decoded_prog, const uint32_t*, uint32_t, uint32_t
+ * Returns: None
+ */
+__attribute__((target("sse2")))
+static void decode_sse2(decoded_prog prog, const uint32_t *words,
+                        uint32_t first, uint32_t count)
+{
+        const __m128i seven = _mm_set1_epi32(7);
+        const __m128i thirteen = _mm_set1_epi32(13);
+        const __m128i lv_mask = _mm_set1_epi32(0x1ffffff);
+        uint32_t i = first;
+        uint32_t end = first + count;
+
+        for (; i + 4 <= end; i += 4) {
+                __m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+                __m128i op = _mm_srli_epi32(w, 28);
+                __m128i is_lv = _mm_cmpeq_epi32(op, thirteen);
+                __m128i a3 = _mm_and_si128(_mm_srli_epi32(w, 6), seven);
+                __m128i a13 = _mm_and_si128(_mm_srli_epi32(w, 25), seven);
+                __m128i a = _mm_or_si128(_mm_and_si128(is_lv, a13),
+                                         _mm_andnot_si128(is_lv, a3));
+                __m128i b = _mm_andnot_si128(is_lv, _mm_and_si128(
+                                             _mm_srli_epi32(w, 3), seven));
+                __m128i c = _mm_andnot_si128(is_lv, _mm_and_si128(w, seven));
+                __m128i lv = _mm_and_si128(is_lv, _mm_and_si128(w, lv_mask));
+                uint32_t bytes;
+
+                bytes = narrow4_sse2(op);
+                memcpy(prog->opcode + i, &bytes, 4);
+                bytes = narrow4_sse2(a);
+                memcpy(prog->a + i, &bytes, 4);
+                bytes = narrow4_sse2(b);
+                memcpy(prog->b + i, &bytes, 4);
+                bytes = narrow4_sse2(c);
+                memcpy(prog->c + i, &bytes, 4);
+                _mm_storeu_si128((__m128i *)(prog->lvalue + i), lv);
+        }
+
+        decode_scalar(prog, words, i, end - i);
+}
+
+/* Narrows eight 32-bit lanes holding values below 256 to eight bytes */
+__attribute__((target("avx2")))
+static inline uint64_t narrow8_avx2(__m256i v)
+{
+        __m256i packed = _mm256_packus_epi32(v, v);
+
+        packed = _mm256_packus_epi16(packed, packed);
+        uint64_t lo = (uint32_t)_mm_cvtsi128_si32(
+                                _mm256_castsi256_si128(packed));
+        uint64_t hi = (uint32_t)_mm_cvtsi128_si32(
+                                _mm256_extracti128_si256(packed, 1));
+
+        return lo | (hi << 32);
+}
+
+/* Function: decode_avx2
+ * Does: Decodes eight words per step with AVX2 shifts and masks
+ * Paramters: decoded_prog, const uint32_t*, uint32_t, uint32_t
+ * Returns: None
+ */
+__attribute__((target("avx2")))
+static void decode_avx2(decoded_prog prog, const uint32_t *words,
+                        uint32_t first, uint32_t count)
+{
+        const __m256i seven = _mm256_set1_epi32(7);
+        const __m256i thirteen = _mm256_set1_epi32(13);
+        const __m256i lv_mask = _mm256_set1_epi32(0x1ffffff);
+        uint32_t i = first;
+        uint32_t end = first + count;
+
+        for (; i + 8 <= end; i += 8) {
+                __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+                __m256i op = _mm256_srli_epi32(w, 28);
+                __m256i is_lv = _mm256_cmpeq_epi32(op, thirteen);
+                __m256i a = _mm256_blendv_epi8(
+                        _mm256_and_si256(_mm256_srli_epi32(w, 6), seven),
+                        _mm256_and_si256(_mm256_srli_epi32(w, 25), seven),
+                        is_lv);
+                __m256i b = _mm256_andnot_si256(is_lv,
+                                _mm256_and_si256(_mm256_srli_epi32(w, 3),
+                                                 seven));
+                __m256i c = _mm256_andnot_si256(is_lv,
+                                                _mm256_and_si256(w, seven));
+                __m256i lv = _mm256_and_si256(is_lv,
+                                              _mm256_and_si256(w, lv_mask));
+                uint64_t bytes;
+
+                bytes = narrow8_avx2(op);
+                memcpy(prog->opcode + i, &bytes, 8);
+                bytes = narrow8_avx2(a);
+                memcpy(prog->a + i, &bytes, 8);
+                bytes = narrow8_avx2(b);
+                memcpy(prog->b + i, &bytes, 8);
+                bytes = narrow8_avx2(c);
+                memcpy(prog->c + i, &bytes, 8);
+                _mm256_storeu_si256((__m256i *)(prog->lvalue + i), lv);
+        }
+
+        decode_scalar(prog, words, i, end - i);
+}
+#endif
+
+/* Picks the widest decoder this CPU supports, once */
+static decode_fn select_decoder()
+{
+        static decode_fn chosen = NULL;
+
+        if (chosen == NULL) {
+                chosen = decode_scalar;
+#ifdef DECODE_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2")) {
+                        chosen = decode_avx2;
+                } else if (__builtin_cpu_supports("sse2")) {
+                        chosen = decode_sse2;
+                }
+#endif
+        }
+        return chosen;
+}
+
+/* Function: decode_segment
+ * Does: Decodes count words of a segment starting at first
+ * Paramters: decoded_prog, const uint32_t*, uint32_t, uint32_t
+ * Returns: None
+ */
+void decode_segment(decoded_prog prog, const uint32_t *words, uint32_t first,
+                    uint32_t count)
+{
+        select_decoder()(prog, words, first, count);
+
+        /* Gives each new load or store site a cache of its own */
+        for (uint32_t i = first; i < first + count; i++) {
+                if ((prog->opcode[i] != 1 && prog->opcode[i] != 2) ||
+                    prog->site[i] != 0) {
+                        continue;
+                }
+                if (prog->num_sites == prog->site_capacity) {
+                        uint32_t capacity = prog->site_capacity * 2;
+                        void *caches = realloc(prog->caches, capacity *
+                                               sizeof(*prog->caches));
+
+                        if (caches == NULL) {
+                                fprintf(stderr, "Error: Could not allocate "
+                                                "decoded program\n");
+                                exit(EXIT_FAILURE);
+                        }
+                        prog->caches = caches;
+                        prog->site_capacity = capacity;
+                }
+                memset(&prog->caches[prog->num_sites], 0,
+                       sizeof(*prog->caches));
+                prog->site[i] = prog->num_sites++;
+        }
+}
+
+static uint32_t page_words()
+{
+        return wb_page_size() / sizeof(uint32_t);
+}
+
+/* Runs inside the SIGSEGV handler: only marks the words stale */
+static void invalidate(void *cl, uint32_t first, uint32_t count)
+{
+        decoded_prog prog = cl;
+        uint8_t *faults = &prog->page_faults[first / page_words()];
+
+        if (*faults < UINT8_MAX) {
+                (*faults)++;
+        }
+        memset(prog->opcode + first, OP_STALE, count);
+}
+
+/* Function: decode_new
+ * Does: Decodes a whole program segment
+ * Paramters: uint32_t*, uint32_t
+ * Returns: decoded_prog
+ */
+decoded_prog decode_new(uint32_t *words, uint32_t length)
+{
+        decoded_prog prog = malloc(sizeof(*prog));
+        size_t bytes = length + 1;
+
+        prog->length = length;
+        prog->opcode = malloc(bytes);
+        prog->a = malloc(bytes);
+        prog->b = malloc(bytes);
+        prog->c = malloc(bytes);
+        prog->lvalue = malloc(bytes * sizeof(uint32_t));
+        prog->site = calloc(bytes, sizeof(uint32_t));
+        prog->page_faults = calloc(length / page_words() + 1, 1);
+        prog->raw_pages = 0;
+        prog->page_cold = NULL;
+        prog->page_shift = __builtin_ctz(page_words());
+        prog->site_capacity = 64;
+        prog->num_sites = 1;
+        prog->caches = calloc(prog->site_capacity, sizeof(*prog->caches));
+        prog->image = NULL;
+        prog->image_bytes = 0;
+        prog->folds = NULL;
+        prog->values = NULL;
+        prog->idioms = NULL;
+        if (prog->opcode == NULL || prog->a == NULL || prog->b == NULL ||
+            prog->c == NULL || prog->lvalue == NULL || prog->site == NULL ||
+            prog->page_faults == NULL) {
+                fprintf(stderr, "Error: Could not allocate decoded program\n");
+                exit(EXIT_FAILURE);
+        }
+
+        /* Running off the end of an empty program is an invalid opcode */
+        prog->opcode[length] = 14;
+        decode_segment(prog, words, 0, length);
+
+        return prog;
+}
+
+/* Function: decode_image_size
+ * Does: Gives the bytes decode_write_image writes for a program: opcode,
+ *       a, b and c (length + 1 bytes each, sentinel included), then
+ *       lvalue and site (length + 1 words each)
+ * Paramters: uint32_t
+ * Returns: size_t
+ */
+size_t decode_image_size(uint32_t length)
+{
+        size_t entries = (size_t)length + 1;
+
+        return 4 * entries + 2 * entries * sizeof(uint32_t);
+}
+
+/* Function: decode_write_image
+ * Does: Writes the decoded arrays in the layout decode_map expects. The
+ *       segment caches are not written; they start empty on every run
+ * Paramters: decoded_prog, FILE*
+ * Returns: bool (false if a write failed)
+ */
+bool decode_write_image(decoded_prog prog, FILE *fp)
+{
+        size_t entries = (size_t)prog->length + 1;
+
+        return fwrite(prog->opcode, 1, entries, fp) == entries &&
+               fwrite(prog->a, 1, entries, fp) == entries &&
+               fwrite(prog->b, 1, entries, fp) == entries &&
+               fwrite(prog->c, 1, entries, fp) == entries &&
+               fwrite(prog->lvalue, sizeof(uint32_t), entries, fp) == entries &&
+               fwrite(prog->site, sizeof(uint32_t), entries, fp) == entries;
+}
+
+/* Function: sound
+ * Does: Checks that arrays from an image can be run without reading or
+ *       writing outside them, whatever the file holds: each register
+ *       field names one of the eight, each opcode fits in four bits, each
+ *       site has a cache and the sentinel is in place
+ * Paramters: decoded_prog
+ * Returns: bool
+ */
+static bool sound(decoded_prog prog)
+{
+        uint8_t opcodes = 0;
+        uint8_t registers = 0;
+        uint32_t last_site = 0;
+
+        for (uint32_t i = 0; i < prog->length; i++) {
+                opcodes |= prog->opcode[i];
+                registers |= prog->a[i] | prog->b[i] | prog->c[i];
+                if (prog->site[i] > last_site) {
+                        last_site = prog->site[i];
+                }
+        }
+        return opcodes < 16 && registers < 8 &&
+               last_site < prog->num_sites &&
+               prog->opcode[prog->length] == 14 &&
+               prog->site[prog->length] == 0;
+}
+
+/* Function: decode_map
+ * Does: Uses arrays written by decode_write_image in place, without
+ *       decoding anything. Once they are found sound, the mapping
+ *       (page-aligned, private and writable) belongs to the decoded
+ *       program
+ * Paramters: void*, size_t, uint32_t, uint32_t
+ * Returns: decoded_prog (NULL, leaving the mapping alone, if the arrays
+ *          could not be run safely)
+ */
+decoded_prog decode_map(void *image, size_t bytes, uint32_t length,
+                        uint32_t num_sites)
+{
+        decoded_prog prog = malloc(sizeof(*prog));
+        size_t entries = (size_t)length + 1;
+        uint8_t *next = image;
+
+        if (num_sites == 0 || num_sites > entries) {
+                free(prog);
+                return NULL;
+        }
+        prog->length = length;
+        prog->opcode = next;
+        prog->a = next + entries;
+        prog->b = next + 2 * entries;
+        prog->c = next + 3 * entries;
+        prog->lvalue = (uint32_t *)(next + 4 * entries);
+        prog->site = prog->lvalue + entries;
+        prog->num_sites = num_sites;
+        if (!sound(prog)) {
+                free(prog);
+                return NULL;
+        }
+        prog->page_faults = calloc(length / page_words() + 1, 1);
+        prog->raw_pages = 0;
+        prog->page_cold = NULL;
+        prog->page_shift = __builtin_ctz(page_words());
+        prog->site_capacity = 64;
+        while (prog->site_capacity < num_sites) {
+                prog->site_capacity *= 2;
+        }
+        prog->caches = calloc(prog->site_capacity, sizeof(*prog->caches));
+        prog->image = image;
+        prog->image_bytes = bytes;
+        prog->folds = NULL;
+        prog->values = NULL;
+        prog->idioms = NULL;
+        if (prog->page_faults == NULL || prog->caches == NULL) {
+                fprintf(stderr, "Error: Could not allocate decoded program\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return prog;
+}
+
+/* Leaves the pages marked OP_RAW writable when the barrier is armed */
+static bool page_open(void *cl, uint32_t first)
+{
+        decoded_prog prog = cl;
+
+        return prog->page_faults[first / page_words()] > DECODE_MAX_FAULTS;
+}
+
+/* Function: decode_attach
+ * Does: Guards the segment a program was decoded from with this thread's
+ *       write barrier, so that stores into it mark the program stale
+ * Paramters: decoded_prog, uint32_t*
+ * Returns: None
+ */
+void decode_attach(decoded_prog prog, uint32_t *words)
+{
+        wb_arm(words, prog->length, invalidate,
+               prog->raw_pages == 0 ? NULL : page_open, prog);
+}
+
+/* Function: decode_detach
+ * Does: Releases this thread's write barrier while the program is parked
+ * Paramters: None
+ * Returns: None
+ */
+void decode_detach()
+{
+        wb_detach();
+}
+
+/* Function: decode_refresh
+ * Does: Re-decodes (and folds again, if the page was folded) the page
+ *       holding a stale word and guards it again. A page that keeps being
+ *       written (data kept next to code) is instead left writable and
+ *       marked OP_RAW, so that it stops costing a fault per store
+ * Paramters: decoded_prog, uint32_t*, uint32_t
+ * Returns: None
+ */
+void decode_refresh(decoded_prog prog, uint32_t *words, uint32_t index)
+{
+        uint32_t first = index & ~(page_words() - 1);
+        uint32_t count = page_words();
+
+        if (count > prog->length - first) {
+                count = prog->length - first;
+        }
+
+        uint8_t *faults = &prog->page_faults[first / page_words()];
+
+        /* A raw page's count is pinned at UINT8_MAX, to be counted once */
+        if (*faults > DECODE_MAX_FAULTS) {
+                if (*faults != UINT8_MAX) {
+                        *faults = UINT8_MAX;
+                        prog->raw_pages++;
+                }
+                memset(prog->opcode + first, OP_RAW, count);
+                return;
+        }
+
+        decode_segment(prog, words, first, count);
+        if (prog->folds != NULL &&
+            !prog->page_cold[first >> prog->page_shift]) {
+                peephole_optimize(prog, first, count);
+        }
+        wb_protect_words(first, count);
+}
+
+/* Function: decode_free
+ * Does: Frees a decoded program. The segment it came from stays guarded
+ *       until that segment is freed
+ * Paramters: decoded_prog*
+ * Returns: None
+ */
+void decode_free(decoded_prog *prog)
+{
+        if ((*prog)->image != NULL) {
+                munmap((*prog)->image, (*prog)->image_bytes);
+        } else {
+                free((*prog)->opcode);
+                free((*prog)->a);
+                free((*prog)->b);
+                free((*prog)->c);
+                free((*prog)->lvalue);
+                free((*prog)->site);
+        }
+        if ((*prog)->folds != NULL) {
+                peephole_free(&(*prog)->folds);
+        }
+        if ((*prog)->values != NULL) {
+                specialise_free(&(*prog)->values);
+        }
+        if ((*prog)->idioms != NULL) {
+                idiom_free(&(*prog)->idioms);
+        }
+        free((*prog)->page_faults);
+        free((*prog)->page_cold);
+        free((*prog)->caches);
+        free(*prog);
+        *prog = NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef DECODE_INCLUDED
+#define DECODE_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "mem_interface.h"
+
+/* Marks a word whose page has been written since it was decoded */
+#define OP_STALE 16
+
+/* Marks a word on a page that is written too often to keep guarding. It is
+ * decoded from segment 0 each time it runs.
+ */
+#define OP_RAW 17
+
+/* Marks the first word of a run folded by peephole.c. Its lvalue is the
+ * index of the fold.
+ */
+#define OP_FOLDED 18
+
+/* Mark a word given a register-specialised handler (handlers.h). Its lvalue
+ * is the handler's index in reg_handlers or mem_handlers.
+ */
+#define OP_REGS 19
+#define OP_MEMORY 20
+
+/* Mark a multiply or divide that is recording its operands, and one given
+ * a guarded fast path for the value they settled on (specialise.h). Their
+ * lvalue is the index of their site.
+ */
+#define OP_PROFILE 21
+#define OP_SPECIALISED 22
+
+/* Marks the head of a loop that may run as a copy, fill or scan kernel
+ * (idiom.h). Its lvalue is the index of the loop.
+ */
+#define OP_IDIOM 23
+
+/* Stores a page may take before it is left writable for good */
+#define DECODE_MAX_FAULTS 8
+
+/* Segment 0 decoded in one pass, one array per field. A word at index i
+ * decodes to opcode[i], a[i], b[i], c[i] and lvalue[i], exactly as
+ * decode_word would give them. Each segmented load or store gets its own
+ * segment cache, caches[site[i]]; site 0 means none. The arrays either
+ * come from malloc or, when image is set, all live in image_bytes of a
+ * mapped .umx file. folds, values and idioms are NULL until
+ * peephole_start, after which a page is optimised the first time control
+ * jumps into it (page_cold says which are still waiting).
+ */
+typedef struct decoded_prog {
+        uint32_t length;
+        uint8_t *opcode;
+        uint8_t *a;
+        uint8_t *b;
+        uint8_t *c;
+        uint32_t *lvalue;
+        uint32_t *site;
+        uint8_t *page_faults;
+        uint32_t raw_pages;             /* marked OP_RAW */
+        uint8_t *page_cold;             /* NULL until peephole_start */
+        uint32_t page_shift;            /* log2 of the words in a page */
+        struct seg_cache *caches;
+        uint32_t num_sites;
+        uint32_t site_capacity;
+        void *image;
+        size_t image_bytes;
+        struct peephole *folds;
+        struct specialise *values;
+        struct idioms *idioms;
+} *decoded_prog;
+
+decoded_prog decode_new(uint32_t *words, uint32_t length);
+size_t decode_image_size(uint32_t length);
+bool decode_write_image(decoded_prog prog, FILE *fp);
+decoded_prog decode_map(void *image, size_t bytes, uint32_t length,
+                        uint32_t num_sites);
+void decode_attach(decoded_prog prog, uint32_t *words);
+void decode_detach();
+void decode_refresh(decoded_prog prog, uint32_t *words, uint32_t index);
+void decode_free(decoded_prog *prog);
+void decode_segment(decoded_prog prog, const uint32_t *words, uint32_t first,
+                    uint32_t count);
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "diff_engine.h"
+#include "vm_interface.h"
+#include "mem_interface.h"
+#include "ops_interface.h"
+
+static const char *status_names[] = {
+        "yielded", "halted", "blocked", "faulted"
+};
+
+/* One engine's VM and everything it has printed so far */
+struct side {
+        const char *name;
+        um_vm vm;
+        vm_status status;
+        FILE *out;
+        char *output;
+        size_t output_length;
+};
+
+static void side_new(struct side *side, const char *name, FILE *program,
+                     const void *input, size_t input_length, bool ext)
+{
+        side->name = name;
+        side->out = open_memstream(&side->output, &side->output_length);
+        rewind(program);
+        side->vm = vm_new(program, NULL, side->out);
+        side->vm->ext = ext;
+        side->status = VM_YIELDED;
+        io_feed(side->vm->io, input, input_length);
+        io_close_input(side->vm->io);
+}
+
+static void side_free(struct side *side)
+{
+        vm_free(&side->vm);
+        fclose(side->out);
+        free(side->output);
+}
+
+/* Function: same_state
+ * Does: Compares everything a UM program can observe, plus where each
+ *       engine is up to
+ * Paramters: struct side*, struct side*
+ * Returns: bool
+ */
+static bool same_state(struct side *x, struct side *y)
+{
+        if (x->status != y->status ||
+            x->vm->prog_count != y->vm->prog_count ||
+            x->vm->instructions != y->vm->instructions) {
+                return false;
+        }
+        for (unsigned i = 0; i < 8; i++) {
+                if (at_reg(x->vm->registers, i) !=
+                    at_reg(y->vm->registers, i)) {
+                        return false;
+                }
+        }
+        if (x->output_length != y->output_length ||
+            memcmp(x->output, y->output, x->output_length) != 0) {
+                return false;
+        }
+        return mem_hash(x->vm->mem) == mem_hash(y->vm->mem);
+}
+
+static void dump_state(FILE *report, struct side *side)
+{
+        um_vm vm = side->vm;
+        uint32_t pc = vm->prog_count;
+
+        fprintf(report, "%s: %s after %llu instructions, pc %u", side->name,
+                status_names[side->status],
+                (unsigned long long)vm->instructions, pc);
+        if (pc < seg_length(vm->mem, 0)) {
+                fprintf(report, " (word 0x%08x)", get_word(vm->mem, 0, pc));
+        }
+        fprintf(report, "\n ");
+        for (unsigned i = 0; i < 8; i++) {
+                fprintf(report, " r%u=0x%08x", i, at_reg(vm->registers, i));
+        }
+        fprintf(report, "\n  memory hash 0x%016llx, %zu bytes of output\n",
+                (unsigned long long)mem_hash(vm->mem), side->output_length);
+        if (side->status == VM_FAULTED) {
+                fprintf(report, "  fault: %s\n", trap_message(vm->trap));
+        }
+}
+
+/* Function: diff_engines
+ * Does: Runs a program on the reference engine (run_ref) and the fast one
+ *       (run_for) side by side with the same input, comparing registers,
+ *       program counter, output and a hash of memory every interval
+ *       instructions. Stops at the first difference and dumps both
+ *       states to report. The reference output goes to output, if given.
+ *       ext allows the extension opcodes on both
+ * Paramters: FILE*, const void*, size_t, uint64_t, bool, FILE*, FILE*
+ * Returns: bool (true if the engines agreed to the end)
+ */
+bool diff_engines(FILE *program, const void *input, size_t input_length,
+                  uint64_t interval, bool ext, FILE *output, FILE *report)
+{
+        struct side ref, fast;
+        bool agree = true;
+
+        side_new(&ref, "reference", program, input, input_length, ext);
+        side_new(&fast, "fast", program, input, input_length, ext);
+
+        while (agree && ref.status == VM_YIELDED) {
+                ref.status = run_ref(ref.vm, interval);
+                fast.status = run_for(fast.vm, interval);
+                fflush(ref.out);
+                fflush(fast.out);
+
+                if (!same_state(&ref, &fast)) {
+                        agree = false;
+                        fprintf(report, "Engines diverged within the %llu "
+                                "instructions before this point\n",
+                                (unsigned long long)interval);
+                        dump_state(report, &ref);
+                        dump_state(report, &fast);
+                }
+        }
+
+        if (output != NULL) {
+                fwrite(ref.output, 1, ref.output_length, output);
+        }
+
+        side_free(&ref);
+        side_free(&fast);
+
+        return agree;
+}
@@ -0,0 +1,14 @@
+#ifndef DIFF_ENGINE_INCLUDED
+#define DIFF_ENGINE_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Instructions between comparisons unless asked otherwise */
+#define DIFF_INTERVAL 4096
+
+bool diff_engines(FILE *program, const void *input, size_t input_length,
+                  uint64_t interval, bool ext, FILE *output, FILE *report);
+
+#endif
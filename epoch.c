@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "epoch.h"
+
+/* Retirements between the quiescent points epoch_retired takes, and how
+ * many may wait at most before it gives the other threads a moment to
+ * pass theirs (a few times, as one may be blocked on input)
+ */
+#define EPOCH_BATCH 64
+#define EPOCH_MAX_PENDING (1 << 16)
+#define EPOCH_WAITS 20
+
+/* The slot of the thread calling, as of its last quiescent point, and
+ * what it has retired since
+ */
+static __thread int64_t own_slot = -1;
+static __thread uint32_t retired_since = 0;
+
+/* One thread's announcement, on a cache line of its own */
+struct epoch_slot {
+        uint64_t epoch;
+        bool active;
+} __attribute__((aligned(64)));
+
+/* Something retired in a given epoch */
+struct retired {
+        struct retired *next;
+        uint64_t epoch;
+        void *ptr;
+        uint32_t length;
+        epoch_release_fn release;
+};
+
+struct epochs {
+        uint64_t global;
+        struct retired *pending;        /* newest first */
+        uint64_t num_pending;
+        bool freeing;                   /* a thread is freeing pending */
+        uint32_t num_slots;
+        struct epoch_slot *slots;
+};
+
+/* Function: epoch_new
+ * Does: Creates the epochs for a number of thread slots, none active
+ * Paramters: uint32_t
+ * Returns: epochs
+ */
+epochs epoch_new(uint32_t num_slots)
+{
+        epochs e = malloc(sizeof(*e));
+
+        if (e == NULL || posix_memalign((void **)&e->slots,
+                                        sizeof(struct epoch_slot),
+                                        num_slots *
+                                        sizeof(struct epoch_slot)) != 0) {
+                fprintf(stderr, "Error: Could not allocate epochs\n");
+                exit(EXIT_FAILURE);
+        }
+        e->global = 0;
+        e->pending = NULL;
+        e->num_pending = 0;
+        e->freeing = false;
+        e->num_slots = num_slots;
+        for (uint32_t i = 0; i < num_slots; i++) {
+                e->slots[i].epoch = 0;
+                e->slots[i].active = false;
+        }
+        return e;
+}
+
+/* Function: epoch_enter
+ * Does: Makes a slot active, in the current epoch. The thread must not
+ *       use anything it looked up before entering
+ * Paramters: epochs, uint32_t
+ * Returns: None
+ */
+void epoch_enter(epochs e, uint32_t slot)
+{
+        struct epoch_slot *s = &e->slots[slot];
+
+        __atomic_store_n(&s->active, true, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&s->epoch, __atomic_load_n(&e->global,
+                                                    __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+}
+
+/* Function: epoch_leave
+ * Does: Makes a slot inactive, so that the epoch may move on without it
+ * Paramters: epochs, uint32_t
+ * Returns: None
+ */
+void epoch_leave(epochs e, uint32_t slot)
+{
+        __atomic_store_n(&e->slots[slot].active, false, __ATOMIC_SEQ_CST);
+}
+
+/* Moves the global epoch on from global if every active slot has
+ * announced it
+ */
+static void advance(epochs e, uint64_t global)
+{
+        for (uint32_t i = 0; i < e->num_slots; i++) {
+                struct epoch_slot *s = &e->slots[i];
+
+                if (__atomic_load_n(&s->active, __ATOMIC_SEQ_CST) &&
+                    __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) != global) {
+                        return;
+                }
+        }
+        __atomic_compare_exchange_n(&e->global, &global, global + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Pushes a chain of retired things from first to last back on pending */
+static void push(epochs e, struct retired *first, struct retired *last)
+{
+        struct retired *head = __atomic_load_n(&e->pending,
+                                               __ATOMIC_RELAXED);
+
+        do {
+                last->next = head;
+        } while (!__atomic_compare_exchange_n(&e->pending, &head, first,
+                                              true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+}
+
+/* Frees whatever was retired two epochs or more ago, unless another
+ * thread already is
+ */
+static void reclaim(epochs e)
+{
+        if (__atomic_exchange_n(&e->freeing, true, __ATOMIC_ACQUIRE)) {
+                return;
+        }
+
+        uint64_t safe = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+        struct retired *item = __atomic_exchange_n(&e->pending, NULL,
+                                                   __ATOMIC_ACQUIRE);
+        struct retired *kept = NULL;
+        struct retired *last = NULL;
+        uint64_t freed = 0;
+
+        while (item != NULL) {
+                struct retired *next = item->next;
+
+                if (item->epoch + 2 <= safe) {
+                        item->release(item->ptr, item->length);
+                        free(item);
+                        freed++;
+                } else {
+                        item->next = kept;
+                        kept = item;
+                        if (last == NULL) {
+                                last = item;
+                        }
+                }
+                item = next;
+        }
+        if (kept != NULL) {
+                push(e, kept, last);
+        }
+        __atomic_sub_fetch(&e->num_pending, freed, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->freeing, false, __ATOMIC_RELEASE);
+}
+
+/* Function: epoch_quiesce
+ * Does: Announces that the thread in a slot holds nothing it looked up
+ *       before now, then moves the epoch on and frees what it can, if
+ *       anything is waiting
+ * Paramters: epochs, uint32_t
+ * Returns: None
+ */
+void epoch_quiesce(epochs e, uint32_t slot)
+{
+        uint64_t global = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+
+        own_slot = slot;
+        retired_since = 0;
+        __atomic_store_n(&e->slots[slot].epoch, global, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&e->pending, __ATOMIC_RELAXED) == NULL) {
+                return;
+        }
+        advance(e, global);
+        reclaim(e);
+}
+
+/* Function: epoch_retire
+ * Does: Hands over something no longer reachable from the memory, to be
+ *       released once no thread can be using it
+ * Paramters: epochs, void*, uint32_t, epoch_release_fn
+ * Returns: None
+ */
+void epoch_retire(epochs e, void *ptr, uint32_t length,
+                  epoch_release_fn release)
+{
+        struct retired *item = malloc(sizeof(*item));
+
+        if (item == NULL) {
+                fprintf(stderr, "Error: Could not allocate epochs\n");
+                exit(EXIT_FAILURE);
+        }
+        item->epoch = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+        item->ptr = ptr;
+        item->length = length;
+        item->release = release;
+        __atomic_add_fetch(&e->num_pending, 1, __ATOMIC_RELAXED);
+        push(e, item, item);
+}
+
+/* Function: epoch_retired
+ * Does: Passes a quiescent point for the calling thread every EPOCH_BATCH
+ *       calls, so that a thread unmapping segment after segment does not
+ *       leave a slice's worth of them waiting, and holds it back briefly
+ *       while too many are waiting anyway. Called where the thread
+ *       holds nothing it looked up, once it has passed a quiescent point
+ *       of its own
+ * Paramters: epochs
+ * Returns: None
+ */
+void epoch_retired(epochs e)
+{
+        if (own_slot < 0 || ++retired_since < EPOCH_BATCH) {
+                return;
+        }
+        epoch_quiesce(e, own_slot);
+        for (int i = 0; i < EPOCH_WAITS &&
+             __atomic_load_n(&e->num_pending, __ATOMIC_RELAXED) >
+             EPOCH_MAX_PENDING; i++) {
+                struct timespec moment = { 0, 50000 };
+
+                nanosleep(&moment, NULL);
+                epoch_quiesce(e, own_slot);
+        }
+}
+
+/* Function: epoch_free
+ * Does: Releases everything still retired and frees the epochs, once no
+ *       thread is left to use any of it
+ * Paramters: epochs*
+ * Returns: None
+ */
+void epoch_free(epochs *e)
+{
+        struct retired *item = (*e)->pending;
+
+        while (item != NULL) {
+                struct retired *next = item->next;
+
+                item->release(item->ptr, item->length);
+                free(item);
+                item = next;
+        }
+        free((*e)->slots);
+        free(*e);
+        *e = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef EPOCH_INCLUDED
+#define EPOCH_INCLUDED
+#include <stdint.h>
+
+/* Called to free something retired, once no thread can be using it */
+typedef void (*epoch_release_fn)(void *ptr, uint32_t length);
+
+/* Epoch-based reclamation for the memory the threads of one UM share.
+ * Each thread has a slot, and between slices of instructions, when it
+ * holds no pointer into segment words or the segment table, passes a
+ * quiescent point (epoch_quiesce) announcing the global epoch. Words of
+ * unmapped segments and outgrown segment tables are retired in the epoch
+ * of the unmap and freed once the epoch has moved on twice, which it only
+ * does when every active thread has announced it: by then no thread can
+ * still be using them. A thread that waits (joining, or at the end) leaves
+ * its slot so that it holds nobody up. A thread that unmaps a lot also
+ * passes one every few unmaps (epoch_retired). Retiring is a lock-free
+ * push; only one thread at a time frees.
+ */
+typedef struct epochs *epochs;
+
+epochs epoch_new(uint32_t num_slots);
+void epoch_enter(epochs e, uint32_t slot);
+void epoch_leave(epochs e, uint32_t slot);
+void epoch_quiesce(epochs e, uint32_t slot);
+void epoch_retire(epochs e, void *ptr, uint32_t length,
+                  epoch_release_fn release);
+void epoch_retired(epochs e);
+void epoch_free(epochs *e);
+
+#endif
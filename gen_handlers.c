@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Writes handlers.inc: one handler for every register triple of each kind
+ * in handlers.h, and the tables handlers_assign indexes. The names must be
+ * in the order of reg_kind and mem_kind.
+ */
+static const char *reg_kinds[] = { "cmov", "add", "mul", "nand" };
+static const char *mem_kinds[] = { "sload", "sstore" };
+
+#define NUM_REG_KINDS (sizeof(reg_kinds) / sizeof(reg_kinds[0]))
+#define NUM_MEM_KINDS (sizeof(mem_kinds) / sizeof(mem_kinds[0]))
+
+/* Function: write_kind
+ * Does: Writes the 512 handlers of one kind, named KIND_A_B_C
+ * Paramters: FILE*, const char*, int (whether they use memory)
+ * Returns: None
+ */
+static void write_kind(FILE *out, const char *kind, int memory)
+{
+        for (unsigned triple = 0; triple < 512; triple++) {
+                unsigned a = triple >> 6;
+                unsigned b = triple >> 3 & 7;
+                unsigned c = triple & 7;
+
+                if (memory) {
+                        fprintf(out, "static void %s_%u_%u_%u(uint32_t *r, "
+                                "um_mem mem, seg_cache cache)\n{\n"
+                                "        %s(r, mem, cache, %u, %u, %u);\n"
+                                "}\n\n", kind, a, b, c, kind, a, b, c);
+                } else {
+                        fprintf(out, "static void %s_%u_%u_%u(uint32_t *r)\n"
+                                "{\n        %s(r, %u, %u, %u);\n}\n\n",
+                                kind, a, b, c, kind, a, b, c);
+                }
+        }
+}
+
+/* Function: write_table
+ * Does: Writes a table of the handlers of the given kinds, kind by kind
+ * Paramters: FILE*, const char* (type), const char* (name), const char**,
+ *            unsigned
+ * Returns: None
+ */
+static void write_table(FILE *out, const char *type, const char *name,
+                        const char **kinds, unsigned num_kinds)
+{
+        fprintf(out, "const %s %s[] = {\n", type, name);
+        for (unsigned k = 0; k < num_kinds; k++) {
+                for (unsigned triple = 0; triple < 512; triple++) {
+                        fprintf(out, "        %s_%u_%u_%u,\n", kinds[k],
+                                triple >> 6, triple >> 3 & 7, triple & 7);
+                }
+        }
+        fprintf(out, "};\n\n");
+}
+
+int main(void)
+{
+        fprintf(stdout, "/* Generated by gen_handlers. Do not edit. */\n\n");
+        for (unsigned k = 0; k < NUM_REG_KINDS; k++) {
+                write_kind(stdout, reg_kinds[k], 0);
+        }
+        for (unsigned k = 0; k < NUM_MEM_KINDS; k++) {
+                write_kind(stdout, mem_kinds[k], 1);
+        }
+        write_table(stdout, "reg_handler", "reg_handlers", reg_kinds,
+                    NUM_REG_KINDS);
+        write_table(stdout, "mem_handler", "mem_handlers", mem_kinds,
+                    NUM_MEM_KINDS);
+
+        return fclose(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
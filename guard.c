@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "guard.h"
+#include "mem_interface.h"
+#include "write_barrier.h"
+#include "trap.h"
+
+/* The memory of the UM this thread is running */
+static __thread um_mem current = NULL;
+
+/* Bytes of whole pages holding num_words, the words ending the last one */
+static size_t data_bytes(uint32_t num_words)
+{
+        size_t page = wb_page_size();
+        size_t bytes = (size_t)num_words * sizeof(uint32_t);
+
+        return (bytes + page - 1) & ~(page - 1);
+}
+
+/* Function: guard_fault
+ * Does: Called by the SIGSEGV handler for a fault the write barrier does
+ *       not own. A fault in the guard of a segment of the attached UM is
+ *       an out-of-bounds load or store: it traps like the checked one.
+ *       The fault comes from a load or store in the interpreter, never
+ *       from inside libc, so unwinding from here leaves nothing half done.
+ *       Segments not mapped (or not yet) are passed over
+ * Paramters: void* (the address)
+ * Returns: bool (false if the fault is not in a guard)
+ */
+static bool guard_fault(void *addr)
+{
+        uintptr_t address = (uintptr_t)addr;
+        um_mem mem = current;
+
+        if (mem == NULL) {
+                return false;
+        }
+
+        uint32_t num_segs = __atomic_load_n(&mem->num_segs, __ATOMIC_ACQUIRE);
+        struct seg_table *table = __atomic_load_n(&mem->table,
+                                                  __ATOMIC_ACQUIRE);
+
+        for (uint32_t id = 1; id < num_segs; id++) {
+                mem_seg seg = table->slots[id];
+
+                if (!__atomic_load_n(&seg->mapped, __ATOMIC_ACQUIRE)) {
+                        continue;
+                }
+
+                uintptr_t end = (uintptr_t)(seg->words + seg->length);
+
+                if (seg->guarded && address >= end &&
+                    address < end + GUARD_BYTES) {
+                        trap_raise(TRAP_OUT_OF_BOUNDS);
+                }
+        }
+        return false;
+}
+
+/* Function: guard_alloc_words
+ * Does: Allocates zeroed storage for a segment in a reservation of its
+ *       own, placed so that the word after its last is the first of
+ *       GUARD_BYTES that cannot be touched
+ * Paramters: uint32_t
+ * Returns: uint32_t* (NULL if the address space ran out)
+ */
+uint32_t *guard_alloc_words(uint32_t num_words)
+{
+        size_t bytes = data_bytes(num_words);
+        char *base = mmap(NULL, bytes + GUARD_BYTES, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (base == MAP_FAILED) {
+                return NULL;
+        }
+        if (mprotect(base, bytes, PROT_READ | PROT_WRITE) != 0) {
+                munmap(base, bytes + GUARD_BYTES);
+                return NULL;
+        }
+        wb_set_fallback(guard_fault);
+
+        return (uint32_t *)(base + bytes) - num_words;
+}
+
+/* Function: guard_free_words
+ * Does: Releases storage from guard_alloc_words, guard and all
+ * Paramters: uint32_t*, uint32_t
+ * Returns: None
+ */
+void guard_free_words(uint32_t *words, uint32_t num_words)
+{
+        size_t bytes = data_bytes(num_words);
+
+        munmap((char *)(words + num_words) - bytes, bytes + GUARD_BYTES);
+}
+
+/* Function: guard_attach
+ * Does: Says which UM this thread runs, so that a fault in the guard of
+ *       one of its segments can be raised against it
+ * Paramters: um_mem
+ * Returns: None
+ */
+void guard_attach(um_mem mem)
+{
+        current = mem;
+}
+
+/* Function: guard_detach
+ * Does: Stops reporting guard faults on this thread
+ * Paramters: None
+ * Returns: None
+ */
+void guard_detach()
+{
+        current = NULL;
+}
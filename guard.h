@@ -0,0 +1,22 @@
+#ifndef GUARD_INCLUDED
+#define GUARD_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mem_interface.h"
+
+/* Segments at least this long get guard pages when they are enabled */
+#define GUARD_MIN_WORDS (1 << 14)
+
+/* Inaccessible bytes after a guarded segment: any 32-bit offset past its
+ * end lands in them
+ */
+#define GUARD_BYTES ((size_t)1 << 34)
+
+uint32_t *guard_alloc_words(uint32_t num_words);
+void guard_free_words(uint32_t *words, uint32_t num_words);
+void guard_attach(um_mem mem);
+void guard_detach();
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "handlers.h"
+#include "decode.h"
+#include "mem_interface.h"
+#include "trap.h"
+
+/* The bodies of the handlers. Each generated handler calls one of these
+ * with constant register numbers, so it compiles to a few moves on fixed
+ * slots of the register file.
+ */
+static inline void cmov(uint32_t *r, unsigned a, unsigned b, unsigned c)
+{
+        if (r[c] != 0) {
+                r[a] = r[b];
+        }
+}
+
+static inline void add(uint32_t *r, unsigned a, unsigned b, unsigned c)
+{
+        r[a] = r[b] + r[c];
+}
+
+static inline void mul(uint32_t *r, unsigned a, unsigned b, unsigned c)
+{
+        r[a] = r[b] * r[c];
+}
+
+static inline void nand(uint32_t *r, unsigned a, unsigned b, unsigned c)
+{
+        r[a] = ~(r[b] & r[c]);
+}
+
+/* As segmented_load_cached and segmented_store_cached */
+static inline void sload(uint32_t *r, um_mem mem, seg_cache cache,
+                         unsigned a, unsigned b, unsigned c)
+{
+        if (cache->id == r[b] && cache->generation == mem->generation) {
+                if (mem->count_caches) {
+                        cache->hits++;
+                }
+        } else {
+                if (mem->count_caches) {
+                        cache->misses++;
+                }
+                seg_cache_fill(mem, cache, r[b]);
+        }
+        if (r[c] >= cache->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
+        }
+        r[a] = cache->words[r[c]];
+}
+
+static inline void sstore(uint32_t *r, um_mem mem, seg_cache cache,
+                          unsigned a, unsigned b, unsigned c)
+{
+        if (cache->id == r[a] && cache->generation == mem->generation) {
+                if (mem->count_caches) {
+                        cache->hits++;
+                }
+        } else {
+                if (mem->count_caches) {
+                        cache->misses++;
+                }
+                seg_cache_fill(mem, cache, r[a]);
+        }
+        if (r[b] >= cache->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
+        }
+        cache->words[r[b]] = r[c];
+}
+
+#include "handlers.inc"
+
+/* Function: handlers_assign
+ * Does: Points each conditional move, add, multiply, NAND and segmented
+ *       load or store among count decoded words from first at its handler
+ * Paramters: decoded_prog, uint32_t, uint32_t
+ * Returns: None
+ */
+void handlers_assign(decoded_prog prog, uint32_t first, uint32_t count)
+{
+        static const int reg_kinds[] = {
+                [0] = HANDLER_CMOV, [3] = HANDLER_ADD, [4] = HANDLER_MUL,
+                [6] = HANDLER_NAND
+        };
+
+        for (uint32_t i = first; i < first + count; i++) {
+                uint32_t opcode = prog->opcode[i];
+                uint32_t triple = prog->a[i] << 6 | prog->b[i] << 3 |
+                                  prog->c[i];
+
+                switch (opcode) {
+                        case 0 :
+                        case 3 :
+                        case 4 :
+                        case 6 :
+                                prog->opcode[i] = OP_REGS;
+                                prog->lvalue[i] = reg_kinds[opcode] *
+                                                  HANDLER_TRIPLES + triple;
+                                break;
+                        case 1 :
+                        case 2 :
+                                prog->opcode[i] = OP_MEMORY;
+                                prog->lvalue[i] = (opcode == 1 ? HANDLER_SLOAD
+                                                   : HANDLER_SSTORE) *
+                                                  HANDLER_TRIPLES + triple;
+                                break;
+                        default :
+                                break;
+                }
+        }
+}
@@ -0,0 +1,33 @@
+#ifndef HANDLERS_INCLUDED
+#define HANDLERS_INCLUDED
+#include <stdint.h>
+
+#include "mem_interface.h"
+#include "decode.h"
+
+/* One handler per opcode and register triple (A << 6 | B << 3 | C), built
+ * by gen_handlers into handlers.inc. A word whose opcode has handlers is
+ * decoded as OP_REGS or OP_MEMORY with lvalue = kind * HANDLER_TRIPLES +
+ * triple, so the registers it names are fixed in the code it runs.
+ */
+#define HANDLER_TRIPLES 512
+
+/* In the order gen_handlers writes the tables */
+typedef enum reg_kind {
+        HANDLER_CMOV = 0, HANDLER_ADD, HANDLER_MUL, HANDLER_NAND,
+        HANDLER_REG_KINDS
+} reg_kind;
+
+typedef enum mem_kind {
+        HANDLER_SLOAD = 0, HANDLER_SSTORE, HANDLER_MEM_KINDS
+} mem_kind;
+
+typedef void (*reg_handler)(uint32_t *r);
+typedef void (*mem_handler)(uint32_t *r, um_mem mem, seg_cache cache);
+
+extern const reg_handler reg_handlers[HANDLER_REG_KINDS * HANDLER_TRIPLES];
+extern const mem_handler mem_handlers[HANDLER_MEM_KINDS * HANDLER_TRIPLES];
+
+void handlers_assign(decoded_prog prog, uint32_t first, uint32_t count);
+
+#endif
@@ -0,0 +1,564 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idiom.h"
+#include "decode.h"
+#include "mem_interface.h"
+#include "write_barrier.h"
+
+/* What a register holds partway through an iteration, in terms of the
+ * registers as that iteration started
+ */
+typedef enum value_kind {
+        V_CONST = 0,            /* k */
+        V_START,                /* register reg as the iteration began, + k */
+        V_LOADED,               /* the word the body loaded */
+        V_OTHER
+} value_kind;
+
+struct value {
+        uint8_t kind;
+        uint8_t reg;
+        uint32_t k;
+};
+
+/* One iteration of a loop, worked out from its words and the registers
+ * it starts with
+ */
+struct shape {
+        struct value end[8];            /* each register after it */
+        struct value cond;              /* what the conditional move tests */
+        bool stay_if_zero;              /* loops while cond is 0, not while
+                                           it is not */
+        uint8_t target;                 /* register the loop jumps through */
+        uint32_t exit;
+        bool loads;
+        bool stores;
+        uint32_t load_seg;
+        uint32_t store_seg;
+        struct value load_at;           /* offsets, both V_START */
+        struct value store_at;
+        struct value stored;            /* V_CONST or V_LOADED */
+};
+
+static void check_alloc(void *p)
+{
+        if (p == NULL) {
+                fprintf(stderr, "Error: Could not allocate loop idioms\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static bool register_only(uint8_t opcode)
+{
+        return opcode == 3 || opcode == 6 || opcode == 13;
+}
+
+/* Function: find_head
+ * Does: Finds the loop closed by the load_program at j: a conditional move
+ *       into its target register, followed only by register-only words
+ *       that leave it alone, picks between two registers, one of which a
+ *       load_value in the body sets to the head. Between head and j there
+ *       may only be adds, NANDs, load_values and at most one segmented
+ *       load and one store, and nothing before lo
+ * Paramters: decoded_prog, uint32_t (lo), uint32_t (j)
+ * Returns: uint32_t (the head, or j if there is no such loop)
+ */
+static uint32_t find_head(decoded_prog prog, uint32_t lo, uint32_t j)
+{
+        uint8_t target = prog->c[j];
+        uint32_t move = j;
+        uint32_t head = j;
+
+        for (uint32_t i = j; i > lo; i--) {
+                uint32_t p = i - 1;
+
+                if (prog->opcode[p] == 0 && prog->a[p] == target) {
+                        move = p;
+                        break;
+                }
+                if (!register_only(prog->opcode[p]) ||
+                    prog->a[p] == target) {
+                        return j;
+                }
+        }
+        if (move == j) {
+                return j;
+        }
+        for (uint32_t p = move; p > lo && head == j;) {
+                p--;
+                if (prog->opcode[p] == 13 &&
+                    (prog->a[p] == target || prog->a[p] == prog->b[move]) &&
+                    prog->lvalue[p] >= lo && prog->lvalue[p] <= p) {
+                        head = prog->lvalue[p];
+                }
+        }
+        if (head == j) {
+                return j;
+        }
+
+        unsigned loads = 0;
+        unsigned stores = 0;
+
+        for (uint32_t p = head; p < j; p++) {
+                uint8_t opcode = prog->opcode[p];
+
+                if (opcode == 1) {
+                        loads++;
+                } else if (opcode == 2) {
+                        stores++;
+                } else if (!register_only(opcode) && p != move) {
+                        return j;
+                }
+        }
+        if (loads > 1 || stores > 1 || loads + stores == 0) {
+                return j;
+        }
+        return head;
+}
+
+/* Function: idiom_find
+ * Does: Records each loop that could be a copy, fill or scan among count
+ *       decoded words from first, with its words as decoded. Must run
+ *       before the words are folded; idiom_mark then marks their heads
+ * Paramters: decoded_prog, uint32_t, uint32_t
+ * Returns: uint32_t (the first loop recorded)
+ */
+uint32_t idiom_find(decoded_prog prog, uint32_t first, uint32_t count)
+{
+        uint32_t page_words = wb_page_size() / sizeof(uint32_t);
+
+        if (prog->idioms == NULL) {
+                prog->idioms = calloc(1, sizeof(*prog->idioms));
+                check_alloc(prog->idioms);
+        }
+
+        idioms loops = prog->idioms;
+        uint32_t from = loops->num_loops;
+
+        for (uint32_t j = first; j < first + count; j++) {
+                if (prog->opcode[j] != 12) {
+                        continue;
+                }
+
+                /* The whole loop lies in one page, so that a store into
+                 * any of it also drops the loop
+                 */
+                uint32_t lo = j / page_words * page_words;
+
+                if (lo < first) {
+                        lo = first;
+                }
+                if (j + 1 - lo > IDIOM_MAX_BODY) {
+                        lo = j + 1 - IDIOM_MAX_BODY;
+                }
+
+                uint32_t head = find_head(prog, lo, j);
+
+                if (head == j) {
+                        continue;
+                }
+                if (loops->num_loops == loops->capacity) {
+                        loops->capacity = loops->capacity == 0 ? 16
+                                          : loops->capacity * 2;
+                        loops->loops = realloc(loops->loops, loops->capacity *
+                                               sizeof(*loops->loops));
+                        check_alloc(loops->loops);
+                }
+
+                struct idiom_loop *loop = &loops->loops[loops->num_loops++];
+
+                *loop = (struct idiom_loop){ 0 };
+                loop->head = head;
+                loop->length = j - head + 1;
+                for (uint32_t p = head; p <= j; p++) {
+                        struct idiom_word *word = &loop->body[p - head];
+
+                        word->opcode = prog->opcode[p];
+                        word->a = prog->a[p];
+                        word->b = prog->b[p];
+                        word->c = prog->c[p];
+                        word->lvalue = prog->lvalue[p];
+                        if (p < j && word->opcode != 2) {
+                                loop->written |= 1 << word->a;
+                        }
+                }
+        }
+        return from;
+}
+
+/* Function: idiom_mark
+ * Does: Makes the head of each loop recorded since from run as OP_IDIOM,
+ *       keeping what it was decoded as for when the loop falls back. A
+ *       head shared by two loops is kept by the first
+ * Paramters: decoded_prog, uint32_t
+ * Returns: None
+ */
+void idiom_mark(decoded_prog prog, uint32_t from)
+{
+        idioms loops = prog->idioms;
+
+        for (uint32_t i = from; i < loops->num_loops; i++) {
+                struct idiom_loop *loop = &loops->loops[i];
+
+                if (prog->opcode[loop->head] == OP_IDIOM) {
+                        loop->given_up = true;
+                        continue;
+                }
+                loop->saved_opcode = prog->opcode[loop->head];
+                loop->saved_lvalue = prog->lvalue[loop->head];
+                prog->opcode[loop->head] = OP_IDIOM;
+                prog->lvalue[loop->head] = i;
+        }
+}
+
+static struct value constant(uint32_t k)
+{
+        return (struct value){ V_CONST, 0, k };
+}
+
+static struct value add(struct value x, struct value y)
+{
+        if (x.kind == V_CONST && y.kind == V_CONST) {
+                return constant(x.k + y.k);
+        }
+        if (x.kind == V_START && y.kind == V_CONST) {
+                return (struct value){ V_START, x.reg, x.k + y.k };
+        }
+        if (x.kind == V_CONST && y.kind == V_START) {
+                return (struct value){ V_START, y.reg, x.k + y.k };
+        }
+        return (struct value){ V_OTHER, 0, 0 };
+}
+
+static struct value nand(struct value x, struct value y)
+{
+        if (x.kind == V_CONST && y.kind == V_CONST) {
+                return constant(~(x.k & y.k));
+        }
+        return (struct value){ V_OTHER, 0, 0 };
+}
+
+/* Function: evaluate
+ * Does: Works out one iteration of a loop from the registers it starts
+ *       with. Registers the body writes are kept symbolic, the rest are
+ *       the constants they hold. Fails unless the body is a copy, fill or
+ *       scan: one load from a constant segment at an offset register,
+ *       then at most one store of it (or one store of a constant) to a
+ *       constant segment at an offset register, and a conditional move
+ *       between constant registers, one of them the head
+ * Paramters: const struct idiom_loop*, const uint32_t*, struct shape*
+ * Returns: bool (true if it is one)
+ */
+static bool evaluate(const struct idiom_loop *loop, const uint32_t *r,
+                     struct shape *shape)
+{
+        struct value *v = shape->end;
+        bool moved = false;
+
+        *shape = (struct shape){ .loads = false };
+        for (unsigned reg = 0; reg < 8; reg++) {
+                v[reg] = (loop->written >> reg) & 1
+                         ? (struct value){ V_START, reg, 0 }
+                         : constant(r[reg]);
+        }
+
+        for (unsigned i = 0; i + 1 < loop->length; i++) {
+                const struct idiom_word *word = &loop->body[i];
+                struct value x = v[word->b];
+                struct value y = v[word->c];
+
+                switch (word->opcode) {
+                        case 0 : {
+                                struct value t = v[word->a];
+
+                                if (moved || t.kind != V_CONST ||
+                                    x.kind != V_CONST) {
+                                        return false;
+                                }
+                                if (x.k == loop->head) {
+                                        shape->exit = t.k;
+                                } else if (t.k == loop->head) {
+                                        shape->exit = x.k;
+                                        shape->stay_if_zero = true;
+                                } else {
+                                        return false;
+                                }
+                                shape->cond = y;
+                                shape->target = word->a;
+                                v[word->a] = (struct value){ V_OTHER, 0, 0 };
+                                moved = true;
+                                break;
+                        }
+                        case 1 :
+                                if (shape->stores || x.kind != V_CONST ||
+                                    y.kind != V_START) {
+                                        return false;
+                                }
+                                shape->loads = true;
+                                shape->load_seg = x.k;
+                                shape->load_at = y;
+                                v[word->a] = (struct value){ V_LOADED, 0, 0 };
+                                break;
+                        case 2 :
+                                if (v[word->a].kind != V_CONST ||
+                                    x.kind != V_START ||
+                                    (y.kind == V_LOADED) != shape->loads ||
+                                    (y.kind != V_LOADED &&
+                                     y.kind != V_CONST)) {
+                                        return false;
+                                }
+                                shape->stores = true;
+                                shape->store_seg = v[word->a].k;
+                                shape->store_at = x;
+                                shape->stored = y;
+                                break;
+                        case 3 :
+                                v[word->a] = add(x, y);
+                                break;
+                        case 6 :
+                                v[word->a] = nand(x, y);
+                                break;
+                        default:
+                                v[word->a] = constant(word->lvalue);
+                        break;
+                }
+        }
+
+        struct value program = v[loop->body[loop->length - 1].b];
+
+        return moved && program.kind == V_CONST && program.k == 0;
+}
+
+/* Says whether register reg steps by +1 or -1 each iteration, giving it */
+static int step_of(const struct shape *shape, unsigned reg)
+{
+        struct value end = shape->end[reg];
+
+        if (end.kind != V_START || end.reg != reg) {
+                return 0;
+        }
+        return end.k == 1 ? 1 : end.k == UINT32_MAX ? -1 : 0;
+}
+
+/* Function: in_bounds
+ * Does: Gives how many iterations in a row can use a mapped segment from
+ *       offset base, stepping by step, before leaving it
+ * Paramters: um_mem, uint32_t, uint32_t, int
+ * Returns: uint64_t (0 if the segment is not mapped)
+ */
+static uint64_t in_bounds(um_mem mem, uint32_t seg, uint32_t base, int step)
+{
+        uint32_t length;
+
+        if (!seg_mapped(mem, seg, &length) || base >= length) {
+                return 0;
+        }
+        return step > 0 ? (uint64_t)length - base : (uint64_t)base + 1;
+}
+
+/* The lowest offset of count words used from base, stepping by step */
+static uint32_t lowest(uint32_t base, int step, uint64_t count)
+{
+        return step > 0 ? base : base - (uint32_t)(count - 1);
+}
+
+/* Function: scan
+ * Does: Finds the first of count words, in the order the loop reads them,
+ *       that ends it: the first 0 or, if stay_if_zero, the first other
+ * Paramters: const uint32_t*, uint64_t, int (step), bool
+ * Returns: uint64_t (its index, or count if none does)
+ */
+static uint64_t scan(const uint32_t *words, uint64_t count, int step,
+                     bool stay_if_zero)
+{
+        for (uint64_t i = 0; i < count; i++) {
+                uint32_t word = step > 0 ? words[i] : words[count - 1 - i];
+
+                if ((word == 0) != stay_if_zero) {
+                        return i;
+                }
+        }
+        return count;
+}
+
+/* Function: run_shape
+ * Does: Runs as many iterations of a loop as it would run before exiting,
+ *       leaving the segments it uses or running out of budget, as one
+ *       memmove, fill or scan, then sets the registers and program counter
+ *       as those iterations would have left them. Copies that overlap in
+ *       a way memmove would not follow, stores into segment 0 and runs of
+ *       fewer than IDIOM_MIN_TRIPS iterations are left to be interpreted
+ * Paramters: struct idiom_loop*, struct shape*, uint32_t*, um_mem,
+ *            uint64_t, uint32_t*
+ * Returns: uint64_t (iterations run, or 0 if none were)
+ */
+static uint64_t run_shape(struct idiom_loop *loop, struct shape *shape,
+                          uint32_t *r, um_mem mem, uint64_t budget,
+                          uint32_t *prog_count)
+{
+        int step = 0;
+        uint64_t trips = budget / loop->length;
+        uint64_t exits_after = UINT64_MAX;
+        uint64_t bound;
+        uint32_t load_base = 0;
+        uint32_t store_base = 0;
+
+        for (unsigned reg = 0; reg < 8; reg++) {
+                struct value end = shape->end[reg];
+
+                if (!((loop->written >> reg) & 1) || reg == shape->target) {
+                        continue;
+                }
+                if (end.kind == V_OTHER ||
+                    (end.kind == V_START && end.reg != reg)) {
+                        return 0;
+                }
+        }
+        if (shape->loads) {
+                step = step_of(shape, shape->load_at.reg);
+                load_base = r[shape->load_at.reg] + shape->load_at.k;
+                if (step == 0) {
+                        return 0;
+                }
+                bound = in_bounds(mem, shape->load_seg, load_base, step);
+                trips = trips < bound ? trips : bound;
+        }
+        if (shape->stores) {
+                int store_step = step_of(shape, shape->store_at.reg);
+
+                store_base = r[shape->store_at.reg] + shape->store_at.k;
+                if (store_step == 0 || (step != 0 && store_step != step) ||
+                    shape->store_seg == 0) {
+                        return 0;
+                }
+                step = store_step;
+                bound = in_bounds(mem, shape->store_seg, store_base, step);
+                trips = trips < bound ? trips : bound;
+        }
+
+        if (shape->cond.kind == V_START && !shape->stay_if_zero &&
+            shape->cond.reg != shape->target) {
+                int counts = step_of(shape, shape->cond.reg);
+                uint32_t value = r[shape->cond.reg] + shape->cond.k;
+
+                if (counts == 0) {
+                        return 0;
+                }
+                exits_after = (uint64_t)(counts < 0 ? value : -value) + 1;
+        } else if (shape->cond.kind != V_LOADED) {
+                return 0;
+        }
+        if (exits_after < trips) {
+                trips = exits_after;
+        }
+        if (trips < IDIOM_MIN_TRIPS) {
+                return 0;
+        }
+
+        uint32_t loaded = 0;
+
+        if (shape->loads) {
+                const uint32_t *words = mem_range(mem, shape->load_seg,
+                        lowest(load_base, step, trips), trips);
+
+                if (shape->cond.kind == V_LOADED) {
+                        exits_after = scan(words, trips, step,
+                                           shape->stay_if_zero) + 1;
+                        if (exits_after < IDIOM_MIN_TRIPS) {
+                                return 0;
+                        }
+                        if (exits_after < trips) {
+                                /* Going down, the words read are the
+                                 * highest ones
+                                 */
+                                if (step < 0) {
+                                        words += trips - exits_after;
+                                }
+                                trips = exits_after;
+                        }
+                }
+                loaded = step > 0 ? words[trips - 1] : words[0];
+        }
+        if (shape->loads && shape->stores) {
+                uint32_t src = lowest(load_base, step, trips);
+                uint32_t dst = lowest(store_base, step, trips);
+                bool overlaps = shape->load_seg == shape->store_seg &&
+                                src < (uint64_t)dst + trips &&
+                                dst < (uint64_t)src + trips;
+
+                if (overlaps && (step > 0 ? dst > src : dst < src)) {
+                        return 0;
+                }
+                mem_copy(mem, shape->store_seg, dst, shape->load_seg, src,
+                         trips);
+        } else if (shape->stores) {
+                mem_fill(mem, shape->store_seg,
+                         lowest(store_base, step, trips), shape->stored.k,
+                         trips);
+        }
+
+        for (unsigned reg = 0; reg < 8; reg++) {
+                struct value end = shape->end[reg];
+
+                if (!((loop->written >> reg) & 1) || reg == shape->target) {
+                        continue;
+                }
+                if (end.kind == V_START) {
+                        r[reg] += end.k * (uint32_t)trips;
+                } else if (end.kind == V_CONST) {
+                        r[reg] = end.k;
+                } else {
+                        r[reg] = loaded;
+                }
+        }
+        r[shape->target] = trips == exits_after ? shape->exit : loop->head;
+        *prog_count = r[shape->target];
+        loop->kind = shape->stores ? (shape->loads ? IDIOM_COPY : IDIOM_FILL)
+                                   : IDIOM_SCAN;
+        return trips;
+}
+
+/* Function: idiom_run
+ * Does: Runs the loop at index as a kernel from its head, if it is a copy,
+ *       fill or scan for the registers it starts with and at least
+ *       IDIOM_MIN_TRIPS of its iterations fit in budget instructions. A
+ *       loop that keeps falling back is put back as it was decoded
+ * Paramters: decoded_prog, uint32_t, uint32_t* (registers), um_mem,
+ *            uint64_t, uint32_t* (program counter)
+ * Returns: uint64_t (instructions run, or 0 to run the head word as
+ *          decoded)
+ */
+uint64_t idiom_run(decoded_prog prog, uint32_t index, uint32_t *r,
+                   um_mem mem, uint64_t budget, uint32_t *prog_count)
+{
+        struct idiom_loop *loop = &prog->idioms->loops[index];
+        struct shape shape;
+        uint64_t trips = 0;
+
+        if (evaluate(loop, r, &shape)) {
+                trips = run_shape(loop, &shape, r, mem, budget, prog_count);
+        }
+        if (trips == 0) {
+                loop->fallbacks++;
+                if (loop->fallbacks > IDIOM_FALLBACKS &&
+                    loop->fallbacks > IDIOM_GIVE_UP * loop->runs) {
+                        prog->opcode[loop->head] = loop->saved_opcode;
+                        prog->lvalue[loop->head] = loop->saved_lvalue;
+                        loop->given_up = true;
+                }
+                return 0;
+        }
+        loop->runs++;
+        loop->iterations += trips;
+        return trips * loop->length;
+}
+
+void idiom_free(idioms *loops)
+{
+        free((*loops)->loops);
+        free(*loops);
+        *loops = NULL;
+}
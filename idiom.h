@@ -0,0 +1,75 @@
+#ifndef IDIOM_INCLUDED
+#define IDIOM_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mem_interface.h"
+#include "decode.h"
+
+/* Most words in a loop body, its closing jump included */
+#define IDIOM_MAX_BODY 32
+
+/* Fewest iterations worth running as a kernel; shorter loops (and the
+ * last few iterations before the budget runs out) are interpreted
+ */
+#define IDIOM_MIN_TRIPS 4
+
+/* Fallbacks after which a loop that rarely runs as a kernel is put back
+ * as it was decoded, if they are also more than IDIOM_GIVE_UP times its
+ * kernel runs
+ */
+#define IDIOM_FALLBACKS 64
+#define IDIOM_GIVE_UP 4
+
+/* What a loop last ran as */
+typedef enum idiom_kind {
+        IDIOM_NONE = 0,
+        IDIOM_COPY,             /* loads a word, stores it elsewhere */
+        IDIOM_FILL,             /* stores the same word */
+        IDIOM_SCAN,             /* loads until a word is (or is not) 0 */
+        IDIOM_KINDS
+} idiom_kind;
+
+struct idiom_word {
+        uint8_t opcode;
+        uint8_t a, b, c;
+        uint32_t lvalue;
+};
+
+/* A loop of segment 0 from head to a load_program that jumps back to it
+ * or out, after a conditional move picks which. Its words are kept as
+ * decoded (the arrays of the decoded program hold folds and handlers by
+ * the time it runs). The head word runs as OP_IDIOM with lvalue giving
+ * the loop; it runs as saved_opcode and saved_lvalue when the loop falls
+ * back to being interpreted
+ */
+struct idiom_loop {
+        uint32_t head;
+        uint8_t length;
+        uint8_t saved_opcode;
+        uint8_t kind;
+        bool given_up;
+        uint32_t saved_lvalue;
+        uint8_t written;                /* registers the body writes */
+        struct idiom_word body[IDIOM_MAX_BODY];
+        uint64_t runs;
+        uint64_t iterations;
+        uint64_t fallbacks;
+};
+
+/* Every loop found in one decoded program. Like folds, the loops of a
+ * page that is decoded again are left behind
+ */
+typedef struct idioms {
+        struct idiom_loop *loops;
+        uint32_t num_loops;
+        uint32_t capacity;
+} *idioms;
+
+uint32_t idiom_find(decoded_prog prog, uint32_t first, uint32_t count);
+void idiom_mark(decoded_prog prog, uint32_t from);
+uint64_t idiom_run(decoded_prog prog, uint32_t index, uint32_t *r,
+                   um_mem mem, uint64_t budget, uint32_t *prog_count);
+void idiom_free(idioms *loops);
+
+#endif
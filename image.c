@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "vm_interface.h"
+#include "mem_interface.h"
+#include "decode.h"
+#include "write_barrier.h"
+
+static uint64_t round_up(uint64_t bytes, uint64_t align)
+{
+        if (bytes == 0) {
+                bytes = 1;
+        }
+        return (bytes + align - 1) / align * align;
+}
+
+static int64_t mtime_of(const struct stat *st)
+{
+        return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Function: write_image
+ * Does: Writes the header, the words and the decoded arrays, each at the
+ *       offset the header gives. Seeking past the end leaves zeros between
+ * Paramters: FILE*, struct umx_header*, const uint32_t*, decoded_prog
+ * Returns: bool (false if a write failed)
+ */
+static bool write_image(FILE *fp, struct umx_header *header,
+                        const uint32_t *words, decoded_prog prog)
+{
+        return fwrite(header, sizeof(*header), 1, fp) == 1 &&
+               fseeko(fp, header->words_offset, SEEK_SET) == 0 &&
+               fwrite(words, sizeof(uint32_t), header->length, fp) ==
+                        header->length &&
+               fseeko(fp, header->decoded_offset, SEEK_SET) == 0 &&
+               decode_write_image(prog, fp);
+}
+
+/* Function: build
+ * Does: Parses and decodes a .um program once and writes the result as a
+ *       .umx image to out, which must be seekable. With no source, the
+ *       image records none, so nothing can make it stale
+ * Paramters: FILE* (the program), FILE*, const char* (NULL for none),
+ *            const struct stat* (of the source), uint64_t* (set to the
+ *            program's hash)
+ * Returns: bool (false if a write failed)
+ */
+static bool build(FILE *program, FILE *out, const char *source,
+                  const struct stat *source_stat, uint64_t *hash)
+{
+        struct umx_header header;
+        um_mem mem = init_mem();
+
+        init_prog(mem, program);
+
+        uint32_t *words = seg_words(mem, 0);
+        uint32_t length = seg_length(mem, 0);
+        decoded_prog prog = decode_new(words, length);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "UMX", 4);
+        header.version = UMX_VERSION;
+        header.byte_order = UMX_BYTE_ORDER;
+        header.flags = UMX_DECODED;
+        header.length = length;
+        header.num_sites = prog->num_sites;
+        header.hash = mem_hash_words(words, length);
+        header.words_offset = round_up(sizeof(header), UMX_ALIGN);
+        header.decoded_offset = header.words_offset +
+                round_up((uint64_t)length * sizeof(uint32_t), UMX_ALIGN);
+        header.decoded_bytes = decode_image_size(length);
+        if (source != NULL) {
+                header.source_size = source_stat->st_size;
+                header.source_mtime = mtime_of(source_stat);
+                if (realpath(source, header.source) == NULL) {
+                        strncpy(header.source, source, PATH_MAX - 1);
+                }
+        }
+        *hash = header.hash;
+
+        bool written = write_image(out, &header, words, prog);
+
+        decode_free(&prog);
+        free_mem(mem);
+
+        return written;
+}
+
+/* Function: image_compile
+ * Does: Parses and decodes a .um file once and saves the result as a
+ *       .umx image. The image is written beside its final name and moved
+ *       into place, so a UM starting at the same time never sees half of it
+ * Paramters: const char*, const char*
+ * Returns: bool (false, with a message, if the image could not be written)
+ */
+bool image_compile(const char *source, const char *image)
+{
+        struct stat source_stat;
+        uint64_t hash;
+        FILE *fp = fopen(source, "rb");
+
+        if (fp == NULL || fstat(fileno(fp), &source_stat) != 0) {
+                fprintf(stderr, "Error: Could not open %s\n", source);
+                if (fp != NULL) {
+                        fclose(fp);
+                }
+                return false;
+        }
+
+        size_t temp_length = strlen(image) + 5;
+        char *temp = malloc(temp_length);
+        snprintf(temp, temp_length, "%s.tmp", image);
+
+        bool written = false;
+        FILE *out = fopen(temp, "wb");
+        if (out != NULL) {
+                written = build(fp, out, source, &source_stat, &hash);
+                written = fclose(out) == 0 && written;
+        }
+        fclose(fp);
+        if (written && rename(temp, image) != 0) {
+                written = false;
+        }
+        if (!written) {
+                fprintf(stderr, "Error: Could not write %s\n", image);
+                remove(temp);
+        }
+
+        free(temp);
+        return written;
+}
+
+/* Function: image_build
+ * Does: Writes the .umx image of a program read from a stream, for a
+ *       caller that keeps images itself (umd keeps them in memory). The
+ *       image names no source
+ * Paramters: FILE* (the program), FILE* (seekable), uint64_t* (set to
+ *            the program's hash)
+ * Returns: bool (false if a write failed)
+ */
+bool image_build(FILE *program, FILE *out, uint64_t *hash)
+{
+        return build(program, out, NULL, NULL, hash) && fflush(out) == 0;
+}
+
+/* Function: guess_source
+ * Does: Names the .um beside an image whose header cannot be trusted
+ * Paramters: const char*
+ * Returns: char* (malloc'd)
+ */
+static char *guess_source(const char *path)
+{
+        size_t length = strlen(path);
+        char *source = malloc(length + 4);
+
+        strcpy(source, path);
+        if (length > 4 && strcmp(path + length - 4, ".umx") == 0) {
+                source[length - 1] = '\0';
+        } else {
+                strcat(source, ".um");
+        }
+        return source;
+}
+
+/* Function: usable
+ * Does: Checks that an image was written by this version, in this byte
+ *       order, is laid out for this page size and is complete, and that
+ *       the .um it came from (if it is still there) has not changed since
+ * Paramters: const struct umx_header*, off_t (image size)
+ * Returns: bool
+ */
+static bool usable(const struct umx_header *header, off_t size)
+{
+        struct stat source_stat;
+        uint64_t words_end = header->words_offset +
+                             (uint64_t)header->length * sizeof(uint32_t);
+
+        if (header->byte_order != UMX_BYTE_ORDER ||
+            UMX_ALIGN % wb_page_size() != 0 ||
+            header->words_offset % UMX_ALIGN != 0 ||
+            header->decoded_offset % UMX_ALIGN != 0 ||
+            header->decoded_offset < words_end ||
+            (uint64_t)size < words_end) {
+                return false;
+        }
+        if ((header->flags & UMX_DECODED) &&
+            (header->decoded_bytes != decode_image_size(header->length) ||
+             (uint64_t)size < header->decoded_offset + header->decoded_bytes)) {
+                return false;
+        }
+        if (stat(header->source, &source_stat) == 0 &&
+            ((uint64_t)source_stat.st_size != header->source_size ||
+             mtime_of(&source_stat) != header->source_mtime)) {
+                return false;
+        }
+        return true;
+}
+
+/* Function: map_image
+ * Does: Maps a usable image once, hands segment 0 and the decoded program
+ *       to a new UM where they lie in the (private) mapping and lets go of
+ *       the rest. The words must still hash as the header says and the
+ *       decoded arrays must be safe to run (see decode_map), or nothing
+ *       of the image is used
+ * Paramters: int, const struct umx_header*, size_t (image size), FILE*,
+ *            FILE*
+ * Returns: um_vm (NULL if the mapping failed or the image was corrupt)
+ */
+static um_vm map_image(int fd, const struct umx_header *header, size_t bytes,
+                       FILE *in, FILE *out)
+{
+        uint8_t *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                             fd, 0);
+
+        if (base == MAP_FAILED) {
+                return NULL;
+        }
+
+        uint32_t *words = (uint32_t *)(base + header->words_offset);
+        uint8_t *words_end = (uint8_t *)words +
+                round_up((uint64_t)header->length * sizeof(uint32_t),
+                         wb_page_size());
+        uint8_t *rest = base + bytes;
+        decoded_prog prog = NULL;
+
+        if (mem_hash_words(words, header->length) != header->hash) {
+                munmap(base, bytes);
+                return NULL;
+        }
+        if (header->flags & UMX_DECODED) {
+                rest = base + header->decoded_offset;
+                prog = decode_map(rest, header->decoded_bytes, header->length,
+                                  header->num_sites);
+                if (prog == NULL) {
+                        munmap(base, bytes);
+                        return NULL;
+                }
+        }
+        munmap(base, header->words_offset);
+        if (rest > words_end) {
+                munmap(words_end, rest - words_end);
+        }
+
+        um_mem mem = init_mem();
+        mem_adopt_program(mem, words, header->length);
+
+        return vm_adopt(mem, prog, in, out);
+}
+
+/* Function: image_open
+ * Does: Creates a UM from a .umx image with one mmap, so nothing is
+ *       parsed or decoded. Returns NULL if path is not an image; if it is
+ *       one that cannot be used, also sets fallback to the .um to run
+ *       instead (malloc'd)
+ * Paramters: const char*, FILE*, FILE*, char**
+ * Returns: um_vm
+ */
+um_vm image_open(const char *path, FILE *in, FILE *out, char **fallback)
+{
+        struct umx_header header;
+        struct stat image_stat;
+        int fd = open(path, O_RDONLY);
+
+        *fallback = NULL;
+        if (fd < 0) {
+                return NULL;
+        }
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, "UMX", 4) != 0) {
+                close(fd);
+                return NULL;
+        }
+
+        header.source[PATH_MAX - 1] = '\0';
+        if (header.version != UMX_VERSION) {
+                *fallback = guess_source(path);
+                close(fd);
+                return NULL;
+        }
+        if (fstat(fd, &image_stat) != 0 ||
+            !usable(&header, image_stat.st_size)) {
+                *fallback = strdup(header.source);
+                close(fd);
+                return NULL;
+        }
+
+        um_vm vm = map_image(fd, &header, image_stat.st_size, in, out);
+
+        close(fd);
+        if (vm == NULL) {
+                *fallback = strdup(header.source);
+        }
+        return vm;
+}
+
+/* Function: image_open_fd
+ * Does: Creates a UM from an image already open, as image_build wrote it.
+ *       Each UM gets a private mapping of its own, so any number may be
+ *       created from one image and none sees another's stores. The
+ *       descriptor stays open
+ * Paramters: int, FILE*, FILE*
+ * Returns: um_vm (NULL if it is not a usable image)
+ */
+um_vm image_open_fd(int fd, FILE *in, FILE *out)
+{
+        struct umx_header header;
+        struct stat image_stat;
+
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, "UMX", 4) != 0 ||
+            header.version != UMX_VERSION || fstat(fd, &image_stat) != 0) {
+                return NULL;
+        }
+        header.source[PATH_MAX - 1] = '\0';
+        if (!usable(&header, image_stat.st_size)) {
+                return NULL;
+        }
+        return map_image(fd, &header, image_stat.st_size, in, out);
+}
@@ -0,0 +1,44 @@
+#ifndef IMAGE_INCLUDED
+#define IMAGE_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "vm_interface.h"
+
+/* A .umx image is a UM program ready to run: this header, then the
+ * program words in the byte order of the machine that wrote it, then
+ * (optionally) the decoded arrays from decode_write_image. Each part starts
+ * on a multiple of UMX_ALIGN, which covers every common page size, so the
+ * whole file can be mapped once and each part handed over in place.
+ */
+#define UMX_VERSION 1
+#define UMX_ALIGN 65536
+#define UMX_BYTE_ORDER 0x01020304
+
+/* Flags */
+#define UMX_DECODED 1
+
+struct umx_header {
+        char magic[4];                  /* "UMX" and a NUL */
+        uint32_t version;
+        uint32_t byte_order;            /* UMX_BYTE_ORDER as written */
+        uint32_t flags;
+        uint32_t length;                /* words in the program */
+        uint32_t num_sites;             /* segment cache sites decoded */
+        uint64_t hash;                  /* mem_hash_words of the program */
+        uint64_t words_offset;
+        uint64_t decoded_offset;
+        uint64_t decoded_bytes;
+        uint64_t source_size;           /* the .um it was compiled from */
+        int64_t source_mtime;           /* in nanoseconds */
+        char source[PATH_MAX];
+};
+
+bool image_compile(const char *source, const char *image);
+bool image_build(FILE *program, FILE *out, uint64_t *hash);
+um_vm image_open(const char *path, FILE *in, FILE *out, char **fallback);
+um_vm image_open_fd(int fd, FILE *in, FILE *out);
+
+#endif
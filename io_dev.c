@@ -2,19 +2,1022 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <seq.h>
 #include <uarray.h>
 
+#include "io_dev.h"
 #include "except.h"
 
-uint32_t io_input()
+/* Input handed over by another thread. The UM reads from head, the feeder
+ * appends at tail. Output waiting for another thread to take it goes the
+ * other way: the UM appends, the taker takes from head.
+ */
+struct io_queue {
+        pthread_mutex_t lock;
+        pthread_cond_t arrived;
+        pthread_cond_t taken;           /* output only: the taker took some */
+        unsigned char *bytes;
+        size_t head;
+        size_t tail;
+        size_t capacity;
+        bool closed;
+};
+
+/* Bytes passed from one thread to another. Each side only writes its own
+ * index, and they are kept a cache line apart
+ */
+struct byte_ring {
+        unsigned char *bytes;
+        uint64_t head;                  /* consumer's */
+        char apart[64];
+        uint64_t tail;                  /* producer's */
+        uint64_t limit;                 /* producer's: head + size, seen */
+};
+
+#define RING_MASK (IO_ASYNC_RING - 1)
+
+/* The threads of an asynchronous device. The UM produces into out and
+ * consumes from in; the locks are only for sleeping and waking
+ */
+struct io_async {
+        struct byte_ring out;
+        int out_fd;
+        pthread_t writer;
+        pthread_mutex_t out_lock;
+        pthread_cond_t out_wake;        /* writer: there is output */
+        pthread_cond_t out_drained;     /* UM: the writer wrote some */
+        bool writer_idle;
+        bool write_failed;
+        bool stopping;
+
+        struct byte_ring in;
+        int in_fd;
+        pthread_t reader;
+        pthread_mutex_t in_lock;
+        pthread_cond_t in_arrived;      /* UM: the reader read some */
+        pthread_cond_t in_space;        /* reader: the UM took some */
+        bool reader_waiting;
+        bool in_eof;
+
+        struct io_async *next;          /* flushed at exit */
+        io_dev io;
+};
+
+/* See io_pipe in io_dev.h. The writer only moves ring.tail and the
+ * reader ring.head; the lock guards the rest
+ */
+struct io_pipe {
+        struct byte_ring ring;
+        pthread_mutex_t lock;
+        pthread_cond_t moved;           /* either side: the other moved */
+        bool reader_waiting;
+        bool writer_waiting;
+        bool closed;                    /* the writer is done */
+        bool gone;                      /* the reader is done */
+};
+
+static struct io_async *async_devices = NULL;
+static pthread_mutex_t async_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct io_queue *new_queue()
+{
+        struct io_queue *queue = calloc(1, sizeof(*queue));
+
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->arrived, NULL);
+        pthread_cond_init(&queue->taken, NULL);
+        return queue;
+}
+
+static void free_queue(struct io_queue *queue)
+{
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->arrived);
+        pthread_cond_destroy(&queue->taken);
+        free(queue->bytes);
+        free(queue);
+}
+
+io_dev io_new(FILE *in, FILE *out)
+{
+        io_dev io = malloc(sizeof(*io));
+        io->in = in;
+        io->out = out;
+        io->queue = NULL;
+        io->out_queue = NULL;
+        io->async = NULL;
+        io->pipe_in = NULL;
+        io->pipe_out = NULL;
+        io->bytes_in = 0;
+        io->bytes_out = 0;
+
+        if (in == NULL) {
+                io->queue = new_queue();
+        }
+        if (out == NULL) {
+                io->out_queue = new_queue();
+        }
+
+        return io;
+}
+
+static void stop_async(io_dev io);
+
+void io_free(io_dev *io)
+{
+        if ((*io)->async != NULL) {
+                stop_async(*io);
+        }
+        io_disconnect(*io);
+
+        if ((*io)->queue != NULL) {
+                free_queue((*io)->queue);
+        }
+        if ((*io)->out_queue != NULL) {
+                free_queue((*io)->out_queue);
+        }
+        free(*io);
+        *io = NULL;
+}
+
+/* Function: queue_append
+ * Does: Adds bytes at the tail of a queue, first dropping those already
+ *       taken from its head, and wakes whoever waits for them
+ * Paramters: struct io_queue*, const void*, size_t
+ * Returns: None
+ */
+static void queue_append(struct io_queue *queue, const void *bytes,
+                         size_t length)
+{
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head > 0) {
+                memmove(queue->bytes, queue->bytes + queue->head,
+                        queue->tail - queue->head);
+                queue->tail -= queue->head;
+                queue->head = 0;
+        }
+        if (queue->tail + length > queue->capacity) {
+                queue->capacity = (queue->tail + length) * 2;
+                queue->bytes = realloc(queue->bytes, queue->capacity);
+        }
+        memcpy(queue->bytes + queue->tail, bytes, length);
+        queue->tail += length;
+        pthread_cond_broadcast(&queue->arrived);
+        pthread_mutex_unlock(&queue->lock);
+}
+
+/* Counts a byte through the device, for whoever is watching */
+static void count_byte(uint64_t *counter)
+{
+        __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Waits on cond for at most IO_ASYNC_MS; the caller holds lock */
+static void wait_a_while(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += IO_ASYNC_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(cond, lock, &until);
+}
+
+/* Wakes the other side of a pipe if it is asleep. Each side wakes the
+ * other only once a batch has moved, or it is about to wait itself, so
+ * that on a busy machine the two do not take turns a byte at a time
+ */
+static inline void pipe_wake(struct io_pipe *pipe, bool *waiting)
 {
-        char value = fgetc(stdin);
-        
+        if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&pipe->lock);
+                pthread_cond_broadcast(&pipe->moved);
+                pthread_mutex_unlock(&pipe->lock);
+        }
+}
+
+/* Function: pipe_input
+ * Does: Takes the next byte from a pipe, waiting while it is empty
+ * Paramters: io_dev
+ * Returns: uint32_t (the byte, or EOF once the writer is done and every
+ *          byte it wrote has been taken)
+ */
+static uint32_t pipe_input(io_dev io)
+{
+        struct io_pipe *pipe = io->pipe_in;
+        struct byte_ring *ring = &pipe->ring;
+        uint64_t head = ring->head;
+
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+                /* Whatever the UM output before asking is seen first */
+                if (io->pipe_out != NULL) {
+                        pipe_wake(io->pipe_out,
+                                  &io->pipe_out->reader_waiting);
+                }
+                pthread_mutex_lock(&pipe->lock);
+                __atomic_store_n(&pipe->reader_waiting, true,
+                                 __ATOMIC_SEQ_CST);
+                while (head == __atomic_load_n(&ring->tail,
+                                               __ATOMIC_SEQ_CST) &&
+                       !pipe->closed) {
+                        wait_a_while(&pipe->moved, &pipe->lock);
+                }
+                __atomic_store_n(&pipe->reader_waiting, false,
+                                 __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&pipe->lock);
+                if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+                        return (uint32_t)EOF;
+                }
+        }
+
+        uint32_t value = ring->bytes[head & RING_MASK];
+
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        if ((head + 1) % IO_ASYNC_BATCH == 0) {
+                pipe_wake(pipe, &pipe->writer_waiting);
+        }
+        count_byte(&io->bytes_in);
         return value;
 }
 
-void io_output(uint32_t word)
+/* Function: pipe_room
+ * Does: Waits for room in a pipe, then gives where the next bytes go and
+ *       how many fit there without wrapping
+ * Paramters: struct io_pipe*, unsigned char**
+ * Returns: size_t (0 if the reader is done, so output is dropped)
+ */
+static size_t pipe_room(struct io_pipe *pipe, unsigned char **at)
 {
-        fputc(word, stdout);
-}
\ No newline at end of file
+        struct byte_ring *ring = &pipe->ring;
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail - head == IO_ASYNC_RING) {
+                pipe_wake(pipe, &pipe->reader_waiting);
+                pthread_mutex_lock(&pipe->lock);
+                __atomic_store_n(&pipe->writer_waiting, true,
+                                 __ATOMIC_SEQ_CST);
+                while (tail - __atomic_load_n(&ring->head,
+                                __ATOMIC_SEQ_CST) == IO_ASYNC_RING &&
+                       !pipe->gone) {
+                        wait_a_while(&pipe->moved, &pipe->lock);
+                }
+                __atomic_store_n(&pipe->writer_waiting, false,
+                                 __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&pipe->lock);
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        }
+        if (__atomic_load_n(&pipe->gone, __ATOMIC_RELAXED)) {
+                return 0;
+        }
+
+        size_t room = IO_ASYNC_RING - (tail - head);
+        size_t chunk = IO_ASYNC_RING - (tail & RING_MASK);
+
+        ring->limit = head + IO_ASYNC_RING;
+        *at = ring->bytes + (tail & RING_MASK);
+        return room < chunk ? room : chunk;
+}
+
+/* Hands the reader of a pipe everything written up to tail. The wake-up
+ * is only a hint: a reader that misses it looks again within IO_ASYNC_MS
+ */
+static inline void pipe_commit(struct io_pipe *pipe, uint64_t tail)
+{
+        uint64_t start = pipe->ring.tail;
+
+        __atomic_store_n(&pipe->ring.tail, tail, __ATOMIC_RELEASE);
+        if (start / IO_ASYNC_BATCH != tail / IO_ASYNC_BATCH) {
+                pipe_wake(pipe, &pipe->reader_waiting);
+        }
+}
+
+/* Function: async_input
+ * Does: Takes the next byte the reader thread has read. If there is none
+ *       yet, first waits for the output so far to be written, so that
+ *       whatever the UM printed before asking is seen before it blocks
+ * Paramters: io_dev
+ * Returns: uint32_t (the byte, or EOF)
+ */
+static uint32_t async_input(io_dev io)
+{
+        struct io_async *async = io->async;
+        struct byte_ring *ring = &async->in;
+        uint64_t head = ring->head;
+
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+                io_flush(io);
+                pthread_mutex_lock(&async->in_lock);
+                while (head == __atomic_load_n(&ring->tail,
+                                               __ATOMIC_ACQUIRE) &&
+                       !async->in_eof) {
+                        pthread_cond_wait(&async->in_arrived,
+                                          &async->in_lock);
+                }
+                pthread_mutex_unlock(&async->in_lock);
+                if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+                        return (uint32_t)EOF;
+                }
+        }
+
+        uint32_t value = ring->bytes[head & RING_MASK];
+
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&async->reader_waiting, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&async->in_lock);
+                pthread_cond_signal(&async->in_space);
+                pthread_mutex_unlock(&async->in_lock);
+        }
+        count_byte(&io->bytes_in);
+        return value;
+}
+
+/* Function: async_output
+ * Does: Puts bytes in the output ring, waiting for the writer only when
+ *       it is full, and wakes the writer each time a batch fills
+ * Paramters: struct io_async*, const unsigned char*, size_t
+ * Returns: None
+ */
+static void async_output(struct io_async *async, const unsigned char *bytes,
+                         size_t length)
+{
+        struct byte_ring *ring = &async->out;
+        uint64_t start = ring->tail;
+        uint64_t tail = start;
+
+        while (length > 0) {
+                uint64_t head = __atomic_load_n(&ring->head,
+                                                __ATOMIC_ACQUIRE);
+                size_t space = IO_ASYNC_RING - (tail - head);
+                size_t chunk = IO_ASYNC_RING - (tail & RING_MASK);
+
+                if (space == 0) {
+                        pthread_mutex_lock(&async->out_lock);
+                        pthread_cond_signal(&async->out_wake);
+                        while (tail - __atomic_load_n(&ring->head,
+                                        __ATOMIC_ACQUIRE) == IO_ASYNC_RING &&
+                               !async->write_failed) {
+                                pthread_cond_wait(&async->out_drained,
+                                                  &async->out_lock);
+                        }
+                        pthread_mutex_unlock(&async->out_lock);
+                        if (async->write_failed) {
+                                return;
+                        }
+                        continue;
+                }
+                ring->limit = head + IO_ASYNC_RING;
+                if (chunk > space) {
+                        chunk = space;
+                }
+                if (chunk > length) {
+                        chunk = length;
+                }
+                memcpy(ring->bytes + (tail & RING_MASK), bytes, chunk);
+                tail += chunk;
+                bytes += chunk;
+                length -= chunk;
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        /* Only a hint: a writer that misses it still wakes within
+         * IO_ASYNC_MS, and whoever must wait for it wakes it under the lock
+         */
+        if (start / IO_ASYNC_BATCH != tail / IO_ASYNC_BATCH &&
+            __atomic_load_n(&async->writer_idle, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&async->out_lock);
+                pthread_cond_signal(&async->out_wake);
+                pthread_mutex_unlock(&async->out_lock);
+        }
+}
+
+uint32_t io_input(io_dev io)
+{
+        struct io_queue *queue = io->queue;
+
+        if (io->pipe_in != NULL) {
+                return pipe_input(io);
+        }
+        if (io->async != NULL) {
+                return async_input(io);
+        }
+        if (queue == NULL) {
+                int value = fgetc(io->in);
+
+                if (value != EOF) {
+                        count_byte(&io->bytes_in);
+                }
+                return value;
+        }
+
+        int value = EOF;
+        pthread_mutex_lock(&queue->lock);
+        while (queue->head == queue->tail && !queue->closed) {
+                pthread_cond_wait(&queue->arrived, &queue->lock);
+        }
+        if (queue->head < queue->tail) {
+                value = queue->bytes[queue->head++];
+                count_byte(&io->bytes_in);
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        return value;
+}
+
+void io_output(io_dev io, uint32_t word)
+{
+        struct io_async *async = io->async;
+
+        if (io->pipe_out != NULL) {
+                struct byte_ring *ring = &io->pipe_out->ring;
+                unsigned char *at;
+
+                /* The reader is further behind than limit says */
+                if (ring->tail < ring->limit) {
+                        ring->bytes[ring->tail & RING_MASK] = word;
+                        pipe_commit(io->pipe_out, ring->tail + 1);
+                } else if (pipe_room(io->pipe_out, &at) > 0) {
+                        *at = word;
+                        pipe_commit(io->pipe_out, ring->tail + 1);
+                }
+        } else if (async != NULL) {
+                struct byte_ring *ring = &async->out;
+                uint64_t tail = ring->tail;
+
+                /* Most bytes neither fill the ring nor end a batch */
+                if (tail + 1 < ring->limit &&
+                    (tail + 1) % IO_ASYNC_BATCH != 0) {
+                        ring->bytes[tail & RING_MASK] = word;
+                        __atomic_store_n(&ring->tail, tail + 1,
+                                         __ATOMIC_RELEASE);
+                } else {
+                        unsigned char byte = word;
+
+                        async_output(async, &byte, 1);
+                }
+        } else if (io->out_queue != NULL) {
+                unsigned char byte = word;
+
+                queue_append(io->out_queue, &byte, 1);
+        } else {
+                fputc(word, io->out);
+        }
+        count_byte(&io->bytes_out);
+}
+
+/* Bytes io_output_words narrows at a time */
+#define IO_CHUNK 4096
+
+/* Function: io_output_words
+ * Does: Outputs count words, one byte each as io_output would, in one
+ *       write per chunk. The narrowing loop is simple enough for the
+ *       compiler to vectorise
+ * Paramters: io_dev, const uint32_t*, uint32_t
+ * Returns: None
+ */
+void io_output_words(io_dev io, const uint32_t *words, uint32_t count)
+{
+        unsigned char bytes[IO_CHUNK];
+
+        /* Straight into a pipe's ring, narrowing on the way */
+        for (uint32_t done = 0; io->pipe_out != NULL && done < count;) {
+                unsigned char *at;
+                size_t room = pipe_room(io->pipe_out, &at);
+
+                if (room == 0) {
+                        break;
+                }
+                if (room > count - done) {
+                        room = count - done;
+                }
+                for (size_t i = 0; i < room; i++) {
+                        at[i] = (unsigned char)words[done + i];
+                }
+                pipe_commit(io->pipe_out, io->pipe_out->ring.tail + room);
+                done += room;
+        }
+        for (uint32_t done = 0; io->pipe_out == NULL && done < count;) {
+                uint32_t chunk = count - done < IO_CHUNK ? count - done
+                                                         : IO_CHUNK;
+
+                for (uint32_t i = 0; i < chunk; i++) {
+                        bytes[i] = (unsigned char)words[done + i];
+                }
+                if (io->async != NULL) {
+                        async_output(io->async, bytes, chunk);
+                } else if (io->out_queue != NULL) {
+                        queue_append(io->out_queue, bytes, chunk);
+                } else {
+                        fwrite(bytes, 1, chunk, io->out);
+                }
+                done += chunk;
+        }
+        __atomic_store_n(&io->bytes_out, io->bytes_out + count,
+                         __ATOMIC_RELAXED);
+}
+
+/* Tells whether io_input would return without waiting */
+bool io_ready(io_dev io)
+{
+        struct io_queue *queue = io->queue;
+
+        /* An asynchronous device may block, as reading the file would */
+        if (queue == NULL) {
+                return true;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        bool ready = queue->head < queue->tail || queue->closed;
+        pthread_mutex_unlock(&queue->lock);
+
+        return ready;
+}
+
+/* Function: io_room
+ * Does: Tells whether the UM may output more without waiting for it to be
+ *       taken: always, unless output waits for io_take and IO_OUTPUT_MAX
+ *       bytes of it already are. The engines stop at an output
+ *       instruction while there is none, as they stop at input while
+ *       io_ready is false; one instruction may take output past the limit
+ * Paramters: io_dev
+ * Returns: bool
+ */
+bool io_room(io_dev io)
+{
+        struct io_queue *queue = io->out_queue;
+
+        if (queue == NULL) {
+                return true;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        bool room = queue->tail - queue->head < IO_OUTPUT_MAX ||
+                    queue->closed;
+        pthread_mutex_unlock(&queue->lock);
+
+        return room;
+}
+
+/* Waits until io_input would return without waiting, and output has room
+ * (see io_room)
+ */
+void io_wait(io_dev io)
+{
+        struct io_queue *queue = io->queue;
+        struct io_queue *out_queue = io->out_queue;
+
+        if (queue != NULL) {
+                pthread_mutex_lock(&queue->lock);
+                while (queue->head == queue->tail && !queue->closed) {
+                        pthread_cond_wait(&queue->arrived, &queue->lock);
+                }
+                pthread_mutex_unlock(&queue->lock);
+        }
+        if (out_queue != NULL) {
+                pthread_mutex_lock(&out_queue->lock);
+                while (out_queue->tail - out_queue->head >= IO_OUTPUT_MAX &&
+                       !out_queue->closed) {
+                        pthread_cond_wait(&out_queue->taken,
+                                          &out_queue->lock);
+                }
+                pthread_mutex_unlock(&out_queue->lock);
+        }
+}
+
+void io_feed(io_dev io, const void *bytes, size_t length)
+{
+        queue_append(io->queue, bytes, length);
+}
+
+/* After the bytes already fed, input reads as end of file */
+void io_close_input(io_dev io)
+{
+        struct io_queue *queue = io->queue;
+
+        pthread_mutex_lock(&queue->lock);
+        queue->closed = true;
+        pthread_cond_broadcast(&queue->arrived);
+        pthread_mutex_unlock(&queue->lock);
+}
+
+/* Function: io_take
+ * Does: Takes up to max bytes of the output waiting, for another thread to
+ *       send on, waiting until there is some or io_close_output
+ * Paramters: io_dev, void*, size_t
+ * Returns: size_t (0 once output is closed and all of it taken)
+ */
+size_t io_take(io_dev io, void *bytes, size_t max)
+{
+        struct io_queue *queue = io->out_queue;
+
+        pthread_mutex_lock(&queue->lock);
+        while (queue->head == queue->tail && !queue->closed) {
+                pthread_cond_wait(&queue->arrived, &queue->lock);
+        }
+
+        size_t length = queue->tail - queue->head;
+
+        if (length > max) {
+                length = max;
+        }
+        memcpy(bytes, queue->bytes + queue->head, length);
+        queue->head += length;
+        pthread_cond_broadcast(&queue->taken);
+        pthread_mutex_unlock(&queue->lock);
+
+        return length;
+}
+
+/* Ends output: io_take returns 0 once what is waiting has been taken, and
+ * a UM outputting more is no longer held back
+ */
+void io_close_output(io_dev io)
+{
+        struct io_queue *queue = io->out_queue;
+
+        pthread_mutex_lock(&queue->lock);
+        queue->closed = true;
+        pthread_cond_broadcast(&queue->arrived);
+        pthread_cond_broadcast(&queue->taken);
+        pthread_mutex_unlock(&queue->lock);
+}
+
+/* Function: write_all
+ * Does: Writes the output between head and tail in the ring, both pieces
+ *       of it if it wraps, with as few system calls as the file allows.
+ *       Once a write fails the rest of the output is dropped
+ * Paramters: struct io_async*, uint64_t, uint64_t
+ * Returns: None
+ */
+static void write_all(struct io_async *async, uint64_t head, uint64_t tail)
+{
+        struct byte_ring *ring = &async->out;
+
+        while (head < tail && !async->write_failed) {
+                size_t first = IO_ASYNC_RING - (head & RING_MASK);
+                struct iovec pieces[2];
+                int count = 1;
+
+                pieces[0].iov_base = ring->bytes + (head & RING_MASK);
+                pieces[0].iov_len = tail - head;
+                if (tail - head > first) {
+                        pieces[0].iov_len = first;
+                        pieces[1].iov_base = ring->bytes;
+                        pieces[1].iov_len = tail - head - first;
+                        count = 2;
+                }
+
+                ssize_t written = writev(async->out_fd, pieces, count);
+
+                if (written < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (written <= 0) {
+                        async->write_failed = true;
+                        return;
+                }
+                head += written;
+        }
+}
+
+/* Function: writer_thread
+ * Does: Writes output as the UM produces it. It sleeps while there is
+ *       none, waking when a batch is waiting, when asked to, or every
+ *       IO_ASYNC_MS to write what is left. On stopping it writes the rest
+ * Paramters: void* (the struct io_async)
+ * Returns: NULL
+ */
+static void *writer_thread(void *cl)
+{
+        struct io_async *async = cl;
+        struct byte_ring *ring = &async->out;
+
+        for (;;) {
+                uint64_t head = ring->head;
+                uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+                if (head != tail) {
+                        write_all(async, head, tail);
+                        pthread_mutex_lock(&async->out_lock);
+                        __atomic_store_n(&ring->head, tail, __ATOMIC_SEQ_CST);
+                        pthread_cond_broadcast(&async->out_drained);
+                        pthread_mutex_unlock(&async->out_lock);
+                        continue;
+                }
+
+                /* Says it is going to sleep, then looks once more, so that
+                 * output put meanwhile is not left waiting
+                 */
+                pthread_mutex_lock(&async->out_lock);
+                __atomic_store_n(&async->writer_idle, true, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+                        if (async->stopping) {
+                                pthread_mutex_unlock(&async->out_lock);
+                                return NULL;
+                        }
+                        wait_a_while(&async->out_wake, &async->out_lock);
+                }
+                __atomic_store_n(&async->writer_idle, false, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&async->out_lock);
+        }
+}
+
+/* Function: reader_thread
+ * Does: Reads input ahead of the UM until end of file, waiting while the
+ *       ring is full. It can only be cancelled while it reads, so it never
+ *       stops holding the lock
+ * Paramters: void* (the struct io_async)
+ * Returns: NULL
+ */
+static void *reader_thread(void *cl)
+{
+        struct io_async *async = cl;
+        struct byte_ring *ring = &async->in;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        for (;;) {
+                uint64_t tail = ring->tail;
+                size_t space = IO_ASYNC_RING - (tail -
+                               __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+
+                if (space == 0) {
+                        pthread_mutex_lock(&async->in_lock);
+                        __atomic_store_n(&async->reader_waiting, true,
+                                         __ATOMIC_SEQ_CST);
+                        while (tail - __atomic_load_n(&ring->head,
+                                        __ATOMIC_SEQ_CST) == IO_ASYNC_RING &&
+                               !__atomic_load_n(&async->stopping,
+                                                __ATOMIC_SEQ_CST)) {
+                                pthread_cond_wait(&async->in_space,
+                                                  &async->in_lock);
+                        }
+                        __atomic_store_n(&async->reader_waiting, false,
+                                         __ATOMIC_SEQ_CST);
+                        pthread_mutex_unlock(&async->in_lock);
+                        if (__atomic_load_n(&async->stopping,
+                                            __ATOMIC_SEQ_CST)) {
+                                return NULL;
+                        }
+                        continue;
+                }
+
+                size_t chunk = IO_ASYNC_RING - (tail & RING_MASK);
+
+                if (chunk > space) {
+                        chunk = space;
+                }
+
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                ssize_t got = read(async->in_fd,
+                                   ring->bytes + (tail & RING_MASK), chunk);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+                if (got < 0 && errno == EINTR) {
+                        continue;
+                }
+
+                pthread_mutex_lock(&async->in_lock);
+                if (got <= 0) {
+                        async->in_eof = true;
+                } else {
+                        __atomic_store_n(&ring->tail, tail + got,
+                                         __ATOMIC_RELEASE);
+                }
+                pthread_cond_broadcast(&async->in_arrived);
+                pthread_mutex_unlock(&async->in_lock);
+                if (got <= 0) {
+                        return NULL;
+                }
+        }
+}
+
+/* Writes out every asynchronous device when the program exits, however
+ * it exits, as stdio would for its own buffers
+ */
+static void flush_at_exit()
+{
+        pthread_mutex_lock(&async_devices_lock);
+        for (struct io_async *a = async_devices; a != NULL; a = a->next) {
+                io_flush(a->io);
+        }
+        pthread_mutex_unlock(&async_devices_lock);
+}
+
+static void register_flush()
+{
+        atexit(flush_at_exit);
+}
+
+/* Function: io_start_async
+ * Does: Gives a device a writer thread and a reader thread, so that the
+ *       UM neither waits on write nor on read while there is input ahead.
+ *       A device fed by io_feed or drained by io_take already has that
+ *       side in memory, and one connected to pipes has no file to wait on
+ *       for at least one side (and its reader would take input meant for
+ *       another UM); all are left as they are, as is one on a stream with
+ *       no descriptor for the threads to use (a memory stream, say)
+ * Paramters: io_dev
+ * Returns: None
+ */
+void io_start_async(io_dev io)
+{
+        static pthread_once_t registered = PTHREAD_ONCE_INIT;
+
+        if (io->async != NULL || io->queue != NULL ||
+            io->out_queue != NULL || io->pipe_in != NULL ||
+            io->pipe_out != NULL || fileno(io->in) < 0 ||
+            fileno(io->out) < 0) {
+                return;
+        }
+
+        struct io_async *async = calloc(1, sizeof(*async));
+
+        if (async == NULL ||
+            (async->out.bytes = malloc(IO_ASYNC_RING)) == NULL ||
+            (async->in.bytes = malloc(IO_ASYNC_RING)) == NULL) {
+                fprintf(stderr, "Error: Could not allocate I/O rings\n");
+                exit(EXIT_FAILURE);
+        }
+        fflush(io->out);
+        async->out_fd = fileno(io->out);
+        async->in_fd = fileno(io->in);
+        async->io = io;
+        pthread_mutex_init(&async->out_lock, NULL);
+        pthread_cond_init(&async->out_wake, NULL);
+        pthread_cond_init(&async->out_drained, NULL);
+        pthread_mutex_init(&async->in_lock, NULL);
+        pthread_cond_init(&async->in_arrived, NULL);
+        pthread_cond_init(&async->in_space, NULL);
+        pthread_create(&async->writer, NULL, writer_thread, async);
+        pthread_create(&async->reader, NULL, reader_thread, async);
+        io->async = async;
+
+        pthread_once(&registered, register_flush);
+        pthread_mutex_lock(&async_devices_lock);
+        async->next = async_devices;
+        async_devices = async;
+        pthread_mutex_unlock(&async_devices_lock);
+}
+
+/* Function: io_flush
+ * Does: Waits until all the output so far has been written. Output into
+ *       a pipe is already there, so its reader is only woken
+ * Paramters: io_dev
+ * Returns: None
+ */
+void io_flush(io_dev io)
+{
+        struct io_async *async = io->async;
+
+        if (io->pipe_out != NULL) {
+                pipe_wake(io->pipe_out, &io->pipe_out->reader_waiting);
+                return;
+        }
+        if (async == NULL) {
+                if (io->out_queue == NULL) {
+                        fflush(io->out);
+                }
+                return;
+        }
+
+        struct byte_ring *ring = &async->out;
+        uint64_t tail = ring->tail;
+
+        pthread_mutex_lock(&async->out_lock);
+        pthread_cond_signal(&async->out_wake);
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail &&
+               !async->write_failed) {
+                pthread_cond_wait(&async->out_drained, &async->out_lock);
+        }
+        pthread_mutex_unlock(&async->out_lock);
+}
+
+/* Function: stop_async
+ * Does: Writes the rest of the output and stops both threads. Input read
+ *       ahead and never asked for is lost, as with any buffered reader
+ * Paramters: io_dev
+ * Returns: None
+ */
+static void stop_async(io_dev io)
+{
+        struct io_async *async = io->async;
+
+        pthread_mutex_lock(&async_devices_lock);
+        for (struct io_async **a = &async_devices; *a != NULL;
+             a = &(*a)->next) {
+                if (*a == async) {
+                        *a = async->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&async_devices_lock);
+
+        pthread_mutex_lock(&async->out_lock);
+        __atomic_store_n(&async->stopping, true, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&async->out_wake);
+        pthread_mutex_unlock(&async->out_lock);
+        pthread_join(async->writer, NULL);
+
+        pthread_mutex_lock(&async->in_lock);
+        pthread_cond_signal(&async->in_space);
+        pthread_mutex_unlock(&async->in_lock);
+        pthread_cancel(async->reader);
+        pthread_join(async->reader, NULL);
+
+        pthread_mutex_destroy(&async->out_lock);
+        pthread_cond_destroy(&async->out_wake);
+        pthread_cond_destroy(&async->out_drained);
+        pthread_mutex_destroy(&async->in_lock);
+        pthread_cond_destroy(&async->in_arrived);
+        pthread_cond_destroy(&async->in_space);
+        free(async->out.bytes);
+        free(async->in.bytes);
+        free(async);
+        io->async = NULL;
+}
+
+/* Function: io_pipe_new
+ * Does: Creates an empty pipe, for io_connect to join two devices with
+ * Paramters: None
+ * Returns: io_pipe
+ */
+io_pipe io_pipe_new()
+{
+        io_pipe pipe = calloc(1, sizeof(*pipe));
+
+        if (pipe == NULL ||
+            (pipe->ring.bytes = malloc(IO_ASYNC_RING)) == NULL) {
+                fprintf(stderr, "Error: Could not allocate a pipe\n");
+                exit(EXIT_FAILURE);
+        }
+        pipe->ring.limit = IO_ASYNC_RING;
+        pthread_mutex_init(&pipe->lock, NULL);
+        pthread_cond_init(&pipe->moved, NULL);
+        return pipe;
+}
+
+/* Function: io_pipe_free
+ * Does: Frees a pipe that neither device is connected to any more
+ * Paramters: io_pipe*
+ * Returns: None
+ */
+void io_pipe_free(io_pipe *pipe)
+{
+        pthread_mutex_destroy(&(*pipe)->lock);
+        pthread_cond_destroy(&(*pipe)->moved);
+        free((*pipe)->ring.bytes);
+        free(*pipe);
+        *pipe = NULL;
+}
+
+/* Function: io_connect
+ * Does: Makes a device read its input from pipe in and write its output
+ *       to pipe out instead of its files. Either may be NULL to keep the
+ *       file. Each side of a pipe takes one device
+ * Paramters: io_dev, io_pipe, io_pipe
+ * Returns: None
+ */
+void io_connect(io_dev io, io_pipe in, io_pipe out)
+{
+        if (in != NULL) {
+                io->pipe_in = in;
+        }
+        if (out != NULL) {
+                io->pipe_out = out;
+        }
+}
+
+/* Function: io_disconnect
+ * Does: Ends a device's use of its pipes, as closing a file would: the
+ *       reader of its output pipe gets end of file once it has taken every
+ *       byte, and the writer of its input pipe has the rest of its output
+ *       dropped
+ * Paramters: io_dev
+ * Returns: None
+ */
+void io_disconnect(io_dev io)
+{
+        if (io->pipe_out != NULL) {
+                pthread_mutex_lock(&io->pipe_out->lock);
+                io->pipe_out->closed = true;
+                pthread_cond_broadcast(&io->pipe_out->moved);
+                pthread_mutex_unlock(&io->pipe_out->lock);
+                io->pipe_out = NULL;
+        }
+        if (io->pipe_in != NULL) {
+                pthread_mutex_lock(&io->pipe_in->lock);
+                __atomic_store_n(&io->pipe_in->gone, true, __ATOMIC_RELAXED);
+                pthread_cond_broadcast(&io->pipe_in->moved);
+                pthread_mutex_unlock(&io->pipe_in->lock);
+                io->pipe_in = NULL;
+        }
+}
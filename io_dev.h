@@ -1,12 +1,72 @@
 #ifndef IO_DEV_INCLUDED
 #define IO_DEV_INCLUDED
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <seq.h>
 #include <uarray.h>
 #include "except.h"
 
-uint32_t io_input();
-void io_output(uint32_t word);
+/* Bytes in each ring of an asynchronous device, and the output waiting
+ * that wakes its writer early (it also looks every IO_ASYNC_MS)
+ */
+#define IO_ASYNC_RING (1 << 20)
+#define IO_ASYNC_BATCH 4096
+#define IO_ASYNC_MS 10
 
-#endif
\ No newline at end of file
+/* Output waiting to be taken past which a UM with no output file stops
+ * until some is (see io_room)
+ */
+#define IO_OUTPUT_MAX 65536
+
+/* The I/O device of one UM: where its input comes from and where its
+ * output goes. Without an input file, input is whatever io_feed has
+ * handed over so far, and without an output file, output waits for
+ * io_take to hand it to another thread. An asynchronous device has a
+ * writer thread draining output and a reader thread reading input ahead,
+ * each through a ring. A device connected to pipes takes its input from
+ * the ring the UM before it outputs into, or outputs into the ring the UM
+ * after it reads, in place of the files.
+ */
+typedef struct io_dev {
+        FILE *in;
+        FILE *out;
+        struct io_queue *queue;
+        struct io_queue *out_queue;
+        struct io_async *async;
+        struct io_pipe *pipe_in;
+        struct io_pipe *pipe_out;
+        uint64_t bytes_in;              /* read by metrics.c */
+        uint64_t bytes_out;
+} *io_dev;
+
+io_dev io_new(FILE *in, FILE *out);
+void io_free(io_dev *io);
+uint32_t io_input(io_dev io);
+void io_output(io_dev io, uint32_t word);
+void io_output_words(io_dev io, const uint32_t *words, uint32_t count);
+
+bool io_ready(io_dev io);
+bool io_room(io_dev io);
+void io_wait(io_dev io);
+void io_feed(io_dev io, const void *bytes, size_t length);
+void io_close_input(io_dev io);
+size_t io_take(io_dev io, void *bytes, size_t max);
+void io_close_output(io_dev io);
+
+void io_start_async(io_dev io);
+void io_flush(io_dev io);
+
+/* A ring of IO_ASYNC_RING bytes from one UM's output to the next one's
+ * input, in the same process. Each side sleeps only when the ring is full
+ * or empty, and looks again every IO_ASYNC_MS in case a wake-up was missed
+ */
+typedef struct io_pipe *io_pipe;
+
+io_pipe io_pipe_new();
+void io_pipe_free(io_pipe *pipe);
+void io_connect(io_dev io, io_pipe in, io_pipe out);
+void io_disconnect(io_dev io);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "latency.h"
+
+/* Every value of one measure, to sort for percentiles, and a histogram */
+struct series {
+        uint64_t *values;
+        uint32_t count;
+        uint32_t capacity;
+        uint64_t bins[LATENCY_BINS];
+};
+
+struct latency_stats {
+        bool in_line;                   /* a line has started, not ended */
+        bool open;                      /* an interaction is under way */
+        bool answered;                  /* it has output */
+        uint64_t start_ns;
+        uint64_t first_ns;
+        uint64_t last_ns;
+        uint64_t start_instructions;
+        uint32_t silent;                /* interactions without output */
+        struct series first;            /* microseconds */
+        struct series last;
+        struct series instructions;
+};
+
+static uint64_t now_ns()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static unsigned bin_of(uint64_t value)
+{
+        unsigned bin = value == 0 ? 0 : 63 - __builtin_clzll(value);
+
+        return bin < LATENCY_BINS ? bin : LATENCY_BINS - 1;
+}
+
+static void add(struct series *series, uint64_t value)
+{
+        if (series->count == series->capacity) {
+                series->capacity = series->capacity == 0 ? 64
+                                   : series->capacity * 2;
+                series->values = realloc(series->values, series->capacity *
+                                         sizeof(uint64_t));
+                if (series->values == NULL) {
+                        fprintf(stderr, "Error: Could not allocate latency "
+                                "stats\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        series->values[series->count++] = value;
+        series->bins[bin_of(value)]++;
+}
+
+/* Ends the interaction under way, if any, at this instruction count */
+static void finish(latency_stats stats, uint64_t instructions)
+{
+        if (!stats->open) {
+                return;
+        }
+        stats->open = false;
+        add(&stats->instructions, instructions - stats->start_instructions);
+        if (stats->answered) {
+                add(&stats->first, (stats->first_ns - stats->start_ns) / 1000);
+                add(&stats->last, (stats->last_ns - stats->start_ns) / 1000);
+        } else {
+                stats->silent++;
+        }
+}
+
+/* Function: latency_new
+ * Does: Creates empty latency stats
+ * Paramters: None
+ * Returns: latency_stats
+ */
+latency_stats latency_new()
+{
+        latency_stats stats = calloc(1, sizeof(*stats));
+
+        if (stats == NULL) {
+                fprintf(stderr, "Error: Could not allocate latency stats\n");
+                exit(EXIT_FAILURE);
+        }
+        return stats;
+}
+
+/* Function: latency_input
+ * Does: Called as an input instruction returns value. The first byte of a
+ *       line ends the last interaction and starts the next; end of input
+ *       ends the last one
+ * Paramters: latency_stats, uint32_t, uint64_t (instructions so far)
+ * Returns: None
+ */
+void latency_input(latency_stats stats, uint32_t value,
+                   uint64_t instructions)
+{
+        if (value == UINT32_MAX) {
+                finish(stats, instructions);
+                stats->in_line = false;
+                return;
+        }
+        if (!stats->in_line) {
+                finish(stats, instructions);
+                stats->open = true;
+                stats->answered = false;
+                stats->in_line = true;
+                stats->start_ns = now_ns();
+                stats->start_instructions = instructions;
+        }
+        if (value == '\n') {
+                stats->in_line = false;
+        }
+}
+
+/* Function: latency_output
+ * Does: Called as an output instruction hands its bytes to the device
+ * Paramters: latency_stats
+ * Returns: None
+ */
+void latency_output(latency_stats stats)
+{
+        if (!stats->open) {
+                return;
+        }
+        stats->last_ns = now_ns();
+        if (!stats->answered) {
+                stats->first_ns = stats->last_ns;
+                stats->answered = true;
+        }
+}
+
+static int by_value(const void *x, const void *y)
+{
+        uint64_t vx = *(const uint64_t *)x;
+        uint64_t vy = *(const uint64_t *)y;
+
+        return (vx > vy) - (vx < vy);
+}
+
+/* The value at percentile p (nearest rank) of a series, sorting it */
+static uint64_t percentile(struct series *series, unsigned p)
+{
+        if (series->count == 0) {
+                return 0;
+        }
+        qsort(series->values, series->count, sizeof(uint64_t), by_value);
+
+        uint64_t rank = ((uint64_t)series->count * p + 99) / 100;
+
+        return series->values[rank == 0 ? 0 : rank - 1];
+}
+
+static void report_series(FILE *out, const char *name, struct series *series,
+                          const char *unit)
+{
+        fprintf(out, "%-28s p50 %10llu%s  p99 %10llu%s  max %10llu%s\n", name,
+                (unsigned long long)percentile(series, 50), unit,
+                (unsigned long long)percentile(series, 99), unit,
+                (unsigned long long)percentile(series, 100), unit);
+}
+
+/* Function: latency_report
+ * Does: Ends the interaction under way, then prints the percentiles of
+ *       each measure and a histogram of the two latencies
+ * Paramters: FILE*, latency_stats, uint64_t (instructions at the end)
+ * Returns: None
+ */
+void latency_report(FILE *out, latency_stats stats, uint64_t instructions)
+{
+        finish(stats, instructions);
+
+        fprintf(out, "Interactions: %u lines of input, %u with no output\n",
+                stats->instructions.count, stats->silent);
+        if (stats->instructions.count == 0) {
+                return;
+        }
+        report_series(out, "Input to first output:", &stats->first, "us");
+        report_series(out, "Input to last output:", &stats->last, "us");
+        report_series(out, "Instructions per line:", &stats->instructions,
+                      "");
+
+        fprintf(out, "%22s %14s %14s\n", "microseconds", "first output",
+                "last output");
+        for (unsigned bin = 0; bin < LATENCY_BINS; bin++) {
+                if (stats->first.bins[bin] == 0 &&
+                    stats->last.bins[bin] == 0) {
+                        continue;
+                }
+
+                char range[32];
+
+                if (bin == 0) {
+                        snprintf(range, sizeof(range), "0-1");
+                } else if (bin == LATENCY_BINS - 1) {
+                        snprintf(range, sizeof(range), "%llu+", 1ULL << bin);
+                } else {
+                        snprintf(range, sizeof(range), "%llu-%llu",
+                                 1ULL << bin, (2ULL << bin) - 1);
+                }
+                fprintf(out, "%22s %14llu %14llu\n", range,
+                        (unsigned long long)stats->first.bins[bin],
+                        (unsigned long long)stats->last.bins[bin]);
+        }
+}
+
+/* Function: latency_free
+ * Does: Frees latency stats
+ * Paramters: latency_stats*
+ * Returns: None
+ */
+void latency_free(latency_stats *stats)
+{
+        free((*stats)->first.values);
+        free((*stats)->last.values);
+        free((*stats)->instructions.values);
+        free(*stats);
+        *stats = NULL;
+}
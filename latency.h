@@ -0,0 +1,24 @@
+#ifndef LATENCY_INCLUDED
+#define LATENCY_INCLUDED
+#include <stdio.h>
+#include <stdint.h>
+
+/* Log2 bins of the histograms, in microseconds, the last one open-ended */
+#define LATENCY_BINS 32
+
+/* How an interactive UM feels: for each line of input, the time from the
+ * UM taking its first byte to the first and to the last output it gave in
+ * reply, and the instructions it ran until the next line. The engines
+ * call latency_input and latency_output at each input and output
+ * instruction.
+ */
+typedef struct latency_stats *latency_stats;
+
+latency_stats latency_new();
+void latency_input(latency_stats stats, uint32_t value,
+                   uint64_t instructions);
+void latency_output(latency_stats stats);
+void latency_report(FILE *out, latency_stats stats, uint64_t instructions);
+void latency_free(latency_stats *stats);
+
+#endif
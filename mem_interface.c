@@ -2,25 +2,355 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include <seq.h>
 #include <uarray.h>
 
 #include "mem_interface.h"
+#include "write_barrier.h"
+#include "guard.h"
 #include "bitpack.h"
 #include "except.h"
+#include "trap.h"
 
-Seq_T init_mem() 
+/* Keeps the counts metrics.c reads. The threads of a UM may change them
+ * at once, so they are added to atomically; the peak is only a sample
+ */
+static void account(um_mem mem, int segments, int64_t words)
 {
-        Seq_T mem = Seq_new(0);
+        uint32_t live = __atomic_add_fetch(&mem->live_segments, segments,
+                                           __ATOMIC_RELAXED);
+
+        if (live > mem->peak_segments) {
+                __atomic_store_n(&mem->peak_segments, live, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&mem->mapped_bytes, words * sizeof(uint32_t),
+                           __ATOMIC_RELAXED);
+}
+
+/* Counts words of segments other than 0 coming into or (negative) leaving
+ * memory
+ */
+static void resident(um_mem mem, int64_t words)
+{
+        __atomic_add_fetch(&mem->resident_bytes, words * sizeof(uint32_t),
+                           __ATOMIC_RELAXED);
+}
+
+static void count(uint64_t *counter)
+{
+        __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Function: alloc_words
+ * Does: Gives a segment num_words zeroed words: with a guard after them if
+ *       guard pages are on and it is long enough, else from the arena if
+ *       there is one and it is short enough, else ready from the
+ *       reclaimer or from calloc
+ * Paramters: um_mem, mem_seg, uint32_t
+ * Returns: None
+ */
+static void alloc_words(um_mem mem, mem_seg seg, uint32_t num_words)
+{
+        seg->words = NULL;
+        seg->guarded = false;
+        seg->in_arena = false;
+        if (mem->guard_pages && num_words >= GUARD_MIN_WORDS) {
+                seg->words = guard_alloc_words(num_words);
+                seg->guarded = seg->words != NULL;
+        }
+        if (seg->words == NULL && mem->arena != NULL) {
+                seg->words = arena_alloc(mem->arena, num_words, seg->ordinal);
+                seg->in_arena = seg->words != NULL;
+        }
+        if (seg->words == NULL && mem->reclaim != NULL) {
+                seg->words = reclaim_get(mem->reclaim, num_words);
+        }
+        if (seg->words == NULL) {
+                seg->words = calloc(num_words, sizeof(uint32_t));
+        }
+        if (seg->words == NULL && num_words != 0) {
+                fprintf(stderr, "Error: Could not allocate segment\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void release_plain(void *ptr, uint32_t length)
+{
+        (void)length;
+        free(ptr);
+}
+
+static void release_guarded(void *ptr, uint32_t length)
+{
+        guard_free_words(ptr, length);
+}
+
+/* Gives up a segment's words, however they were allocated. Shared memory
+ * only retires them: another thread may still be using them
+ */
+static void release_words(um_mem mem, mem_seg seg)
+{
+        if (seg->in_arena) {
+                arena_release(mem->arena, seg->words, seg->length,
+                              seg->ordinal);
+        } else if (mem->epochs != NULL && seg->words != NULL) {
+                epoch_retire(mem->epochs, seg->words, seg->length,
+                             seg->guarded ? release_guarded : release_plain);
+        } else if (seg->guarded) {
+                guard_free_words(seg->words, seg->length);
+        } else if (mem->reclaim != NULL && seg->words != NULL) {
+                reclaim_put(mem->reclaim, seg->words, seg->length);
+        } else {
+                free(seg->words);
+        }
+        seg->words = NULL;
+        seg->guarded = false;
+        seg->in_arena = false;
+}
+
+/* Function: spill_out
+ * Does: Writes a segment to the spill store and frees its words. Anything
+ *       pointing at them must be told through the generation
+ * Paramters: um_mem, mem_seg
+ * Returns: None
+ */
+static void spill_out(um_mem mem, mem_seg seg)
+{
+        if (mem->spill == NULL) {
+                mem->spill = spill_new();
+        }
+        if (seg->slot == SPILL_NONE) {
+                seg->slot = spill_alloc(mem->spill, seg->length);
+        }
+        spill_write(mem->spill, seg->slot, seg->words, seg->length);
+        release_words(mem, seg);
+        seg->spilled = true;
+        resident(mem, -(int64_t)seg->length);
+        count(&mem->spills);
+}
+
+/* Function: enforce_quota
+ * Does: Once the words in memory go over the quota, spills segments until
+ *       they are an eighth under it, so that this happens in batches. A
+ *       clock hand goes round the segments: one used since it last passed
+ *       gets another chance, one that was not is spilled. The segment
+ *       being used right now (keep), the pinned one and segment 0 are
+ *       never spilled. If
+ *       anything changed, the generation moves on so that segment caches
+ *       look again, which also marks the segments they use as referenced
+ * Paramters: um_mem, mem_seg
+ * Returns: None
+ */
+static void enforce_quota(um_mem mem, mem_seg keep)
+{
+        if (mem->quota == 0 || mem->resident_bytes <= mem->quota) {
+                return;
+        }
+
+        uint32_t num_segs = mem->num_segs;
+        uint64_t target = mem->quota - mem->quota / 8;
+        bool changed = false;
+
+        /* Two turns are enough: the first clears every referenced bit */
+        for (uint32_t steps = 0; mem->resident_bytes > target &&
+             steps < 2 * num_segs; steps++) {
+                mem->clock_hand = (mem->clock_hand + 1) % num_segs;
+                mem_seg seg = mem->table->slots[mem->clock_hand];
+
+                if (mem->clock_hand == 0 || seg == keep ||
+                    seg == mem->pinned || !seg->mapped || seg->spilled ||
+                    seg->length == 0) {
+                        continue;
+                }
+                if (seg->referenced) {
+                        seg->referenced = false;
+                } else {
+                        spill_out(mem, seg);
+                }
+                changed = true;
+        }
+
+        if (changed) {
+                mem->generation++;
+        }
+}
+
+/* Function: fault_in
+ * Does: Reads a spilled segment back into memory, possibly spilling
+ *       others to stay within the quota
+ * Paramters: um_mem, mem_seg
+ * Returns: None
+ */
+static void fault_in(um_mem mem, mem_seg seg)
+{
+        alloc_words(mem, seg, seg->length);
+        spill_read(mem->spill, seg->slot, seg->words, seg->length);
+        seg->spilled = false;
+        resident(mem, seg->length);
+        count(&mem->spill_faults);
+        enforce_quota(mem, seg);
+}
+
+/* The segment with an identifier, or NULL if there has never been one.
+ * A table is only published once it holds every identifier below
+ * num_segs
+ */
+static inline mem_seg seg_at(um_mem mem, unsigned seg_num)
+{
+        if (seg_num >= __atomic_load_n(&mem->num_segs, __ATOMIC_ACQUIRE)) {
+                return NULL;
+        }
+        return __atomic_load_n(&mem->table, __ATOMIC_ACQUIRE)->slots[seg_num];
+}
+
+/* Looks up a segment about to be used, bringing it back if spilled. An
+ * identifier of no mapped segment traps
+ */
+static inline mem_seg use_seg(um_mem mem, unsigned seg_num)
+{
+        mem_seg seg = seg_at(mem, seg_num);
+
+        if (seg == NULL || !seg->mapped) {
+                trap_raise(TRAP_UNMAPPED);
+        }
+        seg->referenced = true;
+        if (seg->spilled) {
+                fault_in(mem, seg);
+        }
+        return seg;
+}
+
+static struct seg_table *new_table(uint32_t capacity)
+{
+        struct seg_table *table = malloc(sizeof(*table) +
+                                         capacity * sizeof(mem_seg));
+
+        if (table == NULL) {
+                fprintf(stderr, "Error: Could not allocate segment table\n");
+                exit(EXIT_FAILURE);
+        }
+        table->capacity = capacity;
+        return table;
+}
+
+/* Function: add_seg
+ * Does: Gives a segment an identifier never used before, replacing the
+ *       table with one twice the size if it is full. Segments are only
+ *       added under grow_lock, so none is lost from a table being copied
+ * Paramters: um_mem, mem_seg
+ * Returns: uint32_t (the identifier)
+ */
+static uint32_t add_seg(um_mem mem, mem_seg seg)
+{
+        pthread_mutex_lock(&mem->grow_lock);
+
+        struct seg_table *table = mem->table;
+        uint32_t id = mem->num_segs;
+
+        if (id == table->capacity) {
+                struct seg_table *bigger = new_table(table->capacity * 2);
+
+                memcpy(bigger->slots, table->slots, id * sizeof(mem_seg));
+                __atomic_store_n(&mem->table, bigger, __ATOMIC_RELEASE);
+                if (mem->epochs != NULL) {
+                        epoch_retire(mem->epochs, table, 0, release_plain);
+                } else {
+                        free(table);
+                }
+                table = bigger;
+        }
+        table->slots[id] = seg;
+        __atomic_store_n(&mem->num_segs, id + 1, __ATOMIC_RELEASE);
+
+        pthread_mutex_unlock(&mem->grow_lock);
+        return id;
+}
+
+/* Takes the identifier on top of the free stack, or 0 if it is empty.
+ * The count of changes in the top makes a pop that raced with others
+ * fail, even if the same identifier is back on top by then
+ */
+static uint32_t pop_free_id(um_mem mem)
+{
+        uint64_t top = __atomic_load_n(&mem->free_ids, __ATOMIC_ACQUIRE);
+        uint64_t next;
+
+        do {
+                uint32_t id = (uint32_t)top;
+
+                if (id == 0) {
+                        return 0;
+                }
+                next = ((top >> 32) + 1) << 32 |
+                       __atomic_load_n(&seg_at(mem, id)->next_free,
+                                       __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&mem->free_ids, &top, next,
+                                              true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE));
+
+        return (uint32_t)top;
+}
+
+/* Puts an unmapped segment's identifier on top of the free stack */
+static void push_free_id(um_mem mem, mem_seg seg, uint32_t id)
+{
+        uint64_t top = __atomic_load_n(&mem->free_ids, __ATOMIC_RELAXED);
+
+        do {
+                __atomic_store_n(&seg->next_free, (uint32_t)top,
+                                 __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&mem->free_ids, &top,
+                                              ((top >> 32) + 1) << 32 | id,
+                                              true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+}
+
+um_mem init_mem() 
+{
+        um_mem mem = malloc(sizeof(*mem));
+        mem->table = new_table(64);
+        mem->num_segs = 0;
+        mem->free_ids = 0;
+        pthread_mutex_init(&mem->grow_lock, NULL);
+        mem->epochs = NULL;
+        mem->generation = 1;
+        mem->live_segments = 0;
+        mem->peak_segments = 0;
+        mem->mapped_bytes = 0;
+        mem->quota = 0;
+        mem->limit = 0;
+        mem->resident_bytes = 0;
+        mem->clock_hand = 0;
+        mem->pinned = NULL;
+        mem->spill = NULL;
+        mem->spills = 0;
+        mem->spill_faults = 0;
+        mem->reclaim = NULL;
+        mem->guard_pages = false;
+        mem->arena = NULL;
+        mem->count_caches = false;
+        mem->trace = NULL;
+        mem->maps = 0;
+        account(mem, 1, 0);
+
         mem_seg prog_seg = malloc(sizeof(*prog_seg));
         prog_seg->mapped = 1;
+        prog_seg->length = 0;
         prog_seg->words = NULL;
-        Seq_addlo(mem, prog_seg);
+        prog_seg->spilled = false;
+        prog_seg->referenced = true;
+        prog_seg->guarded = false;
+        prog_seg->in_arena = false;
+        prog_seg->ordinal = 0;
+        prog_seg->slot = SPILL_NONE;
+        add_seg(mem, prog_seg);
 
         return mem;
 }
 
-void init_prog(Seq_T mem, FILE *fp)
+void init_prog(um_mem mem, FILE *fp)
 {
         int counter = 0;
 
@@ -32,7 +362,8 @@ void init_prog(Seq_T mem, FILE *fp)
         bool end = false;
 
         if (mem == NULL || fp == NULL) {
-                fprintf(stdout, "Error: Memory/File pointer is uninitialized");
+                fprintf(stderr, "Error: Memory/File pointer is "
+                        "uninitialized\n");
                 exit(EXIT_FAILURE);
         }
 
@@ -46,8 +377,10 @@ void init_prog(Seq_T mem, FILE *fp)
         }
 
         num_words = counter / 4;
-        mem_seg prog_seg = (mem_seg)Seq_get(mem, 0);
-        prog_seg->words = UArray_new(num_words, sizeof(uint32_t));
+        mem_seg prog_seg = mem->table->slots[0];
+        prog_seg->length = num_words;
+        prog_seg->words = wb_alloc_words(num_words);
+        account(mem, 0, num_words);
         end = false;
 
         rewind(fp);
@@ -64,9 +397,7 @@ void init_prog(Seq_T mem, FILE *fp)
                         if (reader < 4) {
                                 reader++;
                         } else {
-                                uint32_t *curr_word = 
-                                UArray_at(prog_seg->words, index); 
-                                *curr_word = word;
+                                prog_seg->words[index] = word;
 
                                 reader = 1;
                                 index++;
@@ -75,131 +406,521 @@ void init_prog(Seq_T mem, FILE *fp)
         }
 }
 
-Seq_T init_unmapped_seq()
+uint32_t mem_map_segment(um_mem mem, unsigned num_words)
 {
-        Seq_T unmapped_seq = Seq_new(0);
+        if (mem->limit != 0 &&
+            __atomic_load_n(&mem->mapped_bytes, __ATOMIC_RELAXED) +
+            (uint64_t)num_words * sizeof(uint32_t) > mem->limit) {
+                trap_raise(TRAP_MEMORY_LIMIT);
+        }
+
+        /* Gets the segment number of an unmapped segment, if any */
+        uint32_t new_index = pop_free_id(mem);
+
+        mem_seg new_seg;
+
+        if (new_index != 0) {
+                new_seg = seg_at(mem, new_index);
+        } else {
+                /* Creates a new struct, with nothing another thread (or
+                 * guard_fault) could read half-made once add_seg
+                 * publishes it
+                 */
+                new_seg = malloc(sizeof(*new_seg));
+                if (new_seg == NULL) {
+                        fprintf(stderr, "Error: Could not allocate "
+                                        "segment\n");
+                        exit(EXIT_FAILURE);
+                }
+                new_seg->mapped = 0;
+                new_seg->words = NULL;
+                new_seg->length = 0;
+                new_seg->guarded = false;
+                new_index = add_seg(mem, new_seg);
+        }
+
+        /* Sets all words to 0 */
+        new_seg->length = num_words;
+        new_seg->ordinal = __atomic_fetch_add(&mem->maps, 1,
+                                              __ATOMIC_RELAXED);
+        alloc_words(mem, new_seg, num_words);
+        new_seg->spilled = false;
+        new_seg->referenced = true;
+        new_seg->slot = SPILL_NONE;
+        __atomic_store_n(&new_seg->mapped, 1, __ATOMIC_RELEASE);
+        account(mem, 1, num_words);
+        resident(mem, num_words);
+        enforce_quota(mem, new_seg);
 
-        return unmapped_seq;
+        return new_index;
 }
 
-uint32_t mem_map_segment(Seq_T mem, Seq_T unmapped_seq, unsigned num_words)
+void mem_unmap_segment(um_mem mem, unsigned index)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        if (index == 0) {
+                trap_raise(TRAP_UNMAP_ZERO);
         }
-        uint32_t new_index;
 
-        mem_seg new_seg;
+        mem_seg old_seg = seg_at(mem, index);
+
+        /* Checks if the segment is already unmapped; of threads unmapping
+         * it at once, only one goes on
+         */
+        if (old_seg != NULL &&
+            __atomic_exchange_n(&old_seg->mapped, 0, __ATOMIC_ACQ_REL) != 0) {
+                __atomic_add_fetch(&mem->generation, 1, __ATOMIC_SEQ_CST);
+                account(mem, -1, -(int64_t)old_seg->length);
+                if (!old_seg->spilled) {
+                        resident(mem, -(int64_t)old_seg->length);
+                }
+                if (old_seg->slot != SPILL_NONE) {
+                        spill_release(mem->spill, old_seg->slot,
+                                      old_seg->length);
+                        old_seg->slot = SPILL_NONE;
+                }
+                old_seg->spilled = false;
+                release_words(mem, old_seg);
+                old_seg->length = 0;
+        } else {
+                trap_raise(TRAP_UNMAPPED);
+        }
 
-        /* Checks if there are any unmapped segments */
-        if (Seq_length(unmapped_seq) != 0) {
-                /* Gets the segment number of an unmapped segment */
-                uint32_t* new_index_ptr = 
-                ((void *)(uintptr_t)Seq_remhi(unmapped_seq));
-                new_index = *new_index_ptr;
-                free(new_index_ptr);
-                new_seg = (mem_seg)Seq_get(mem, new_index);
-                new_seg->mapped = 1;
-                new_seg->words = UArray_new(num_words, sizeof(uint32_t));
+        push_free_id(mem, old_seg, index);
+        if (mem->epochs != NULL) {
+                epoch_retired(mem->epochs);
+        }
+}
 
-        } else {
-                /* Creates a new struct */
-                new_seg = malloc(sizeof(*new_seg));
-                new_seg->mapped = 1;
-                new_seg->words = UArray_new(num_words, sizeof(uint32_t));
+uint32_t get_word(um_mem mem, unsigned seg_num, unsigned offset)
+{
+        mem_seg curr_seg = use_seg(mem, seg_num);
+        if (offset >= curr_seg->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
+        }
 
-                Seq_addhi(mem, new_seg);
-                new_index = Seq_length(mem) - 1;
+        return curr_seg->words[offset];
+}
+
+void put_word(um_mem mem, unsigned seg_num, unsigned offset, uint32_t val)
+{
+        mem_seg curr_seg = use_seg(mem, seg_num);
+        if (offset >= curr_seg->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
         }
 
-        /* Sets all words to 0 */
-        for (unsigned i = 0; i < num_words; i++) {
-                uint32_t *temp = UArray_at(new_seg->words, i);
-                *temp = 0;
+        curr_seg->words[offset] = val;
+}
+
+uint32_t seg_length(um_mem mem, unsigned seg_num)
+{
+        mem_seg curr_seg = seg_at(mem, seg_num);
+
+        return curr_seg->length;
+}
+
+/* Function: seg_mapped
+ * Does: Says whether seg_num is a mapped segment, giving its length if so.
+ *       Never traps, and touches no words
+ * Paramters: um_mem, unsigned, uint32_t*
+ * Returns: bool
+ */
+bool seg_mapped(um_mem mem, unsigned seg_num, uint32_t *length)
+{
+        mem_seg seg = seg_at(mem, seg_num);
+
+        if (seg == NULL) {
+                return false;
         }
+        *length = seg->length;
+        return seg->mapped;
+}
 
-        return new_index;
+uint32_t *seg_words(um_mem mem, unsigned seg_num)
+{
+        mem_seg curr_seg = use_seg(mem, seg_num);
+
+        return curr_seg->words;
 }
 
-void mem_unmap_segment(Seq_T mem, Seq_T unmapped_seq, unsigned index)
+/* Points a cache at where a segment is now. A guarded segment needs no
+ * offset check: one past its end faults and is reported by guard.c
+ */
+void seg_cache_fill(um_mem mem, seg_cache cache, unsigned seg_num)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        mem_seg curr_seg = use_seg(mem, seg_num);
+
+        cache->id = seg_num;
+        cache->generation = mem->generation;
+        cache->words = curr_seg->words;
+        cache->length = curr_seg->guarded ? UINT32_MAX : curr_seg->length;
+}
+
+/* Replaces segment 0 with a copy of the given segment. The copy goes into
+ * fresh page-aligned storage; the old program is released. Other threads
+ * of the UM may be running the old one, so with threads it traps
+ */
+void mem_load_segment(um_mem mem, unsigned seg_num)
+{
+        if (mem->epochs != NULL) {
+                trap_raise(TRAP_SHARED_CODE);
         }
 
-        mem_seg old_seg = (mem_seg)Seq_get(mem, index);
+        mem_seg to_duplicate = use_seg(mem, seg_num);
+        uint32_t length = to_duplicate->length;
+        uint32_t *words = wb_alloc_words(length);
 
-        /* Checks if the segment is already unmapped*/
-        if (old_seg->mapped != 0) {
-                old_seg->mapped = 0;
-                UArray_free(&(old_seg->words));
-                old_seg->words = NULL;
-        } else {
-                fprintf(stdout, "Error: Unmapping an unmapped segment");
-                exit(EXIT_FAILURE);
+        memcpy(words, to_duplicate->words, length * sizeof(uint32_t));
+        mem_adopt_program(mem, words, length);
+}
+
+/* Function: mem_adopt_program
+ * Does: Makes a block of words segment 0, abandoning the old program
+ *       segment. The words must be page-aligned and released the same way
+ *       as those from wb_alloc_words (a mapped image qualifies)
+ * Paramters: um_mem, uint32_t*, uint32_t
+ * Returns: None
+ */
+void mem_adopt_program(um_mem mem, uint32_t *words, uint32_t length)
+{
+        mem_seg prog_seg = mem->table->slots[0];
+
+        if (prog_seg->words != NULL) {
+                wb_free_words(prog_seg->words, prog_seg->length);
+        }
+        account(mem, 0, (int64_t)length - prog_seg->length);
+        prog_seg->words = words;
+        prog_seg->length = length;
+        mem->generation++;
+}
+
+/* Function: check_range
+ * Does: Traps unless seg_num is a mapped segment holding count words from
+ *       offset. Touches no words, so a spilled segment stays spilled
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t
+ * Returns: None
+ */
+static void check_range(um_mem mem, unsigned seg_num, uint32_t offset,
+                        uint32_t count)
+{
+        mem_seg seg = seg_at(mem, seg_num);
+
+        if (seg == NULL || !seg->mapped) {
+                trap_raise(TRAP_UNMAPPED);
         }
+        if ((uint64_t)offset + count > seg->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
+        }
+}
+
+/* Function: use_range
+ * Does: Looks up a mapped segment about to be used from offset for count
+ *       words, checking that they are all in it
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t
+ * Returns: mem_seg
+ */
+static mem_seg use_range(um_mem mem, unsigned seg_num, uint32_t offset,
+                         uint32_t count)
+{
+        check_range(mem, seg_num, offset, count);
+        return use_seg(mem, seg_num);
+}
+
+/* Function: mem_range
+ * Does: Gives the count words of a segment from offset, valid until the
+ *       memory is next used
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t
+ * Returns: const uint32_t*
+ */
+const uint32_t *mem_range(um_mem mem, unsigned seg_num, uint32_t offset,
+                          uint32_t count)
+{
+        mem_seg seg = use_range(mem, seg_num, offset, count);
 
-        uint32_t *new_index = malloc(sizeof(*new_index));
-        *new_index = index;
-        Seq_addhi(unmapped_seq, (void *)(uintptr_t)new_index);
+        return count == 0 ? NULL : seg->words + offset;
 }
 
-uint32_t get_word(Seq_T mem, unsigned seg_num, unsigned offset)
+/* Function: mem_copy
+ * Does: Copies count words between (or within) segments, as memmove
+ *       would. A copy into segment 0 goes through the write barrier like
+ *       any other store
+ * Paramters: um_mem, unsigned, uint32_t, unsigned, uint32_t, uint32_t
+ * Returns: None
+ */
+void mem_copy(um_mem mem, unsigned dst_seg, uint32_t dst_offset,
+              unsigned src_seg, uint32_t src_offset, uint32_t count)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        /* Nothing may trap once src is pinned */
+        check_range(mem, dst_seg, dst_offset, count);
+
+        mem_seg src = use_range(mem, src_seg, src_offset, count);
+
+        /* Bringing back dst must not spill src */
+        mem->pinned = src;
+        mem_seg dst = use_range(mem, dst_seg, dst_offset, count);
+        mem->pinned = NULL;
+
+        if (count != 0) {
+                memmove(dst->words + dst_offset, src->words + src_offset,
+                        (size_t)count * sizeof(uint32_t));
+        }
+}
+
+/* Function: mem_fill
+ * Does: Sets count words of a segment from offset to value. Each memcpy
+ *       doubles the words filled, so the work is done by libc's widest
+ *       copy loop
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t, uint32_t
+ * Returns: None
+ */
+void mem_fill(um_mem mem, unsigned seg_num, uint32_t offset, uint32_t value,
+              uint32_t count)
+{
+        mem_seg seg = use_range(mem, seg_num, offset, count);
+        uint32_t *words = seg->words + offset;
+
+        if (count == 0) {
+                return;
+        }
+        if (value == 0) {
+                memset(words, 0, (size_t)count * sizeof(uint32_t));
+                return;
         }
 
-        mem_seg curr_seg = (mem_seg)Seq_get(mem, seg_num);
-        uint32_t word = *(uint32_t *)UArray_at(curr_seg->words, offset);
+        words[0] = value;
+        for (uint32_t filled = 1; filled < count;) {
+                uint32_t more = filled < count - filled ? filled
+                                                        : count - filled;
 
-        return word;
+                memcpy(words + filled, words, (size_t)more * sizeof(uint32_t));
+                filled += more;
+        }
 }
 
-void put_word(Seq_T mem, unsigned seg_num, unsigned offset, uint32_t val)
+/* Function: mem_map_copy
+ * Does: Maps a segment of count words holding a copy of those of another
+ *       segment from offset
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t
+ * Returns: uint32_t (the new segment's identifier)
+ */
+uint32_t mem_map_copy(um_mem mem, unsigned src_seg, uint32_t offset,
+                      uint32_t count)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        use_range(mem, src_seg, offset, count);
+
+        uint32_t index = mem_map_segment(mem, count);
+        mem_seg dst = seg_at(mem, index);
+
+        /* Mapping may have spilled the source; bringing it back must not
+         * spill the copy
+         */
+        mem->pinned = dst;
+        mem_seg src = use_range(mem, src_seg, offset, count);
+        mem->pinned = NULL;
+
+        if (count != 0) {
+                memcpy(dst->words, src->words + offset,
+                       (size_t)count * sizeof(uint32_t));
         }
+        return index;
+}
 
-        mem_seg curr_seg = (mem_seg)Seq_get(mem, seg_num);
-        uint32_t *word = (uint32_t *)UArray_at(curr_seg->words, offset);
-        *word = val;
+static uint64_t hash_words(uint64_t hash, const uint32_t *words,
+                           uint32_t length)
+{
+        for (uint32_t i = 0; i < length; i++) {
+                hash = (hash ^ words[i]) * 1099511628211ULL;
+        }
+        return hash;
 }
 
-void free_mem(Seq_T mem)
+/* FNV-1a over a block of words */
+uint64_t mem_hash_words(const uint32_t *words, uint32_t length)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory is uninitialized");
-                exit(EXIT_FAILURE);
+        return hash_words(14695981039346656037ULL, words, length);
+}
+
+/* FNV-1a over the identifier, length and words of every mapped segment */
+uint64_t mem_hash(um_mem mem)
+{
+        uint64_t hash = 14695981039346656037ULL;
+        uint32_t length = mem->num_segs;
+
+        for (uint32_t i = 0; i < length; i++) {
+                mem_seg curr_seg = mem->table->slots[i];
+
+                if (!curr_seg->mapped) {
+                        continue;
+                }
+                curr_seg = use_seg(mem, i);
+                hash = (hash ^ (uint32_t)i) * 1099511628211ULL;
+                hash = (hash ^ curr_seg->length) * 1099511628211ULL;
+                hash = hash_words(hash, curr_seg->words, curr_seg->length);
         }
 
-        int length = Seq_length(mem);
+        return hash;
+}
 
-        /* Frees each mem_seg struct*/
-        for (int i = 0; i < length; i++) {
-                mem_seg curr_seg = (mem_seg)Seq_get(mem, i);
-                /* Frees each Uarray of words */
-                if ((curr_seg)->words != NULL) {
-                        UArray_free(&(curr_seg->words));
-                } 
-                free(curr_seg);
+/* Function: mem_set_quota
+ * Does: Limits the bytes of segment words a UM keeps in memory (0 for no
+ *       limit), spilling at once if it is already over
+ * Paramters: um_mem, uint64_t
+ * Returns: None
+ */
+void mem_set_quota(um_mem mem, uint64_t bytes)
+{
+        mem->quota = bytes;
+        enforce_quota(mem, NULL);
+}
+
+/* Function: mem_set_limit
+ * Does: Limits the bytes of segment words a UM may have mapped at once (0
+ *       for no limit); a map past it traps with TRAP_MEMORY_LIMIT
+ * Paramters: um_mem, uint64_t
+ * Returns: None
+ */
+void mem_set_limit(um_mem mem, uint64_t bytes)
+{
+        mem->limit = bytes;
+}
+
+/* Function: mem_start_reclaim
+ * Does: Starts a reclaimer thread for the memory, so that the words of
+ *       unmapped segments are freed or recycled off the UM's thread
+ * Paramters: um_mem
+ * Returns: None
+ */
+void mem_start_reclaim(um_mem mem)
+{
+        if (mem->reclaim == NULL) {
+                mem->reclaim = reclaim_start();
         }
-        Seq_free(&mem);
 }
 
-void free_unmapped_seq(Seq_T unmapped_seq)
+/* Function: mem_use_guard_pages
+ * Does: Puts segments of GUARD_MIN_WORDS or more mapped from now on in
+ *       storage followed by guard pages
+ * Paramters: um_mem
+ * Returns: None
+ */
+void mem_use_guard_pages(um_mem mem)
+{
+        mem->guard_pages = true;
+}
+
+/* Function: mem_use_arena
+ * Does: Places short segments mapped from now on in an arena, by a
+ *       profile if one is given (see arena.h). The memory owns both
+ * Paramters: um_mem, arena_profile (NULL for none)
+ * Returns: None
+ */
+void mem_use_arena(um_mem mem, arena_profile profile)
+{
+        mem->arena = arena_new(profile);
+}
+
+/* Function: mem_record_uses
+ * Does: Starts counting the loads and stores of each segment, by the
+ *       order it was mapped in, as told by mem_note_use
+ * Paramters: um_mem
+ * Returns: None
+ */
+void mem_record_uses(um_mem mem)
+{
+        mem->trace = arena_trace_new();
+}
+
+/* Function: mem_note_use
+ * Does: Counts a load or store of a mapped segment, if recording
+ * Paramters: um_mem, unsigned
+ * Returns: None
+ */
+void mem_note_use(um_mem mem, unsigned seg_num)
 {
-        int length = Seq_length(unmapped_seq);
+        mem_seg seg = seg_at(mem, seg_num);
 
-        /* Frees each number in the sequence */
-        for (int i = 0; i < length; i++) {
-                free((void *)((uintptr_t)Seq_get(unmapped_seq, i)));
+        if (mem->trace != NULL && seg != NULL && seg->mapped) {
+                arena_trace_use(mem->trace, seg->ordinal);
         }
+}
+
+/* Function: mem_write_uses
+ * Does: Writes the uses recorded so far as an arena profile
+ * Paramters: um_mem, FILE*
+ * Returns: None
+ */
+void mem_write_uses(um_mem mem, FILE *out)
+{
+        arena_trace_write(mem->trace, out, mem->maps);
+}
+
+/* Function: mem_share
+ * Does: Readies the memory for the threads of a UM, with a slot in the
+ *       epochs for each of up to num_slots of them, none entered yet. A
+ *       reclaimer only serves one thread, so it is stopped
+ * Paramters: um_mem, uint32_t
+ * Returns: None
+ */
+void mem_share(um_mem mem, uint32_t num_slots)
+{
+        if (mem->epochs != NULL) {
+                return;
+        }
+        if (mem->reclaim != NULL) {
+                reclaim_stop(&mem->reclaim);
+        }
+        mem->epochs = epoch_new(num_slots);
+}
+
+/* Function: mem_compare_swap
+ * Does: Replaces a word with desired if it is expected, in one step that
+ *       every thread of the UM sees whole. It orders every load and store
+ *       around it, as a full barrier
+ * Paramters: um_mem, unsigned, uint32_t, uint32_t, uint32_t
+ * Returns: uint32_t (the word as it was)
+ */
+uint32_t mem_compare_swap(um_mem mem, unsigned seg_num, uint32_t offset,
+                          uint32_t expected, uint32_t desired)
+{
+        mem_seg seg = use_range(mem, seg_num, offset, 1);
 
-        Seq_free(&unmapped_seq);
-}
\ No newline at end of file
+        __atomic_compare_exchange_n(&seg->words[offset], &expected, desired,
+                                    false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+        return expected;
+}
+
+void free_mem(um_mem mem)
+{
+        if (mem->reclaim != NULL) {
+                reclaim_stop(&mem->reclaim);
+        }
+        if (mem->epochs != NULL) {
+                epoch_free(&mem->epochs);
+        }
+
+        uint32_t length = mem->num_segs;
+
+        /* Frees each mem_seg struct*/
+        for (uint32_t i = 0; i < length; i++) {
+                mem_seg curr_seg = mem->table->slots[i];
+                /* Frees each array of words */
+                if (i == 0 && curr_seg->words != NULL) {
+                        wb_free_words(curr_seg->words, curr_seg->length);
+                } else {
+                        release_words(mem, curr_seg);
+                } 
+                free(curr_seg);
+        }
+        free(mem->table);
+        if (mem->arena != NULL) {
+                arena_free(&mem->arena);
+        }
+        if (mem->trace != NULL) {
+                arena_trace_free(&mem->trace);
+        }
+        pthread_mutex_destroy(&mem->grow_lock);
+        if (mem->spill != NULL) {
+                spill_free(&mem->spill);
+        }
+        free(mem);
+}
@@ -2,23 +2,145 @@
 #define MEM_INTERFACE_INCLUDED
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <seq.h>
 #include <uarray.h>
 #include "except.h"
+#include "spill.h"
+#include "reclaim.h"
+#include "epoch.h"
+#include "arena.h"
 
+/* Segment 0 is kept in page-aligned storage from write_barrier.h so that it
+ * can be made read-only while decoded copies of it exist. Any other segment
+ * may be spilled to disk when its UM is over quota, leaving words NULL
+ * until it is next used.
+ */
 typedef struct mem_seg {
         unsigned mapped;
-        UArray_T words;
+        uint32_t length;
+        uint32_t *words;
+        bool spilled;
+        bool referenced;        /* used since the clock hand last passed */
+        bool guarded;           /* words from guard_alloc_words */
+        bool in_arena;          /* words from arena_alloc */
+        uint64_t ordinal;       /* segments mapped before it */
+        uint64_t slot;          /* in the spill store, or SPILL_NONE */
+        uint32_t next_free;     /* unmapped below it on the free list */
 } *mem_seg;
 
-Seq_T init_mem();
-void init_prog(Seq_T mem, FILE *fp);
-Seq_T init_unmapped_seq();
-uint32_t mem_map_segment(Seq_T mem, Seq_T unmapped_seq, unsigned num_words);
-void mem_unmap_segment(Seq_T mem, Seq_T unmapped_seq, unsigned index);
-uint32_t get_word(Seq_T mem, unsigned seg_num, unsigned offset);
-void put_word(Seq_T mem, unsigned seg_num, unsigned offset, uint32_t val);
-void free_mem(Seq_T mem);
-void free_unmapped_seq(Seq_T unmapped_seq);
+/* The segments by identifier. A table that fills up is replaced by one
+ * twice the size, so that a thread looking a segment up in the old one
+ * still finds it
+ */
+struct seg_table {
+        uint32_t capacity;
+        mem_seg slots[];
+};
+
+#define SPILL_NONE UINT64_MAX
+
+/* The memory of one UM: the segments by identifier, the identifiers free
+ * for reuse, and a generation that changes whenever a segment goes away or
+ * is replaced, so that anything remembering where a segment was can tell
+ * when to look again. Mapping never moves an existing segment, so it leaves
+ * the generation alone. The segment and byte counts are for metrics.c,
+ * which reads them from another thread.
+ *
+ * The free identifiers are a stack threaded through the segments, whose
+ * top (free_ids) is the identifier and, above it, a count of the changes
+ * made to it, so that it can be pushed and popped with compare-and-swap.
+ * Only identifiers never used before take grow_lock. Once shared by the
+ * threads of a UM (mem_share), unmapped words and outgrown tables are
+ * retired to the epochs instead of being freed, and segment 0 no longer
+ * changes.
+ *
+ * With a quota, the words in memory of segments other than 0 are kept
+ * under quota bytes by spilling the ones least recently used (by a clock
+ * sweep) to a spill store. Segment 0 always stays and does not count.
+ * With a limit, a map that would take the bytes mapped (segment 0
+ * included) past it traps instead.
+ *
+ * With a reclaimer, unmapped words are freed (or recycled for later maps)
+ * on its thread instead. With guard pages, long segments are followed by
+ * inaccessible memory, so their caches need not check offsets. With an
+ * arena, short segments are placed together in the order they are
+ * mapped (or by a profile of which ones are hot); every segment knows its
+ * place in that order, which is also what recorded uses are counted by.
+ */
+typedef struct um_mem {
+        struct seg_table *table;
+        uint32_t num_segs;
+        uint64_t free_ids;
+        pthread_mutex_t grow_lock;
+        epochs epochs;                  /* NULL until shared */
+        uint64_t generation;
+        uint32_t live_segments;
+        uint32_t peak_segments;
+        uint64_t mapped_bytes;
+        uint64_t quota;                 /* 0 means no limit */
+        uint64_t limit;                 /* 0 means no limit */
+        uint64_t resident_bytes;
+        uint32_t clock_hand;
+        struct mem_seg *pinned;         /* not spilled, besides the one used */
+        spill_store spill;
+        uint64_t spills;
+        uint64_t spill_faults;
+        reclaimer reclaim;              /* NULL to free words at once */
+        bool guard_pages;
+        arena arena;                    /* NULL for calloc */
+        bool count_caches;              /* seg_cache hits and misses */
+        arena_trace trace;              /* NULL unless recording uses */
+        uint64_t maps;
+} *um_mem;
+
+/* Where one segment was at a given generation, with how often that was
+ * still true when looked at (counted only with count_caches set in its
+ * um_mem, for um --profile)
+ */
+typedef struct seg_cache {
+        uint32_t id;
+        uint64_t generation;
+        uint32_t *words;
+        uint32_t length;
+        uint64_t hits;
+        uint64_t misses;
+} *seg_cache;
+
+um_mem init_mem();
+void init_prog(um_mem mem, FILE *fp);
+uint32_t mem_map_segment(um_mem mem, unsigned num_words);
+void mem_unmap_segment(um_mem mem, unsigned index);
+uint32_t get_word(um_mem mem, unsigned seg_num, unsigned offset);
+void put_word(um_mem mem, unsigned seg_num, unsigned offset, uint32_t val);
+uint32_t seg_length(um_mem mem, unsigned seg_num);
+uint32_t *seg_words(um_mem mem, unsigned seg_num);
+bool seg_mapped(um_mem mem, unsigned seg_num, uint32_t *length);
+void seg_cache_fill(um_mem mem, seg_cache cache, unsigned seg_num);
+void mem_load_segment(um_mem mem, unsigned seg_num);
+void mem_adopt_program(um_mem mem, uint32_t *words, uint32_t length);
+uint64_t mem_hash(um_mem mem);
+uint64_t mem_hash_words(const uint32_t *words, uint32_t length);
+void mem_set_quota(um_mem mem, uint64_t bytes);
+void mem_set_limit(um_mem mem, uint64_t bytes);
+void mem_start_reclaim(um_mem mem);
+void mem_use_guard_pages(um_mem mem);
+void mem_use_arena(um_mem mem, arena_profile profile);
+void mem_record_uses(um_mem mem);
+void mem_note_use(um_mem mem, unsigned seg_num);
+void mem_write_uses(um_mem mem, FILE *out);
+void mem_share(um_mem mem, uint32_t num_slots);
+uint32_t mem_compare_swap(um_mem mem, unsigned seg_num, uint32_t offset,
+                          uint32_t expected, uint32_t desired);
+
+const uint32_t *mem_range(um_mem mem, unsigned seg_num, uint32_t offset,
+                          uint32_t count);
+void mem_copy(um_mem mem, unsigned dst_seg, uint32_t dst_offset,
+              unsigned src_seg, uint32_t src_offset, uint32_t count);
+void mem_fill(um_mem mem, unsigned seg_num, uint32_t offset, uint32_t value,
+              uint32_t count);
+uint32_t mem_map_copy(um_mem mem, unsigned src_seg, uint32_t offset,
+                      uint32_t count);
+void free_mem(um_mem mem);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "vm_interface.h"
+#include "mem_interface.h"
+#include "io_dev.h"
+
+/* A VM being watched, with what it had done at the last sample */
+struct watch {
+        um_vm vm;
+        char *name;
+        uint64_t last_instructions;
+        struct timespec last_time;
+        struct watch *next;
+};
+
+/* The sampling thread and the VMs it reports on, guarded by lock */
+struct metrics {
+        char *path;
+        char *temp;
+        unsigned interval_ms;
+        pthread_mutex_t lock;
+        pthread_cond_t stop;
+        bool stopping;
+        struct watch *watches;
+        pthread_t thread;
+};
+
+/* One VM's numbers, as of one sample */
+struct sample {
+        const char *name;
+        double values[12];
+};
+
+/* The families written, in the order of sample.values */
+static const struct family {
+        const char *name;
+        const char *type;
+        const char *help;
+        const char *labels;
+} families[] = {
+        { "um_instructions_total", "counter", "Instructions retired", "" },
+        { "um_mips", "gauge",
+          "Millions of instructions per second since the last sample", "" },
+        { "um_segments_live", "gauge", "Mapped segments, segment 0 included",
+          "" },
+        { "um_segments_peak", "gauge", "Most segments mapped at once", "" },
+        { "um_mapped_bytes", "gauge", "Bytes of words in mapped segments",
+          "" },
+        { "um_input_bytes_total", "counter", "Bytes read by input", "" },
+        { "um_output_bytes_total", "counter", "Bytes written by output", "" },
+        { "um_load_program_total", "counter",
+          "load_program instructions by kind", ",kind=\"jump\"" },
+        { "um_load_program_total", "counter", NULL, ",kind=\"code\"" },
+        { "um_resident_bytes", "gauge",
+          "Bytes of words of segments other than 0 in memory", "" },
+        { "um_spills_total", "counter", "Segments spilled to disk", "" },
+        { "um_spill_faults_total", "counter",
+          "Spilled segments read back on use", "" },
+};
+
+#define NUM_FAMILIES (sizeof(families) / sizeof(families[0]))
+
+static double seconds_between(struct timespec *from, struct timespec *to)
+{
+        return (double)(to->tv_sec - from->tv_sec) +
+               (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static uint64_t relaxed(uint64_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static uint32_t relaxed32(uint32_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Function: take_sample
+ * Does: Reads one VM's counters and works out its rate since the last
+ *       sample. Called with the lock held
+ * Paramters: struct watch*, struct sample*
+ * Returns: None
+ */
+static void take_sample(struct watch *w, struct sample *sample)
+{
+        um_vm vm = w->vm;
+        struct timespec now;
+        uint64_t instructions = relaxed(&vm->instructions);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = seconds_between(&w->last_time, &now);
+
+        sample->values[0] = instructions;
+        sample->values[1] = seconds <= 0 ? 0 : (instructions -
+                            w->last_instructions) / seconds / 1e6;
+        sample->values[2] = relaxed32(&vm->mem->live_segments);
+        sample->values[3] = relaxed32(&vm->mem->peak_segments);
+        sample->values[4] = relaxed(&vm->mem->mapped_bytes);
+        sample->values[5] = relaxed(&vm->io->bytes_in);
+        sample->values[6] = relaxed(&vm->io->bytes_out);
+        sample->values[7] = relaxed(&vm->jumps);
+        sample->values[8] = relaxed(&vm->replacements);
+        sample->values[9] = relaxed(&vm->mem->resident_bytes);
+        sample->values[10] = relaxed(&vm->mem->spills);
+        sample->values[11] = relaxed(&vm->mem->spill_faults);
+
+        w->last_instructions = instructions;
+        w->last_time = now;
+}
+
+/* Writes a label value with \, " and newlines escaped */
+static void write_label(FILE *fp, const char *value)
+{
+        for (; *value != '\0'; value++) {
+                if (*value == '\\' || *value == '"') {
+                        fputc('\\', fp);
+                        fputc(*value, fp);
+                } else if (*value == '\n') {
+                        fputs("\\n", fp);
+                } else {
+                        fputc(*value, fp);
+                }
+        }
+}
+
+/* Function: write_samples
+ * Does: Writes one sample of every watched VM in the Prometheus text
+ *       format. It goes to a temporary file that then replaces the
+ *       output, so a scraper never reads half a sample
+ * Paramters: metrics
+ * Returns: None
+ */
+static void write_samples(metrics m)
+{
+        struct sample *samples = NULL;
+        size_t num_samples = 0;
+
+        pthread_mutex_lock(&m->lock);
+        for (struct watch *w = m->watches; w != NULL; w = w->next) {
+                samples = realloc(samples, (num_samples + 1) *
+                                           sizeof(*samples));
+                samples[num_samples].name = strdup(w->name);
+                take_sample(w, &samples[num_samples]);
+                num_samples++;
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        FILE *fp = fopen(m->temp, "w");
+        if (fp != NULL) {
+                for (size_t f = 0; f < NUM_FAMILIES; f++) {
+                        if (families[f].help != NULL) {
+                                fprintf(fp, "# HELP %s %s.\n# TYPE %s %s\n",
+                                        families[f].name, families[f].help,
+                                        families[f].name, families[f].type);
+                        }
+                        for (size_t i = 0; i < num_samples; i++) {
+                                fprintf(fp, "%s{vm=\"", families[f].name);
+                                write_label(fp, samples[i].name);
+                                fprintf(fp, "\"%s} %.15g\n",
+                                        families[f].labels,
+                                        samples[i].values[f]);
+                        }
+                }
+                if (fclose(fp) == 0) {
+                        rename(m->temp, m->path);
+                }
+        }
+
+        for (size_t i = 0; i < num_samples; i++) {
+                free((char *)samples[i].name);
+        }
+        free(samples);
+}
+
+/* Function: sampler
+ * Does: Writes a sample every interval until asked to stop, then writes
+ *       a last one
+ * Paramters: void* (the metrics)
+ * Returns: NULL
+ */
+static void *sampler(void *cl)
+{
+        metrics m = cl;
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        pthread_mutex_lock(&m->lock);
+        while (!m->stopping) {
+                deadline.tv_sec += m->interval_ms / 1000;
+                deadline.tv_nsec += (long)(m->interval_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+                /* Sleeps to the deadline unless told to stop */
+                while (!m->stopping &&
+                       pthread_cond_timedwait(&m->stop, &m->lock,
+                                              &deadline) == 0) {
+                        continue;
+                }
+                pthread_mutex_unlock(&m->lock);
+                write_samples(m);
+                pthread_mutex_lock(&m->lock);
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        return NULL;
+}
+
+/* Function: metrics_start
+ * Does: Starts a thread that rewrites the file at path with a sample of
+ *       every watched VM each interval_ms milliseconds
+ * Paramters: const char*, unsigned
+ * Returns: metrics
+ */
+metrics metrics_start(const char *path, unsigned interval_ms)
+{
+        metrics m = calloc(1, sizeof(*m));
+        size_t temp_length = strlen(path) + 5;
+
+        m->path = strdup(path);
+        m->temp = malloc(temp_length);
+        snprintf(m->temp, temp_length, "%s.tmp", path);
+        m->interval_ms = interval_ms == 0 ? METRICS_INTERVAL : interval_ms;
+        pthread_mutex_init(&m->lock, NULL);
+        pthread_cond_init(&m->stop, NULL);
+        pthread_create(&m->thread, NULL, sampler, m);
+
+        return m;
+}
+
+/* Function: metrics_watch
+ * Does: Adds a VM to the samples, labelled vm="name". The VM must be
+ *       unwatched (or the metrics stopped) before it is freed
+ * Paramters: metrics, um_vm, const char*
+ * Returns: None
+ */
+void metrics_watch(metrics m, um_vm vm, const char *name)
+{
+        struct watch *w = malloc(sizeof(*w));
+
+        w->vm = vm;
+        w->name = strdup(name);
+        w->last_instructions = relaxed(&vm->instructions);
+        clock_gettime(CLOCK_MONOTONIC, &w->last_time);
+
+        pthread_mutex_lock(&m->lock);
+        w->next = m->watches;
+        m->watches = w;
+        pthread_mutex_unlock(&m->lock);
+}
+
+/* Function: metrics_unwatch
+ * Does: Drops a VM from the samples
+ * Paramters: metrics, um_vm
+ * Returns: None
+ */
+void metrics_unwatch(metrics m, um_vm vm)
+{
+        pthread_mutex_lock(&m->lock);
+        for (struct watch **w = &m->watches; *w != NULL; w = &(*w)->next) {
+                if ((*w)->vm == vm) {
+                        struct watch *gone = *w;
+
+                        *w = gone->next;
+                        free(gone->name);
+                        free(gone);
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&m->lock);
+}
+
+/* Function: metrics_stop
+ * Does: Writes a final sample and stops the thread
+ * Paramters: metrics*
+ * Returns: None
+ */
+void metrics_stop(metrics *m)
+{
+        pthread_mutex_lock(&(*m)->lock);
+        (*m)->stopping = true;
+        pthread_cond_signal(&(*m)->stop);
+        pthread_mutex_unlock(&(*m)->lock);
+        pthread_join((*m)->thread, NULL);
+
+        while ((*m)->watches != NULL) {
+                metrics_unwatch(*m, (*m)->watches->vm);
+        }
+        pthread_mutex_destroy(&(*m)->lock);
+        pthread_cond_destroy(&(*m)->stop);
+        free((*m)->path);
+        free((*m)->temp);
+        free(*m);
+        *m = NULL;
+}
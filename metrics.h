@@ -0,0 +1,18 @@
+#ifndef METRICS_INCLUDED
+#define METRICS_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vm_interface.h"
+
+/* Milliseconds between samples unless asked otherwise */
+#define METRICS_INTERVAL 1000
+
+typedef struct metrics *metrics;
+
+metrics metrics_start(const char *path, unsigned interval_ms);
+void metrics_watch(metrics m, um_vm vm, const char *name);
+void metrics_unwatch(metrics m, um_vm vm);
+void metrics_stop(metrics *m);
+
+#endif
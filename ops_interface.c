@@ -10,6 +10,7 @@
 #include "io_dev.h"
 #include "bitpack.h"
 #include "except.h"
+#include "trap.h"
 
 /* Function: initialize_regs
  * Does: Initializes registers
@@ -36,10 +37,6 @@ UArray_T initialize_regs()
  */
 void free_regs(UArray_T registers)
 {
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Reigsters not initialized");  
-                exit(EXIT_FAILURE);
-        }  
         UArray_free(&registers);
 }
 
@@ -50,10 +47,6 @@ void free_regs(UArray_T registers)
  */
 uint32_t at_reg(UArray_T registers, unsigned index)
 {
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Reigsters not initialized");
-                exit(EXIT_FAILURE);  
-        }       
         return *((uint32_t *)UArray_at(registers, index));
 }
 
@@ -63,12 +56,7 @@ uint32_t at_reg(UArray_T registers, unsigned index)
  * Returns: None
  */
 void update_reg(UArray_T registers, unsigned index, uint32_t word)
-{ 
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Reigsters not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
+{
         uint32_t *curr_reg = (uint32_t *)UArray_at(registers, index);
         *curr_reg = word;
 }
@@ -82,17 +70,17 @@ void update_reg(UArray_T registers, unsigned index, uint32_t word)
 void decode_word(uint32_t word, uint32_t *opcode, unsigned *a, unsigned *b, 
                  unsigned *c, unsigned *lvalue)
 {
-        *opcode = (uint32_t)Bitpack_getu(word, 4, 28);
+        *opcode = word >> 28;
 
         if (*opcode == 13) {
-                *a = (unsigned)Bitpack_getu(word, 3, 25);
+                *a = (word >> 25) & 0x7;
                 *b = 0;
                 *c = 0;
-                *lvalue = (unsigned)Bitpack_getu(word, 25, 0);
+                *lvalue = word & 0x1ffffff;
         } else {
-                *a = (unsigned)Bitpack_getu(word, 3, 6);
-                *b = (unsigned)Bitpack_getu(word, 3, 3);
-                *c = (unsigned)Bitpack_getu(word, 3, 0);
+                *a = (word >> 6) & 0x7;
+                *b = (word >> 3) & 0x7;
+                *c = word & 0x7;
                 *lvalue = 0;
         }
 }
@@ -104,16 +92,6 @@ void decode_word(uint32_t word, uint32_t *opcode, unsigned *a, unsigned *b,
  */
 void conditional_move(UArray_T registers, unsigned a, unsigned b, unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
         if (at_reg(registers, c) == 0) {
                 return;
         } else {
@@ -124,22 +102,12 @@ void conditional_move(UArray_T registers, unsigned a, unsigned b, unsigned c)
 
 /* Function: segmented_load
  * Does: Performs a segmented load
- * Paramters: UArray_T, Seq_T, unsigned, unsigned
+ * Paramters: UArray_T, um_mem, unsigned, unsigned
  * Returns: None
  */
-void segmented_load(UArray_T registers, Seq_T mem, unsigned a, unsigned b, 
+void segmented_load(UArray_T registers, um_mem mem, unsigned a, unsigned b, 
                     unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL || mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
         unsigned val_b = at_reg(registers, b);
         unsigned val_c = at_reg(registers, c);
 
@@ -149,22 +117,12 @@ void segmented_load(UArray_T registers, Seq_T mem, unsigned a, unsigned b,
 
 /* Function: segmented_store
  * Does: Performs a segmented store
- * Paramters: UArray_T, Seq_T, unsigned, unsigned
+ * Paramters: UArray_T, um_mem, unsigned, unsigned
  * Returns: None
  */
-void segmented_store(UArray_T registers, Seq_T mem, unsigned a, unsigned b, 
+void segmented_store(UArray_T registers, um_mem mem, unsigned a, unsigned b, 
                      unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL || mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
         unsigned val_a = at_reg(registers, a);
         unsigned val_b = at_reg(registers, b);
         unsigned val_c = at_reg(registers, c);
@@ -172,23 +130,71 @@ void segmented_store(UArray_T registers, Seq_T mem, unsigned a, unsigned b,
         put_word(mem, val_a, val_b, val_c);
 }
 
-/* Function: addition
- * Does: Performs an addition
- * Paramters: UArray_T, unsigned, unsigned, unsigned
+/* Function: segmented_load_cached
+ * Does: Performs a segmented load through the cache of its instruction,
+ *       which skips the segment lookup while the segment is the same one
+ *       as last time and nothing has been mapped or unmapped since
+ * Paramters: UArray_T, um_mem, seg_cache, unsigned, unsigned, unsigned
  * Returns: None
  */
-void addition(UArray_T registers, unsigned a, unsigned b, unsigned c)
+void segmented_load_cached(UArray_T registers, um_mem mem, seg_cache cache,
+                           unsigned a, unsigned b, unsigned c)
+{
+        uint32_t val_b = at_reg(registers, b);
+        uint32_t val_c = at_reg(registers, c);
+
+        if (cache->id == val_b && cache->generation == mem->generation) {
+                if (mem->count_caches) {
+                        cache->hits++;
+                }
+        } else {
+                if (mem->count_caches) {
+                        cache->misses++;
+                }
+                seg_cache_fill(mem, cache, val_b);
+        }
+
+        if (val_c >= cache->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
+        }
+        update_reg(registers, a, cache->words[val_c]);
+}
+
+/* Function: segmented_store_cached
+ * Does: Performs a segmented store through the cache of its instruction
+ * Paramters: UArray_T, um_mem, seg_cache, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+void segmented_store_cached(UArray_T registers, um_mem mem, seg_cache cache,
+                            unsigned a, unsigned b, unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stderr, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
+        uint32_t val_a = at_reg(registers, a);
+        uint32_t val_b = at_reg(registers, b);
+
+        if (cache->id == val_a && cache->generation == mem->generation) {
+                if (mem->count_caches) {
+                        cache->hits++;
+                }
+        } else {
+                if (mem->count_caches) {
+                        cache->misses++;
+                }
+                seg_cache_fill(mem, cache, val_a);
         }
 
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
+        if (val_b >= cache->length) {
+                trap_raise(TRAP_OUT_OF_BOUNDS);
         }
+        cache->words[val_b] = at_reg(registers, c);
+}
 
+/* Function: addition
+ * Does: Performs an addition
+ * Paramters: UArray_T, unsigned, unsigned, unsigned
+ * Returns: None
+ */
+void addition(UArray_T registers, unsigned a, unsigned b, unsigned c)
+{
         uint32_t first = at_reg(registers, b);
         uint32_t second = at_reg(registers, c);
         uint32_t sum = (first + second) % 4294967296;
@@ -203,16 +209,6 @@ void addition(UArray_T registers, unsigned a, unsigned b, unsigned c)
  */
 void multiplication (UArray_T registers, unsigned a, unsigned b, unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
         uint32_t first = at_reg(registers, b);
         uint32_t second = at_reg(registers, c);
         uint32_t product = (first * second) % 4294967296;
@@ -227,18 +223,13 @@ void multiplication (UArray_T registers, unsigned a, unsigned b, unsigned c)
  */
 void division(UArray_T registers, unsigned a, unsigned b, unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");
-                exit(EXIT_FAILURE);  
-        }
-
         uint32_t first = at_reg(registers, b);
         uint32_t second = at_reg(registers, c);
+
+        /* Dividing by 0 is undefined in C, so it is never left to the host */
+        if (second == 0) {
+                trap_raise(TRAP_DIVIDE_BY_ZERO);
+        }
         uint32_t quotient = (first / second) % 4294967296;
 
         update_reg(registers, a, quotient);
@@ -251,16 +242,6 @@ void division(UArray_T registers, unsigned a, unsigned b, unsigned c)
  */
 void bitwise_NAND(UArray_T registers, unsigned a, unsigned b, unsigned c)
 {
-        if (a > 7 || b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
         uint32_t first = at_reg(registers, b);
         uint32_t second = at_reg(registers, c);
         uint32_t result = first & second;
@@ -270,110 +251,55 @@ void bitwise_NAND(UArray_T registers, unsigned a, unsigned b, unsigned c)
 
 /* Function: halt
  * Does: Halts the program
- * Paramters: Seq_T, uint32_t*
+ * Paramters: um_mem, uint32_t*
  * Returns: None
  */
-void halt(Seq_T mem, uint32_t *prog_count)
+void halt(um_mem mem, uint32_t *prog_count)
 {
-        if (mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized"); 
-                exit(EXIT_FAILURE); 
-        }
-        
-        mem_seg prog_seg = (mem_seg)Seq_get(mem, 0);
-        *prog_count = ((uint32_t)UArray_length(prog_seg->words));
+        *prog_count = seg_length(mem, 0);
 }
 
 /* Function: map_segment
  * Does: Maps a segment with a specified number of words
- * Paramters: UArray_T, Seq_T, Seq_T, unsigned, unsigned
+ * Paramters: UArray_T, um_mem, unsigned, unsigned
  * Returns: None
  */
-void map_segment(UArray_T registers, Seq_T mem, Seq_T unmapped_seq, unsigned b, 
-                 unsigned c)
+void map_segment(UArray_T registers, um_mem mem, unsigned b, unsigned c)
 {
-        if (b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL || mem == NULL || unmapped_seq == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
         unsigned val_c = at_reg(registers, c);
 
-        uint32_t index = mem_map_segment(mem, unmapped_seq, val_c);
+        uint32_t index = mem_map_segment(mem, val_c);
         update_reg(registers, b, index);
 }
 
 /* Function: unmap_segment
  * Does: Maps the segment at a specified index
- * Paramters: UArray_T, Seq_T, Seq_T, unsigned
+ * Paramters: UArray_T, um_mem, unsigned
  * Returns: None
  */
-void unmap_segment(UArray_T registers, Seq_T mem, Seq_T unmapped_seq, 
-                   unsigned c)
+void unmap_segment(UArray_T registers, um_mem mem, unsigned c)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL || mem == NULL || unmapped_seq == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
-        unsigned index = (unsigned)at_reg(registers, c);
-
-        if (index == 0) {
-                fprintf(stdout, "Error: Cannot unmap segment 0");  
-                exit(EXIT_FAILURE);
-        }
-
-        mem_unmap_segment(mem, unmapped_seq, index);
+        mem_unmap_segment(mem, at_reg(registers, c));
 }
 
 /* Function: output
  * Does: Outputs the value at the given register
- * Paramters: UArray_T, unsigned
+ * Paramters: UArray_T, io_dev, unsigned
  * Returns: None
  */
-void output(UArray_T registers, unsigned c)
+void output(UArray_T registers, io_dev io, unsigned c)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
-        io_output(at_reg(registers, c));
+        io_output(io, at_reg(registers, c));
 }
 
 /* Function: input
  * Does: Takes input and stores it in the given register
- * Paramters: UArray_T, unsigned
+ * Paramters: UArray_T, io_dev, unsigned
  * Returns: None
  */
-void input(UArray_T registers, unsigned c)
+void input(UArray_T registers, io_dev io, unsigned c)
 {
-        if (c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-
-        uint32_t userinput = io_input();
+        uint32_t userinput = io_input(io);
         if (userinput == (unsigned)EOF) {
                 userinput = ~0;      
         } 
@@ -383,22 +309,12 @@ void input(UArray_T registers, unsigned c)
 
 /* Function: load_program
  * Does: Loads the sgment at the spcified index into the program
- * Paramters: Seq_T, UArray_T, uint32_t*, unsigned, unsigned
+ * Paramters: um_mem, UArray_T, uint32_t*, unsigned, unsigned
  * Returns: None
  */
-void load_program(Seq_T mem, UArray_T registers, uint32_t *prog_count, 
+void load_program(um_mem mem, UArray_T registers, uint32_t *prog_count, 
                   unsigned b, unsigned c)
 {
-        if (b > 7 || c > 7) {
-                fprintf(stdout, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
-
-        if (registers == NULL || mem == NULL) {
-                fprintf(stdout, "Error: Memory not initialized");  
-                exit(EXIT_FAILURE);
-        }
-        
         uint32_t seg_num = at_reg(registers, b);
 
         if (seg_num == 0) {
@@ -406,26 +322,8 @@ void load_program(Seq_T mem, UArray_T registers, uint32_t *prog_count,
                 return;
         }
 
-        /* Makes a deep copy of the segment to be duplicated*/
-        mem_seg to_duplicate = (mem_seg)Seq_get(mem, seg_num);
-        mem_seg duplicate = malloc(sizeof(*duplicate));
-        duplicate->mapped = to_duplicate->mapped;
-
-        int length = UArray_length(to_duplicate->words);
-        duplicate->words = UArray_new(length, sizeof(uint32_t));
-
-        /* Copies each word */
-        for (int i = 0; i < length; i++) {
-                uint32_t *temp_duplicate = UArray_at(duplicate->words, i);
-                uint32_t *temp_to_duplicate = UArray_at(to_duplicate->words, i);
-                *temp_duplicate = *temp_to_duplicate;
-        }
-        /* Abandons the original program segment */
-        mem_seg abandoned = Seq_remlo(mem);
-        UArray_free(&(abandoned->words));
-        free(abandoned);
-
-        Seq_addlo(mem, duplicate);
+        /* Replaces segment 0 with a deep copy of the segment */
+        mem_load_segment(mem, seg_num);
 
         *prog_count = at_reg(registers, c);
 }
@@ -437,14 +335,41 @@ void load_program(Seq_T mem, UArray_T registers, uint32_t *prog_count,
  */
 void load_value(UArray_T registers, unsigned a, unsigned lvalue)
 {
-        if (a > 7) {
-                fprintf(stderr, "Error: Invalid register index provided");
-                exit(EXIT_FAILURE);
-        }
+        update_reg(registers, a, lvalue);
+}
 
-        if (registers == NULL) {
-                fprintf(stderr, "Error: Memory not initialized");  
+/* Function: extension
+ * Does: Performs an EXT_MEMORY or EXT_OUTPUT instruction (see
+ *       ops_interface.h), given its whole word
+ * Paramters: UArray_T, um_mem, io_dev, uint32_t
+ * Returns: bool (false if the word is no extension instruction)
+ */
+bool extension(UArray_T registers, um_mem mem, io_dev io, uint32_t word)
+{
+        uint32_t a = at_reg(registers, (word >> 6) & 0x7);
+        uint32_t b = at_reg(registers, (word >> 3) & 0x7);
+        uint32_t c = at_reg(registers, word & 0x7);
+
+        if (word >> 28 == EXT_OUTPUT) {
+                io_output_words(io, mem_range(mem, a, b, c), c);
+                return true;
+        }
+
+        uint32_t d = at_reg(registers, (word >> 9) & 0x7);
+
+        switch ((word >> 15) & 0x7) {
+                case EXT_COPY :
+                        mem_copy(mem, a, b, c, d,
+                                 at_reg(registers, (word >> 12) & 0x7));
+                        return true;
+                case EXT_FILL :
+                        mem_fill(mem, a, b, c, d);
+                        return true;
+                case EXT_MAP_COPY :
+                        update_reg(registers, (word >> 6) & 0x7,
+                                   mem_map_copy(mem, b, c, d));
+                        return true;
+                default :
+                        return false;
         }
-
-        update_reg(registers, a, lvalue);
-}
\ No newline at end of file
+}
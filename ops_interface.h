@@ -6,6 +6,31 @@
 #include <uarray.h>
 
 #include "except.h"
+#include "io_dev.h"
+#include "mem_interface.h"
+
+/* Extension opcodes, run only by a UM created with --ext (else they are
+ * invalid, as in the standard UM). Besides the usual A (bits 6-8), B (3-5)
+ * and C (0-2), EXT_MEMORY words have D (bits 9-11), E (12-14) and a
+ * function (15-17):
+ *   EXT_COPY      m[rA][rB .. rB+rE) := m[rC][rD .. rD+rE) (may overlap)
+ *   EXT_FILL      m[rA][rB .. rB+rD) := rC
+ *   EXT_MAP_COPY  rA := a new segment holding a copy of m[rB][rC .. rC+rD)
+ * and, only in a UM created with --threads as well (threads.h):
+ *   EXT_SPAWN     rA := the identifier of a new thread, which starts at
+ *                 m[0][rB] with a copy of the registers, rA included
+ *   EXT_JOIN      waits for thread rB to halt, then rA := its r0
+ *   EXT_CAS       rA := m[rB][rC], then m[rB][rC] := rE if that was rD,
+ *                 in one step
+ * EXT_OUTPUT outputs m[rA][rB .. rB+rC), one byte per word.
+ */
+#define EXT_MEMORY 14
+#define EXT_OUTPUT 15
+
+typedef enum ext_function {
+        EXT_COPY = 0, EXT_FILL, EXT_MAP_COPY,
+        EXT_SPAWN, EXT_JOIN, EXT_CAS
+} ext_function;
 
 UArray_T initialize_regs();
 void free_regs(UArray_T registers);
@@ -15,23 +40,26 @@ void update_reg(UArray_T registers, unsigned index, uint32_t word);
 void decode_word(uint32_t word, uint32_t *opcode, unsigned *a, unsigned *b, 
 	             unsigned *c, unsigned *lvalue);
 void conditional_move(UArray_T registers, unsigned a, unsigned b, unsigned c);
-void segmented_load(UArray_T registers, Seq_T mem, unsigned a, unsigned b, 
+void segmented_load(UArray_T registers, um_mem mem, unsigned a, unsigned b, 
 	                unsigned c);
-void segmented_store(UArray_T registers, Seq_T mem, unsigned a, unsigned b, 
+void segmented_store(UArray_T registers, um_mem mem, unsigned a, unsigned b, 
 	                 unsigned c);
+void segmented_load_cached(UArray_T registers, um_mem mem, seg_cache cache,
+                           unsigned a, unsigned b, unsigned c);
+void segmented_store_cached(UArray_T registers, um_mem mem, seg_cache cache,
+                            unsigned a, unsigned b, unsigned c);
 void addition(UArray_T registers, unsigned a, unsigned b, unsigned c);
 void multiplication (UArray_T registers, unsigned a, unsigned b, unsigned c);
 void division(UArray_T registers, unsigned a, unsigned b, unsigned c);
 void bitwise_NAND(UArray_T registers, unsigned a, unsigned b, unsigned c);
-void halt(Seq_T mem, uint32_t *prog_count);
-void map_segment(UArray_T registers, Seq_T mem, Seq_T unmapped_seq, unsigned b, 
-	             unsigned c);
-void unmap_segment(UArray_T registers, Seq_T mem, Seq_T unmapped_seq, 
-	               unsigned c);
-void output(UArray_T registers, unsigned c);
-void input(UArray_T registers, unsigned c);
-void load_program(Seq_T mem, UArray_T registers, uint32_t *prog_count, 
+void halt(um_mem mem, uint32_t *prog_count);
+void map_segment(UArray_T registers, um_mem mem, unsigned b, unsigned c);
+void unmap_segment(UArray_T registers, um_mem mem, unsigned c);
+void output(UArray_T registers, io_dev io, unsigned c);
+void input(UArray_T registers, io_dev io, unsigned c);
+void load_program(um_mem mem, UArray_T registers, uint32_t *prog_count, 
 	              unsigned b, unsigned c);
 void load_value(UArray_T registers, unsigned a, unsigned lvalue);
+bool extension(UArray_T registers, um_mem mem, io_dev io, uint32_t word);
 
 #endif
\ No newline at end of file
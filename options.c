@@ -0,0 +1,23 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "options.h"
+
+/* Function: parse_bytes
+ * Does: Reads a byte count, with an optional K, M or G suffix
+ * Paramters: const char*
+ * Returns: uint64_t (0 if it is not a number)
+ */
+uint64_t parse_bytes(const char *text)
+{
+        char *end;
+        uint64_t bytes = strtoull(text, &end, 10);
+
+        switch (*end) {
+                case 'G' : bytes <<= 10; /* fall through */
+                case 'M' : bytes <<= 10; /* fall through */
+                case 'K' : bytes <<= 10; break;
+                default : break;
+        }
+        return bytes;
+}
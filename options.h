@@ -0,0 +1,10 @@
+#ifndef OPTIONS_INCLUDED
+#define OPTIONS_INCLUDED
+#include <stdint.h>
+
+/* What the command-line tools (um, umd, umc, um-test) share in reading
+ * their options
+ */
+uint64_t parse_bytes(const char *text);
+
+#endif
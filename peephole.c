@@ -0,0 +1,616 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <uarray.h>
+
+#include "peephole.h"
+#include "handlers.h"
+#include "specialise.h"
+#include "idiom.h"
+#include "decode.h"
+#include "write_barrier.h"
+
+/* What a fold_op computes. NOT, AND, OR and XOR are what sequences of
+ * NANDs spell out; SELECT is a conditional move (z ? y : x)
+ */
+enum fold_opcode {
+        FOLD_CONST = 0, FOLD_NOT, FOLD_AND, FOLD_OR, FOLD_XOR, FOLD_NAND,
+        FOLD_ADD, FOLD_MUL, FOLD_DIV, FOLD_SELECT
+};
+
+/* Values 0-7 are the registers as a run starts; value 8 + i is the result
+ * of node i
+ */
+#define FOLD_INPUTS 8
+#define MAX_NODES (2 * PEEPHOLE_MAX_RUN)
+#define CSE_SLOTS 256
+
+/* A run being folded: the nodes built so far, the value each register
+ * holds and a table for finding a node that was already built
+ */
+struct run {
+        struct fold_op nodes[MAX_NODES];
+        uint16_t num_nodes;
+        uint16_t regs[8];
+        uint16_t cse[CSE_SLOTS];        /* node + 1, 0 if empty */
+};
+
+static struct fold_op *node(struct run *run, uint16_t value)
+{
+        return value < FOLD_INPUTS ? NULL : &run->nodes[value - FOLD_INPUTS];
+}
+
+static bool is_op(struct run *run, uint16_t value, uint8_t op)
+{
+        return value >= FOLD_INPUTS && node(run, value)->op == op;
+}
+
+static bool is_const(struct run *run, uint16_t value, uint32_t k)
+{
+        return is_op(run, value, FOLD_CONST) && node(run, value)->k == k;
+}
+
+/* Function: make
+ * Does: Gives the value of an operation, building a node only if the
+ *       same one was not built before in this run
+ * Paramters: struct run*, uint8_t, uint16_t, uint16_t, uint16_t, uint32_t
+ * Returns: uint16_t (the value)
+ */
+static uint16_t make(struct run *run, uint8_t op, uint16_t x, uint16_t y,
+                     uint16_t z, uint32_t k)
+{
+        unsigned slot = (op * 31u + x * 7u + y * 13u + z * 17u +
+                         k * 2654435761u) % CSE_SLOTS;
+
+        while (run->cse[slot] != 0) {
+                struct fold_op *n = &run->nodes[run->cse[slot] - 1];
+
+                if (n->op == op && n->x == x && n->y == y && n->z == z &&
+                    n->k == k) {
+                        return FOLD_INPUTS + run->cse[slot] - 1;
+                }
+                slot = (slot + 1) % CSE_SLOTS;
+        }
+
+        struct fold_op *n = &run->nodes[run->num_nodes++];
+
+        n->op = op;
+        n->x = x;
+        n->y = y;
+        n->z = z;
+        n->k = k;
+        run->cse[slot] = run->num_nodes;
+        return FOLD_INPUTS + run->num_nodes - 1;
+}
+
+static uint16_t fold_const(struct run *run, uint32_t k)
+{
+        return make(run, FOLD_CONST, 0, 0, 0, k);
+}
+
+/* Gives a two-operand operation its operands in a fixed order, so that
+ * make finds x op y and y op x alike
+ */
+static uint16_t make2(struct run *run, uint8_t op, uint16_t x, uint16_t y)
+{
+        return x <= y ? make(run, op, x, y, 0, 0) : make(run, op, y, x, 0, 0);
+}
+
+/* Says whether {x, y} and {p, q} are the same pair of values */
+static bool same_pair(uint16_t x, uint16_t y, uint16_t p, uint16_t q)
+{
+        return (x == p && y == q) || (x == q && y == p);
+}
+
+static uint16_t fold_xor(struct run *run, uint16_t x, uint16_t y);
+static uint16_t fold_and(struct run *run, uint16_t x, uint16_t y);
+
+static uint16_t fold_not(struct run *run, uint16_t x)
+{
+        struct fold_op *n = node(run, x);
+
+        if (n == NULL) {
+                return make(run, FOLD_NOT, x, 0, 0, 0);
+        }
+        switch (n->op) {
+                case FOLD_CONST : return fold_const(run, ~n->k);
+                case FOLD_NOT : return n->x;
+                case FOLD_NAND : return fold_and(run, n->x, n->y);
+                case FOLD_AND : return make2(run, FOLD_NAND, n->x, n->y);
+                default : return make(run, FOLD_NOT, x, 0, 0, 0);
+        }
+}
+
+static uint16_t fold_or(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k | node(run, y)->k);
+        }
+        if (x == y || is_const(run, y, 0)) {
+                return x;
+        }
+        if (is_const(run, x, 0)) {
+                return y;
+        }
+        if (is_const(run, x, UINT32_MAX) || is_const(run, y, UINT32_MAX)) {
+                return fold_const(run, UINT32_MAX);
+        }
+        return make2(run, FOLD_OR, x, y);
+}
+
+static uint16_t fold_and(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k & node(run, y)->k);
+        }
+        if (x == y || is_const(run, y, UINT32_MAX)) {
+                return x;
+        }
+        if (is_const(run, x, UINT32_MAX)) {
+                return y;
+        }
+        if (is_const(run, x, 0) || is_const(run, y, 0)) {
+                return fold_const(run, 0);
+        }
+
+        /* (p | q) & ~(p & q) is p ^ q */
+        if (is_op(run, y, FOLD_OR)) {
+                uint16_t swap = x;
+
+                x = y;
+                y = swap;
+        }
+        if (is_op(run, x, FOLD_OR) && is_op(run, y, FOLD_NAND) &&
+            same_pair(node(run, x)->x, node(run, x)->y,
+                      node(run, y)->x, node(run, y)->y)) {
+                return fold_xor(run, node(run, x)->x, node(run, x)->y);
+        }
+        return make2(run, FOLD_AND, x, y);
+}
+
+static uint16_t fold_xor(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k ^ node(run, y)->k);
+        }
+        if (x == y) {
+                return fold_const(run, 0);
+        }
+        if (is_const(run, y, 0)) {
+                return x;
+        }
+        if (is_const(run, x, 0)) {
+                return y;
+        }
+        if (is_const(run, y, UINT32_MAX)) {
+                return fold_not(run, x);
+        }
+        if (is_const(run, x, UINT32_MAX)) {
+                return fold_not(run, y);
+        }
+        return make2(run, FOLD_XOR, x, y);
+}
+
+/* Says whether x and y are ~(p & t) and ~(q & t) for t = ~(p & q), the
+ * four-NAND spelling of p ^ q, and if so gives p and q
+ */
+static bool nand_xor(struct run *run, uint16_t x, uint16_t y, uint16_t *p,
+                     uint16_t *q)
+{
+        if (!is_op(run, x, FOLD_NAND) || !is_op(run, y, FOLD_NAND)) {
+                return false;
+        }
+
+        struct fold_op *nx = node(run, x);
+        struct fold_op *ny = node(run, y);
+        uint16_t xs[2] = { nx->x, nx->y };
+        uint16_t ys[2] = { ny->x, ny->y };
+
+        for (unsigned i = 0; i < 2; i++) {
+                for (unsigned j = 0; j < 2; j++) {
+                        uint16_t t = xs[i];
+
+                        if (t != ys[j] || !is_op(run, t, FOLD_NAND) ||
+                            !same_pair(xs[1 - i], ys[1 - j],
+                                       node(run, t)->x, node(run, t)->y)) {
+                                continue;
+                        }
+                        *p = xs[1 - i];
+                        *q = ys[1 - j];
+                        return true;
+                }
+        }
+        return false;
+}
+
+static uint16_t fold_nand(struct run *run, uint16_t x, uint16_t y)
+{
+        uint16_t p, q;
+
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, ~(node(run, x)->k & node(run, y)->k));
+        }
+        if (x == y || is_const(run, y, UINT32_MAX)) {
+                return fold_not(run, x);
+        }
+        if (is_const(run, x, UINT32_MAX)) {
+                return fold_not(run, y);
+        }
+        if (is_const(run, x, 0) || is_const(run, y, 0)) {
+                return fold_const(run, UINT32_MAX);
+        }
+        if (is_op(run, x, FOLD_NOT) && is_op(run, y, FOLD_NOT)) {
+                return fold_or(run, node(run, x)->x, node(run, y)->x);
+        }
+        if (nand_xor(run, x, y, &p, &q)) {
+                return fold_xor(run, p, q);
+        }
+        return make2(run, FOLD_NAND, x, y);
+}
+
+static uint16_t fold_add(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k + node(run, y)->k);
+        }
+        if (is_const(run, y, 0)) {
+                return x;
+        }
+        if (is_const(run, x, 0)) {
+                return y;
+        }
+        return make2(run, FOLD_ADD, x, y);
+}
+
+static uint16_t fold_mul(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST) && is_op(run, y, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k * node(run, y)->k);
+        }
+        if (is_const(run, x, 0) || is_const(run, y, 0)) {
+                return fold_const(run, 0);
+        }
+        if (is_const(run, y, 1)) {
+                return x;
+        }
+        if (is_const(run, x, 1)) {
+                return y;
+        }
+        return make2(run, FOLD_MUL, x, y);
+}
+
+/* Divides by y, which is known to be a constant other than 0 */
+static uint16_t fold_div(struct run *run, uint16_t x, uint16_t y)
+{
+        if (is_op(run, x, FOLD_CONST)) {
+                return fold_const(run, node(run, x)->k / node(run, y)->k);
+        }
+        if (is_const(run, y, 1)) {
+                return x;
+        }
+        return make(run, FOLD_DIV, x, y, 0, 0);
+}
+
+/* What a conditional move leaves in its register: y if z, else x */
+static uint16_t fold_select(struct run *run, uint16_t x, uint16_t y,
+                            uint16_t z)
+{
+        if (is_op(run, z, FOLD_CONST)) {
+                return node(run, z)->k != 0 ? y : x;
+        }
+        if (x == y) {
+                return x;
+        }
+        return make(run, FOLD_SELECT, x, y, z, 0);
+}
+
+/* Function: fold_word
+ * Does: Adds one instruction to a run, if it only works on registers and
+ *       cannot fail (a division only when its divisor is known not to be
+ *       0). Leaves the run as it was otherwise
+ * Paramters: struct run*, decoded_prog, uint32_t
+ * Returns: bool (whether the instruction was added)
+ */
+static bool fold_word(struct run *run, decoded_prog prog, uint32_t i)
+{
+        uint16_t *regs = run->regs;
+        unsigned a = prog->a[i];
+        unsigned b = prog->b[i];
+        unsigned c = prog->c[i];
+
+        switch (prog->opcode[i]) {
+                case 0 :
+                        regs[a] = fold_select(run, regs[a], regs[b], regs[c]);
+                        return true;
+                case 3 :
+                        regs[a] = fold_add(run, regs[b], regs[c]);
+                        return true;
+                case 4 :
+                        regs[a] = fold_mul(run, regs[b], regs[c]);
+                        return true;
+                case 5 :
+                        if (!is_op(run, regs[c], FOLD_CONST) ||
+                            is_const(run, regs[c], 0)) {
+                                return false;
+                        }
+                        regs[a] = fold_div(run, regs[b], regs[c]);
+                        return true;
+                case 6 :
+                        regs[a] = fold_nand(run, regs[b], regs[c]);
+                        return true;
+                case 13 :
+                        regs[a] = fold_const(run, prog->lvalue[i]);
+                        return true;
+                default :
+                        return false;
+        }
+}
+
+/* Function: build_run
+ * Does: Folds instructions from first until one that cannot be folded,
+ *       limit, or the node table is nearly full
+ * Paramters: struct run*, decoded_prog, uint32_t, uint32_t
+ * Returns: uint32_t (instructions folded)
+ */
+static uint32_t build_run(struct run *run, decoded_prog prog, uint32_t first,
+                          uint32_t limit)
+{
+        uint32_t i = first;
+
+        run->num_nodes = 0;
+        memset(run->cse, 0, sizeof(run->cse));
+        for (unsigned r = 0; r < 8; r++) {
+                run->regs[r] = r;
+        }
+
+        /* An instruction builds at most two nodes */
+        while (i < limit && run->num_nodes + 2 <= MAX_NODES &&
+               fold_word(run, prog, i)) {
+                i++;
+        }
+        return i - first;
+}
+
+static void check_alloc(void *p)
+{
+        if (p == NULL) {
+                fprintf(stderr, "Error: Could not allocate folds\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static unsigned operands(uint8_t op)
+{
+        switch (op) {
+                case FOLD_CONST : return 0;
+                case FOLD_NOT : return 1;
+                case FOLD_SELECT : return 3;
+                default : return 2;
+        }
+}
+
+/* Function: save_fold
+ * Does: Keeps the nodes a run's registers end up depending on, in the
+ *       order they were built, and adds them to the program's folds as
+ *       the fold for the run's first word. Values overwritten within the
+ *       run, and registers left as they were, cost nothing
+ * Paramters: peephole, struct run*, uint32_t (run length)
+ * Returns: uint32_t (index of the fold)
+ */
+static uint32_t save_fold(peephole folds, struct run *run, uint32_t length)
+{
+        bool live[MAX_NODES] = { false };
+        uint16_t slot[FOLD_INPUTS + MAX_NODES];
+        struct fold fold = { 0 };
+
+        for (unsigned r = 0; r < 8; r++) {
+                if (run->regs[r] >= FOLD_INPUTS) {
+                        live[run->regs[r] - FOLD_INPUTS] = true;
+                }
+        }
+        for (int i = run->num_nodes - 1; i >= 0; i--) {
+                uint16_t uses[3] = { run->nodes[i].x, run->nodes[i].y,
+                                     run->nodes[i].z };
+
+                for (unsigned u = 0; live[i] && u < operands(run->nodes[i].op);
+                     u++) {
+                        if (uses[u] >= FOLD_INPUTS) {
+                                live[uses[u] - FOLD_INPUTS] = true;
+                        }
+                }
+        }
+
+        if (folds->num_ops + run->num_nodes > folds->op_capacity) {
+                while (folds->num_ops + run->num_nodes > folds->op_capacity) {
+                        folds->op_capacity = folds->op_capacity == 0 ?
+                                1024 : 2 * folds->op_capacity;
+                }
+                folds->ops = realloc(folds->ops, folds->op_capacity *
+                                                 sizeof(struct fold_op));
+                check_alloc(folds->ops);
+        }
+        if (folds->num_folds == folds->fold_capacity) {
+                folds->fold_capacity = folds->fold_capacity == 0 ?
+                        256 : 2 * folds->fold_capacity;
+                folds->folds = realloc(folds->folds, folds->fold_capacity *
+                                                     sizeof(struct fold));
+                check_alloc(folds->folds);
+        }
+
+        for (unsigned r = 0; r < FOLD_INPUTS; r++) {
+                slot[r] = r;
+        }
+        fold.first_op = folds->num_ops;
+        for (unsigned i = 0; i < run->num_nodes; i++) {
+                struct fold_op *op = &folds->ops[folds->num_ops];
+
+                if (!live[i]) {
+                        continue;
+                }
+                *op = run->nodes[i];
+                op->x = slot[op->x];
+                op->y = slot[op->y];
+                op->z = slot[op->z];
+                slot[FOLD_INPUTS + i] = FOLD_INPUTS + fold.num_ops++;
+                folds->num_ops++;
+        }
+
+        fold.length = length;
+        for (unsigned r = 0; r < 8; r++) {
+                if (run->regs[r] != r) {
+                        fold.store_reg[fold.num_stores] = r;
+                        fold.store_slot[fold.num_stores++] =
+                                slot[run->regs[r]];
+                }
+        }
+
+        folds->folds[folds->num_folds] = fold;
+        folds->words_folded += length;
+        return folds->num_folds++;
+}
+
+/* Function: peephole_optimize
+ * Does: Folds each run of two or more register-only instructions among
+ *       count decoded words from first. Within a run, constants are
+ *       propagated (so load_value, add and multiply chains become one
+ *       constant), NAND sequences become the NOT, AND, OR or XOR they
+ *       spell, and only the last value written to each register is kept.
+ *       The run's first word becomes OP_FOLDED with lvalue giving its
+ *       fold; the rest keep their ordinary decoding, so a jump into the
+ *       middle of a run still works. Runs stay within a page, so that a
+ *       store into any of their words (which marks the whole page stale)
+ *       also undoes the fold. The words left over that multiply or
+ *       divide then start profiling their operands (specialise.c), and
+ *       the rest get their register-specialised handlers (handlers.c).
+ *       Loops that may copy, fill or scan (idiom.c) are found before any
+ *       of this, and their heads marked after
+ * Paramters: decoded_prog, uint32_t, uint32_t
+ * Returns: None
+ */
+void peephole_optimize(decoded_prog prog, uint32_t first, uint32_t count)
+{
+        uint32_t page_words = wb_page_size() / sizeof(uint32_t);
+        uint32_t end = first + count;
+        struct run *run = malloc(sizeof(*run));
+        uint32_t loops = idiom_find(prog, first, count);
+
+        if (prog->folds == NULL) {
+                prog->folds = calloc(1, sizeof(*prog->folds));
+        }
+        check_alloc(run);
+        check_alloc(prog->folds);
+
+        for (uint32_t i = first; i < end;) {
+                uint32_t limit = (i / page_words + 1) * page_words;
+
+                if (limit > end) {
+                        limit = end;
+                }
+                if (limit > i + PEEPHOLE_MAX_RUN) {
+                        limit = i + PEEPHOLE_MAX_RUN;
+                }
+
+                uint32_t length = build_run(run, prog, i, limit);
+
+                if (length >= 2) {
+                        prog->lvalue[i] = save_fold(prog->folds, run, length);
+                        prog->opcode[i] = OP_FOLDED;
+                }
+                i += length == 0 ? 1 : length;
+        }
+
+        free(run);
+        specialise_assign(prog, first, count);
+        handlers_assign(prog, first, count);
+        idiom_mark(prog, loops);
+}
+
+/* Function: peephole_start
+ * Does: Turns folding on for a program, leaving every page to be
+ *       optimised when control first jumps into it (peephole_enter), so
+ *       that a UM starts at once however long its program
+ * Paramters: decoded_prog
+ * Returns: None
+ */
+void peephole_start(decoded_prog prog)
+{
+        size_t pages = (prog->length >> prog->page_shift) + 1;
+
+        prog->folds = calloc(1, sizeof(*prog->folds));
+        prog->page_cold = malloc(pages);
+        check_alloc(prog->folds);
+        check_alloc(prog->page_cold);
+        memset(prog->page_cold, 1, pages);
+}
+
+/* Function: peephole_fold_page
+ * Does: Optimises the page holding pc, which has not been yet
+ * Paramters: decoded_prog, uint32_t
+ * Returns: None
+ */
+void peephole_fold_page(decoded_prog prog, uint32_t pc)
+{
+        uint32_t first = pc >> prog->page_shift << prog->page_shift;
+        uint32_t count = (uint32_t)1 << prog->page_shift;
+
+        if (count > prog->length - first) {
+                count = prog->length - first;
+        }
+        prog->page_cold[pc >> prog->page_shift] = 0;
+        peephole_optimize(prog, first, count);
+}
+
+/* Function: peephole_run
+ * Does: Runs the fold at index on the registers, if its whole run fits
+ *       in budget instructions
+ * Paramters: peephole, uint32_t, UArray_T, uint64_t
+ * Returns: uint32_t (instructions run, or 0 if it did not fit)
+ */
+uint32_t peephole_run(peephole folds, uint32_t index, UArray_T registers,
+                      uint64_t budget)
+{
+        const struct fold *fold = &folds->folds[index];
+
+        if (fold->length > budget) {
+                return 0;
+        }
+
+        /* A UArray keeps its elements side by side */
+        uint32_t *regs = UArray_at(registers, 0);
+        uint32_t v[FOLD_INPUTS + MAX_NODES];
+        uint32_t *out = v + FOLD_INPUTS;
+        const struct fold_op *op = &folds->ops[fold->first_op];
+
+        memcpy(v, regs, FOLD_INPUTS * sizeof(uint32_t));
+        for (unsigned i = 0; i < fold->num_ops; i++, op++, out++) {
+                switch (op->op) {
+                        case FOLD_CONST : *out = op->k; break;
+                        case FOLD_NOT : *out = ~v[op->x]; break;
+                        case FOLD_AND : *out = v[op->x] & v[op->y]; break;
+                        case FOLD_OR : *out = v[op->x] | v[op->y]; break;
+                        case FOLD_XOR : *out = v[op->x] ^ v[op->y]; break;
+                        case FOLD_NAND : *out = ~(v[op->x] & v[op->y]); break;
+                        case FOLD_ADD : *out = v[op->x] + v[op->y]; break;
+                        case FOLD_MUL : *out = v[op->x] * v[op->y]; break;
+                        case FOLD_DIV : *out = v[op->x] / v[op->y]; break;
+                        case FOLD_SELECT :
+                                *out = v[op->z] != 0 ? v[op->y] : v[op->x];
+                                break;
+                }
+        }
+        for (unsigned s = 0; s < fold->num_stores; s++) {
+                regs[fold->store_reg[s]] = v[fold->store_slot[s]];
+        }
+
+        return fold->length;
+}
+
+void peephole_free(peephole *folds)
+{
+        free((*folds)->folds);
+        free((*folds)->ops);
+        free(*folds);
+        *folds = NULL;
+}
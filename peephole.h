@@ -0,0 +1,62 @@
+#ifndef PEEPHOLE_INCLUDED
+#define PEEPHOLE_INCLUDED
+#include <stdint.h>
+#include <uarray.h>
+
+#include "decode.h"
+
+/* Longest run of words folded into one */
+#define PEEPHOLE_MAX_RUN 64
+
+/* What a folded run computes: a list of operations, each leaving its
+ * result in the next value slot (slots 0-7 hold the registers as the run
+ * starts), followed by the registers to set from those slots
+ */
+struct fold {
+        uint32_t first_op;
+        uint16_t num_ops;
+        uint8_t length;                 /* words the run covers */
+        uint8_t num_stores;
+        uint8_t store_reg[8];
+        uint16_t store_slot[8];
+};
+
+struct fold_op {
+        uint8_t op;
+        uint16_t x, y, z;
+        uint32_t k;
+};
+
+/* Every run folded for one decoded program. The folds of a page that is
+ * decoded again are left behind; the write barrier gives up on a page
+ * after a few stores, which bounds them
+ */
+typedef struct peephole {
+        struct fold *folds;
+        uint32_t num_folds;
+        uint32_t fold_capacity;
+        struct fold_op *ops;
+        uint32_t num_ops;
+        uint32_t op_capacity;
+        uint64_t words_folded;
+} *peephole;
+
+void peephole_start(decoded_prog prog);
+void peephole_optimize(decoded_prog prog, uint32_t first, uint32_t count);
+void peephole_fold_page(decoded_prog prog, uint32_t pc);
+uint32_t peephole_run(peephole folds, uint32_t index, UArray_T registers,
+                      uint64_t budget);
+void peephole_free(peephole *folds);
+
+/* Optimises the page holding pc if it has not been yet. Called wherever
+ * control jumps, so a page is folded once it is jumped into; code only
+ * ever fallen into runs as decoded, which costs little as it is not a loop
+ */
+static inline void peephole_enter(decoded_prog prog, uint32_t pc)
+{
+        if (pc < prog->length && prog->page_cold[pc >> prog->page_shift]) {
+                peephole_fold_page(prog, pc);
+        }
+}
+
+#endif
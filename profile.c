@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "profile.h"
+#include "vm_interface.h"
+#include "decode.h"
+#include "peephole.h"
+#include "specialise.h"
+#include "idiom.h"
+#include "mem_interface.h"
+#include "threads.h"
+
+static decoded_prog sort_prog;
+
+static uint64_t accesses(uint32_t pc)
+{
+        struct seg_cache *cache = &sort_prog->caches[sort_prog->site[pc]];
+
+        return cache->hits + cache->misses;
+}
+
+static int by_accesses(const void *x, const void *y)
+{
+        uint64_t ax = accesses(*(const uint32_t *)x);
+        uint64_t ay = accesses(*(const uint32_t *)y);
+
+        return (ax < ay) - (ax > ay);
+}
+
+/* Function: report_seg_caches
+ * Does: Prints the busiest segmented load/store sites of segment 0 with
+ *       how often their segment cache hit
+ * Paramters: FILE*, decoded_prog, const uint32_t* (segment 0)
+ * Returns: None
+ */
+static void report_seg_caches(FILE *out, decoded_prog prog,
+                              const uint32_t *words)
+{
+        uint32_t *pcs = malloc((prog->num_sites + 1) * sizeof(uint32_t));
+        uint32_t num_pcs = 0;
+        uint64_t hits = 0;
+        uint64_t total = 0;
+
+        for (uint32_t pc = 0; pc < prog->length; pc++) {
+                if (prog->site[pc] != 0) {
+                        struct seg_cache *cache = &prog->caches[prog->site[pc]];
+
+                        pcs[num_pcs++] = pc;
+                        hits += cache->hits;
+                        total += cache->hits + cache->misses;
+                }
+        }
+
+        sort_prog = prog;
+        qsort(pcs, num_pcs, sizeof(uint32_t), by_accesses);
+
+        fprintf(out, "Segment cache: %llu accesses, %.2f%% hits\n",
+                (unsigned long long)total,
+                total == 0 ? 0.0 : 100.0 * hits / total);
+        fprintf(out, "%10s %6s %14s %8s\n", "pc", "op", "accesses", "hits");
+        for (uint32_t i = 0; i < num_pcs && i < PROFILE_TOP; i++) {
+                uint32_t pc = pcs[i];
+                struct seg_cache *cache = &prog->caches[prog->site[pc]];
+                uint64_t count = cache->hits + cache->misses;
+
+                if (count == 0) {
+                        break;
+                }
+                fprintf(out, "%10u %6s %14llu %7.2f%%\n", pc,
+                        words[pc] >> 28 == 1 ? "SLOAD" : "SSTORE",
+                        (unsigned long long)count, 100.0 * cache->hits / count);
+        }
+
+        free(pcs);
+}
+
+static const struct spec_site *sort_sites;
+
+/* Sites by pc, older first */
+static int by_pc(const void *x, const void *y)
+{
+        uint32_t ix = *(const uint32_t *)x;
+        uint32_t iy = *(const uint32_t *)y;
+        uint32_t px = sort_sites[ix].pc;
+        uint32_t py = sort_sites[iy].pc;
+
+        return px != py ? (px > py) - (px < py) : (ix > iy) - (ix < iy);
+}
+
+static int by_runs(const void *x, const void *y)
+{
+        uint64_t rx = ((const struct spec_site *)x)->runs;
+        uint64_t ry = ((const struct spec_site *)y)->runs;
+
+        return (rx < ry) - (rx > ry);
+}
+
+/* Function: report_values
+ * Does: Prints the busiest multiply and divide words with the operand
+ *       value they settled on, what they run now and how often a fast
+ *       path's guard failed. A word decoded again after a store has had
+ *       several sites: they are added up under the newest that ran
+ * Paramters: FILE*, specialise
+ * Returns: None
+ */
+static void report_values(FILE *out, specialise spec)
+{
+        static const char *forms[] = {
+                [SPEC_PROFILING] = "profiling", [SPEC_GENERAL] = "general",
+                [SPEC_SHIFT] = "shift", [SPEC_RECIPROCAL] = "reciprocal"
+        };
+        uint32_t *order = malloc((spec->num_sites + 1) * sizeof(uint32_t));
+        struct spec_site *sites = malloc((spec->num_sites + 1) *
+                                         sizeof(*sites));
+        uint32_t num_words = 0;
+        uint32_t fast = 0;
+
+        for (uint32_t i = 0; i < spec->num_sites; i++) {
+                order[i] = i;
+        }
+        sort_sites = spec->sites;
+        qsort(order, spec->num_sites, sizeof(uint32_t), by_pc);
+        for (uint32_t i = 0; i < spec->num_sites; i++) {
+                const struct spec_site *site = &spec->sites[order[i]];
+
+                if (num_words > 0 && sites[num_words - 1].pc == site->pc) {
+                        struct spec_site *word = &sites[num_words - 1];
+                        uint64_t runs = word->runs + site->runs;
+                        uint64_t misses = word->misses + site->misses;
+
+                        if (site->runs > 0) {
+                                *word = *site;
+                        }
+                        word->runs = runs;
+                        word->misses = misses;
+                } else {
+                        sites[num_words++] = *site;
+                }
+        }
+        for (uint32_t i = 0; i < num_words; i++) {
+                fast += sites[i].form >= SPEC_SHIFT;
+        }
+        qsort(sites, num_words, sizeof(*sites), by_runs);
+
+        fprintf(out, "Value profile: %u multiply/divide words, %u "
+                "specialised\n", num_words, fast);
+        fprintf(out, "%10s %6s %14s %12s %11s %10s\n", "pc", "op", "runs",
+                "value", "form", "misses");
+        for (uint32_t i = 0; i < num_words && i < PROFILE_TOP; i++) {
+                struct spec_site *site = &sites[i];
+
+                if (site->runs == 0) {
+                        break;
+                }
+                fprintf(out, "%10u %6s %14llu %12u %11s %10llu\n", site->pc,
+                        site->opcode == 4 ? "MUL" : "DIV",
+                        (unsigned long long)site->runs, site->value[0],
+                        forms[site->form],
+                        (unsigned long long)site->misses);
+        }
+
+        free(order);
+        free(sites);
+}
+
+static int by_iterations(const void *x, const void *y)
+{
+        uint64_t ix = ((const struct idiom_loop *)x)->iterations;
+        uint64_t iy = ((const struct idiom_loop *)y)->iterations;
+
+        return (ix < iy) - (ix > iy);
+}
+
+/* Function: report_idioms
+ * Does: Prints the loops that ran as kernels most, with what they ran
+ *       as, how often and how often they fell back to being interpreted
+ * Paramters: FILE*, idioms
+ * Returns: None
+ */
+static void report_idioms(FILE *out, idioms loops)
+{
+        static const char *kinds[] = {
+                [IDIOM_NONE] = "-", [IDIOM_COPY] = "copy",
+                [IDIOM_FILL] = "fill", [IDIOM_SCAN] = "scan"
+        };
+        struct idiom_loop *sorted = malloc((loops->num_loops + 1) *
+                                           sizeof(*sorted));
+        uint32_t used = 0;
+
+        for (uint32_t i = 0; i < loops->num_loops; i++) {
+                sorted[i] = loops->loops[i];
+                used += loops->loops[i].runs > 0;
+        }
+        qsort(sorted, loops->num_loops, sizeof(*sorted), by_iterations);
+
+        fprintf(out, "Loop idioms: %u loops, %u run as kernels\n",
+                loops->num_loops, used);
+        fprintf(out, "%10s %6s %6s %10s %14s %10s\n", "head", "words",
+                "kind", "runs", "iterations", "fallbacks");
+        for (uint32_t i = 0; i < loops->num_loops && i < PROFILE_TOP; i++) {
+                struct idiom_loop *loop = &sorted[i];
+
+                if (loop->runs == 0 && loop->fallbacks == 0) {
+                        break;
+                }
+                fprintf(out, "%10u %6u %6s %10llu %14llu %10llu%s\n",
+                        loop->head, loop->length, kinds[loop->kind],
+                        (unsigned long long)loop->runs,
+                        (unsigned long long)loop->iterations,
+                        (unsigned long long)loop->fallbacks,
+                        loop->given_up ? " (given up)" : "");
+        }
+
+        free(sorted);
+}
+
+/* Function: profile_report
+ * Does: Prints what was measured while the VM ran the program now in
+ *       segment 0
+ * Paramters: FILE*, um_vm
+ * Returns: None
+ */
+void profile_report(FILE *out, um_vm vm)
+{
+        fprintf(out, "Instructions: %llu\n",
+                (unsigned long long)vm->instructions);
+        if (vm->threads != NULL) {
+                uint64_t spawned, instructions;
+
+                threads_counts(vm->threads, &spawned, &instructions);
+                fprintf(out, "Threads: %llu spawned, %llu instructions "
+                        "between them\n", (unsigned long long)spawned,
+                        (unsigned long long)instructions);
+        }
+        if (vm->mem->quota != 0) {
+                fprintf(out, "Spills: %llu, spill faults: %llu\n",
+                        (unsigned long long)vm->mem->spills,
+                        (unsigned long long)vm->mem->spill_faults);
+        }
+        if (vm->mem->reclaim != NULL) {
+                struct reclaim_counts counts = reclaim_counts(vm->mem->reclaim);
+
+                fprintf(out, "Reclaimer: %llu buffers handed off, %llu freed "
+                        "inline, %llu maps recycled\n",
+                        (unsigned long long)counts.handed_off,
+                        (unsigned long long)counts.freed_inline,
+                        (unsigned long long)counts.recycled);
+        }
+        if (vm->mem->arena != NULL) {
+                struct arena_counts counts = arena_counts(vm->mem->arena);
+
+                fprintf(out, "Arena: %llu segments placed (%llu reused, "
+                        "%llu hot) in %llu chunks\n",
+                        (unsigned long long)counts.placed,
+                        (unsigned long long)counts.reused,
+                        (unsigned long long)counts.hot,
+                        (unsigned long long)counts.chunks);
+        }
+        if (vm->prog != NULL && vm->prog->folds != NULL) {
+                peephole folds = vm->prog->folds;
+
+                fprintf(out, "Folded: %u runs, %llu words into %u "
+                        "operations\n", folds->num_folds,
+                        (unsigned long long)folds->words_folded,
+                        folds->num_ops);
+        }
+        if (vm->prog != NULL) {
+                report_seg_caches(out, vm->prog, seg_words(vm->mem, 0));
+        }
+        if (vm->prog != NULL && vm->prog->values != NULL) {
+                report_values(out, vm->prog->values);
+        }
+        if (vm->prog != NULL && vm->prog->idioms != NULL) {
+                report_idioms(out, vm->prog->idioms);
+        }
+}
@@ -0,0 +1,12 @@
+#ifndef PROFILE_INCLUDED
+#define PROFILE_INCLUDED
+#include <stdio.h>
+
+#include "vm_interface.h"
+
+/* Sites shown in each table of the report */
+#define PROFILE_TOP 20
+
+void profile_report(FILE *out, um_vm vm);
+
+#endif
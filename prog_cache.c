@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "prog_cache.h"
+#include "image.h"
+
+/* One image, in the list from most to least recently used */
+struct entry {
+        struct prog_key key;
+        int fd;
+        uint64_t bytes;
+        struct entry *prev;
+        struct entry *next;
+};
+
+/* A host keeps tens of programs, not thousands, so entries are found by
+ * walking the list
+ */
+struct prog_cache {
+        pthread_mutex_t lock;
+        struct entry *head;
+        struct entry *tail;
+        uint64_t max_bytes;             /* 0 means no limit */
+        struct prog_cache_counts counts;
+};
+
+/* Function: prog_cache_new
+ * Does: Creates an empty cache keeping at most max_bytes of images (0 for
+ *       no limit); the one most recently added is kept even if over
+ * Paramters: uint64_t
+ * Returns: prog_cache
+ */
+prog_cache prog_cache_new(uint64_t max_bytes)
+{
+        prog_cache cache = calloc(1, sizeof(*cache));
+
+        if (cache == NULL) {
+                fprintf(stderr, "Error: Could not allocate cache\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&cache->lock, NULL);
+        cache->max_bytes = max_bytes;
+        return cache;
+}
+
+static void unlink_entry(prog_cache cache, struct entry *e)
+{
+        if (e->prev != NULL) {
+                e->prev->next = e->next;
+        } else {
+                cache->head = e->next;
+        }
+        if (e->next != NULL) {
+                e->next->prev = e->prev;
+        } else {
+                cache->tail = e->prev;
+        }
+}
+
+static void push_front(prog_cache cache, struct entry *e)
+{
+        e->prev = NULL;
+        e->next = cache->head;
+        if (cache->head != NULL) {
+                cache->head->prev = e;
+        } else {
+                cache->tail = e;
+        }
+        cache->head = e;
+}
+
+/* Finds an entry and makes it the most recently used; the caller holds
+ * lock
+ */
+static struct entry *find(prog_cache cache, const struct prog_key *key)
+{
+        for (struct entry *e = cache->head; e != NULL; e = e->next) {
+                if (memcmp(&e->key, key, sizeof(*key)) == 0) {
+                        unlink_entry(cache, e);
+                        push_front(cache, e);
+                        return e;
+                }
+        }
+        return NULL;
+}
+
+/* Drops least recently used entries until the images fit, keeping the
+ * newest; the caller holds lock
+ */
+static void evict(prog_cache cache)
+{
+        while (cache->max_bytes != 0 && cache->counts.bytes > cache->max_bytes
+               && cache->tail != cache->head) {
+                struct entry *e = cache->tail;
+
+                unlink_entry(cache, e);
+                cache->counts.entries--;
+                cache->counts.bytes -= e->bytes;
+                cache->counts.evictions++;
+                close(e->fd);
+                free(e);
+        }
+}
+
+/* Function: prog_cache_key
+ * Does: Computes what the cache knows a program by: the SHA-256 of its
+ *       words as init_prog reads them, a trailing partial word dropped
+ * Paramters: const void*, size_t
+ * Returns: struct prog_key
+ */
+struct prog_key prog_cache_key(const void *program, size_t length)
+{
+        struct prog_key key;
+
+        /* Big-endian words are the bytes they were read from */
+        sha256(program, length / 4 * 4, key.digest);
+        return key;
+}
+
+/* Function: prog_key_format
+ * Does: Writes a key out as hex digits, for the protocol of umd.h
+ * Paramters: const struct prog_key*, char[PROG_KEY_TEXT] (set)
+ * Returns: None
+ */
+void prog_key_format(const struct prog_key *key, char text[PROG_KEY_TEXT])
+{
+        for (unsigned i = 0; i < SHA256_BYTES; i++) {
+                snprintf(text + i * 2, 3, "%02x", key->digest[i]);
+        }
+}
+
+/* Function: prog_key_parse
+ * Does: Reads a key written by prog_key_format
+ * Paramters: const char*, struct prog_key* (set)
+ * Returns: bool (false unless text is exactly that many hex digits)
+ */
+bool prog_key_parse(const char *text, struct prog_key *key)
+{
+        if (strlen(text) != PROG_KEY_TEXT - 1) {
+                return false;
+        }
+        for (unsigned i = 0; i < SHA256_BYTES; i++) {
+                unsigned byte;
+
+                if (!isxdigit((unsigned char)text[i * 2]) ||
+                    !isxdigit((unsigned char)text[i * 2 + 1]) ||
+                    sscanf(text + i * 2, "%2x", &byte) != 1) {
+                        return false;
+                }
+                key->digest[i] = byte;
+        }
+        return true;
+}
+
+/* Function: memory_file
+ * Does: Creates an anonymous memory file, which only the descriptor reaches
+ * Paramters: none
+ * Returns: int (the file, or -1)
+ */
+static int memory_file(void)
+{
+        return memfd_create("umd-image", MFD_CLOEXEC);
+}
+
+/* Function: build_image
+ * Does: Writes the image of a program into a new memory file
+ * Paramters: const void*, size_t, uint64_t* (set to the image's size)
+ * Returns: int (the file, or -1 if it could not be written)
+ */
+static int build_image(const void *program, size_t length, uint64_t *bytes)
+{
+        struct stat image_stat;
+        uint64_t hash;
+        int fd = memory_file();
+
+        if (fd < 0) {
+                return -1;
+        }
+
+        int out_fd = dup(fd);
+        FILE *in = fmemopen((void *)program, length, "rb");
+        FILE *out = out_fd < 0 ? NULL : fdopen(out_fd, "wb");
+        bool built = in != NULL && out != NULL &&
+                     image_build(in, out, &hash);
+
+        if (in != NULL) {
+                fclose(in);
+        }
+        if (out != NULL) {
+                built = fclose(out) == 0 && built;
+        } else if (out_fd >= 0) {
+                close(out_fd);
+        }
+        if (!built || fstat(fd, &image_stat) != 0) {
+                close(fd);
+                return -1;
+        }
+        *bytes = image_stat.st_size;
+        return fd;
+}
+
+/* Function: prog_cache_add
+ * Does: Makes sure a program (the bytes of a .um) is cached, building its
+ *       image unless the same words already are, and evicts to fit
+ * Paramters: prog_cache, const void*, size_t, struct prog_key* (set to
+ *            its key)
+ * Returns: bool (false if the image could not be built)
+ */
+bool prog_cache_add(prog_cache cache, const void *program, size_t length,
+                    struct prog_key *key)
+{
+        *key = prog_cache_key(program, length);
+
+        pthread_mutex_lock(&cache->lock);
+        bool cached = find(cache, key) != NULL;
+        pthread_mutex_unlock(&cache->lock);
+        if (cached) {
+                return true;
+        }
+
+        /* Built unlocked, so other jobs go on meanwhile; one built twice
+         * at once is kept once
+         */
+        uint64_t bytes;
+        int fd = build_image(program, length, &bytes);
+
+        if (fd < 0) {
+                return false;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        if (find(cache, key) != NULL) {
+                close(fd);
+        } else {
+                struct entry *e = malloc(sizeof(*e));
+
+                e->key = *key;
+                e->fd = fd;
+                e->bytes = bytes;
+                push_front(cache, e);
+                cache->counts.entries++;
+                cache->counts.bytes += bytes;
+                evict(cache);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+}
+
+/* Function: prog_cache_open
+ * Does: Creates a UM running a cached program, with its own memory and
+ *       I/O device (no input file means input is fed, and no output file
+ *       that output is taken; see io_dev.h)
+ * Paramters: prog_cache, const struct prog_key*, FILE*, FILE*
+ * Returns: um_vm (NULL if the program is not cached)
+ */
+um_vm prog_cache_open(prog_cache cache, const struct prog_key *key,
+                      FILE *in, FILE *out)
+{
+        pthread_mutex_lock(&cache->lock);
+
+        struct entry *e = find(cache, key);
+        int fd = e == NULL ? -1 : dup(e->fd);
+
+        if (e != NULL) {
+                cache->counts.hits++;
+        } else {
+                cache->counts.misses++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if (fd < 0) {
+                return NULL;
+        }
+
+        /* The duplicate keeps the image open should it be evicted now */
+        um_vm vm = image_open_fd(fd, in, out);
+
+        close(fd);
+        return vm;
+}
+
+struct prog_cache_counts prog_cache_counts(prog_cache cache)
+{
+        pthread_mutex_lock(&cache->lock);
+        struct prog_cache_counts counts = cache->counts;
+        pthread_mutex_unlock(&cache->lock);
+
+        return counts;
+}
+
+void prog_cache_free(prog_cache *cache)
+{
+        struct entry *e = (*cache)->head;
+
+        while (e != NULL) {
+                struct entry *next = e->next;
+
+                close(e->fd);
+                free(e);
+                e = next;
+        }
+        pthread_mutex_destroy(&(*cache)->lock);
+        free(*cache);
+        *cache = NULL;
+}
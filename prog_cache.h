@@ -0,0 +1,50 @@
+#ifndef PROG_CACHE_INCLUDED
+#define PROG_CACHE_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vm_interface.h"
+#include "sha256.h"
+
+/* The programs a long-lived host (umd) has been sent, kept as .umx images
+ * (image.h) in anonymous memory files by the SHA-256 of their words, so
+ * that a program sent again is neither parsed nor decoded. A client asks
+ * for a program by that key alone, so it has to be one no other program
+ * can be made to share: a 64-bit hash would let one client's program run
+ * in place of another's. Each UM made from an entry maps its image
+ * privately, and keeps running on that mapping even once the entry is
+ * evicted. Entries past the byte limit go least recently used first. Any
+ * thread may use a cache.
+ */
+typedef struct prog_cache *prog_cache;
+
+/* What the cache knows a program by */
+struct prog_key {
+        uint8_t digest[SHA256_BYTES];
+};
+
+/* The length of a key written out as hex digits, with its NUL */
+#define PROG_KEY_TEXT (2 * SHA256_BYTES + 1)
+
+struct prog_cache_counts {
+        uint64_t entries;
+        uint64_t bytes;                 /* of the images kept */
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+};
+
+struct prog_key prog_cache_key(const void *program, size_t length);
+void prog_key_format(const struct prog_key *key, char text[PROG_KEY_TEXT]);
+bool prog_key_parse(const char *text, struct prog_key *key);
+prog_cache prog_cache_new(uint64_t max_bytes);
+bool prog_cache_add(prog_cache cache, const void *program, size_t length,
+                    struct prog_key *key);
+um_vm prog_cache_open(prog_cache cache, const struct prog_key *key,
+                      FILE *in, FILE *out);
+struct prog_cache_counts prog_cache_counts(prog_cache cache);
+void prog_cache_free(prog_cache *cache);
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "reclaim.h"
+
+/* The words of an unmapped segment, at least length long */
+struct buffer {
+        uint32_t *words;
+        uint32_t length;
+};
+
+/* A single-producer, single-consumer ring. Each side only writes its own
+ * index, and they are kept a cache line apart
+ */
+struct ring {
+        uint64_t head;                  /* consumer's */
+        char apart[64];
+        uint64_t tail;                  /* producer's */
+        uint64_t mask;
+        struct buffer *slots;
+};
+
+struct reclaimer {
+        struct ring unmapped;                   /* UM to thread */
+        struct ring ready[RECLAIM_CLASSES];     /* thread to UM, zeroed */
+        uint64_t pending_bytes;                 /* in unmapped */
+        struct reclaim_counts counts;
+        pthread_mutex_t lock;                   /* only to sleep and wake */
+        pthread_cond_t wake;
+        bool idle;
+        bool stopping;
+        pthread_t thread;
+};
+
+static void ring_init(struct ring *ring, uint64_t capacity)
+{
+        ring->head = 0;
+        ring->tail = 0;
+        ring->mask = capacity - 1;
+        ring->slots = malloc(capacity * sizeof(*ring->slots));
+        if (ring->slots == NULL) {
+                fprintf(stderr, "Error: Could not allocate reclaimer\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static bool ring_push(struct ring *ring, struct buffer buffer)
+{
+        uint64_t tail = ring->tail;
+
+        if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >
+            ring->mask) {
+                return false;
+        }
+        ring->slots[tail & ring->mask] = buffer;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+        return true;
+}
+
+static bool ring_pop(struct ring *ring, struct buffer *buffer)
+{
+        uint64_t head = ring->head;
+
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) {
+                return false;
+        }
+        *buffer = ring->slots[head & ring->mask];
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        return true;
+}
+
+/* The class whose buffers all hold at least length words, or -1 */
+static int class_for(uint32_t length)
+{
+        int shift = length <= 1u << RECLAIM_MIN_SHIFT ? RECLAIM_MIN_SHIFT
+                  : 32 - __builtin_clz(length - 1);
+
+        shift -= RECLAIM_MIN_SHIFT;
+        return shift < RECLAIM_CLASSES ? shift : -1;
+}
+
+/* The largest class a buffer of length words can serve, or -1 */
+static int class_of(uint32_t length)
+{
+        if (length < 1u << RECLAIM_MIN_SHIFT) {
+                return -1;
+        }
+
+        int shift = 31 - __builtin_clz(length) - RECLAIM_MIN_SHIFT;
+
+        return shift < RECLAIM_CLASSES ? shift : -1;
+}
+
+/* Function: recycle
+ * Does: Zeroes a buffer and makes it ready for a map of its class, or
+ *       frees it if it has no class or its class has enough ready
+ * Paramters: reclaimer, struct buffer
+ * Returns: None
+ */
+static void recycle(reclaimer r, struct buffer buffer)
+{
+        int class = class_of(buffer.length);
+
+        if (class >= 0) {
+                uint32_t words = 1u << (class + RECLAIM_MIN_SHIFT);
+
+                memset(buffer.words, 0, (size_t)words * sizeof(uint32_t));
+                if (ring_push(&r->ready[class], buffer)) {
+                        return;
+                }
+        }
+        free(buffer.words);
+}
+
+/* Function: reclaim_thread
+ * Does: Recycles or frees unmapped buffers as they come, sleeping when
+ *       there are none. On stopping it finishes those already queued
+ * Paramters: void* (the reclaimer)
+ * Returns: NULL
+ */
+static void *reclaim_thread(void *cl)
+{
+        reclaimer r = cl;
+        struct buffer buffer;
+
+        for (;;) {
+                while (ring_pop(&r->unmapped, &buffer)) {
+                        recycle(r, buffer);
+                        __atomic_fetch_sub(&r->pending_bytes,
+                                           (uint64_t)buffer.length *
+                                           sizeof(uint32_t),
+                                           __ATOMIC_RELAXED);
+                }
+
+                /* Says it is going to sleep, then looks once more, so that
+                 * a buffer put meanwhile is not left waiting
+                 */
+                pthread_mutex_lock(&r->lock);
+                __atomic_store_n(&r->idle, true, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&r->unmapped.tail, __ATOMIC_SEQ_CST) ==
+                    r->unmapped.head) {
+                        if (r->stopping) {
+                                pthread_mutex_unlock(&r->lock);
+                                return NULL;
+                        }
+                        pthread_cond_wait(&r->wake, &r->lock);
+                }
+                __atomic_store_n(&r->idle, false, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&r->lock);
+        }
+}
+
+/* Function: reclaim_start
+ * Does: Starts a reclaimer thread
+ * Paramters: None
+ * Returns: reclaimer
+ */
+reclaimer reclaim_start()
+{
+        reclaimer r = calloc(1, sizeof(*r));
+
+        if (r == NULL) {
+                fprintf(stderr, "Error: Could not allocate reclaimer\n");
+                exit(EXIT_FAILURE);
+        }
+        ring_init(&r->unmapped, RECLAIM_RING);
+        for (int class = 0; class < RECLAIM_CLASSES; class++) {
+                ring_init(&r->ready[class], RECLAIM_CACHE);
+        }
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->wake, NULL);
+        pthread_create(&r->thread, NULL, reclaim_thread, r);
+
+        return r;
+}
+
+/* Function: reclaim_put
+ * Does: Hands the words of an unmapped segment to the reclaimer. When it
+ *       is behind (its ring full or too many bytes waiting), frees them
+ *       at once instead
+ * Paramters: reclaimer, uint32_t*, uint32_t
+ * Returns: None
+ */
+void reclaim_put(reclaimer r, uint32_t *words, uint32_t length)
+{
+        struct buffer buffer = { words, length };
+        uint64_t bytes = (uint64_t)length * sizeof(uint32_t);
+
+        if (__atomic_load_n(&r->pending_bytes, __ATOMIC_RELAXED) + bytes >
+            RECLAIM_MAX_PENDING || !ring_push(&r->unmapped, buffer)) {
+                free(words);
+                r->counts.freed_inline++;
+                return;
+        }
+        __atomic_fetch_add(&r->pending_bytes, bytes, __ATOMIC_RELAXED);
+        r->counts.handed_off++;
+
+        uint64_t waiting = r->unmapped.tail -
+                           __atomic_load_n(&r->unmapped.head,
+                                           __ATOMIC_RELAXED);
+
+        if ((waiting >= RECLAIM_BATCH || length >= RECLAIM_BATCH) &&
+            __atomic_load_n(&r->idle, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&r->lock);
+                pthread_cond_signal(&r->wake);
+                pthread_mutex_unlock(&r->lock);
+        }
+}
+
+/* Function: reclaim_get
+ * Does: Gives zeroed words for a new segment of length words, if a
+ *       recycled buffer is ready
+ * Paramters: reclaimer, uint32_t
+ * Returns: uint32_t* (NULL if none is ready)
+ */
+uint32_t *reclaim_get(reclaimer r, uint32_t length)
+{
+        int class = length == 0 ? -1 : class_for(length);
+        struct buffer buffer;
+
+        if (class < 0 || !ring_pop(&r->ready[class], &buffer)) {
+                return NULL;
+        }
+        r->counts.recycled++;
+        return buffer.words;
+}
+
+/* Function: reclaim_counts
+ * Does: Gives what the reclaimer has done so far
+ * Paramters: reclaimer
+ * Returns: struct reclaim_counts
+ */
+struct reclaim_counts reclaim_counts(reclaimer r)
+{
+        return r->counts;
+}
+
+/* Function: reclaim_stop
+ * Does: Lets the thread finish the buffers queued, stops it and frees the
+ *       ready ones
+ * Paramters: reclaimer*
+ * Returns: None
+ */
+void reclaim_stop(reclaimer *r)
+{
+        struct buffer buffer;
+
+        pthread_mutex_lock(&(*r)->lock);
+        (*r)->stopping = true;
+        pthread_cond_signal(&(*r)->wake);
+        pthread_mutex_unlock(&(*r)->lock);
+        pthread_join((*r)->thread, NULL);
+
+        for (int class = 0; class < RECLAIM_CLASSES; class++) {
+                while (ring_pop(&(*r)->ready[class], &buffer)) {
+                        free(buffer.words);
+                }
+                free((*r)->ready[class].slots);
+        }
+        free((*r)->unmapped.slots);
+        pthread_mutex_destroy(&(*r)->lock);
+        pthread_cond_destroy(&(*r)->wake);
+        free(*r);
+        *r = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef RECLAIM_INCLUDED
+#define RECLAIM_INCLUDED
+#include <stdint.h>
+
+/* Unmapped buffers waiting for the reclaimer; past this (or past
+ * RECLAIM_MAX_PENDING bytes) the UM frees them itself
+ */
+#define RECLAIM_RING 4096
+#define RECLAIM_MAX_PENDING ((uint64_t)64 << 20)
+
+/* A sleeping reclaimer is woken once this many buffers (or one this many
+ * words long) are waiting, so that small unmaps do not each cost a wakeup
+ */
+#define RECLAIM_BATCH 64
+
+/* Size classes of recycled buffers, 2^RECLAIM_MIN_SHIFT words and up, and
+ * how many zeroed buffers each keeps ready
+ */
+#define RECLAIM_MIN_SHIFT 0
+#define RECLAIM_CLASSES 17
+#define RECLAIM_CACHE 256
+
+/* A thread that frees the words of unmapped segments for one UM, or
+ * zeroes them and keeps them by size class for the next map, so that
+ * neither unmap nor map waits on free or calloc. Everything passes
+ * through single-producer, single-consumer rings; only the thread running
+ * the UM may call reclaim_put and reclaim_get.
+ */
+typedef struct reclaimer *reclaimer;
+
+struct reclaim_counts {
+        uint64_t handed_off;            /* buffers given to the thread */
+        uint64_t freed_inline;          /* freed by the UM: backpressure */
+        uint64_t recycled;              /* maps given a ready buffer */
+};
+
+reclaimer reclaim_start();
+void reclaim_put(reclaimer r, uint32_t *words, uint32_t length);
+uint32_t *reclaim_get(reclaimer r, uint32_t length);
+struct reclaim_counts reclaim_counts(reclaimer r);
+void reclaim_stop(reclaimer *r);
+
+#endif
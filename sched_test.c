@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm_sched.h"
+#include "vm_interface.h"
+
+/* Instructions the budgeted job gets, well short of its program */
+#define TEST_BUDGET 1000
+
+/* One job, and what it should come to */
+struct sched_case {
+        const char *name;
+        unsigned priority;
+        uint64_t budget;                /* 0 means no limit */
+        bool fed;                       /* input only once the rest finish */
+        vm_status expected;
+};
+
+/* The first job holds the only worker in its finish hook until the rest
+ * are queued behind it, so they are taken purely by priority, then in the
+ * order submitted. The job fed last is taken first, and parks on its input.
+ */
+static const struct sched_case cases[] = {
+        { "halt",         0, 0,           false, VM_HALTED  },
+        { "io",           3, 0,           true,  VM_HALTED  },
+        { "multiply",     1, 0,           false, VM_HALTED  },
+        { "fivehundredk", 0, TEST_BUDGET, false, VM_YIELDED },
+        { "print-six",    2, 0,           false, VM_HALTED  },
+        { "add",          1, 0,           false, VM_HALTED  },
+        { "divide",       0, 0,           false, VM_HALTED  },
+};
+
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+/* The order the jobs should finish in, as indices into cases */
+static const unsigned expected_order[NUM_CASES] = { 0, 4, 2, 5, 3, 6, 1 };
+
+/* Shared with the finish hooks, which all run on the one worker */
+struct sched_run {
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        bool holding;                   /* the worker is at the gate */
+        bool open;
+        unsigned order[NUM_CASES];
+        unsigned num_finished;
+};
+
+struct job_ref {
+        struct sched_run *run;
+        unsigned index;
+};
+
+static char *path_of(const char *dir, const char *name, const char *ext)
+{
+        size_t length = strlen(dir) + strlen(name) + strlen(ext) + 2;
+        char *path = malloc(length);
+
+        snprintf(path, length, "%s/%s%s", dir, name, ext);
+        return path;
+}
+
+/* Function: read_file
+ * Does: Reads a whole file into memory; a missing one reads as empty
+ * Paramters: const char*, size_t*
+ * Returns: char*
+ */
+static char *read_file(const char *path, size_t *length)
+{
+        FILE *fp = fopen(path, "rb");
+        char *contents = NULL;
+
+        *length = 0;
+        if (fp == NULL) {
+                return calloc(1, 1);
+        }
+
+        FILE *stream = open_memstream(&contents, length);
+        int ch;
+
+        while ((ch = fgetc(fp)) != EOF) {
+                fputc(ch, stream);
+        }
+        fclose(stream);
+        fclose(fp);
+
+        return contents;
+}
+
+/* Function: finished
+ * Does: Records that a job finished; the first waits at the gate
+ * Paramters: um_vm, vm_status, void* (a job_ref)
+ * Returns: None
+ */
+static void finished(um_vm vm, vm_status status, void *cl)
+{
+        struct job_ref *ref = cl;
+        struct sched_run *run = ref->run;
+
+        (void)vm;
+        (void)status;
+        if (ref->index == 0) {
+                pthread_mutex_lock(&run->lock);
+                run->holding = true;
+                pthread_cond_broadcast(&run->changed);
+                while (!run->open) {
+                        pthread_cond_wait(&run->changed, &run->lock);
+                }
+                pthread_mutex_unlock(&run->lock);
+        }
+        run->order[run->num_finished++] = ref->index;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *dir = argc > 1 ? argv[1] : "unit_tests";
+        struct sched_run run;
+        struct job_ref refs[NUM_CASES];
+        um_vm vms[NUM_CASES];
+        um_job jobs[NUM_CASES];
+        FILE *outs[NUM_CASES];
+        char *outputs[NUM_CASES];
+        size_t output_lengths[NUM_CASES];
+        unsigned passed = 0;
+
+        pthread_mutex_init(&run.lock, NULL);
+        pthread_cond_init(&run.changed, NULL);
+        run.holding = false;
+        run.open = false;
+        run.num_finished = 0;
+
+        for (unsigned i = 0; i < NUM_CASES; i++) {
+                char *um_path = path_of(dir, cases[i].name, ".um");
+                FILE *program = fopen(um_path, "rb");
+
+                if (program == NULL) {
+                        fprintf(stderr, "%s: Could not open %s\n", argv[0],
+                                um_path);
+                        exit(EXIT_FAILURE);
+                }
+                outs[i] = open_memstream(&outputs[i], &output_lengths[i]);
+                vms[i] = vm_new(program, NULL, outs[i]);
+                fclose(program);
+                free(um_path);
+        }
+
+        sched s = sched_new(1);
+
+        for (unsigned i = 0; i < NUM_CASES; i++) {
+                refs[i].run = &run;
+                refs[i].index = i;
+                jobs[i] = sched_submit(s, vms[i], cases[i].priority,
+                                       cases[i].budget);
+                sched_on_finish(s, jobs[i], finished, &refs[i]);
+                if (!cases[i].fed) {
+                        sched_close_input(s, jobs[i]);
+                }
+                /* The rest go in once the first holds the worker */
+                pthread_mutex_lock(&run.lock);
+                while (i == 0 && !run.holding) {
+                        pthread_cond_wait(&run.changed, &run.lock);
+                }
+                pthread_mutex_unlock(&run.lock);
+        }
+        pthread_mutex_lock(&run.lock);
+        run.open = true;
+        pthread_cond_broadcast(&run.changed);
+        pthread_mutex_unlock(&run.lock);
+
+        vm_status statuses[NUM_CASES];
+
+        for (unsigned i = 0; i < NUM_CASES; i++) {
+                if (!cases[i].fed) {
+                        statuses[i] = sched_wait(s, jobs[i]);
+                }
+        }
+        for (unsigned i = 0; i < NUM_CASES; i++) {
+                if (cases[i].fed) {
+                        char *in_path = path_of(dir, cases[i].name, ".0");
+                        size_t length;
+                        char *input = read_file(in_path, &length);
+
+                        sched_feed(s, jobs[i], input, length);
+                        sched_close_input(s, jobs[i]);
+                        statuses[i] = sched_wait(s, jobs[i]);
+                        free(input);
+                        free(in_path);
+                }
+        }
+        sched_free(&s);
+
+        for (unsigned i = 0; i < NUM_CASES; i++) {
+                const struct sched_case *c = &cases[i];
+                uint64_t instructions = vms[i]->instructions;
+
+                vm_free(&vms[i]);
+                fclose(outs[i]);
+
+                char *out_path = path_of(dir, c->name, ".1");
+                size_t expected_length;
+                char *expected = read_file(out_path, &expected_length);
+                const char *reason = "";
+
+                if (statuses[i] != c->expected) {
+                        reason = "wrong status";
+                } else if (c->budget != 0 && instructions != c->budget) {
+                        reason = "budget not kept";
+                } else if (c->budget == 0 &&
+                           (output_lengths[i] != expected_length ||
+                            memcmp(outputs[i], expected,
+                                   expected_length) != 0)) {
+                        reason = "output differs";
+                }
+                printf("%s  %-16s priority %u  %s\n",
+                       reason[0] == '\0' ? "PASS" : "FAIL", c->name,
+                       c->priority, reason);
+                passed += reason[0] == '\0';
+                free(expected);
+                free(out_path);
+                free(outputs[i]);
+        }
+
+        bool in_order = run.num_finished == NUM_CASES &&
+                        memcmp(run.order, expected_order,
+                               sizeof(expected_order)) == 0;
+
+        printf("%s  finish order    ", in_order ? "PASS" : "FAIL");
+        for (unsigned i = 0; i < run.num_finished; i++) {
+                printf(" %s", cases[run.order[i]].name);
+        }
+        printf("\n%u/%zu jobs passed\n", passed, NUM_CASES);
+        pthread_mutex_destroy(&run.lock);
+        pthread_cond_destroy(&run.changed);
+
+        return passed == NUM_CASES && in_order ? EXIT_SUCCESS
+                                               : EXIT_FAILURE;
+}
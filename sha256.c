@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t round_constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+        0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+        0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+        0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+        0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+        0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+        0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotate(uint32_t x, unsigned n)
+{
+        return x >> n | x << (32 - n);
+}
+
+/* Function: compress
+ * Does: Folds one 64-byte block into the state
+ * Paramters: uint32_t[8], const uint8_t*
+ * Returns: None
+ */
+static void compress(uint32_t state[8], const uint8_t *block)
+{
+        uint32_t w[64];
+        uint32_t v[8];
+
+        for (unsigned i = 0; i < 16; i++) {
+                const uint8_t *b = block + i * 4;
+
+                w[i] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+                       (uint32_t)b[2] << 8 | b[3];
+        }
+        for (unsigned i = 16; i < 64; i++) {
+                uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^
+                              w[i - 15] >> 3;
+                uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^
+                              w[i - 2] >> 10;
+
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        memcpy(v, state, sizeof(v));
+        for (unsigned i = 0; i < 64; i++) {
+                uint32_t s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^
+                              rotate(v[4], 25);
+                uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+                uint32_t t1 = v[7] + s1 + choice + round_constants[i] + w[i];
+                uint32_t s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^
+                              rotate(v[0], 22);
+                uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^
+                                    (v[1] & v[2]);
+
+                memmove(v + 1, v, 7 * sizeof(uint32_t));
+                v[4] += t1;
+                v[0] = t1 + s0 + majority;
+        }
+        for (unsigned i = 0; i < 8; i++) {
+                state[i] += v[i];
+        }
+}
+
+/* Function: sha256
+ * Does: Computes the SHA-256 digest of length bytes
+ * Paramters: const void*, size_t, uint8_t[SHA256_BYTES] (set)
+ * Returns: None
+ */
+void sha256(const void *bytes, size_t length, uint8_t digest[SHA256_BYTES])
+{
+        uint32_t state[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        const uint8_t *next = bytes;
+        size_t left = length;
+        uint8_t tail[128];
+
+        for (; left >= 64; next += 64, left -= 64) {
+                compress(state, next);
+        }
+
+        /* The last bytes, a 1 bit, zeros and the length in bits fill one
+         * block or two
+         */
+        size_t tail_length = left + 9 <= 64 ? 64 : 128;
+        uint64_t bits = (uint64_t)length * 8;
+
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, next, left);
+        tail[left] = 0x80;
+        for (unsigned i = 0; i < 8; i++) {
+                tail[tail_length - 1 - i] = bits >> (i * 8);
+        }
+        compress(state, tail);
+        if (tail_length == 128) {
+                compress(state, tail + 64);
+        }
+
+        for (unsigned i = 0; i < 8; i++) {
+                digest[i * 4] = state[i] >> 24;
+                digest[i * 4 + 1] = state[i] >> 16;
+                digest[i * 4 + 2] = state[i] >> 8;
+                digest[i * 4 + 3] = state[i];
+        }
+}
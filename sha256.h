@@ -0,0 +1,14 @@
+#ifndef SHA256_INCLUDED
+#define SHA256_INCLUDED
+#include <stdint.h>
+#include <stddef.h>
+
+/* SHA-256 (FIPS 180-4), for naming programs by their contents where a
+ * name that two programs could be made to share would let one stand in
+ * for the other
+ */
+#define SHA256_BYTES 32
+
+void sha256(const void *bytes, size_t length, uint8_t digest[SHA256_BYTES]);
+
+#endif
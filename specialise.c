@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "specialise.h"
+#include "decode.h"
+#include "handlers.h"
+
+static bool power_of_two(uint32_t value)
+{
+        return value != 0 && (value & (value - 1)) == 0;
+}
+
+/* Function: specialise_assign
+ * Does: Gives each multiply and divide among count decoded words from
+ *       first a site and marks it OP_PROFILE, so that its first runs
+ *       record their operands. Must run before handlers_assign, which
+ *       would otherwise take the multiplies
+ * Paramters: decoded_prog, uint32_t, uint32_t
+ * Returns: None
+ */
+void specialise_assign(decoded_prog prog, uint32_t first, uint32_t count)
+{
+        if (prog->values == NULL) {
+                prog->values = calloc(1, sizeof(*prog->values));
+        }
+
+        specialise spec = prog->values;
+
+        for (uint32_t i = first; i < first + count; i++) {
+                uint32_t opcode = prog->opcode[i];
+
+                if (opcode != 4 && opcode != 5) {
+                        continue;
+                }
+                if (spec->num_sites == spec->capacity) {
+                        spec->capacity = spec->capacity == 0 ? 64
+                                         : spec->capacity * 2;
+                        spec->sites = realloc(spec->sites, spec->capacity *
+                                              sizeof(*spec->sites));
+                        if (spec->sites == NULL) {
+                                fprintf(stderr, "Error: Could not allocate "
+                                        "value profile\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+
+                struct spec_site *site = &spec->sites[spec->num_sites];
+
+                *site = (struct spec_site){ 0 };
+                site->pc = i;
+                site->opcode = opcode;
+                site->a = prog->a[i];
+                prog->opcode[i] = OP_PROFILE;
+                prog->lvalue[i] = spec->num_sites++;
+        }
+}
+
+/* Puts a site's word back as it was decoded, handler and all */
+static void generalise(decoded_prog prog, struct spec_site *site)
+{
+        site->form = SPEC_GENERAL;
+        prog->opcode[site->pc] = site->opcode;
+        handlers_assign(prog, site->pc, 1);
+}
+
+/* Boyer-Moore majority vote: value[slot] ends up as any value used in more
+ * than half the runs, and votes[slot] bounds from below how often it was
+ */
+static void vote(struct spec_site *site, int slot, uint32_t value)
+{
+        if (site->votes[slot] == 0) {
+                site->value[slot] = value;
+                site->votes[slot] = 1;
+        } else if (site->value[slot] == value) {
+                site->votes[slot]++;
+        } else {
+                site->votes[slot]--;
+        }
+}
+
+/* Function: decide
+ * Does: Ends a site's profiling. A divide whose divisor held steady gets a
+ *       shift (a power of two) or a multiply by its reciprocal; a multiply
+ *       with a factor that held steady at a power of two gets a shift.
+ *       Anything else goes back to its general form
+ * Paramters: decoded_prog, struct spec_site*
+ * Returns: None
+ */
+static void decide(decoded_prog prog, struct spec_site *site)
+{
+        uint32_t pc = site->pc;
+        int slot = -1;
+
+        if (site->opcode == 5) {
+                if (site->votes[0] >= SPECIALISE_VOTES &&
+                    site->value[0] != 0) {
+                        slot = 0;
+                }
+        } else {
+                for (int s = 1; s >= 0; s--) {
+                        if (site->votes[s] >= SPECIALISE_VOTES &&
+                            power_of_two(site->value[s])) {
+                                slot = s;
+                        }
+                }
+        }
+        if (slot < 0) {
+                generalise(prog, site);
+                return;
+        }
+
+        uint32_t value = site->value[slot];
+
+        site->guard = slot == 0 ? prog->c[pc] : prog->b[pc];
+        site->other = slot == 0 ? prog->b[pc] : prog->c[pc];
+        site->specialised_at = site->runs;
+        if (power_of_two(value)) {
+                site->form = SPEC_SHIFT;
+                site->shift = __builtin_ctz(value);
+        } else {
+                /* Round-up reciprocal (Granlund and Montgomery): with
+                 * l = ceil(log2 value), x / value is
+                 * (t + ((x - t) >> 1)) >> (l - 1) for t = x * magic >> 32,
+                 * exactly, for every 32-bit x
+                 */
+                unsigned l = 32 - __builtin_clz(value);
+
+                site->form = SPEC_RECIPROCAL;
+                site->shift = l - 1;
+                site->magic = (((((uint64_t)1 << l) - value) << 32) / value)
+                              + 1;
+        }
+        site->value[0] = value;
+        prog->opcode[pc] = OP_SPECIALISED;
+}
+
+/* Function: specialise_profile
+ * Does: Records the operands of a profiled site about to run, and once it
+ *       has run SPECIALISE_WARMUP times decides what it becomes
+ * Paramters: decoded_prog, uint32_t (the site), const uint32_t* (registers)
+ * Returns: uint32_t (the opcode to run it as this time)
+ */
+uint32_t specialise_profile(decoded_prog prog, uint32_t index,
+                            const uint32_t *r)
+{
+        struct spec_site *site = &prog->values->sites[index];
+        uint32_t pc = site->pc;
+
+        vote(site, 0, r[prog->c[pc]]);
+        if (site->opcode == 4) {
+                vote(site, 1, r[prog->b[pc]]);
+        }
+        if (++site->runs == SPECIALISE_WARMUP) {
+                decide(prog, site);
+        }
+
+        return site->opcode;
+}
+
+/* Function: specialise_run
+ * Does: Runs a specialised site's fast path if its guard holds. A site
+ *       whose guard fails too often goes back to its general form
+ * Paramters: decoded_prog, uint32_t (the site), uint32_t* (registers)
+ * Returns: bool (false if the guard failed: run the general instruction)
+ */
+bool specialise_run(decoded_prog prog, uint32_t index, uint32_t *r)
+{
+        struct spec_site *site = &prog->values->sites[index];
+        uint32_t x = r[site->other];
+
+        site->runs++;
+        if (r[site->guard] != site->value[0]) {
+                site->misses++;
+                if (site->misses * SPECIALISE_WARMUP >
+                    (site->runs - site->specialised_at + SPECIALISE_WARMUP) *
+                    SPECIALISE_MISSES) {
+                        generalise(prog, site);
+                }
+                return false;
+        }
+
+        if (site->form == SPEC_RECIPROCAL) {
+                uint32_t t = ((uint64_t)x * site->magic) >> 32;
+
+                r[site->a] = (t + ((x - t) >> 1)) >> site->shift;
+        } else if (site->opcode == 5) {
+                r[site->a] = x >> site->shift;
+        } else {
+                r[site->a] = x << site->shift;
+        }
+        return true;
+}
+
+void specialise_free(specialise *spec)
+{
+        free((*spec)->sites);
+        free(*spec);
+        *spec = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef SPECIALISE_INCLUDED
+#define SPECIALISE_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "decode.h"
+
+/* Runs a multiply or divide site is profiled for before it is given a
+ * fast path or sent back to its general form
+ */
+#define SPECIALISE_WARMUP 256
+
+/* Votes (of SPECIALISE_WARMUP) the operand value must keep in a majority
+ * vote: at least 7 in 8 runs then used it
+ */
+#define SPECIALISE_VOTES (SPECIALISE_WARMUP * 3 / 4)
+
+/* Guard misses, per SPECIALISE_WARMUP runs since the fast path went in,
+ * after which a site goes back to its general form
+ */
+#define SPECIALISE_MISSES (SPECIALISE_WARMUP / 8)
+
+/* What a site runs now */
+typedef enum spec_form {
+        SPEC_PROFILING = 0,     /* general, recording its operands */
+        SPEC_GENERAL,           /* general: no operand was steady enough */
+        SPEC_SHIFT,             /* by a power of two: a shift */
+        SPEC_RECIPROCAL         /* by another divisor: multiply and shift */
+} spec_form;
+
+/* One multiply or divide word of segment 0. While profiling it keeps a
+ * majority vote over each operand it could be specialised on (the divisor,
+ * or either factor); once specialised, value[0] is what the guard checks
+ * register guard against, and the fast path works on register other
+ */
+struct spec_site {
+        uint32_t pc;
+        uint8_t opcode;                 /* 4 or 5 */
+        uint8_t form;
+        uint8_t a;
+        uint8_t guard;
+        uint8_t other;
+        uint8_t shift;
+        uint32_t magic;
+        uint32_t value[2];              /* candidates: register c, then b */
+        uint32_t votes[2];
+        uint64_t runs;
+        uint64_t specialised_at;        /* runs then */
+        uint64_t misses;                /* of the guard */
+};
+
+/* Every site of one decoded program. Like folds, the sites of a page that
+ * is decoded again are left behind
+ */
+typedef struct specialise {
+        struct spec_site *sites;
+        uint32_t num_sites;
+        uint32_t capacity;
+} *specialise;
+
+void specialise_assign(decoded_prog prog, uint32_t first, uint32_t count);
+uint32_t specialise_profile(decoded_prog prog, uint32_t index,
+                            const uint32_t *r);
+bool specialise_run(decoded_prog prog, uint32_t index, uint32_t *r);
+void specialise_free(specialise *spec);
+
+#endif
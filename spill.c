@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+/* Slots come in power-of-two sizes (in words), and released slots wait
+ * in one list per size for a segment of the same class.
+ */
+#define SPILL_CLASSES 33
+
+struct free_slots {
+        uint64_t *slots;
+        size_t count;
+        size_t capacity;
+};
+
+struct spill_store {
+        FILE *file;
+        int fd;
+        uint64_t end;           /* bytes handed out so far */
+        struct free_slots free[SPILL_CLASSES];
+};
+
+/* The class whose slots hold num_words: the smallest power of two no
+ * smaller than it
+ */
+static unsigned class_of(uint32_t num_words)
+{
+        unsigned class = 0;
+
+        while (((uint64_t)1 << class) < num_words) {
+                class++;
+        }
+        return class;
+}
+
+/* Function: spill_new
+ * Does: Opens an empty store in the temporary directory. The file has no
+ *       name, so it goes away with the process
+ * Paramters: None
+ * Returns: spill_store
+ */
+spill_store spill_new()
+{
+        spill_store store = calloc(1, sizeof(*store));
+
+        store->file = tmpfile();
+        if (store->file == NULL) {
+                fprintf(stderr, "Error: Could not create spill file\n");
+                exit(EXIT_FAILURE);
+        }
+        store->fd = fileno(store->file);
+
+        return store;
+}
+
+void spill_free(spill_store *store)
+{
+        for (unsigned i = 0; i < SPILL_CLASSES; i++) {
+                free((*store)->free[i].slots);
+        }
+        fclose((*store)->file);
+        free(*store);
+        *store = NULL;
+}
+
+/* Function: spill_alloc
+ * Does: Finds room for a segment: a released slot of its class if there
+ *       is one, or else a new one at the end of the file
+ * Paramters: spill_store, uint32_t
+ * Returns: uint64_t (the slot's offset)
+ */
+uint64_t spill_alloc(spill_store store, uint32_t num_words)
+{
+        unsigned class = class_of(num_words);
+        struct free_slots *list = &store->free[class];
+
+        if (list->count > 0) {
+                return list->slots[--list->count];
+        }
+
+        uint64_t slot = store->end;
+        store->end += ((uint64_t)1 << class) * sizeof(uint32_t);
+        return slot;
+}
+
+/* Function: spill_release
+ * Does: Gives a segment's slot back for reuse
+ * Paramters: spill_store, uint64_t, uint32_t
+ * Returns: None
+ */
+void spill_release(spill_store store, uint64_t slot, uint32_t num_words)
+{
+        struct free_slots *list = &store->free[class_of(num_words)];
+
+        if (list->count == list->capacity) {
+                list->capacity = list->capacity == 0 ? 64
+                                                     : 2 * list->capacity;
+                list->slots = realloc(list->slots,
+                                      list->capacity * sizeof(uint64_t));
+        }
+        list->slots[list->count++] = slot;
+}
+
+/* pwrite and pread may move fewer bytes than asked, or be interrupted
+ * before moving any; these go on until all have moved
+ */
+static bool write_all(int fd, const void *data, size_t bytes, off_t offset)
+{
+        const uint8_t *next = data;
+
+        while (bytes > 0) {
+                ssize_t done = pwrite(fd, next, bytes, offset);
+
+                if (done < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (done <= 0) {
+                        return false;
+                }
+                next += done;
+                bytes -= done;
+                offset += done;
+        }
+        return true;
+}
+
+static bool read_all(int fd, void *data, size_t bytes, off_t offset)
+{
+        uint8_t *next = data;
+
+        while (bytes > 0) {
+                ssize_t done = pread(fd, next, bytes, offset);
+
+                if (done < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (done <= 0) {
+                        return false;
+                }
+                next += done;
+                bytes -= done;
+                offset += done;
+        }
+        return true;
+}
+
+void spill_write(spill_store store, uint64_t slot, const uint32_t *words,
+                 uint32_t num_words)
+{
+        size_t bytes = (size_t)num_words * sizeof(uint32_t);
+
+        if (!write_all(store->fd, words, bytes, slot)) {
+                fprintf(stderr, "Error: Could not spill segment\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+void spill_read(spill_store store, uint64_t slot, uint32_t *words,
+                uint32_t num_words)
+{
+        size_t bytes = (size_t)num_words * sizeof(uint32_t);
+
+        if (!read_all(store->fd, words, bytes, slot)) {
+                fprintf(stderr, "Error: Could not read spilled segment\n");
+                exit(EXIT_FAILURE);
+        }
+}
@@ -0,0 +1,21 @@
+#ifndef SPILL_INCLUDED
+#define SPILL_INCLUDED
+#include <stdint.h>
+
+/* Where spilled segments go: an unlinked temporary file, carved into
+ * slots. A segment keeps its slot until it is unmapped, so spilling it
+ * again rewrites the same place.
+ */
+typedef struct spill_store *spill_store;
+
+spill_store spill_new();
+void spill_free(spill_store *store);
+
+uint64_t spill_alloc(spill_store store, uint32_t num_words);
+void spill_release(spill_store store, uint64_t slot, uint32_t num_words);
+void spill_write(spill_store store, uint64_t slot, const uint32_t *words,
+                 uint32_t num_words);
+void spill_read(spill_store store, uint64_t slot, uint32_t *words,
+                uint32_t num_words);
+
+#endif
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "threads.h"
+#include "vm_interface.h"
+#include "mem_interface.h"
+#include "ops_interface.h"
+#include "write_barrier.h"
+#include "epoch.h"
+#include "trap.h"
+
+/* A thread other than the first, and the pthread running it */
+struct um_thread {
+        um_vm vm;
+        pthread_t thread;
+        bool done;                      /* halted or faulted */
+        vm_status status;
+};
+
+struct um_threads {
+        pthread_mutex_t lock;
+        pthread_cond_t finished;        /* a thread is done, or stopping */
+        struct um_thread *threads[THREADS_MAX];  /* NULL if free or 0 */
+        bool stopping;                  /* a thread faulted */
+        um_vm faulted;                  /* the first, kept for its report */
+        uint64_t spawned;
+        uint64_t instructions;          /* of the threads gone */
+};
+
+static um_threads threads_new()
+{
+        um_threads threads = calloc(1, sizeof(*threads));
+
+        if (threads == NULL) {
+                fprintf(stderr, "Error: Could not allocate threads\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&threads->lock, NULL);
+        pthread_cond_init(&threads->finished, NULL);
+        return threads;
+}
+
+/* Runs one thread to the end on its own pthread */
+static void *run_thread(void *cl)
+{
+        struct um_thread *thread = cl;
+        um_vm vm = thread->vm;
+        um_threads threads = vm->threads;
+
+        epoch_quiesce(vm->mem->epochs, vm->thread_id);
+
+        vm_status status = vm_run(vm);
+
+        epoch_leave(vm->mem->epochs, vm->thread_id);
+        pthread_mutex_lock(&threads->lock);
+        thread->status = status;
+        thread->done = true;
+        pthread_cond_broadcast(&threads->finished);
+        pthread_mutex_unlock(&threads->lock);
+        return NULL;
+}
+
+/* Function: spawn
+ * Does: Starts a thread at pc with a copy of the registers, after rA is
+ *       set to its identifier. The first spawn gives the UM its threads,
+ *       shares its memory and freezes segment 0
+ * Paramters: um_vm, unsigned (A), uint32_t
+ * Returns: None
+ */
+static void spawn(um_vm vm, unsigned a, uint32_t pc)
+{
+        if (pc >= seg_length(vm->mem, 0)) {
+                trap_raise(TRAP_PC_OUT_OF_BOUNDS);
+        }
+        if (vm->threads == NULL) {
+                vm->threads = threads_new();
+                mem_share(vm->mem, THREADS_MAX);
+                epoch_enter(vm->mem->epochs, 0);
+                epoch_quiesce(vm->mem->epochs, 0);
+                wb_freeze();
+        }
+
+        um_threads threads = vm->threads;
+        uint32_t id = 1;
+
+        pthread_mutex_lock(&threads->lock);
+        while (id < THREADS_MAX && threads->threads[id] != NULL) {
+                id++;
+        }
+        if (id == THREADS_MAX) {
+                pthread_mutex_unlock(&threads->lock);
+                trap_raise(TRAP_TOO_MANY_THREADS);
+        }
+
+        struct um_thread *thread = malloc(sizeof(*thread));
+
+        if (thread == NULL) {
+                fprintf(stderr, "Error: Could not allocate a thread\n");
+                exit(EXIT_FAILURE);
+        }
+        update_reg(vm->registers, a, id);
+        thread->vm = vm_thread(vm, id, pc);
+        thread->done = false;
+        threads->threads[id] = thread;
+        threads->spawned++;
+        epoch_enter(vm->mem->epochs, id);
+        if (pthread_create(&thread->thread, NULL, run_thread, thread) != 0) {
+                fprintf(stderr, "Error: Could not start a thread\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&threads->lock);
+}
+
+/* Function: join
+ * Does: Waits for a thread to halt and frees it, leaving the epochs while
+ *       it waits. Traps if there is no such thread (a thread joining
+ *       itself would wait forever), or if the UM is stopping because a
+ *       thread faulted
+ * Paramters: um_vm, uint32_t
+ * Returns: uint32_t (the thread's r0)
+ */
+static uint32_t join(um_vm vm, uint32_t id)
+{
+        um_threads threads = vm->threads;
+        struct um_thread *thread;
+
+        if (threads == NULL || id == 0 || id >= THREADS_MAX ||
+            id == vm->thread_id) {
+                trap_raise(TRAP_NO_THREAD);
+        }
+
+        epoch_leave(vm->mem->epochs, vm->thread_id);
+        pthread_mutex_lock(&threads->lock);
+        while ((thread = threads->threads[id]) != NULL && !thread->done &&
+               !threads->stopping) {
+                pthread_cond_wait(&threads->finished, &threads->lock);
+        }
+
+        trap_cause cause = thread == NULL ? TRAP_NO_THREAD
+                         : threads->stopping ? TRAP_THREAD : TRAP_NONE;
+
+        if (cause == TRAP_NONE) {
+                threads->threads[id] = NULL;
+                threads->instructions += thread->vm->instructions;
+        }
+        pthread_mutex_unlock(&threads->lock);
+        epoch_enter(vm->mem->epochs, vm->thread_id);
+        if (cause != TRAP_NONE) {
+                trap_raise(cause);
+        }
+
+        uint32_t result = at_reg(thread->vm->registers, 0);
+
+        pthread_join(thread->thread, NULL);
+        vm_free(&thread->vm);
+        free(thread);
+        return result;
+}
+
+/* Function: threads_extension
+ * Does: Performs an EXT_SPAWN, EXT_JOIN or EXT_CAS instruction (see
+ *       ops_interface.h), if the UM allows them
+ * Paramters: um_vm, uint32_t
+ * Returns: bool (false if the word is none of them)
+ */
+bool threads_extension(um_vm vm, uint32_t word)
+{
+        UArray_T registers = vm->registers;
+        unsigned a = (word >> 6) & 0x7;
+        uint32_t b = at_reg(registers, (word >> 3) & 0x7);
+
+        if (!vm->threaded || word >> 28 != EXT_MEMORY) {
+                return false;
+        }
+
+        switch ((word >> 15) & 0x7) {
+                case EXT_SPAWN :
+                        spawn(vm, a, b);
+                        return true;
+                case EXT_JOIN :
+                        update_reg(registers, a, join(vm, b));
+                        return true;
+                case EXT_CAS :
+                        update_reg(registers, a, mem_compare_swap(vm->mem, b,
+                                   at_reg(registers, word & 0x7),
+                                   at_reg(registers, (word >> 9) & 0x7),
+                                   at_reg(registers, (word >> 12) & 0x7)));
+                        return true;
+                default :
+                        return false;
+        }
+}
+
+/* Function: threads_quiesce
+ * Does: Called by each thread between slices: passes a quiescent point,
+ *       and notes a fault of its own or stops it if another's is noted
+ * Paramters: um_vm, vm_status (why the slice ended)
+ * Returns: vm_status (VM_FAULTED with TRAP_THREAD if it must stop)
+ */
+vm_status threads_quiesce(um_vm vm, vm_status status)
+{
+        um_threads threads = vm->threads;
+
+        epoch_quiesce(vm->mem->epochs, vm->thread_id);
+        if (status == VM_FAULTED && vm->trap != TRAP_THREAD) {
+                pthread_mutex_lock(&threads->lock);
+                if (!threads->stopping) {
+                        threads->stopping = true;
+                        threads->faulted = vm;
+                }
+                pthread_cond_broadcast(&threads->finished);
+                pthread_mutex_unlock(&threads->lock);
+        } else if (status != VM_HALTED && status != VM_FAULTED &&
+                   __atomic_load_n(&threads->stopping, __ATOMIC_RELAXED)) {
+                vm->trap = TRAP_THREAD;
+                status = VM_FAULTED;
+        }
+        return status;
+}
+
+/* Function: threads_finish
+ * Does: Called by the first thread once it has halted or faulted: waits
+ *       for every other thread, frees them (but one that faulted) and
+ *       says how the UM as a whole ended
+ * Paramters: um_vm, vm_status (how the first thread ended)
+ * Returns: vm_status (VM_FAULTED with TRAP_THREAD if only another
+ *          thread faulted)
+ */
+vm_status threads_finish(um_vm vm, vm_status status)
+{
+        um_threads threads = vm->threads;
+
+        epoch_leave(vm->mem->epochs, 0);
+        pthread_mutex_lock(&threads->lock);
+        for (uint32_t id = 1; id < THREADS_MAX; id++) {
+                while (threads->threads[id] != NULL &&
+                       !threads->threads[id]->done) {
+                        pthread_cond_wait(&threads->finished, &threads->lock);
+                }
+        }
+        pthread_mutex_unlock(&threads->lock);
+
+        for (uint32_t id = 1; id < THREADS_MAX; id++) {
+                struct um_thread *thread = threads->threads[id];
+
+                if (thread == NULL) {
+                        continue;
+                }
+                pthread_join(thread->thread, NULL);
+                threads->instructions += thread->vm->instructions;
+                if (thread->vm != threads->faulted) {
+                        vm_free(&thread->vm);
+                        free(thread);
+                        threads->threads[id] = NULL;
+                }
+        }
+
+        if (status == VM_HALTED && threads->faulted != NULL) {
+                vm->trap = TRAP_THREAD;
+                status = VM_FAULTED;
+        }
+        return status;
+}
+
+/* Function: threads_faulted
+ * Does: Gives the thread whose fault stopped the others, if any
+ * Paramters: um_threads
+ * Returns: um_vm (NULL if none faulted)
+ */
+um_vm threads_faulted(um_threads threads)
+{
+        return threads->faulted;
+}
+
+/* Function: threads_counts
+ * Does: Gives how many threads were spawned and how many instructions
+ *       those that have ended ran between them
+ * Paramters: um_threads, uint64_t*, uint64_t*
+ * Returns: None
+ */
+void threads_counts(um_threads threads, uint64_t *spawned,
+                    uint64_t *instructions)
+{
+        *spawned = threads->spawned;
+        *instructions = threads->instructions;
+}
+
+/* Function: threads_free
+ * Does: Frees the threads of a UM, once they have all ended
+ * Paramters: um_threads*
+ * Returns: None
+ */
+void threads_free(um_threads *threads)
+{
+        for (uint32_t id = 1; id < THREADS_MAX; id++) {
+                struct um_thread *thread = (*threads)->threads[id];
+
+                if (thread != NULL) {
+                        vm_free(&thread->vm);
+                        free(thread);
+                }
+        }
+        pthread_mutex_destroy(&(*threads)->lock);
+        pthread_cond_destroy(&(*threads)->finished);
+        free(*threads);
+        *threads = NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef THREADS_INCLUDED
+#define THREADS_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vm_interface.h"
+
+/* Most threads a UM may have at once, its first included */
+#define THREADS_MAX 64
+
+/* Instructions a thread of a UM with threads runs between quiescent
+ * points (epoch.h), which is also how soon it stops once another faults
+ */
+#define THREADS_SLICE (1 << 20)
+
+/* The threads of one UM, created by its first EXT_SPAWN (ops_interface.h).
+ * Each thread is a um_vm of its own, on a pthread of its own, running its
+ * own decoded copy of segment 0 on the memory and I/O device of the first
+ * (identifier 0), which owns them. Identifiers go from 1 and are reused
+ * once joined.
+ *
+ * Once a UM has threads, segment 0 no longer changes: a store into it or
+ * a load_program of another segment traps, since the other copies would
+ * not see it. Loads and stores of other threads' words are only ordered
+ * by EXT_CAS. A UM ends when its first thread halts and every other one
+ * has; a fault in any thread stops them all, and is the UM's fault.
+ */
+typedef struct um_threads *um_threads;
+
+bool threads_extension(um_vm vm, uint32_t word);
+vm_status threads_quiesce(um_vm vm, vm_status status);
+vm_status threads_finish(um_vm vm, vm_status status);
+um_vm threads_faulted(um_threads threads);
+void threads_counts(um_threads threads, uint64_t *spawned,
+                    uint64_t *instructions);
+void threads_free(um_threads *threads);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "trap.h"
+
+/* The innermost frame of this thread */
+static __thread struct trap_frame *current = NULL;
+
+static const char *messages[] = {
+        "No fault",
+        "Invalid Instruction",
+        "Segment is not mapped",
+        "Segment offset out of bounds",
+        "Division by zero",
+        "Cannot unmap segment 0",
+        "Program counter out of bounds",
+        "No such thread to join",
+        "Too many threads",
+        "Segment 0 cannot change once a UM has threads",
+        "Another thread faulted",
+        "Memory limit exceeded"
+};
+
+/* Function: trap_push
+ * Does: Makes a frame, whose env has just been set by sigsetjmp (saving
+ *       the signal mask), the one faults on this thread land in
+ * Paramters: struct trap_frame*
+ * Returns: None
+ */
+void trap_push(struct trap_frame *frame)
+{
+        frame->prev = current;
+        current = frame;
+}
+
+/* Function: trap_pop
+ * Does: Removes the innermost frame, after a run that did not fault
+ * Paramters: struct trap_frame*
+ * Returns: None
+ */
+void trap_pop(struct trap_frame *frame)
+{
+        current = frame->prev;
+}
+
+/* Function: trap_raise
+ * Does: Unwinds to the innermost frame, which is popped, with the cause.
+ *       With no frame (a fault outside any run) the cause is printed and
+ *       the process fails. Safe to call from a signal handler that
+ *       interrupted the run
+ * Paramters: trap_cause
+ * Returns: Never
+ */
+void trap_raise(trap_cause cause)
+{
+        struct trap_frame *frame = current;
+
+        if (frame == NULL) {
+                fprintf(stderr, "Error: %s\n", trap_message(cause));
+                exit(EXIT_FAILURE);
+        }
+        current = frame->prev;
+        siglongjmp(frame->env, cause);
+}
+
+/* Function: trap_message
+ * Does: Describes a cause
+ * Paramters: trap_cause
+ * Returns: const char*
+ */
+const char *trap_message(trap_cause cause)
+{
+        if ((unsigned)cause >= sizeof(messages) / sizeof(messages[0])) {
+                return "Unknown fault";
+        }
+        return messages[cause];
+}
@@ -0,0 +1,35 @@
+#ifndef TRAP_INCLUDED
+#define TRAP_INCLUDED
+#include <setjmp.h>
+
+/* Why a UM faulted */
+typedef enum trap_cause {
+        TRAP_NONE = 0,
+        TRAP_BAD_OPCODE,                /* 14 or 15 without --ext */
+        TRAP_UNMAPPED,                  /* no segment with that identifier */
+        TRAP_OUT_OF_BOUNDS,             /* offset past a segment's end */
+        TRAP_DIVIDE_BY_ZERO,
+        TRAP_UNMAP_ZERO,                /* unmapping segment 0 */
+        TRAP_PC_OUT_OF_BOUNDS,          /* a jump past segment 0's end */
+        TRAP_NO_THREAD,                 /* joining no thread it can */
+        TRAP_TOO_MANY_THREADS,          /* spawning past THREADS_MAX */
+        TRAP_SHARED_CODE,               /* changing segment 0 with threads */
+        TRAP_THREAD,                    /* stopped: another thread faulted */
+        TRAP_MEMORY_LIMIT               /* mapping past mem_set_limit */
+} trap_cause;
+
+/* Where a fault on this thread lands. The engines push one around each
+ * run; trap_raise, from anywhere below, unwinds to the innermost with the
+ * cause as sigsetjmp's value. Frames nest
+ */
+struct trap_frame {
+        sigjmp_buf env;
+        struct trap_frame *prev;
+};
+
+void trap_push(struct trap_frame *frame);
+void trap_pop(struct trap_frame *frame);
+void trap_raise(trap_cause cause) __attribute__((noreturn));
+const char *trap_message(trap_cause cause);
+
+#endif
@@ -2,136 +2,533 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
 #include <seq.h>
 #include <uarray.h>
 #include <except.h>
 #include <bitpack.h>
 
-#include "io_dev.h"
-#include "mem_interface.h"
-#include "ops_interface.h"
+#include "vm_interface.h"
+#include "profile.h"
+#include "diff_engine.h"
+#include "image.h"
+#include "metrics.h"
+#include "options.h"
 
-void run_prog(Seq_T mem, Seq_T unmapped_seq, UArray_T registers, 
-              uint32_t *prog_count);
+static void usage(const char *progname)
+{
+        fprintf(stderr, "Usage: %s [--profile] [--mem-quota BYTES[K|M|G]] "
+                        "[--metrics FILE [--metrics-interval MS]]\n"
+                        "          [--access-map [--cache-sim]] "
+                        "[--latency-stats] [--call-graph FILE]\n"
+                        "          [--ext] [--threads] [--reclaim] "
+                        "[--guard-pages] [--async-io]\n"
+                        "          [--arena] [--arena-profile FILE] "
+                        "[--arena-record FILE]\n"
+                        "          [--diff-engines [--diff-every K]] "
+                        "file.um|file.umx\n"
+                        "       %s [options] --pipeline file.um|file.umx ...\n"
+                        "       %s --compile-image file.um [file.umx]\n",
+                progname, progname, progname);
+        exit(EXIT_FAILURE);
+}
 
-int main(int argc, char *argv[]) {
-        if (argc == 1) {
-                fprintf(stdout, "Error: A UM file not provided\n");
-                exit(EXIT_FAILURE);
+/* Reads all of a stream into memory */
+static char *read_all(FILE *fp, size_t *length)
+{
+        size_t capacity = 4096;
+        char *bytes = malloc(capacity);
+        size_t got;
+
+        *length = 0;
+        while ((got = fread(bytes + *length, 1, capacity - *length, fp)) > 0) {
+                *length += got;
+                if (*length == capacity) {
+                        capacity *= 2;
+                        bytes = realloc(bytes, capacity);
+                }
+        }
+        return bytes;
+}
+
+/* Function: compile_image
+ * Does: Writes the .umx image of a .um file, by default beside it
+ * Paramters: const char*, const char* (NULL for the default)
+ * Returns: int (exit status)
+ */
+static int compile_image(const char *source, const char *image)
+{
+        char *path = NULL;
+
+        if (image == NULL) {
+                size_t length = strlen(source);
+
+                path = malloc(length + 5);
+                strcpy(path, source);
+                if (length > 3 && strcmp(source + length - 3, ".um") == 0) {
+                        strcat(path, "x");
+                } else {
+                        strcat(path, ".umx");
+                }
+                image = path;
+        }
+
+        bool written = image_compile(source, image);
+
+        free(path);
+        return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Function: run_diff
+ * Does: Runs the program on the reference and fast engines in lockstep
+ *       with all of standard input, printing the reference output
+ * Paramters: FILE*, uint64_t, bool
+ * Returns: int (exit status)
+ */
+static int run_diff(FILE *fp, uint64_t interval, bool ext)
+{
+        size_t input_length;
+        char *input = read_all(stdin, &input_length);
+        bool agree = diff_engines(fp, input, input_length, interval, ext,
+                                  stdout, stderr);
+
+        free(input);
+        return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* What to do besides running a UM */
+struct run_options {
+        bool profile;
+        bool ext;
+        bool access_map;
+        bool cache_sim;
+        bool reclaim;
+        bool guard_pages;
+        bool async_io;
+        bool latency;
+        bool threads;                   /* implies ext */
+        bool arena;
+        const char *call_graph;         /* file for the folded stacks */
+        const char *arena_profile;      /* implies arena */
+        const char *arena_record;       /* file for the uses */
+        uint64_t quota;
+};
+
+/* Writes a UM's folded stacks to path and a summary to stderr */
+static void report_call_graph(um_vm vm, const char *path)
+{
+        FILE *folded = fopen(path, "w");
+
+        if (folded == NULL) {
+                fprintf(stderr, "Error: Could not open %s for writing\n",
+                        path);
+        }
+        callgraph_report(folded, stderr, vm->calls, vm->instructions);
+        if (folded != NULL) {
+                fclose(folded);
+        }
+        callgraph_free(&vm->calls);
+}
+
+/* Function: open_um
+ * Does: Creates a UM running a program file, with the given files for
+ *       input and output. A current .umx image runs as it is; any other
+ *       falls back to the .um it came from. Exits if there is no program
+ *       to read
+ * Paramters: const char* (this program's name), const char*, FILE*, FILE*
+ * Returns: um_vm
+ */
+static um_vm open_um(const char *progname, const char *path, FILE *in,
+                     FILE *out)
+{
+        char *fallback = NULL;
+        um_vm vm = image_open(path, in, out, &fallback);
+
+        if (vm != NULL) {
+                return vm;
+        }
+        if (fallback != NULL) {
+                fprintf(stderr, "%s: %s is out of date or unusable, "
+                        "running %s\n", progname, path, fallback);
         }
 
-        FILE *fp;
-        fp = fopen(argv[1], "r");
+        const char *source = fallback != NULL ? fallback : path;
+        FILE *fp = fopen(source, "r");
 
         /* Checks if the file is read */
         if (fp == NULL) {
                 fprintf(stderr, "%s: %s %s %s\n",
-                        argv[0], "Could not open file ",
-                        argv[1], "for reading");
+                        progname, "Could not open file ", source,
+                        "for reading");
                 exit(EXIT_FAILURE);
         }
 
-        /* Main UM components */
-        Seq_T mem;
-        Seq_T unmapped_seq;
-        UArray_T registers;
-        uint32_t prog_count = 0;
-
         /* Initializes main UM components */
-        registers = initialize_regs();
-        unmapped_seq = init_unmapped_seq();
-        mem = init_mem();
-        init_prog(mem, fp);
+        vm = vm_new(fp, in, out);
+        fclose(fp);
+        free(fallback);
+        return vm;
+}
 
-        /* Runs the UM */
-        run_prog(mem, unmapped_seq, registers, &prog_count);
+/* Reads an arena profile from path, or exits if it cannot */
+static arena_profile read_profile(const char *path)
+{
+        FILE *in = fopen(path, "r");
+        arena_profile profile = in == NULL ? NULL : arena_profile_read(in);
 
-        /* Frees memory */
-        fclose(fp);
-        free_mem(mem);
-        free_unmapped_seq(unmapped_seq);
-        free_regs(registers);
+        if (in != NULL) {
+                fclose(in);
+        }
+        if (profile == NULL) {
+                fprintf(stderr, "Error: Could not read an arena profile "
+                        "from %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        return profile;
+}
+
+/* Writes the uses a UM recorded to path, as an arena profile */
+static void write_uses(um_vm vm, const char *path)
+{
+        FILE *out = fopen(path, "w");
+
+        if (out == NULL) {
+                fprintf(stderr, "Error: Could not open %s for writing\n",
+                        path);
+                return;
+        }
+        mem_write_uses(vm->mem, out);
+        fclose(out);
+}
+
+/* Sets a UM up as the options ask */
+static void prepare(um_vm vm, struct run_options *options)
+{
+        vm->ext = options->ext;
+        vm->threaded = options->threads;
+        vm->mem->count_caches = options->profile;
+        if (options->access_map) {
+                vm->access = access_map_new(options->cache_sim);
+        }
+        if (options->latency) {
+                vm->latency = latency_new();
+        }
+        if (options->call_graph != NULL) {
+                vm->calls = callgraph_new();
+        }
+        mem_set_quota(vm->mem, options->quota);
+        if (options->reclaim) {
+                mem_start_reclaim(vm->mem);
+        }
+        if (options->guard_pages) {
+                mem_use_guard_pages(vm->mem);
+        }
+        if (options->arena) {
+                mem_use_arena(vm->mem, options->arena_profile == NULL ? NULL
+                              : read_profile(options->arena_profile));
+        }
+        if (options->arena_record != NULL) {
+                mem_record_uses(vm->mem);
+        }
+        if (options->async_io) {
+                io_start_async(vm->io);
+        }
+}
+
+/* Says whether any report was asked for */
+static bool reports(struct run_options *options)
+{
+        return options->profile || options->access_map || options->latency ||
+               options->call_graph != NULL;
+}
+
+/* Reports on a UM that has stopped, if asked to, and frees it */
+static void report_and_free(um_vm vm, struct run_options *options)
+{
+        if (options->profile || vm->access != NULL ||
+            vm->latency != NULL || vm->calls != NULL) {
+                io_flush(vm->io);
+        }
+        if (options->profile) {
+                profile_report(stderr, vm);
+        }
+        if (vm->access != NULL) {
+                access_report(stderr, vm->access);
+                access_map_free(&vm->access);
+        }
+        if (vm->latency != NULL) {
+                latency_report(stderr, vm->latency, vm->instructions);
+                latency_free(&vm->latency);
+        }
+        if (vm->calls != NULL) {
+                report_call_graph(vm, options->call_graph);
+        }
+        if (vm->mem->trace != NULL) {
+                write_uses(vm, options->arena_record);
+        }
+        vm_free(&vm);
+}
+
+/* Runs a UM to the end, reports on it if asked and frees it, and gives
+ * the exit status (failure if it faulted). The last metrics sample is
+ * written however it ended
+ */
+static int run_and_free(um_vm vm, struct run_options *options, metrics m,
+                        const char *name)
+{
+        prepare(vm, options);
+        if (m != NULL) {
+                metrics_watch(m, vm, name);
+        }
+
+        vm_status status = vm_run(vm);
+
+        if (m != NULL) {
+                metrics_stop(&m);
+        }
+        if (status == VM_FAULTED) {
+                vm_report_trap(stderr, vm);
+        }
+        report_and_free(vm, options);
+        return status == VM_FAULTED ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* One UM of a pipeline and the thread running it */
+struct stage {
+        um_vm vm;
+        const char *name;
+        int number;                     /* from 1 */
+        pthread_t thread;
+        vm_status status;
+};
+
+/* Keeps the reports of stages faulting at once apart */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Runs one stage to the end on its own thread, then closes its pipes */
+static void *run_stage(void *cl)
+{
+        struct stage *stage = cl;
 
-        exit(EXIT_SUCCESS);
+        stage->status = vm_run(stage->vm);
+        if (stage->status == VM_FAULTED) {
+                pthread_mutex_lock(&report_lock);
+                fprintf(stderr, "Stage %d (%s):\n", stage->number,
+                        stage->name);
+                vm_report_trap(stderr, stage->vm);
+                pthread_mutex_unlock(&report_lock);
+        }
+        io_disconnect(stage->vm->io);
+        return NULL;
 }
 
-/* Function: run_program
- * Does: Runs all instructions
- * Paramters: Seq_T, Seq_T, UArray_T, uint32_t*
- * Returns: none
+/* Function: run_pipeline
+ * Does: Runs count UMs at once, each on its own thread, as a shell
+ *       pipeline would run them: each one's output is the next one's
+ *       input, through an io_pipe, with the first reading standard input
+ *       and the last writing standard output. A UM that halts or faults
+ *       closes its pipes, so the next one reads end of file and the one
+ *       before has the rest of its output dropped. Reports follow, stage
+ *       by stage
+ * Paramters: const char*, char** (the program files), int,
+ *            struct run_options*, metrics
+ * Returns: int (exit status: failure if any UM faulted)
  */
-void run_prog(Seq_T mem, Seq_T unmapped_seq, UArray_T registers, 
-              uint32_t *prog_count) {
-        bool exit_condition = false;
+static int run_pipeline(const char *progname, char **paths, int count,
+                        struct run_options *options, metrics m)
+{
+        struct stage *stages = calloc(count, sizeof(*stages));
+        io_pipe *pipes = calloc(count, sizeof(*pipes));
+        int status = EXIT_SUCCESS;
+
+        if (stages == NULL || pipes == NULL) {
+                fprintf(stderr, "Error: Could not allocate pipeline\n");
+                exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i + 1 < count; i++) {
+                pipes[i] = io_pipe_new();
+        }
+        for (int i = 0; i < count; i++) {
+                struct stage *stage = &stages[i];
+
+                stage->vm = open_um(progname, paths[i], stdin, stdout);
+                stage->name = paths[i];
+                stage->number = i + 1;
+                io_connect(stage->vm->io, i > 0 ? pipes[i - 1] : NULL,
+                           i + 1 < count ? pipes[i] : NULL);
+                prepare(stage->vm, options);
+                if (m != NULL) {
+                        metrics_watch(m, stage->vm, stage->name);
+                }
+        }
+        for (int i = 0; i < count; i++) {
+                if (pthread_create(&stages[i].thread, NULL, run_stage,
+                                   &stages[i]) != 0) {
+                        fprintf(stderr, "Error: Could not start stage %d\n",
+                                i + 1);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        for (int i = 0; i < count; i++) {
+                pthread_join(stages[i].thread, NULL);
+        }
+        if (m != NULL) {
+                metrics_stop(&m);
+        }
+
+        for (int i = 0; i < count; i++) {
+                if (stages[i].status == VM_FAULTED) {
+                        status = EXIT_FAILURE;
+                }
+                if (reports(options)) {
+                        fprintf(stderr, "Stage %d (%s):\n", i + 1,
+                                paths[i]);
+                }
+                report_and_free(stages[i].vm, options);
+        }
+        for (int i = 0; i + 1 < count; i++) {
+                io_pipe_free(&pipes[i]);
+        }
+        free(stages);
+        free(pipes);
+        return status;
+}
+
+int main(int argc, char *argv[]) {
+        struct run_options options = { false, false, false, false, false,
+                                       false, false, false, false, false,
+                                       NULL, NULL, NULL, 0 };
+        bool diff = false;
+        bool compile = false;
+        bool pipeline = false;
+        const char *metrics_path = NULL;
+        unsigned metrics_interval = METRICS_INTERVAL;
+        uint64_t diff_interval = DIFF_INTERVAL;
+        int arg = 1;
+
+        /* Options come before the UM file */
+        for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+                if (strcmp(argv[arg], "--profile") == 0) {
+                        options.profile = true;
+                } else if (strcmp(argv[arg], "--mem-quota") == 0 &&
+                           arg + 1 < argc) {
+                        options.quota = parse_bytes(argv[++arg]);
+                        if (options.quota == 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[arg], "--ext") == 0) {
+                        options.ext = true;
+                } else if (strcmp(argv[arg], "--threads") == 0) {
+                        options.threads = true;
+                        options.ext = true;
+                } else if (strcmp(argv[arg], "--arena") == 0) {
+                        options.arena = true;
+                } else if (strcmp(argv[arg], "--arena-profile") == 0 &&
+                           arg + 1 < argc) {
+                        options.arena_profile = argv[++arg];
+                        options.arena = true;
+                } else if (strcmp(argv[arg], "--arena-record") == 0 &&
+                           arg + 1 < argc) {
+                        options.arena_record = argv[++arg];
+                } else if (strcmp(argv[arg], "--reclaim") == 0) {
+                        options.reclaim = true;
+                } else if (strcmp(argv[arg], "--guard-pages") == 0) {
+                        options.guard_pages = true;
+                } else if (strcmp(argv[arg], "--async-io") == 0) {
+                        options.async_io = true;
+                } else if (strcmp(argv[arg], "--latency-stats") == 0) {
+                        options.latency = true;
+                } else if (strcmp(argv[arg], "--call-graph") == 0 &&
+                           arg + 1 < argc) {
+                        options.call_graph = argv[++arg];
+                } else if (strcmp(argv[arg], "--access-map") == 0) {
+                        options.access_map = true;
+                } else if (strcmp(argv[arg], "--cache-sim") == 0) {
+                        options.cache_sim = true;
+                } else if (strcmp(argv[arg], "--compile-image") == 0) {
+                        compile = true;
+                } else if (strcmp(argv[arg], "--pipeline") == 0) {
+                        pipeline = true;
+                } else if (strcmp(argv[arg], "--metrics") == 0 &&
+                           arg + 1 < argc) {
+                        metrics_path = argv[++arg];
+                } else if (strcmp(argv[arg], "--metrics-interval") == 0 &&
+                           arg + 1 < argc) {
+                        metrics_interval = strtoul(argv[++arg], NULL, 10);
+                        if (metrics_interval == 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[arg], "--diff-engines") == 0) {
+                        diff = true;
+                } else if (strcmp(argv[arg], "--diff-every") == 0 &&
+                           arg + 1 < argc) {
+                        diff_interval = strtoull(argv[++arg], NULL, 10);
+                        if (diff_interval == 0) {
+                                usage(argv[0]);
+                        }
+                } else {
+                        usage(argv[0]);
+                }
+        }
+
+        if (arg == argc) {
+                fprintf(stdout, "Error: A UM file not provided\n");
+                exit(EXIT_FAILURE);
+        }
 
-        /* Keeps running until the program counter points to the last 
-         * instruction 
+        /* Diffing and compiling take one program, and the stages' call
+         * graphs and uses would all go to one file, or come from one
          */
-        while (!exit_condition) {
-                uint32_t instruction = get_word(mem, 0, *prog_count);
-                uint32_t opcode;
-                unsigned a, b, c, lvalue;
-                decode_word(instruction, &opcode, &a, &b, &c, &lvalue);
-
-                *prog_count = *prog_count + 1; 
-
-                /* Executes the specified instruction */
-                switch (opcode) {
-                        case 0 :
-                                conditional_move(registers, a, b, c);
-                                break;
-                        case 1 :
-                                segmented_load(registers, mem, a, b, c);
-                                break;
-                        case 2 :
-                                segmented_store(registers, mem, a, b, c);
-                                break;
-                        case 3 :
-                                addition(registers, a, b, c);
-                                break;
-                        case 4 :
-                                multiplication(registers, a, b, c);
-                                break;
-                        case 5 :
-                                division(registers, a, b, c);
-                                break;
-                        case 6 :
-                                bitwise_NAND(registers, a, b, c);
-                                break;
-                        case 7 :
-                                halt(mem, prog_count);
-                                break;
-                        case 8 :
-                                map_segment(registers, mem, unmapped_seq, b, c);
-                                break;
-                        case 9 :
-                                unmap_segment(registers, mem, unmapped_seq, c);
-                                break;
-                        case 10 :
-                                output(registers, c);
-                                break;
-                        case 11 :
-                                input(registers, c);
-                                break;
-                        case 12 :
-                                load_program(mem, registers, prog_count, b, c);
-                                break;
-                        case 13 :
-                                load_value(registers, a, lvalue);
-                                break;
-                        default:
-                                fprintf(stderr, "Error: Invalid Instruction\n");
-                                exit(EXIT_FAILURE);
+        if (pipeline && (diff || compile || options.call_graph != NULL ||
+                         options.arena_profile != NULL ||
+                         options.arena_record != NULL)) {
+                usage(argv[0]);
+        }
+
+        /* The spill store, the asynchronous rings, the arena and the
+         * per-UM reports assume one thread runs the UM
+         */
+        if (options.threads && (diff || pipeline || options.quota != 0 ||
+                                options.async_io || options.access_map ||
+                                options.cache_sim || options.latency ||
+                                options.call_graph != NULL ||
+                                options.arena ||
+                                options.arena_record != NULL)) {
+                usage(argv[0]);
+        }
+        if (compile) {
+                if (argc - arg > 2) {
+                        usage(argv[0]);
+                }
+                exit(compile_image(argv[arg],
+                                   arg + 1 < argc ? argv[arg + 1] : NULL));
+        }
 
+        if (diff) {
+                FILE *fp = fopen(argv[arg], "r");
+
+                if (fp == NULL) {
+                        fprintf(stderr, "%s: %s %s %s\n",
+                                argv[0], "Could not open file ", argv[arg],
+                                "for reading");
+                        exit(EXIT_FAILURE);
                 }
 
-                mem_seg prog_seg = (mem_seg)Seq_get(mem, 0);
-                uint32_t curr_length = (uint32_t)UArray_length(prog_seg->words);
+                int status = run_diff(fp, diff_interval, options.ext);
+                fclose(fp);
+                exit(status);
+        }
 
-                /* Check if the last instruction has been executed*/
-                if (*prog_count == curr_length) {
-                        exit_condition = true;
-                } 
+        metrics m = metrics_path == NULL ? NULL
+                  : metrics_start(metrics_path, metrics_interval);
 
+        if (pipeline) {
+                exit(run_pipeline(argv[0], argv + arg, argc - arg, &options,
+                                  m));
         }
-}
\ No newline at end of file
+
+        um_vm vm = open_um(argv[0], argv[arg], stdin, stdout);
+
+        exit(run_and_free(vm, &options, m, argv[arg]));
+}
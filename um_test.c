@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "vm_interface.h"
+#include "options.h"
+
+/* What a test is listed with: the um options of the same names. With
+ * pipeline, the program runs between two copies of cat.um, joined to each
+ * by an io_pipe. With fault, the program must fault for that cause
+ * rather than halt
+ */
+struct test_options {
+        bool ext;
+        bool threads;
+        uint64_t quota;                 /* --mem-quota; 0 means none */
+        uint64_t limit;                 /* --mem-limit; 0 means none */
+        bool reclaim;
+        bool guard_pages;
+        bool async_io;
+        bool pipeline;
+        bool arena;
+        trap_cause fault;               /* TRAP_NONE: must halt */
+};
+
+/* The causes --fault takes */
+static const struct {
+        const char *name;
+        trap_cause cause;
+} fault_names[] = {
+        { "bad-opcode",       TRAP_BAD_OPCODE },
+        { "unmapped",         TRAP_UNMAPPED },
+        { "out-of-bounds",    TRAP_OUT_OF_BOUNDS },
+        { "divide-by-zero",   TRAP_DIVIDE_BY_ZERO },
+        { "unmap-zero",       TRAP_UNMAP_ZERO },
+        { "pc-out-of-bounds", TRAP_PC_OUT_OF_BOUNDS },
+        { "no-thread",        TRAP_NO_THREAD },
+        { "too-many-threads", TRAP_TOO_MANY_THREADS },
+        { "shared-code",      TRAP_SHARED_CODE },
+        { "thread",           TRAP_THREAD },
+        { "memory-limit",     TRAP_MEMORY_LIMIT }
+};
+
+#define NUM_FAULT_NAMES (sizeof(fault_names) / sizeof(fault_names[0]))
+
+/* One program from the test list and what happened when it ran */
+struct test_case {
+        char *name;
+        char *label;                    /* the name and its options */
+        struct test_options options;
+        bool passed;
+        const char *reason;
+        double millis;
+};
+
+/* Shared by the worker threads */
+struct test_run {
+        const char *dir;
+        struct test_case *tests;
+        unsigned num_tests;
+        unsigned next;
+};
+
+static char *path_of(const char *dir, const char *name, const char *ext)
+{
+        size_t length = strlen(dir) + strlen(name) + strlen(ext) + 2;
+        char *path = malloc(length);
+
+        snprintf(path, length, "%s/%s%s", dir, name, ext);
+        return path;
+}
+
+/* Reads the rest of a stream into memory */
+static char *read_stream(FILE *fp, size_t *length)
+{
+        char *contents = NULL;
+        size_t capacity = 0;
+
+        *length = 0;
+
+        int ch;
+        while ((ch = fgetc(fp)) != EOF) {
+                if (*length + 1 >= capacity) {
+                        capacity = capacity == 0 ? 256 : capacity * 2;
+                        contents = realloc(contents, capacity);
+                }
+                contents[(*length)++] = ch;
+        }
+
+        return contents == NULL ? calloc(1, 1) : contents;
+}
+
+/* Function: read_file
+ * Does: Reads a whole file into memory. A missing file reads as empty,
+ *       which is how umlabwrite records "no input" and "no output"
+ * Paramters: const char*, size_t*
+ * Returns: char*
+ */
+static char *read_file(const char *path, size_t *length)
+{
+        FILE *fp = fopen(path, "rb");
+
+        if (fp == NULL) {
+                *length = 0;
+                return calloc(1, 1);
+        }
+
+        char *contents = read_stream(fp, length);
+
+        fclose(fp);
+        return contents;
+}
+
+static double now_millis()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Sets a UM up as its test's options ask */
+static void prepare(um_vm vm, const struct test_options *options)
+{
+        vm->ext = options->ext || options->threads;
+        vm->threaded = options->threads;
+        mem_set_quota(vm->mem, options->quota);
+        mem_set_limit(vm->mem, options->limit);
+        if (options->reclaim) {
+                mem_start_reclaim(vm->mem);
+        }
+        if (options->guard_pages) {
+                mem_use_guard_pages(vm->mem);
+        }
+        if (options->arena) {
+                mem_use_arena(vm->mem, NULL);
+        }
+        if (options->async_io) {
+                io_start_async(vm->io);
+        }
+}
+
+/* Creates a UM running dir/NAME.um, or returns NULL if there is none */
+static um_vm open_vm(const char *dir, const char *name, FILE *in, FILE *out)
+{
+        char *um_path = path_of(dir, name, ".um");
+        FILE *program = fopen(um_path, "rb");
+        um_vm vm = NULL;
+
+        if (program != NULL) {
+                vm = vm_new(program, in, out);
+                fclose(program);
+        }
+        free(um_path);
+        return vm;
+}
+
+/* One UM of a pipeline test and the thread running it */
+struct stage {
+        um_vm vm;
+        pthread_t thread;
+        vm_status status;
+};
+
+/* Runs one stage to the end, then closes its pipes as um --pipeline does */
+static void *run_stage(void *cl)
+{
+        struct stage *stage = cl;
+
+        stage->status = vm_run(stage->vm);
+        io_disconnect(stage->vm->io);
+        return NULL;
+}
+
+/* Function: run_pipeline
+ * Does: Runs a test's UM with a cat.um before and after it, each stage on
+ *       its own thread, and frees them all
+ * Paramters: const char*, um_vm (the test's), FILE*, FILE*,
+ *            const struct test_options*, trap_cause* (set if the test's UM
+ *            faulted)
+ * Returns: vm_status (of the test's UM; VM_FAULTED if either cat failed)
+ */
+static vm_status run_pipeline(const char *dir, um_vm vm, FILE *in,
+                              FILE *out, const struct test_options *options,
+                              trap_cause *cause)
+{
+        struct stage stages[3];
+        io_pipe pipes[2] = { io_pipe_new(), io_pipe_new() };
+
+        stages[0].vm = open_vm(dir, "cat", in, out);
+        stages[1].vm = vm;
+        stages[2].vm = open_vm(dir, "cat", in, out);
+        if (stages[0].vm == NULL || stages[2].vm == NULL) {
+                fprintf(stderr, "Error: %s/cat.um is needed for --pipeline\n",
+                        dir);
+                exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < 3; i++) {
+                io_connect(stages[i].vm->io, i > 0 ? pipes[i - 1] : NULL,
+                           i < 2 ? pipes[i] : NULL);
+                prepare(stages[i].vm, options);
+                pthread_create(&stages[i].thread, NULL, run_stage,
+                               &stages[i]);
+        }
+        for (int i = 0; i < 3; i++) {
+                pthread_join(stages[i].thread, NULL);
+        }
+
+        vm_status status = stages[1].status;
+
+        *cause = vm->trap;
+        if (stages[0].status != VM_HALTED || stages[2].status != VM_HALTED) {
+                status = VM_FAULTED;
+                *cause = (stages[0].status == VM_FAULTED ? stages[0].vm
+                                                         : stages[2].vm)->trap;
+        }
+        for (int i = 0; i < 3; i++) {
+                vm_free(&stages[i].vm);
+        }
+        io_pipe_free(&pipes[0]);
+        io_pipe_free(&pipes[1]);
+        return status;
+}
+
+/* Function: run_test
+ * Does: Runs one test program on its own UM, feeding it NAME.0 and
+ *       comparing what it prints with NAME.1. It passes if it also ends
+ *       as listed: halted, or faulted for the cause given with --fault
+ * Paramters: const char*, struct test_case*
+ * Returns: None
+ */
+static void run_test(const char *dir, struct test_case *test)
+{
+        char *in_path = path_of(dir, test->name, ".0");
+        char *out_path = path_of(dir, test->name, ".1");
+        FILE *in = fopen(in_path, "rb");
+        char *output = NULL;
+        size_t output_length = 0;
+
+        if (in == NULL) {
+                in = fopen("/dev/null", "rb");
+        }
+
+        /* A real file, so that --async-io has a descriptor to write */
+        FILE *out = tmpfile();
+        double start = now_millis();
+        um_vm vm = open_vm(dir, test->name, in, out);
+
+        test->passed = false;
+        if (vm == NULL) {
+                test->reason = "program not found";
+        } else {
+                vm_status status;
+                trap_cause cause;
+
+                if (test->options.pipeline) {
+                        status = run_pipeline(dir, vm, in, out,
+                                              &test->options, &cause);
+                } else {
+                        prepare(vm, &test->options);
+                        status = vm_run(vm);
+                        cause = vm_faulted_thread(vm)->trap;
+                        vm_free(&vm);
+                }
+                test->millis = now_millis() - start;
+                rewind(out);
+                output = read_stream(out, &output_length);
+
+                size_t expected_length;
+                char *expected = read_file(out_path, &expected_length);
+
+                trap_cause fault = test->options.fault;
+                bool ended = fault == TRAP_NONE
+                             ? status == VM_HALTED
+                             : status == VM_FAULTED && cause == fault;
+
+                test->passed = ended && output_length == expected_length &&
+                               memcmp(output, expected, output_length) == 0;
+                if (!ended && status == VM_FAULTED) {
+                        test->reason = trap_message(cause);
+                } else if (!ended) {
+                        test->reason = "did not fault";
+                } else {
+                        test->reason = test->passed ? "" : "output differs";
+                }
+                free(expected);
+        }
+
+        fclose(out);
+        free(output);
+        fclose(in);
+        free(in_path);
+        free(out_path);
+}
+
+static void *worker(void *cl)
+{
+        struct test_run *run = cl;
+        unsigned i;
+
+        while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) <
+               run->num_tests) {
+                run_test(run->dir, &run->tests[i]);
+        }
+        return NULL;
+}
+
+/* Takes the next word of a line split by spaces, or NULL at its end */
+static char *next_word(char **text)
+{
+        char *word;
+
+        do {
+                word = strsep(text, " \t");
+        } while (word != NULL && word[0] == '\0');
+        return word;
+}
+
+/* The cause --fault names, or TRAP_NONE for no known one */
+static trap_cause fault_named(const char *name)
+{
+        for (unsigned i = 0; i < NUM_FAULT_NAMES; i++) {
+                if (strcmp(fault_names[i].name, name) == 0) {
+                        return fault_names[i].cause;
+                }
+        }
+        return TRAP_NONE;
+}
+
+/* Function: read_options
+ * Does: Reads the options after a test's name
+ * Paramters: char* (the rest of the line, or NULL; split up),
+ *            struct test_options*
+ * Returns: bool (false if one is unknown or lacks its value)
+ */
+static bool read_options(char *text, struct test_options *options)
+{
+        char *word;
+
+        memset(options, 0, sizeof(*options));
+        while ((word = next_word(&text)) != NULL) {
+                if (strcmp(word, "--ext") == 0) {
+                        options->ext = true;
+                } else if (strcmp(word, "--threads") == 0) {
+                        options->threads = true;
+                } else if (strcmp(word, "--mem-quota") == 0) {
+                        word = next_word(&text);
+                        if (word == NULL ||
+                            (options->quota = parse_bytes(word)) == 0) {
+                                return false;
+                        }
+                } else if (strcmp(word, "--mem-limit") == 0) {
+                        word = next_word(&text);
+                        if (word == NULL ||
+                            (options->limit = parse_bytes(word)) == 0) {
+                                return false;
+                        }
+                } else if (strcmp(word, "--reclaim") == 0) {
+                        options->reclaim = true;
+                } else if (strcmp(word, "--guard-pages") == 0) {
+                        options->guard_pages = true;
+                } else if (strcmp(word, "--async-io") == 0) {
+                        options->async_io = true;
+                } else if (strcmp(word, "--pipeline") == 0) {
+                        options->pipeline = true;
+                } else if (strcmp(word, "--arena") == 0) {
+                        options->arena = true;
+                } else if (strcmp(word, "--fault") == 0) {
+                        word = next_word(&text);
+                        if (word == NULL ||
+                            (options->fault = fault_named(word)) ==
+                                    TRAP_NONE) {
+                                return false;
+                        }
+                } else {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* Function: read_test_list
+ * Does: Reads the tests in a UMTESTS file, one per line: a program, with
+ *       any ".um" suffix dropped, and the options (as um's, see
+ *       test_options) to run it with. A program may be listed more than
+ *       once, with different options. Exits on an option it does not know
+ * Paramters: FILE*, unsigned*
+ * Returns: struct test_case*
+ */
+static struct test_case *read_test_list(FILE *fp, unsigned *num_tests)
+{
+        struct test_case *tests = NULL;
+        char line[1024];
+
+        *num_tests = 0;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                size_t length = strlen(line);
+
+                while (length > 0 && isspace((unsigned char)line[length - 1])) {
+                        line[--length] = '\0';
+                }
+
+                char *rest = line;
+                char *name = strsep(&rest, " \t");
+
+                length = strlen(name);
+                if (length > 3 && strcmp(name + length - 3, ".um") == 0) {
+                        name[length - 3] = '\0';
+                }
+                if (name[0] == '\0') {
+                        continue;
+                }
+
+                tests = realloc(tests, (*num_tests + 1) * sizeof(*tests));
+
+                struct test_case *test = &tests[*num_tests];
+
+                test->name = strdup(name);
+                if (rest == NULL) {
+                        test->label = strdup(name);
+                } else {
+                        size_t label_length = strlen(name) + strlen(rest) + 2;
+
+                        test->label = malloc(label_length);
+                        snprintf(test->label, label_length, "%s %s", name,
+                                 rest);
+                }
+                if (!read_options(rest, &test->options)) {
+                        fprintf(stderr, "Error: Bad options for %s in the "
+                                "test list\n", name);
+                        exit(EXIT_FAILURE);
+                }
+                test->millis = 0;
+                (*num_tests)++;
+        }
+
+        return tests;
+}
+
+int main(int argc, char *argv[])
+{
+        const char *list_path = argc > 1 ? argv[1] : "unit_tests/UMTESTS";
+        FILE *list = fopen(list_path, "r");
+
+        if (list == NULL) {
+                fprintf(stderr, "%s: Could not open %s\n", argv[0], list_path);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Test programs live next to the list */
+        char *dir = strdup(list_path);
+        char *slash = strrchr(dir, '/');
+        if (slash != NULL) {
+                *slash = '\0';
+        } else {
+                strcpy(dir, ".");
+        }
+
+        struct test_run run;
+        run.dir = dir;
+        run.tests = read_test_list(list, &run.num_tests);
+        run.next = 0;
+        fclose(list);
+
+        long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads < 1) {
+                num_threads = 1;
+        }
+        if (num_threads > (long)run.num_tests) {
+                num_threads = run.num_tests;
+        }
+
+        double start = now_millis();
+        pthread_t *threads = malloc(num_threads * sizeof(*threads));
+        for (long i = 0; i < num_threads; i++) {
+                pthread_create(&threads[i], NULL, worker, &run);
+        }
+        for (long i = 0; i < num_threads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        double elapsed = now_millis() - start;
+
+        unsigned passed = 0;
+        for (unsigned i = 0; i < run.num_tests; i++) {
+                struct test_case *test = &run.tests[i];
+
+                printf("%s  %-44s %10.2f ms  %s\n",
+                       test->passed ? "PASS" : "FAIL", test->label,
+                       test->millis, test->reason);
+                passed += test->passed;
+                free(test->name);
+                free(test->label);
+        }
+        printf("%u/%u tests passed in %.2f ms on %ld threads\n",
+               passed, run.num_tests, elapsed, num_threads);
+
+        free(threads);
+        free(run.tests);
+        free(dir);
+
+        return passed == run.num_tests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
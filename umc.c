@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "umd.h"
+#include "prog_cache.h"
+#include "options.h"
+
+static void usage(const char *progname)
+{
+        fprintf(stderr, "Usage: %s [--budget N] [--mem-limit BYTES[K|M|G]] "
+                        "[--repeat N] SOCKET file.um\n"
+                        "       %s --stats SOCKET\n",
+                progname, progname);
+        exit(EXIT_FAILURE);
+}
+
+/* Reads all of a stream into memory */
+static char *read_all(FILE *fp, size_t *length)
+{
+        size_t capacity = 4096;
+        char *bytes = malloc(capacity);
+        size_t got;
+
+        *length = 0;
+        while ((got = fread(bytes + *length, 1, capacity - *length, fp)) > 0) {
+                *length += got;
+                if (*length == capacity) {
+                        capacity *= 2;
+                        bytes = realloc(bytes, capacity);
+                }
+        }
+        return bytes;
+}
+
+static void fail(const char *message)
+{
+        fprintf(stderr, "umc: %s\n", message);
+        exit(EXIT_FAILURE);
+}
+
+/* Connects to umd, or exits */
+static int connect_to(const char *path)
+{
+        struct sockaddr_un addr;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr,
+                              sizeof(addr)) != 0) {
+                fprintf(stderr, "umc: Could not connect to %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+        return fd;
+}
+
+/* Sends a request line and its bytes */
+static void send_request(FILE *out, const char *line, const char *bytes,
+                         size_t length)
+{
+        if (fputs(line, out) == EOF ||
+            fwrite(bytes, 1, length, out) != length || fflush(out) != 0) {
+                fail("Lost the connection");
+        }
+}
+
+/* Copies n bytes of a frame from the daemon to a stream */
+static void copy_frame(FILE *in, FILE *to, size_t n)
+{
+        char buffer[4096];
+
+        while (n > 0) {
+                size_t chunk = n < sizeof(buffer) ? n : sizeof(buffer);
+
+                if (fread(buffer, 1, chunk, in) != chunk) {
+                        fail("Lost the connection");
+                }
+                fwrite(buffer, 1, chunk, to);
+                n -= chunk;
+        }
+}
+
+/* Function: run
+ * Does: Asks umd to run a program by its key, sending the program first
+ *       if the daemon does not have it, and copies the output to stdout
+ *       and any fault report to stderr as they come
+ * Paramters: FILE*, FILE* (the connection), const char* (program),
+ *            size_t, const char* (input), size_t, uint64_t (budget),
+ *            uint64_t (memory limit)
+ * Returns: bool (whether it halted)
+ */
+static bool run(FILE *in, FILE *out, const char *program, size_t length,
+                const char *input, size_t input_length, uint64_t budget,
+                uint64_t mem_limit)
+{
+        struct prog_key key = prog_cache_key(program, length);
+        char key_text[PROG_KEY_TEXT];
+        char loaded[PROG_KEY_TEXT];
+        char line[UMD_LINE_MAX];
+        char outcome[UMD_LINE_MAX];
+        unsigned long long instructions;
+        size_t n;
+
+        prog_key_format(&key, key_text);
+        snprintf(line, sizeof(line), "RUN %s %zu %llu %llu\n",
+                 key_text, input_length,
+                 (unsigned long long)budget, (unsigned long long)mem_limit);
+        send_request(out, line, input, input_length);
+
+        for (;;) {
+                if (fgets(line, sizeof(line), in) == NULL) {
+                        fail("Lost the connection");
+                }
+                if (sscanf(line, "OUT %zu", &n) == 1) {
+                        copy_frame(in, stdout, n);
+                } else if (sscanf(line, "TRAP %zu", &n) == 1) {
+                        fflush(stdout);
+                        copy_frame(in, stderr, n);
+                } else if (sscanf(line, "END %255s %llu", outcome,
+                                  &instructions) == 2) {
+                        break;
+                } else if (strcmp(line, "MISS\n") == 0) {
+                        snprintf(line, sizeof(line), "LOAD %zu\n", length);
+                        send_request(out, line, program, length);
+                        if (fgets(line, sizeof(line), in) == NULL ||
+                            sscanf(line, "HASH %64s", loaded) != 1 ||
+                            strcmp(loaded, key_text) != 0) {
+                                fail("The daemon could not load the "
+                                     "program");
+                        }
+                        return run(in, out, program, length, input,
+                                   input_length, budget, mem_limit);
+                } else {
+                        fprintf(stderr, "umc: %s", line);
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        fflush(stdout);
+        if (strcmp(outcome, "budget") == 0) {
+                fprintf(stderr, "umc: Stopped at its budget after %llu "
+                        "instructions\n", instructions);
+        }
+        return strcmp(outcome, "halted") == 0;
+}
+
+static double now_us()
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+        uint64_t budget = 0;
+        uint64_t mem_limit = 0;
+        unsigned long repeat = 1;
+        bool stats = false;
+        int arg = 1;
+
+        for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+                if (strcmp(argv[arg], "--budget") == 0 && arg + 1 < argc) {
+                        budget = strtoull(argv[++arg], NULL, 10);
+                } else if (strcmp(argv[arg], "--mem-limit") == 0 &&
+                           arg + 1 < argc) {
+                        mem_limit = parse_bytes(argv[++arg]);
+                } else if (strcmp(argv[arg], "--repeat") == 0 &&
+                           arg + 1 < argc) {
+                        repeat = strtoul(argv[++arg], NULL, 10);
+                        if (repeat == 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[arg], "--stats") == 0) {
+                        stats = true;
+                } else {
+                        usage(argv[0]);
+                }
+        }
+        if (argc - arg != (stats ? 1 : 2)) {
+                usage(argv[0]);
+        }
+
+        int fd = connect_to(argv[arg]);
+        FILE *in = fdopen(fd, "rb");
+        FILE *out = fdopen(dup(fd), "wb");
+        char line[UMD_LINE_MAX];
+
+        if (stats) {
+                send_request(out, "STATS\n", NULL, 0);
+                if (fgets(line, sizeof(line), in) == NULL) {
+                        fail("Lost the connection");
+                }
+                fputs(line, stdout);
+                return EXIT_SUCCESS;
+        }
+
+        FILE *fp = fopen(argv[arg + 1], "rb");
+
+        if (fp == NULL) {
+                fprintf(stderr, "umc: Could not open %s for reading\n",
+                        argv[arg + 1]);
+                exit(EXIT_FAILURE);
+        }
+
+        size_t length, input_length;
+        char *program = read_all(fp, &length);
+        char *input = read_all(stdin, &input_length);
+        bool halted = true;
+        double start = now_us();
+
+        fclose(fp);
+        for (unsigned long i = 0; i < repeat && halted; i++) {
+                halted = run(in, out, program, length, input, input_length,
+                             budget, mem_limit);
+        }
+        if (repeat > 1) {
+                fprintf(stderr, "umc: %lu jobs, %.1f us each\n", repeat,
+                        (now_us() - start) / repeat);
+        }
+
+        fclose(in);
+        fclose(out);
+        free(program);
+        free(input);
+        return halted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "umd.h"
+#include "vm_interface.h"
+#include "mem_interface.h"
+#include "io_dev.h"
+#include "vm_sched.h"
+#include "prog_cache.h"
+#include "options.h"
+
+/* Images kept unless --cache says otherwise */
+#define UMD_CACHE_BYTES ((uint64_t)256 << 20)
+
+static void usage(const char *progname)
+{
+        fprintf(stderr, "Usage: %s [--workers N] [--cache BYTES[K|M|G]] "
+                        "[--budget N]\n"
+                        "          [--mem-limit BYTES[K|M|G]] SOCKET\n",
+                progname);
+        exit(EXIT_FAILURE);
+}
+
+/* What every connection shares */
+struct server {
+        sched workers;
+        prog_cache cache;
+        uint64_t budget;                /* 0 means no limit */
+        uint64_t mem_limit;             /* 0 means no limit */
+        uint64_t jobs;
+};
+
+/* One client, served on a thread of its own */
+struct connection {
+        struct server *server;
+        int fd;
+        FILE *in;
+};
+
+/* Sends all of length bytes, or fails if the client has gone. While the
+ * socket is full, waits for POLLOUT; only this connection's thread waits
+ */
+static bool send_all(int fd, const void *bytes, size_t length)
+{
+        const char *next = bytes;
+
+        while (length > 0) {
+                ssize_t sent = send(fd, next, length,
+                                    MSG_NOSIGNAL | MSG_DONTWAIT);
+
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        struct pollfd writable = { fd, POLLOUT, 0 };
+
+                        if (poll(&writable, 1, -1) < 0 && errno != EINTR) {
+                                return false;
+                        }
+                        continue;
+                }
+                if (sent < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (sent <= 0) {
+                        return false;
+                }
+                next += sent;
+                length -= sent;
+        }
+        return true;
+}
+
+static bool send_line(int fd, const char *line)
+{
+        return send_all(fd, line, strlen(line));
+}
+
+/* Sends a frame: its kind and length on a line, then its bytes */
+static bool send_frame(int fd, const char *kind, const void *bytes,
+                       size_t length)
+{
+        char line[UMD_LINE_MAX];
+
+        snprintf(line, sizeof(line), "%s %zu\n", kind, length);
+        return send_line(fd, line) && send_all(fd, bytes, length);
+}
+
+/* Reads the length bytes a request announced, unless there are too many */
+static char *read_payload(FILE *in, size_t length)
+{
+        if (length > UMD_MAX_BYTES) {
+                return NULL;
+        }
+
+        char *bytes = malloc(length + 1);
+
+        if (bytes != NULL && fread(bytes, 1, length, in) != length) {
+                free(bytes);
+                return NULL;
+        }
+        return bytes;
+}
+
+/* The lower of two limits, where 0 means none */
+static uint64_t lower_limit(uint64_t asked, uint64_t most)
+{
+        if (asked == 0 || (most != 0 && most < asked)) {
+                return most;
+        }
+        return asked;
+}
+
+/* Says how a job ended */
+static const char *outcome(vm_status status)
+{
+        switch (status) {
+                case VM_HALTED :
+                        return "halted";
+                case VM_FAULTED :
+                        return "faulted";
+                default :
+                        return "budget";
+        }
+}
+
+/* Sends a faulted UM's report as a TRAP frame */
+static bool send_trap(int fd, um_vm vm)
+{
+        char *report = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&report, &length);
+
+        if (out == NULL) {
+                return false;
+        }
+        vm_report_trap(out, vm);
+        fclose(out);
+
+        bool sent = send_frame(fd, "TRAP", report, length);
+
+        free(report);
+        return sent;
+}
+
+/* The hook of a job: ends its output once it has finished, so that the
+ * connection forwarding it knows there is no more
+ */
+static void close_output(um_vm vm, vm_status status, void *cl)
+{
+        (void)status;
+        (void)cl;
+        io_close_output(vm->io);
+}
+
+/* Function: forward
+ * Does: Sends a job's output as OUT frames as it comes, until the job
+ *       ends it. Output the client has not yet read holds the job back
+ *       (parked, not on a worker) rather than piling up; once the client
+ *       has gone, the rest is taken and dropped, so the job still runs to
+ *       its end
+ * Paramters: int (the connection), sched, um_job
+ * Returns: bool (false if the client has gone)
+ */
+static bool forward(int fd, sched workers, um_job job)
+{
+        char buffer[UMD_FRAME_BYTES];
+        bool sent = true;
+        size_t got;
+
+        while ((got = sched_take_output(workers, job, buffer,
+                                        sizeof(buffer))) != 0) {
+                sent = sent && send_frame(fd, "OUT", buffer, got);
+        }
+        return sent;
+}
+
+/* Function: run_job
+ * Does: Runs a cached program on the worker pool with its own UM, feeding
+ *       it the whole input and streaming its output back as it comes,
+ *       then sends how it ended
+ * Paramters: struct connection*, const struct prog_key*,
+ *            const char* (input), size_t, uint64_t (budget),
+ *            uint64_t (memory limit)
+ * Returns: bool (false once the client has gone)
+ */
+static bool run_job(struct connection *c, const struct prog_key *key,
+                    const char *input, size_t length, uint64_t budget,
+                    uint64_t mem_limit)
+{
+        struct server *server = c->server;
+
+        /* No files: input is fed and output taken (see io_dev.h) */
+        um_vm vm = prog_cache_open(server->cache, key, NULL, NULL);
+
+        if (vm == NULL) {
+                return send_line(c->fd, "MISS\n");
+        }
+        mem_set_limit(vm->mem, lower_limit(mem_limit, server->mem_limit));
+        __atomic_add_fetch(&server->jobs, 1, __ATOMIC_RELAXED);
+
+        um_job job = sched_submit(server->workers, vm, 0,
+                                  lower_limit(budget, server->budget));
+
+        sched_on_finish(server->workers, job, close_output, NULL);
+        if (length > 0) {
+                sched_feed(server->workers, job, input, length);
+        }
+        sched_close_input(server->workers, job);
+
+        bool sent = forward(c->fd, server->workers, job);
+        vm_status status = sched_wait(server->workers, job);
+        char line[UMD_LINE_MAX];
+
+        if (sent && status == VM_FAULTED) {
+                sent = send_trap(c->fd, vm);
+        }
+        snprintf(line, sizeof(line), "END %s %llu\n", outcome(status),
+                 (unsigned long long)vm->instructions);
+        sent = sent && send_line(c->fd, line);
+        vm_free(&vm);
+        return sent;
+}
+
+/* Function: serve
+ * Does: Answers one client's requests (see umd.h) until it closes the
+ *       connection or makes one that cannot be answered
+ * Paramters: void* (the connection, which it frees)
+ * Returns: NULL
+ */
+static void *serve(void *cl)
+{
+        struct connection *c = cl;
+        struct server *server = c->server;
+        char line[UMD_LINE_MAX];
+        char reply[UMD_LINE_MAX];
+        bool open = true;
+
+        while (open && fgets(line, sizeof(line), c->in) != NULL) {
+                unsigned long long budget, mem_limit;
+                char key_text[PROG_KEY_TEXT];
+                struct prog_key key;
+                size_t length;
+                char *payload = NULL;
+
+                if (sscanf(line, "LOAD %zu", &length) == 1 &&
+                    (payload = read_payload(c->in, length)) != NULL) {
+                        if (length < sizeof(uint32_t) ||
+                            !prog_cache_add(server->cache, payload, length,
+                                            &key)) {
+                                open = send_line(c->fd, "ERROR could not "
+                                                 "load program\n");
+                        } else {
+                                prog_key_format(&key, key_text);
+                                snprintf(reply, sizeof(reply), "HASH %s\n",
+                                         key_text);
+                                open = send_line(c->fd, reply);
+                        }
+                } else if (sscanf(line, "RUN %64s %zu %llu %llu", key_text,
+                                  &length, &budget, &mem_limit) == 4 &&
+                           prog_key_parse(key_text, &key) &&
+                           (payload = read_payload(c->in, length)) != NULL) {
+                        open = run_job(c, &key, payload, length, budget,
+                                       mem_limit);
+                } else if (strcmp(line, "STATS\n") == 0) {
+                        struct prog_cache_counts counts =
+                                prog_cache_counts(server->cache);
+
+                        snprintf(reply, sizeof(reply),
+                                 "STATS %llu %llu %llu %llu %llu %llu\n",
+                                 (unsigned long long)counts.entries,
+                                 (unsigned long long)counts.bytes,
+                                 (unsigned long long)counts.hits,
+                                 (unsigned long long)counts.misses,
+                                 (unsigned long long)counts.evictions,
+                                 (unsigned long long)__atomic_load_n(
+                                         &server->jobs, __ATOMIC_RELAXED));
+                        open = send_line(c->fd, reply);
+                } else {
+                        send_line(c->fd, "ERROR bad request\n");
+                        open = false;
+                }
+                free(payload);
+        }
+
+        fclose(c->in);
+        free(c);
+        return NULL;
+}
+
+/* Function: listen_on
+ * Does: Binds a listening socket to a path, replacing a stale socket (but
+ *       nothing else) there
+ * Paramters: const char*
+ * Returns: int (the socket, or -1 with a message)
+ */
+static int listen_on(const char *path)
+{
+        struct sockaddr_un addr;
+        struct stat st;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "Error: Could not create socket %s\n", path);
+                return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(path);
+        }
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+                fprintf(stderr, "Error: Could not listen on %s\n", path);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+int main(int argc, char *argv[])
+{
+        struct server server = { NULL, NULL, 0, 0, 0 };
+        long workers = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t cache_bytes = UMD_CACHE_BYTES;
+        int arg = 1;
+
+        for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+                if (strcmp(argv[arg], "--workers") == 0 && arg + 1 < argc) {
+                        workers = strtol(argv[++arg], NULL, 10);
+                        if (workers <= 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[arg], "--cache") == 0 &&
+                           arg + 1 < argc) {
+                        cache_bytes = parse_bytes(argv[++arg]);
+                } else if (strcmp(argv[arg], "--budget") == 0 &&
+                           arg + 1 < argc) {
+                        server.budget = strtoull(argv[++arg], NULL, 10);
+                } else if (strcmp(argv[arg], "--mem-limit") == 0 &&
+                           arg + 1 < argc) {
+                        server.mem_limit = parse_bytes(argv[++arg]);
+                } else {
+                        usage(argv[0]);
+                }
+        }
+        if (arg + 1 != argc) {
+                usage(argv[0]);
+        }
+
+        int listener = listen_on(argv[arg]);
+
+        if (listener < 0) {
+                exit(EXIT_FAILURE);
+        }
+        signal(SIGPIPE, SIG_IGN);
+        server.workers = sched_new(workers > 0 ? workers : 1);
+        server.cache = prog_cache_new(cache_bytes);
+
+        /* Runs until killed */
+        for (;;) {
+                int fd = accept(listener, NULL, NULL);
+
+                if (fd < 0) {
+                        if (errno != EINTR && errno != ECONNABORTED) {
+                                perror("accept");
+                        }
+                        continue;
+                }
+
+                struct connection *c = malloc(sizeof(*c));
+                pthread_t thread;
+
+                c->server = &server;
+                c->fd = fd;
+                c->in = fdopen(fd, "rb");
+                if (c->in == NULL || pthread_create(&thread, NULL, serve,
+                                                     c) != 0) {
+                        fprintf(stderr, "Error: Could not serve a client\n");
+                        if (c->in != NULL) {
+                                fclose(c->in);
+                        } else {
+                                close(fd);
+                        }
+                        free(c);
+                        continue;
+                }
+                pthread_detach(thread);
+        }
+}
@@ -0,0 +1,34 @@
+#ifndef UMD_INCLUDED
+#define UMD_INCLUDED
+
+/* What umd and its clients say to each other over a Unix-domain stream
+ * socket. Each request is a line, then the bytes it announces:
+ *
+ *   LOAD <bytes>\n<the .um>            HASH <64 hex digits>\n
+ *   RUN <hash> <input bytes> <budget> <memory limit>\n<the input>
+ *                                      OUT <n>\n<n bytes of output> ...
+ *                                      TRAP <n>\n<n bytes of report>
+ *                                      END <outcome> <instructions>\n
+ *                                      or MISS\n if it is not cached
+ *   STATS\n                            STATS <entries> <bytes> <hits>
+ *                                            <misses> <evictions> <jobs>\n
+ *
+ * The hash is the program's key in the cache (prog_cache.h), the SHA-256
+ * of its words, so a client can work it out and RUN without sending the
+ * program until the daemon answers MISS.
+ *
+ * A RUN's output comes back as it is written, in frames of at most
+ * UMD_FRAME_BYTES, with a TRAP frame (vm_report_trap's report) only if it
+ * faulted. Its outcome is halted, faulted or budget (it ran out of
+ * instructions). A budget or memory limit of 0 asks for the daemon's own,
+ * and neither can be raised past it. Any malformed request is answered
+ * with ERROR <message>\n and the connection closed; any number of
+ * requests may be made on one connection, one after another.
+ */
+#define UMD_LINE_MAX 256
+#define UMD_FRAME_BYTES 65536
+
+/* Longest program or input a request may send */
+#define UMD_MAX_BYTES ((size_t)1 << 30)
+
+#endif
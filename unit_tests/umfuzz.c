@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "assert.h"
+#include "fmt.h"
+#include "seq.h"
+
+#include "diff_engine.h"
+
+/* The emitters in umlab.c */
+extern void Um_write_sequence(FILE *output, Seq_T instructions);
+extern void emit_random_program(Seq_T instructions, unsigned seed,
+                                unsigned length);
+
+/* Blocks per program and instructions between comparisons */
+#define FUZZ_LENGTH 200
+#define FUZZ_INTERVAL 64
+
+static void usage(const char *progname)
+{
+        fprintf(stderr, "Usage: %s [--save DIR] [count [first-seed "
+                        "[length]]]\n", progname);
+        exit(EXIT_FAILURE);
+}
+
+/* Where failing programs go: --save's directory, or one made under
+ * $TMPDIR (or /tmp) at the first failure, so a run never writes into the
+ * directory it was started in
+ */
+static char *save_dir = NULL;
+
+/* Function: saving_to
+ * Does: Gives the directory failing programs are saved in, making a
+ *       temporary one the first time if --save named none
+ * Paramters: none
+ * Returns: const char*
+ */
+static const char *saving_to(void)
+{
+        if (save_dir == NULL) {
+                const char *tmp = getenv("TMPDIR");
+
+                save_dir = Fmt_string("%s/um-fuzz-XXXXXX",
+                                      tmp != NULL && tmp[0] != '\0'
+                                      ? tmp : "/tmp");
+                if (mkdtemp(save_dir) == NULL) {
+                        fprintf(stderr, "Error: Could not make %s\n",
+                                save_dir);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        return save_dir;
+}
+
+/* Function: run_child
+ * Does: Runs diff_engines in a child process, since a UM error exits the
+ *       whole process
+ * Paramters: char*, size_t, const char*, size_t
+ * Returns: bool (true if the engines agreed and nothing crashed)
+ */
+static bool run_child(char *program, size_t program_length,
+                      const char *input, size_t input_length)
+{
+        int status;
+        pid_t pid = fork();
+
+        assert(pid >= 0);
+        if (pid == 0) {
+                FILE *fp = fmemopen(program, program_length, "rb");
+                assert(fp != NULL);
+
+                bool agree = diff_engines(fp, input, input_length,
+                                          FUZZ_INTERVAL, true, NULL, stderr);
+                _exit(agree ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* Function: fuzz_one
+ * Does: Generates the program for a seed and runs it on both engines with
+ *       a few bytes of input. A program the engines disagree on, or that
+ *       stops the UM with an error, is saved as fuzz-SEED.um (see
+ *       saving_to) so it can be replayed with um --ext --diff-engines
+ * Paramters: unsigned, unsigned
+ * Returns: bool (true if the engines agreed)
+ */
+static bool fuzz_one(unsigned seed, unsigned length)
+{
+        Seq_T instructions = Seq_new(0);
+        char *program;
+        size_t program_length;
+        FILE *stream = open_memstream(&program, &program_length);
+        char input[8];
+
+        emit_random_program(instructions, seed, length);
+        Um_write_sequence(stream, instructions);
+        fclose(stream);
+        Seq_free(&instructions);
+
+        for (unsigned i = 0; i < sizeof(input); i++) {
+                input[i] = (char)(seed * 31 + i);
+        }
+
+        bool agree = run_child(program, program_length, input,
+                               seed % (sizeof(input) + 1));
+
+        if (!agree) {
+                char *path = Fmt_string("%s/fuzz-%u.um", saving_to(),
+                                        seed);
+                FILE *saved = fopen(path, "wb");
+
+                if (saved == NULL) {
+                        fprintf(stderr, "Error: Could not write %s\n",
+                                path);
+                        exit(EXIT_FAILURE);
+                }
+
+                fwrite(program, 1, program_length, saved);
+                fclose(saved);
+                fprintf(stderr, "***** Seed %u failed, saved as %s\n",
+                        seed, path);
+                free(path);
+        }
+        free(program);
+
+        return agree;
+}
+
+int main(int argc, char *argv[])
+{
+        unsigned count = 100;
+        unsigned seed = 1;
+        unsigned length = FUZZ_LENGTH;
+        unsigned failures = 0;
+        int arg = 1;
+
+        if (arg + 1 < argc && strcmp(argv[arg], "--save") == 0) {
+                save_dir = Fmt_string("%s", argv[arg + 1]);
+                arg += 2;
+        }
+        if (argc - arg > 3 || (arg < argc && argv[arg][0] == '-')) {
+                usage(argv[0]);
+        }
+        if (arg < argc) {
+                count = strtoul(argv[arg], NULL, 10);
+        }
+        if (arg + 1 < argc) {
+                seed = strtoul(argv[arg + 1], NULL, 10);
+        }
+        if (arg + 2 < argc) {
+                length = strtoul(argv[arg + 2], NULL, 10);
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+                if (!fuzz_one(seed + i, length)) {
+                        failures++;
+                }
+        }
+
+        printf("%u of %u programs failed\n", failures, count);
+        if (failures != 0) {
+                printf("Saved in %s\n", save_dir);
+        }
+        free(save_dir);
+        return failures != 0;
+}
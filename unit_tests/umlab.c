@@ -1,5 +1,7 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <assert.h>
 #include <seq.h>
@@ -9,7 +11,8 @@
 typedef uint32_t Um_instruction;
 typedef enum Um_opcode {
         CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
-        NAND, HALT, ACTIVATE, INACTIVATE, OUT, IN, LOADP, LV
+        NAND, HALT, ACTIVATE, INACTIVATE, OUT, IN, LOADP, LV,
+        XMEM, XOUT                      /* extensions, um --ext */
 } Um_opcode;
 
 /* Functions that return the two instruction types */
@@ -112,6 +115,69 @@ Um_instruction loadval(unsigned ra, unsigned val)
         return instruction;
 }
 
+/* Extension instructions, for a UM run with --ext (see ops_interface.h) */
+static Um_instruction ext_memory(unsigned function, Um_register a,
+                                 Um_register b, Um_register c, Um_register d,
+                                 Um_register e)
+{
+        Um_instruction instruction = three_register(XMEM, a, b, c);
+
+        instruction = Bitpack_newu((uint64_t)instruction, 3, 9, (uint64_t)d);
+        instruction = Bitpack_newu((uint64_t)instruction, 3, 12, (uint64_t)e);
+        instruction = Bitpack_newu((uint64_t)instruction, 3, 15,
+                                   (uint64_t)function);
+
+        return instruction;
+}
+
+/* m[a][b .. b+e) := m[c][d .. d+e) */
+Um_instruction bulk_copy(Um_register a, Um_register b, Um_register c,
+                         Um_register d, Um_register e)
+{
+        return ext_memory(0, a, b, c, d, e);
+}
+
+/* m[a][b .. b+d) := c */
+Um_instruction bulk_fill(Um_register a, Um_register b, Um_register c,
+                         Um_register d)
+{
+        return ext_memory(1, a, b, c, d, r0);
+}
+
+/* a := a new segment holding a copy of m[b][c .. c+d) */
+Um_instruction map_copy(Um_register a, Um_register b, Um_register c,
+                        Um_register d)
+{
+        return ext_memory(2, a, b, c, d, r0);
+}
+
+/* a := the identifier of a new thread starting at m[0][b], for a UM run
+ * with --threads
+ */
+Um_instruction spawn(Um_register a, Um_register b)
+{
+        return ext_memory(3, a, b, r0, r0, r0);
+}
+
+/* Waits for thread b, then a := its r0 */
+Um_instruction join(Um_register a, Um_register b)
+{
+        return ext_memory(4, a, b, r0, r0, r0);
+}
+
+/* a := m[b][c], then m[b][c] := e if that was d */
+Um_instruction compare_swap(Um_register a, Um_register b, Um_register c,
+                            Um_register d, Um_register e)
+{
+        return ext_memory(5, a, b, c, d, e);
+}
+
+/* Outputs m[a][b .. b+c), one byte per word */
+Um_instruction output_range(Um_register a, Um_register b, Um_register c)
+{
+        return three_register(XOUT, a, b, c);
+}
+
 /* Functions for working with streams */
 static inline void emit(Seq_T stream, Um_instruction inst)
 {
@@ -196,6 +262,23 @@ void emit_io_test(Seq_T stream)
         emit(stream, halt());
 }
 
+/* Copies its input to its output until end of file, to stand either side
+ * of a program run as a pipeline
+ */
+void emit_cat_test(Seq_T stream)
+{
+        emit(stream, input(r1));
+        emit(stream, bit_nand(r2, r1, r1));
+        emit(stream, loadval(r3, 6));
+        emit(stream, loadval(r4, 7));
+        emit(stream, conditional_move(r3, r4, r2));
+        emit(stream, load_pro(r0, r3));
+        emit(stream, halt());
+        emit(stream, output(r1));
+        emit(stream, loadval(r3, 0));
+        emit(stream, load_pro(r0, r3));
+}
+
 void emit_advanced_test(Seq_T stream) 
 {
         emit(stream, input(r3));
@@ -227,6 +310,293 @@ void emit_division_test(Seq_T stream)
         emit(stream, halt());
 }
 
+/* Sums r1 * r6 + r1 / r5 for r1 from 400 down, twice: first by 2 and 7,
+ * long enough for both sites to be specialised, then by 1 and 9, so that
+ * their guards fail. Prints the 24-bit sum, high byte first
+ */
+void emit_specialise_test(Seq_T stream)
+{
+        emit(stream, bit_nand(r7, r0, r0));
+        emit(stream, loadval(r5, 7));
+        emit(stream, loadval(r6, 2));
+        emit(stream, loadval(r3, 0));
+
+        /* 4: each pass */
+        emit(stream, loadval(r1, 400));
+
+        /* 5: each step; the multiply is alone, so it is not folded */
+        emit(stream, multiply(r4, r1, r6));
+        emit(stream, divide(r2, r1, r5));
+        emit(stream, add(r3, r3, r4));
+        emit(stream, add(r3, r3, r2));
+        emit(stream, add(r1, r1, r7));
+        emit(stream, loadval(r2, 14));
+        emit(stream, loadval(r4, 5));
+        emit(stream, conditional_move(r2, r4, r1));
+        emit(stream, load_pro(r0, r2));
+
+        /* 14: the next pass, if any */
+        emit(stream, add(r6, r6, r7));
+        emit(stream, loadval(r5, 9));
+        emit(stream, loadval(r2, 20));
+        emit(stream, loadval(r4, 4));
+        emit(stream, conditional_move(r2, r4, r6));
+        emit(stream, load_pro(r0, r2));
+
+        /* 20: r3 / 65536, then r3 / 256 - that * 256, then r3 - r1 * 256 */
+        emit(stream, loadval(r4, 65536));
+        emit(stream, divide(r2, r3, r4));
+        emit(stream, output(r2));
+        emit(stream, loadval(r4, 256));
+        emit(stream, loadval(r6, 1));
+        emit(stream, divide(r1, r3, r4));
+        emit(stream, multiply(r5, r2, r4));
+        emit(stream, bit_nand(r5, r5, r5));
+        emit(stream, add(r5, r5, r6));
+        emit(stream, add(r5, r1, r5));
+        emit(stream, output(r5));
+        emit(stream, multiply(r5, r1, r4));
+        emit(stream, bit_nand(r5, r5, r5));
+        emit(stream, add(r5, r5, r6));
+        emit(stream, add(r5, r3, r5));
+        emit(stream, output(r5));
+        emit(stream, halt());
+}
+
+/* Ends a loop from head: jumps back while cond is not 0 (or, if
+ * while_zero, while it is). Uses r6 and r7
+ */
+static void emit_loop_end(Seq_T stream, Um_register cond, unsigned head,
+                          bool while_zero)
+{
+        unsigned out = Seq_length(stream) + 4;
+
+        emit(stream, loadval(r6, while_zero ? head : out));
+        emit(stream, loadval(r7, while_zero ? out : head));
+        emit(stream, conditional_move(r6, r7, cond));
+        emit(stream, load_pro(r0, r6));
+}
+
+/* Counts r1 and, if index, r4 down by one. Uses r7 */
+static void emit_count_down(Seq_T stream, bool index)
+{
+        emit(stream, loadval(r7, 0));
+        emit(stream, bit_nand(r7, r7, r7));
+        if (index) {
+                emit(stream, add(r4, r4, r7));
+        }
+        emit(stream, add(r1, r1, r7));
+}
+
+/* Fills, copies (going down), scans and smears (which only the
+ * interpreter can do) segments a word at a time, in loops a UM may run as
+ * kernels. Prints "czfz)z."
+ */
+void emit_idiom_test(Seq_T stream)
+{
+        unsigned head;
+
+        /* r2: 40 words; r3: 41 words, the last 0; r5 later: 50 words */
+        emit(stream, loadval(r1, 40));
+        emit(stream, map_seg(r2, r1));
+        emit(stream, loadval(r1, 41));
+        emit(stream, map_seg(r3, r1));
+
+        /* r2[i] = 'f' for i up from 0 */
+        emit(stream, loadval(r1, 40));
+        emit(stream, loadval(r4, 0));
+        head = Seq_length(stream);
+        emit(stream, loadval(r6, 'f'));
+        emit(stream, segment_store(r2, r4, r6));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r4, r4, r7));
+        emit_count_down(stream, false);
+        emit_loop_end(stream, r1, head, false);
+
+        emit(stream, loadval(r4, 3));
+        emit(stream, loadval(r6, 'c'));
+        emit(stream, segment_store(r2, r4, r6));
+        emit(stream, loadval(r6, 'z'));
+        emit(stream, segment_store(r2, r0, r6));
+
+        /* r3[i] = r2[i] for i down from 39 */
+        emit(stream, loadval(r1, 40));
+        emit(stream, loadval(r4, 39));
+        head = Seq_length(stream);
+        emit(stream, segment_load(r5, r2, r4));
+        emit(stream, segment_store(r3, r4, r5));
+        emit_count_down(stream, true);
+        emit_loop_end(stream, r1, head, false);
+
+        emit(stream, loadval(r4, 3));
+        emit(stream, segment_load(r6, r3, r4));
+        emit(stream, output(r6));
+        emit(stream, segment_load(r6, r3, r0));
+        emit(stream, output(r6));
+        emit(stream, loadval(r4, 39));
+        emit(stream, segment_load(r6, r3, r4));
+        emit(stream, output(r6));
+        emit(stream, output(r5));
+
+        /* r4 = 1 + the offset of the first 0 in r3 */
+        emit(stream, loadval(r4, 0));
+        head = Seq_length(stream);
+        emit(stream, segment_load(r5, r3, r4));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r4, r4, r7));
+        emit_loop_end(stream, r5, head, false);
+        emit(stream, output(r4));
+
+        /* r2[i + 1] = r2[i] for i up from 0: each store is read next */
+        emit(stream, loadval(r1, 39));
+        emit(stream, loadval(r4, 0));
+        head = Seq_length(stream);
+        emit(stream, segment_load(r5, r2, r4));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r4, r4, r7));
+        emit(stream, segment_store(r2, r4, r5));
+        emit_count_down(stream, false);
+        emit_loop_end(stream, r1, head, false);
+        emit(stream, segment_load(r6, r2, r4));
+        emit(stream, output(r6));
+
+        /* r4 = 1 + the offset of the first word of r3 that is not 0 */
+        emit(stream, loadval(r1, 50));
+        emit(stream, map_seg(r3, r1));
+        emit(stream, loadval(r4, 45));
+        emit(stream, loadval(r6, 'q'));
+        emit(stream, segment_store(r3, r4, r6));
+        emit(stream, loadval(r4, 0));
+        head = Seq_length(stream);
+        emit(stream, segment_load(r5, r3, r4));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r4, r4, r7));
+        emit_loop_end(stream, r5, head, true);
+        emit(stream, output(r4));
+        emit(stream, halt());
+}
+
+void emit_boolean_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 0xf0));
+        emit(stream, loadval(r2, 0x3c));
+
+        /* AND, OR, XOR and NOT (of the low byte) spelled with NANDs */
+        emit(stream, bit_nand(r3, r1, r2));
+        emit(stream, bit_nand(r3, r3, r3));
+        emit(stream, output(r3));
+        emit(stream, bit_nand(r4, r1, r1));
+        emit(stream, bit_nand(r5, r2, r2));
+        emit(stream, bit_nand(r3, r4, r5));
+        emit(stream, output(r3));
+        emit(stream, bit_nand(r4, r1, r2));
+        emit(stream, bit_nand(r5, r1, r4));
+        emit(stream, bit_nand(r4, r2, r4));
+        emit(stream, bit_nand(r3, r5, r4));
+        emit(stream, output(r3));
+        emit(stream, bit_nand(r3, r1, r1));
+        emit(stream, loadval(r5, 0xff));
+        emit(stream, bit_nand(r3, r3, r5));
+        emit(stream, bit_nand(r3, r3, r3));
+        emit(stream, output(r3));
+
+        /* A constant built up from pieces: 7 * 13 + ~0 */
+        emit(stream, loadval(r3, 7));
+        emit(stream, loadval(r4, 13));
+        emit(stream, multiply(r3, r3, r4));
+        emit(stream, loadval(r4, 0));
+        emit(stream, bit_nand(r4, r4, r4));
+        emit(stream, add(r3, r3, r4));
+        emit(stream, output(r3));
+        emit(stream, loadval(r3, 200));
+        emit(stream, loadval(r4, 4));
+        emit(stream, divide(r3, r3, r4));
+        emit(stream, output(r3));
+        emit(stream, halt());
+}
+
+void emit_ext_test(Seq_T stream)
+{
+        emit(stream, loadval(r2, 8));
+        emit(stream, map_seg(r1, r2));
+
+        /* "AAAAAAAA", then "AAbbbAAA" */
+        emit(stream, loadval(r3, 0));
+        emit(stream, loadval(r4, 'A'));
+        emit(stream, bulk_fill(r1, r3, r4, r2));
+        emit(stream, loadval(r3, 2));
+        emit(stream, loadval(r4, 'b'));
+        emit(stream, loadval(r5, 3));
+        emit(stream, bulk_fill(r1, r3, r4, r5));
+
+        /* Words 0-4 over words 3-7: "AAbAAbbb" */
+        emit(stream, loadval(r3, 3));
+        emit(stream, loadval(r6, 0));
+        emit(stream, loadval(r5, 5));
+        emit(stream, bulk_copy(r1, r3, r1, r6, r5));
+        emit(stream, output_range(r1, r6, r2));
+
+        /* Words 2-5 in a segment of their own: "bAAb" */
+        emit(stream, loadval(r3, 2));
+        emit(stream, loadval(r5, 4));
+        emit(stream, map_copy(r7, r1, r3, r5));
+        emit(stream, output_range(r7, r6, r5));
+        emit(stream, loadval(r4, '\n'));
+        emit(stream, output(r4));
+        emit(stream, halt());
+}
+
+/* Four threads each add 1 to a shared word 30000 times by
+ * compare-and-swap, then halt with a letter of their own in r0. Prints
+ * the letters as each is joined, then the word / 1000 ('x' if no add was
+ * lost)
+ */
+void emit_threads_test(Seq_T stream)
+{
+        unsigned entry_at, head;
+
+        emit(stream, loadval(r1, 1));
+        emit(stream, map_seg(r2, r1));
+        entry_at = Seq_length(stream);
+        emit(stream, loadval(r5, 0));
+        for (int i = 0; i < 4; i++) {
+                emit(stream, spawn(r3, r5));
+        }
+        for (int id = 1; id <= 4; id++) {
+                emit(stream, loadval(r4, id));
+                emit(stream, join(r3, r4));
+                emit(stream, output(r3));
+        }
+        emit(stream, segment_load(r3, r2, r0));
+        emit(stream, loadval(r4, 1000));
+        emit(stream, divide(r3, r3, r4));
+        emit(stream, output(r3));
+        emit(stream, loadval(r3, '\n'));
+        emit(stream, output(r3));
+        emit(stream, halt());
+
+        /* Each thread: r2 is the shared segment, r3 its identifier */
+        Seq_put(stream, entry_at,
+                (void *)(uintptr_t)loadval(r5, Seq_length(stream)));
+        emit(stream, loadval(r1, 30000));
+        head = Seq_length(stream);
+        emit(stream, segment_load(r4, r2, r0));
+        emit(stream, loadval(r7, 1));
+        emit(stream, add(r5, r4, r7));
+        emit(stream, compare_swap(r6, r2, r0, r4, r5));
+
+        /* Again if the word changed in between: r5 = r6 - r4 */
+        emit(stream, bit_nand(r5, r4, r4));
+        emit(stream, add(r5, r5, r7));
+        emit(stream, add(r5, r6, r5));
+        emit_loop_end(stream, r5, head, false);
+        emit_count_down(stream, false);
+        emit_loop_end(stream, r1, head, false);
+        emit(stream, loadval(r0, 'a' - 1));
+        emit(stream, add(r0, r0, r3));
+        emit(stream, halt());
+}
+
 void emit_unmap_test(Seq_T stream) 
 {
         emit(stream, loadval(r2, 4));
@@ -279,4 +649,374 @@ void emit_five_hundred_k_test(Seq_T stream)
                 emit(stream, loadval(r0, 100));
                 emit(stream, map_seg(r1, r0));
         }
-}
\ No newline at end of file
+}
+
+/* Programs that fault, listed in UMTESTS with --fault and the cause. Each
+ * prints 'o' first, so the output up to the fault is checked too
+ */
+
+void emit_bad_segment_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        emit(stream, loadval(r2, 7));
+        emit(stream, loadval(r3, 0));
+        emit(stream, segment_store(r2, r3, r1));
+        emit(stream, output(r1));
+        emit(stream, halt());
+}
+
+void emit_bad_offset_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        emit(stream, loadval(r3, 2));
+        emit(stream, map_seg(r2, r3));
+        emit(stream, segment_load(r4, r2, r3));
+        emit(stream, output(r1));
+        emit(stream, halt());
+}
+
+void emit_divide_by_zero_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        emit(stream, loadval(r3, 0));
+        emit(stream, divide(r2, r1, r3));
+        emit(stream, output(r1));
+        emit(stream, halt());
+}
+
+/* Spawns a thread that joins itself, which must fault rather than wait
+ * forever
+ */
+void emit_join_self_test(Seq_T stream)
+{
+        unsigned entry_at;
+
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        entry_at = Seq_length(stream);
+        emit(stream, loadval(r5, 0));
+        emit(stream, spawn(r3, r5));
+        emit(stream, join(r4, r3));
+        emit(stream, output(r1));
+        emit(stream, halt());
+
+        /* The thread: r3 is its identifier */
+        Seq_put(stream, entry_at,
+                (void *)(uintptr_t)loadval(r5, Seq_length(stream)));
+        emit(stream, join(r4, r3));
+        emit(stream, halt());
+}
+
+void emit_unmapped_load_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        emit(stream, loadval(r3, 2));
+        emit(stream, map_seg(r2, r3));
+        emit(stream, unmap_seg(r2));
+        emit(stream, loadval(r3, 0));
+        emit(stream, segment_load(r4, r2, r3));
+        emit(stream, output(r1));
+        emit(stream, halt());
+}
+
+/* Maps 4 MB, past the --mem-limit it is listed with */
+void emit_limit_test(Seq_T stream)
+{
+        emit(stream, loadval(r1, 'o'));
+        emit(stream, output(r1));
+        emit(stream, loadval(r3, 1 << 20));
+        emit(stream, map_seg(r2, r3));
+        emit(stream, output(r1));
+        emit(stream, halt());
+}
+
+/* Random programs for the fuzzer, which may use the extension
+ * instructions. Registers r0-r2 hold data, r3 counts loop iterations and
+ * r4-r7 are scratch. Segments 1-3 are mapped up front,
+ * every address and divisor is set up just before it is used, and jumps
+ * only go forward or back to the top of a counted loop, so every program
+ * is valid and halts.
+ */
+
+#define FUZZ_SEGMENTS 3
+#define FUZZ_SEGMENT_WORDS 16
+
+static unsigned fuzz_rand(unsigned *seed, unsigned bound)
+{
+        return (unsigned)rand_r(seed) % bound;
+}
+
+static Um_register fuzz_data(unsigned *seed)
+{
+        return (Um_register)fuzz_rand(seed, 3);
+}
+
+/* Leaves any 32-bit word in register a, using b as scratch */
+static void emit_word(Seq_T stream, Um_register a, Um_register b,
+                      uint32_t word)
+{
+        emit(stream, loadval(a, word >> 16));
+        emit(stream, loadval(b, 1 << 16));
+        emit(stream, multiply(a, a, b));
+        emit(stream, loadval(b, word & 0xffff));
+        emit(stream, add(a, a, b));
+}
+
+static Um_instruction random_arithmetic(unsigned *seed)
+{
+        static const Um_opcode ops[] = { CMOV, ADD, MUL, NAND };
+
+        return three_register(ops[fuzz_rand(seed, 4)], fuzz_data(seed),
+                              fuzz_data(seed), fuzz_data(seed));
+}
+
+/* Leaves NOT, AND, OR or XOR of two data registers in d, spelled with
+ * NANDs the way compilers for the UM write them
+ */
+static void emit_random_boolean(Seq_T stream, unsigned *seed, Um_register d)
+{
+        Um_register p = fuzz_data(seed);
+        Um_register q = fuzz_data(seed);
+
+        switch (fuzz_rand(seed, 5)) {
+                case 0 :
+                        emit(stream, bit_nand(d, p, p));
+                        break;
+                case 1 :
+                        emit(stream, bit_nand(r4, p, q));
+                        emit(stream, bit_nand(d, r4, r4));
+                        break;
+                case 2 :
+                        emit(stream, bit_nand(r4, p, p));
+                        emit(stream, bit_nand(r5, q, q));
+                        emit(stream, bit_nand(d, r4, r5));
+                        break;
+                case 3 :
+                        emit(stream, bit_nand(r4, p, q));
+                        emit(stream, bit_nand(r5, p, r4));
+                        emit(stream, bit_nand(r4, q, r4));
+                        emit(stream, bit_nand(d, r5, r4));
+                        break;
+                default:
+                        /* (p | q) & ~(p & q) */
+                        emit(stream, bit_nand(r4, p, p));
+                        emit(stream, bit_nand(r5, q, q));
+                        emit(stream, bit_nand(r4, r4, r5));
+                        emit(stream, bit_nand(r5, p, q));
+                        emit(stream, bit_nand(d, r4, r5));
+                        emit(stream, bit_nand(d, d, d));
+                        break;
+        }
+}
+
+/* Copies, fills, copies out or prints part of a fuzz segment with the
+ * extension instructions, leaving the word count in d
+ */
+static void emit_random_ext(Seq_T stream, unsigned *seed, Um_register d)
+{
+        unsigned count = fuzz_rand(seed, FUZZ_SEGMENT_WORDS + 1);
+
+        emit(stream, loadval(d, count));
+        emit(stream, loadval(r4, 1 + fuzz_rand(seed, FUZZ_SEGMENTS)));
+        emit(stream, loadval(r5, fuzz_rand(seed, FUZZ_SEGMENT_WORDS -
+                                                 count + 1)));
+        switch (fuzz_rand(seed, 4)) {
+                case 0 :
+                        emit(stream, loadval(r6, 1 + fuzz_rand(seed,
+                                                        FUZZ_SEGMENTS)));
+                        emit(stream, loadval(r7, fuzz_rand(seed,
+                                        FUZZ_SEGMENT_WORDS - count + 1)));
+                        emit(stream, bulk_copy(r4, r5, r6, r7, d));
+                        break;
+                case 1 :
+                        emit(stream, bulk_fill(r4, r5, fuzz_data(seed), d));
+                        break;
+                case 2 :
+                        emit(stream, map_copy(r6, r4, r5, d));
+                        emit(stream, unmap_seg(r6));
+                        break;
+                default:
+                        emit(stream, output_range(r4, r5, d));
+                        break;
+        }
+}
+
+/* Copies or fills part of a fuzz segment a word at a time, going down,
+ * with r3 counting the words. A copy may come from segment 0, and may
+ * overlap either way
+ */
+static void emit_random_idiom(Seq_T stream, unsigned *seed, Um_register d)
+{
+        unsigned count = 1 + fuzz_rand(seed, FUZZ_SEGMENT_WORDS);
+        unsigned shift = fuzz_rand(seed, FUZZ_SEGMENT_WORDS - count + 1);
+        unsigned kind = fuzz_rand(seed, 3);
+        unsigned head;
+
+        emit(stream, loadval(r3, count));
+        emit(stream, loadval(r4, fuzz_rand(seed, FUZZ_SEGMENTS + 1)));
+        emit(stream, loadval(r5, 1 + fuzz_rand(seed, FUZZ_SEGMENTS)));
+        head = Seq_length(stream);
+        emit(stream, loadval(r7, 0));
+        emit(stream, bit_nand(r7, r7, r7));
+        emit(stream, add(r3, r3, r7));
+        emit(stream, loadval(r7, shift));
+        emit(stream, add(r7, r3, r7));
+        if (kind == 0) {
+                emit(stream, segment_store(r5, r7, d));
+        } else {
+                /* r7 is the shifted offset: of the store, or the load */
+                emit(stream, segment_load(r6, r4, kind == 1 ? r3 : r7));
+                emit(stream, segment_store(r5, kind == 1 ? r7 : r3, r6));
+        }
+        emit(stream, loadval(r6, Seq_length(stream) + 5));
+        emit(stream, loadval(r7, head));
+        emit(stream, conditional_move(r6, r7, r3));
+        emit(stream, loadval(r7, 0));
+        emit(stream, load_pro(r7, r6));
+}
+
+static void emit_random_block(Seq_T stream, unsigned *seed, bool in_loop)
+{
+        Um_register d = fuzz_data(seed);
+        unsigned length = Seq_length(stream);
+
+        /* Loops use r3, so they only go where no loop is running */
+        switch (fuzz_rand(seed, in_loop ? 11 : 13)) {
+                case 0 :
+                case 1 :
+                        emit(stream, random_arithmetic(seed));
+                        break;
+                case 2 :
+                        emit(stream, loadval(r7, 1 + fuzz_rand(seed, 1000)));
+                        emit(stream, divide(d, fuzz_data(seed), r7));
+                        break;
+                case 3 :
+                        /* Prints the low byte of a data register */
+                        emit(stream, loadval(r5, 255));
+                        emit(stream, bit_nand(r4, d, r5));
+                        emit(stream, bit_nand(r4, r4, r4));
+                        emit(stream, output(r4));
+                        break;
+                case 4 :
+                        emit(stream, loadval(r6, 1 + fuzz_rand(seed,
+                                                        FUZZ_SEGMENTS)));
+                        emit(stream, loadval(r7, fuzz_rand(seed,
+                                                FUZZ_SEGMENT_WORDS)));
+                        if (fuzz_rand(seed, 2) == 0) {
+                                emit(stream, segment_load(d, r6, r7));
+                        } else {
+                                emit(stream, segment_store(r6, r7, d));
+                        }
+                        break;
+                case 5 : {
+                        /* A short lived segment, whose identifier gets
+                         * reused
+                         */
+                        unsigned words = 1 + fuzz_rand(seed, 32);
+
+                        emit(stream, loadval(r4, words));
+                        emit(stream, map_seg(r6, r4));
+                        emit(stream, loadval(r7, fuzz_rand(seed, words)));
+                        emit(stream, segment_store(r6, r7, d));
+                        emit(stream, segment_load(fuzz_data(seed), r6, r7));
+                        emit(stream, unmap_seg(r6));
+                        break;
+                }
+                case 6 :
+                        /* Reads the program as data */
+                        emit(stream, loadval(r6, 0));
+                        emit(stream, loadval(r7, fuzz_rand(seed, length + 1)));
+                        emit(stream, segment_load(d, r6, r7));
+                        break;
+                case 7 :
+                        /* Rewrites the instruction just after the store, which
+                         * would halt if the store were missed
+                         */
+                        emit_word(stream, r5, r4, random_arithmetic(seed));
+                        emit(stream, loadval(r6, 0));
+                        emit(stream, loadval(r7, length + 8));
+                        emit(stream, segment_store(r6, r7, r5));
+                        emit(stream, halt());
+                        break;
+                case 8 : {
+                        /* Jumps over a few words that must never run */
+                        unsigned skip = 1 + fuzz_rand(seed, 4);
+
+                        emit(stream, loadval(r6, 0));
+                        emit(stream, loadval(r7, length + 3 + skip));
+                        emit(stream, load_pro(r6, r7));
+                        for (unsigned i = 0; i < skip; i++) {
+                                emit(stream, fuzz_rand(seed, 2) == 0 ? halt()
+                                                                : 0xf0000000);
+                        }
+                        break;
+                }
+                case 9 :
+                        emit_random_boolean(stream, seed, d);
+                        break;
+                case 10 :
+                        emit_random_ext(stream, seed, d);
+                        break;
+                case 11 :
+                        emit_random_idiom(stream, seed, d);
+                        break;
+                default: {
+                        /* A counted loop around a few more blocks */
+                        unsigned top;
+                        unsigned blocks = 1 + fuzz_rand(seed, 6);
+
+                        emit(stream, loadval(r3, 1 + fuzz_rand(seed, 50)));
+                        top = Seq_length(stream);
+                        for (unsigned i = 0; i < blocks; i++) {
+                                emit_random_block(stream, seed, true);
+                        }
+                        emit(stream, loadval(r5, 0));
+                        emit(stream, bit_nand(r5, r5, r5));
+                        emit(stream, add(r3, r3, r5));
+                        emit(stream, loadval(r7, Seq_length(stream) + 5));
+                        emit(stream, loadval(r4, top));
+                        emit(stream, conditional_move(r7, r4, r3));
+                        emit(stream, loadval(r5, 0));
+                        emit(stream, load_pro(r5, r7));
+                        break;
+                }
+        }
+}
+
+/* Function: emit_random_program
+ * Does: Emits a random, valid UM program of about length blocks. The
+ *       same seed always gives the same program
+ * Paramters: Seq_T, unsigned, unsigned
+ * Returns: None
+ */
+void emit_random_program(Seq_T stream, unsigned seed, unsigned length)
+{
+        for (unsigned i = 0; i < FUZZ_SEGMENTS; i++) {
+                emit(stream, loadval(r4, FUZZ_SEGMENT_WORDS));
+                emit(stream, map_seg(r5, r4));
+        }
+        for (unsigned i = 0; i < 3; i++) {
+                emit(stream, loadval(i, fuzz_rand(&seed, 1 << 25)));
+        }
+        emit(stream, input(r2));
+
+        for (unsigned i = 0; i < length; i++) {
+                emit_random_block(stream, &seed, false);
+        }
+
+        if (fuzz_rand(&seed, 2) == 0) {
+                emit(stream, halt());
+        } else {
+                /* Ends by running a new one word program that halts */
+                emit(stream, loadval(r4, 1));
+                emit(stream, map_seg(r6, r4));
+                emit_word(stream, r5, r4, halt());
+                emit(stream, loadval(r7, 0));
+                emit(stream, segment_store(r6, r7, r5));
+                emit(stream, load_pro(r6, r7));
+        }
+}
@@ -15,13 +15,25 @@ extern void emit_add_test(Seq_T instructions);
 extern void emit_digit_test(Seq_T instructions);
 extern void emit_conditional_move_test(Seq_T instructions);
 extern void emit_io_test(Seq_T instructions);
+extern void emit_cat_test(Seq_T instructions);
 extern void emit_advanced_test(Seq_T instructions);
 extern void emit_multiplication_test(Seq_T instructions);
 extern void emit_division_test(Seq_T instructions);
+extern void emit_boolean_test(Seq_T instructions);
+extern void emit_specialise_test(Seq_T instructions);
+extern void emit_idiom_test(Seq_T instructions);
+extern void emit_ext_test(Seq_T instructions);
+extern void emit_threads_test(Seq_T instructions);
 extern void emit_unmap_test(Seq_T instructions);
 extern void emit_segments_test(Seq_T instructions);
 extern void emit_load_pro_test(Seq_T instructions);
 extern void emit_five_hundred_k_test(Seq_T instructions);
+extern void emit_bad_segment_test(Seq_T instructions);
+extern void emit_bad_offset_test(Seq_T instructions);
+extern void emit_divide_by_zero_test(Seq_T instructions);
+extern void emit_unmapped_load_test(Seq_T instructions);
+extern void emit_join_self_test(Seq_T instructions);
+extern void emit_limit_test(Seq_T instructions);
 
 /* The array `tests` contains all unit tests for the lab. */
 
@@ -34,17 +46,30 @@ static struct test_info {
 } tests[] = {
         { "halt", NULL, "", emit_halt_test },
         { "halt-verbose", NULL, "", emit_verbose_halt_test },
-        { "add", NULL, "", emit_add_test },
-        { "print-six", NULL, "", emit_digit_test },
-        { "condi-mov", NULL, "", emit_conditional_move_test },
-        { "io", NULL, "", emit_io_test },
-        { "advanced", NULL, "", emit_advanced_test },
-        { "multiply", NULL, "", emit_multiplication_test},
-        { "divide", NULL, "", emit_division_test},
-        { "unmap", NULL, "", emit_unmap_test},
+        { "add", NULL, "\003", emit_add_test },
+        { "print-six", NULL, "6", emit_digit_test },
+        { "condi-mov", NULL, "\002\003\002\003\003\003",
+          emit_conditional_move_test },
+        { "io", "I", "I", emit_io_test },
+        { "cat", "Meow\n", "Meow\n", emit_cat_test },
+        { "advanced", "5", "\0055", emit_advanced_test },
+        { "multiply", NULL, "d", emit_multiplication_test},
+        { "divide", NULL, "d", emit_division_test},
+        { "boolean", NULL, "0\374\314\017Z2", emit_boolean_test},
+        { "specialise", NULL, "\003\372\014", emit_specialise_test},
+        { "idiom", NULL, "czfz)z.", emit_idiom_test},
+        { "ext", NULL, "AAbAAbbbbAAb\n", emit_ext_test},
+        { "threads", NULL, "abcdx\n", emit_threads_test},
+        { "unmap", NULL, "\002\002", emit_unmap_test},
         { "segments", NULL, "", emit_segments_test},
         { "loadpro", NULL, "", emit_load_pro_test},
         { "fivehundredk", NULL, "", emit_five_hundred_k_test},
+        { "badseg", NULL, "o", emit_bad_segment_test},
+        { "badoffset", NULL, "o", emit_bad_offset_test},
+        { "divzero", NULL, "o", emit_divide_by_zero_test},
+        { "unmapped-load", NULL, "o", emit_unmapped_load_test},
+        { "joinself", NULL, "o", emit_join_self_test},
+        { "limit", NULL, "o", emit_limit_test},
 };
 
   
@@ -0,0 +1,728 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <seq.h>
+#include <uarray.h>
+
+#include "vm_interface.h"
+#include "io_dev.h"
+#include "mem_interface.h"
+#include "ops_interface.h"
+#include "decode.h"
+#include "peephole.h"
+#include "handlers.h"
+#include "specialise.h"
+#include "idiom.h"
+#include "guard.h"
+#include "trap.h"
+#include "callgraph.h"
+#include "write_barrier.h"
+#include "threads.h"
+
+/* Counters are read from other threads; see um_vm */
+static inline void count(uint64_t *counter, uint64_t n)
+{
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Counts a load_program by kind, before it runs */
+static inline void count_load(um_vm vm, bool replaces)
+{
+        count(replaces ? &vm->replacements : &vm->jumps, 1);
+}
+
+/* Function: vm_new
+ * Does: Creates a UM with the given program loaded as segment 0
+ * Paramters: FILE*, FILE*, FILE*
+ * Returns: um_vm
+ */
+um_vm vm_new(FILE *program, FILE *in, FILE *out)
+{
+        um_mem mem = init_mem();
+
+        init_prog(mem, program);
+        return vm_adopt(mem, NULL, in, out);
+}
+
+/* Function: vm_adopt
+ * Does: Creates a UM around memory whose segment 0 is already loaded and,
+ *       optionally, a decoded copy of it (NULL to decode on first run).
+ *       Both belong to the UM from here on
+ * Paramters: um_mem, decoded_prog, FILE*, FILE*
+ * Returns: um_vm
+ */
+um_vm vm_adopt(um_mem mem, decoded_prog prog, FILE *in, FILE *out)
+{
+        um_vm vm = malloc(sizeof(*vm));
+
+        vm->registers = initialize_regs();
+        vm->mem = mem;
+        vm->prog_count = 0;
+        vm->io = io_new(in, out);
+        vm->prog = prog;
+        vm->instructions = 0;
+        vm->jumps = 0;
+        vm->replacements = 0;
+        vm->ext = false;
+        vm->access = NULL;
+        vm->latency = NULL;
+        vm->calls = NULL;
+        vm->trap = TRAP_NONE;
+        vm->threaded = false;
+        vm->thread_id = 0;
+        vm->threads = NULL;
+
+        return vm;
+}
+
+/* Function: vm_thread
+ * Does: Creates another thread of a UM (threads.h), starting at pc with a
+ *       copy of its registers, on its memory and I/O device. The thread
+ *       decodes segment 0 for itself on first run
+ * Paramters: um_vm, uint32_t, uint32_t
+ * Returns: um_vm
+ */
+um_vm vm_thread(um_vm vm, uint32_t id, uint32_t pc)
+{
+        um_vm thread = malloc(sizeof(*thread));
+
+        *thread = *vm;
+        thread->registers = initialize_regs();
+        for (unsigned i = 0; i < 8; i++) {
+                update_reg(thread->registers, i, at_reg(vm->registers, i));
+        }
+        thread->prog_count = pc;
+        thread->prog = NULL;
+        thread->instructions = 0;
+        thread->jumps = 0;
+        thread->replacements = 0;
+        thread->trap = TRAP_NONE;
+        thread->thread_id = id;
+
+        return thread;
+}
+
+/* Function: vm_free
+ * Does: Frees a UM. Its program and I/O files stay open. Only the first
+ *       thread of a UM frees its memory, I/O device and other threads
+ * Paramters: um_vm*
+ * Returns: None
+ */
+void vm_free(um_vm *vm)
+{
+        if ((*vm)->prog != NULL) {
+                decode_free(&(*vm)->prog);
+        }
+        if ((*vm)->thread_id == 0) {
+                if ((*vm)->threads != NULL) {
+                        threads_free(&(*vm)->threads);
+                }
+                free_mem((*vm)->mem);
+                io_free(&(*vm)->io);
+        }
+        free_regs((*vm)->registers);
+        free(*vm);
+        *vm = NULL;
+}
+
+/* Records a segmented load or store that has just run, if asked to, in
+ * the access map or the uses recorded for an arena profile
+ */
+static inline void note_access(um_vm vm, uint32_t seg_num, uint32_t offset,
+                               bool store)
+{
+        if (vm->access != NULL) {
+                access_record(vm->access, seg_num, offset,
+                              &seg_words(vm->mem, seg_num)[offset], store);
+        }
+        if (vm->mem->trace != NULL) {
+                mem_note_use(vm->mem, seg_num);
+        }
+}
+
+/* Times an input instruction that has just run, if asked to. executed is
+ * how many instructions have run before it in this call
+ */
+static inline void note_input(um_vm vm, unsigned c, uint64_t executed)
+{
+        if (vm->latency != NULL) {
+                latency_input(vm->latency, at_reg(vm->registers, c),
+                              vm->instructions + executed);
+        }
+}
+
+/* Times an output instruction that has just run, if asked to */
+static inline void note_output(um_vm vm)
+{
+        if (vm->latency != NULL) {
+                latency_output(vm->latency);
+        }
+}
+
+/* Shows a call graph a load_program within segment 0 about to run, if
+ * asked to. executed is how many instructions have run in this call, it
+ * included
+ */
+static inline void note_jump(um_vm vm, uint32_t pc, unsigned c,
+                             uint64_t executed)
+{
+        if (vm->calls != NULL) {
+                callgraph_jump(vm->calls, seg_words(vm->mem, 0), pc, c,
+                               UArray_at(vm->registers, 0),
+                               vm->instructions + executed);
+        }
+}
+
+/* Stops at the instruction at pc, just taken from the budget, so that it
+ * runs again once the I/O device is ready for it
+ */
+static inline vm_status blocked_at(um_vm vm, uint32_t pc)
+{
+        vm->prog_count = pc;
+        vm->remaining++;
+        return VM_BLOCKED;
+}
+
+/* Function: run_decoded
+ * Does: The engine of run_for: runs at most budget instructions from a
+ *       decoded copy of segment 0 and says why it stopped. Everything
+ *       needed to carry on lives in the VM, so a later call, on any
+ *       thread, resumes exactly where this one left off. The copy is
+ *       rebuilt in one pass whenever load_program installs a new segment
+ *       0, and a page of it is re-decoded when the write barrier reports a
+ *       store into that page. Once a jump lands in a page, its runs of
+ *       register-only instructions are folded (peephole.c) and run as one,
+ *       unless the budget would run out inside them, and the busiest
+ *       opcodes left run handlers specialised to their registers.
+ *       Multiplies and divides whose operand settles on one value run a
+ *       guarded fast path for it (specialise.c), and loops that copy, fill
+ *       or scan segments run as one memmove, fill or scan (idiom.c)
+ * Paramters: um_vm, uint64_t
+ * Returns: vm_status
+ */
+static vm_status run_decoded(um_vm vm, uint64_t budget)
+{
+        um_mem mem = vm->mem;
+        UArray_T registers = vm->registers;
+        uint32_t *prog_count = &vm->prog_count;
+        uint64_t *remaining = &vm->remaining;
+        vm_status status = VM_YIELDED;
+
+        *remaining = budget;
+
+        if (vm->prog == NULL) {
+                vm->prog = decode_new(seg_words(mem, 0), seg_length(mem, 0));
+        }
+        if (vm->prog->folds == NULL) {
+                peephole_start(vm->prog);
+        }
+        decoded_prog prog = vm->prog;
+        peephole_enter(prog, *prog_count);
+        decode_attach(prog, seg_words(mem, 0));
+        if (mem->epochs != NULL) {
+                wb_freeze();
+        }
+        guard_attach(mem);
+
+        /* The handlers work on the register file directly */
+        uint32_t *r = UArray_at(registers, 0);
+
+        /* Keeps running until the program counter points to the last 
+         * instruction, or the budget runs out
+         */
+        while (status == VM_YIELDED && *remaining > 0) {
+                uint32_t pc = *prog_count;
+                uint32_t opcode = prog->opcode[pc];
+                unsigned a = prog->a[pc];
+                unsigned b = prog->b[pc];
+                unsigned c = prog->c[pc];
+                unsigned lvalue = prog->lvalue[pc];
+
+                *prog_count = *prog_count + 1; 
+                (*remaining)--;
+                /* Both are in memory before a fault can land in a signal */
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+                /* Executes the specified instruction */
+dispatch:
+                switch (opcode) {
+                        case 0 :
+                                conditional_move(registers, a, b, c);
+                                break;
+                        case 1 :
+                                segmented_load_cached(registers, mem, 
+                                        &prog->caches[prog->site[pc]], a, b, c);
+                                break;
+                        case 2 :
+                                segmented_store_cached(registers, mem, 
+                                        &prog->caches[prog->site[pc]], a, b, c);
+                                break;
+                        case 3 :
+                                addition(registers, a, b, c);
+                                break;
+                        case 4 :
+                                multiplication(registers, a, b, c);
+                                break;
+                        case 5 :
+                                division(registers, a, b, c);
+                                break;
+                        case 6 :
+                                bitwise_NAND(registers, a, b, c);
+                                break;
+                        case 7 :
+                                halt(mem, prog_count);
+                                break;
+                        case 8 :
+                                map_segment(registers, mem, b, c);
+                                break;
+                        case 9 :
+                                unmap_segment(registers, mem, c);
+                                break;
+                        case 10 :
+                                if (!io_room(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                output(registers, vm->io, c);
+                                note_output(vm);
+                                break;
+                        case 11 :
+                                if (!io_ready(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                input(registers, vm->io, c);
+                                note_input(vm, c, budget - *remaining - 1);
+                                break;
+                        case 12 : {
+                                bool replaces = at_reg(registers, b) != 0;
+
+                                count_load(vm, replaces);
+                                if (!replaces) {
+                                        note_jump(vm, pc, c,
+                                                  budget - *remaining);
+                                }
+                                load_program(mem, registers, prog_count, b, c);
+                                if (replaces) {
+                                        decode_free(&vm->prog);
+                                        vm->prog = decode_new(
+                                                seg_words(mem, 0), 
+                                                seg_length(mem, 0));
+                                        prog = vm->prog;
+                                        peephole_start(prog);
+                                        decode_attach(prog, seg_words(mem, 0));
+                                }
+                                peephole_enter(prog, *prog_count);
+                                break;
+                        }
+                        case 13 :
+                                load_value(registers, a, lvalue);
+                                break;
+                        case OP_FOLDED : {
+                                uint32_t length = peephole_run(prog->folds,
+                                        lvalue, registers, *remaining + 1);
+
+                                if (length == 0) {
+                                        /* The budget ends inside the run */
+                                        decode_word(seg_words(mem, 0)[pc],
+                                                    &opcode, &a, &b, &c,
+                                                    &lvalue);
+                                        goto dispatch;
+                                }
+                                *prog_count = pc + length;
+                                *remaining -= length - 1;
+                                break;
+                        }
+                        case OP_REGS :
+                                reg_handlers[lvalue](r);
+                                break;
+                        case OP_MEMORY :
+                                mem_handlers[lvalue](r, mem,
+                                        &prog->caches[prog->site[pc]]);
+                                break;
+                        case OP_PROFILE :
+                                opcode = specialise_profile(prog, lvalue, r);
+                                goto dispatch;
+                        case OP_SPECIALISED :
+                                if (specialise_run(prog, lvalue, r)) {
+                                        break;
+                                }
+                                /* The guard failed: the general instruction */
+                                opcode = prog->values->sites[lvalue].opcode;
+                                goto dispatch;
+                        case OP_IDIOM : {
+                                struct idiom_loop *loop =
+                                        &prog->idioms->loops[lvalue];
+                                uint64_t length = 0;
+
+                                /* A call graph must see every jump */
+                                if (vm->calls == NULL) {
+                                        length = idiom_run(prog, lvalue, r,
+                                                mem, *remaining + 1,
+                                                prog_count);
+                                }
+                                if (length == 0) {
+                                        opcode = loop->saved_opcode;
+                                        lvalue = loop->saved_lvalue;
+                                        goto dispatch;
+                                }
+                                count(&vm->jumps, length / loop->length);
+                                *remaining -= length - 1;
+                                break;
+                        }
+                        case OP_RAW :
+                                decode_word(seg_words(mem, 0)[pc], &opcode, 
+                                            &a, &b, &c, &lvalue);
+                                goto dispatch;
+                        case OP_STALE :
+                                /* Segment 0 was written: decode it again */
+                                *prog_count = pc;
+                                (*remaining)++;
+                                decode_refresh(prog, seg_words(mem, 0), pc);
+                                continue;
+                        case EXT_MEMORY :
+                        case EXT_OUTPUT :
+                                if (opcode == EXT_OUTPUT && !io_room(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                /* The word past the end decodes as 14 too */
+                                if (vm->ext && pc < prog->length &&
+                                    extension(registers, mem, vm->io,
+                                              seg_words(mem, 0)[pc])) {
+                                        if (opcode == EXT_OUTPUT) {
+                                                note_output(vm);
+                                        }
+                                        break;
+                                }
+                                if (pc < prog->length &&
+                                    threads_extension(vm,
+                                                      seg_words(mem, 0)[pc])) {
+                                        break;
+                                }
+                                /* fall through */
+                        default:
+                                trap_raise(TRAP_BAD_OPCODE);
+                }
+
+                /* Check if the last instruction has been executed*/
+                if (*prog_count >= prog->length) {
+                        if (*prog_count > prog->length) {
+                                vm->trap = TRAP_PC_OUT_OF_BOUNDS;
+                                status = VM_FAULTED;
+                        } else {
+                                status = VM_HALTED;
+                        }
+                } 
+        }
+
+        decode_detach();
+        guard_detach();
+        count(&vm->instructions, budget - *remaining);
+
+        return status;
+}
+
+/* Function: run_words
+ * Does: The engine of run_ref: runs at most budget instructions the plain
+ *       way. Each instruction is fetched from segment 0 and decoded as it
+ *       runs, and segments are looked up on every access. Slow, but with
+ *       nothing cached it is the reference the faster engines are checked
+ *       against, and where an access map sees every segmented load and
+ *       store
+ * Paramters: um_vm, uint64_t
+ * Returns: vm_status
+ */
+static vm_status run_words(um_vm vm, uint64_t budget)
+{
+        um_mem mem = vm->mem;
+        UArray_T registers = vm->registers;
+        uint32_t *prog_count = &vm->prog_count;
+        uint64_t *remaining = &vm->remaining;
+        vm_status status = VM_YIELDED;
+
+        *remaining = budget;
+
+        while (status == VM_YIELDED && *remaining > 0) {
+                uint32_t pc = *prog_count;
+                uint32_t instruction = get_word(mem, 0, pc);
+                uint32_t opcode;
+                unsigned a, b, c, lvalue;
+                decode_word(instruction, &opcode, &a, &b, &c, &lvalue);
+
+                *prog_count = *prog_count + 1; 
+                (*remaining)--;
+                /* Both are in memory before a fault can land in a signal */
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+                /* Executes the specified instruction */
+                switch (opcode) {
+                        case 0 :
+                                conditional_move(registers, a, b, c);
+                                break;
+                        case 1 : {
+                                uint32_t seg_num = at_reg(registers, b);
+                                uint32_t offset = at_reg(registers, c);
+
+                                segmented_load(registers, mem, a, b, c);
+                                note_access(vm, seg_num, offset, false);
+                                break;
+                        }
+                        case 2 : {
+                                uint32_t seg_num = at_reg(registers, a);
+                                uint32_t offset = at_reg(registers, b);
+
+                                segmented_store(registers, mem, a, b, c);
+                                note_access(vm, seg_num, offset, true);
+                                break;
+                        }
+                        case 3 :
+                                addition(registers, a, b, c);
+                                break;
+                        case 4 :
+                                multiplication(registers, a, b, c);
+                                break;
+                        case 5 :
+                                division(registers, a, b, c);
+                                break;
+                        case 6 :
+                                bitwise_NAND(registers, a, b, c);
+                                break;
+                        case 7 :
+                                halt(mem, prog_count);
+                                break;
+                        case 8 :
+                                map_segment(registers, mem, b, c);
+                                break;
+                        case 9 :
+                                unmap_segment(registers, mem, c);
+                                break;
+                        case 10 :
+                                if (!io_room(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                output(registers, vm->io, c);
+                                note_output(vm);
+                                break;
+                        case 11 :
+                                if (!io_ready(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                input(registers, vm->io, c);
+                                note_input(vm, c, budget - *remaining - 1);
+                                break;
+                        case 12 : {
+                                bool replaces = at_reg(registers, b) != 0;
+
+                                count_load(vm, replaces);
+                                if (!replaces) {
+                                        note_jump(vm, pc, c,
+                                                  budget - *remaining);
+                                }
+                                load_program(mem, registers, prog_count, b, c);
+                                break;
+                        }
+                        case 13 :
+                                load_value(registers, a, lvalue);
+                                break;
+                        case EXT_MEMORY :
+                        case EXT_OUTPUT :
+                                if (opcode == EXT_OUTPUT && !io_room(vm->io)) {
+                                        status = blocked_at(vm, pc);
+                                        continue;
+                                }
+                                if (vm->ext && extension(registers, mem,
+                                                         vm->io,
+                                                         instruction)) {
+                                        if (opcode == EXT_OUTPUT) {
+                                                note_output(vm);
+                                        }
+                                        break;
+                                }
+                                if (threads_extension(vm, instruction)) {
+                                        break;
+                                }
+                                /* fall through */
+                        default:
+                                trap_raise(TRAP_BAD_OPCODE);
+                }
+
+                /* Check if the last instruction has been executed*/
+                uint32_t length = seg_length(mem, 0);
+                if (*prog_count >= length) {
+                        if (*prog_count > length) {
+                                vm->trap = TRAP_PC_OUT_OF_BOUNDS;
+                                status = VM_FAULTED;
+                        } else {
+                                status = VM_HALTED;
+                        }
+                } 
+        }
+
+        count(&vm->instructions, budget - *remaining);
+
+        return status;
+}
+
+typedef vm_status (*engine)(um_vm vm, uint64_t budget);
+
+/* Function: run_trapped
+ * Does: Runs an engine with a trap frame around it. A fault anywhere in
+ *       the instructions it runs lands here: the UM stops at the failing
+ *       instruction with the cause in vm->trap, as if it had not started.
+ *       The engines keep what is left of the budget in the VM, so the
+ *       instructions run before the failing one are still counted. Kept
+ *       apart from the engines so that none of their locals live across
+ *       sigsetjmp
+ * Paramters: um_vm, uint64_t, engine
+ * Returns: vm_status
+ */
+static vm_status run_trapped(um_vm vm, uint64_t budget, engine run)
+{
+        struct trap_frame frame;
+        int cause = sigsetjmp(frame.env, 1);
+
+        if (cause != TRAP_NONE) {
+                decode_detach();
+                guard_detach();
+                vm->prog_count--;
+                /* The failing instruction was taken from the budget */
+                count(&vm->instructions, budget - vm->remaining - 1);
+                vm->trap = cause;
+                return VM_FAULTED;
+        }
+
+        trap_push(&frame);
+        vm_status status = run(vm, budget);
+        trap_pop(&frame);
+
+        return status;
+}
+
+/* Function: run_for
+ * Does: Runs at most budget instructions on the decoded engine (see
+ *       run_decoded) and says why it stopped
+ * Paramters: um_vm, uint64_t
+ * Returns: vm_status
+ */
+vm_status run_for(um_vm vm, uint64_t budget)
+{
+        return run_trapped(vm, budget, run_decoded);
+}
+
+/* Function: run_ref
+ * Does: Runs at most budget instructions on the reference engine (see
+ *       run_words) and says why it stopped
+ * Paramters: um_vm, uint64_t
+ * Returns: vm_status
+ */
+vm_status run_ref(um_vm vm, uint64_t budget)
+{
+        return run_trapped(vm, budget, run_words);
+}
+
+/* Function: vm_faulted_thread
+ * Does: Gives the UM whose fault stopped vm: the thread that faulted if
+ *       vm was stopped by another thread's fault, else vm itself
+ * Paramters: um_vm
+ * Returns: um_vm
+ */
+um_vm vm_faulted_thread(um_vm vm)
+{
+        if (vm->trap == TRAP_THREAD && vm->threads != NULL &&
+            threads_faulted(vm->threads) != NULL) {
+                return threads_faulted(vm->threads);
+        }
+        return vm;
+}
+
+/* Function: vm_report_trap
+ * Does: Prints why a faulted UM stopped: the cause, the program counter,
+ *       the word there with its fields, and the registers. For a UM whose
+ *       threads were stopped by another's fault, that thread's
+ * Paramters: FILE*, um_vm
+ * Returns: None
+ */
+void vm_report_trap(FILE *out, um_vm vm)
+{
+        if (vm_faulted_thread(vm) != vm) {
+                vm = vm_faulted_thread(vm);
+                fprintf(out, "In thread %u:\n", vm->thread_id);
+        }
+
+        uint32_t pc = vm->prog_count;
+
+        fprintf(out, "Error: %s\n", trap_message(vm->trap));
+        if (pc < seg_length(vm->mem, 0)) {
+                uint32_t word = seg_words(vm->mem, 0)[pc];
+                uint32_t opcode;
+                unsigned a, b, c, lvalue;
+
+                decode_word(word, &opcode, &a, &b, &c, &lvalue);
+                fprintf(out, "  at pc %u: word 0x%08x (opcode %u", pc, word,
+                        opcode);
+                if (opcode == 13) {
+                        fprintf(out, ", a %u, value %u)\n", a, lvalue);
+                } else {
+                        fprintf(out, ", a %u, b %u, c %u)\n", a, b, c);
+                }
+        } else {
+                fprintf(out, "  at pc %u, past the end of segment 0 (%u "
+                        "words)\n", pc, seg_length(vm->mem, 0));
+        }
+        fprintf(out, " ");
+        for (unsigned i = 0; i < 8; i++) {
+                fprintf(out, " r%u=0x%08x", i, at_reg(vm->registers, i));
+        }
+        fprintf(out, "\n");
+}
+
+/* Function: vm_run
+ * Does: Runs the UM until it halts or faults, waiting for input whenever
+ *       it has to. A UM with an access map, or recording uses, runs on
+ *       run_ref, which feeds them. A UM with threads runs shorter slices,
+ *       passing a quiescent point after each, and its first thread waits
+ *       for the others at the end
+ * Paramters: um_vm
+ * Returns: vm_status (VM_HALTED or VM_FAULTED)
+ */
+vm_status vm_run(um_vm vm)
+{
+        vm_status status;
+
+        do {
+                uint64_t slice = vm->threads != NULL ? THREADS_SLICE
+                                                     : VM_SLICE;
+
+                status = vm->access != NULL || vm->mem->trace != NULL
+                         ? run_ref(vm, slice) : run_for(vm, slice);
+                if (vm->threads != NULL) {
+                        status = threads_quiesce(vm, status);
+                }
+                if (status == VM_BLOCKED) {
+                        io_wait(vm->io);
+                }
+        } while (status == VM_YIELDED || status == VM_BLOCKED);
+
+        if (vm->threads != NULL && vm->thread_id == 0) {
+                status = threads_finish(vm, status);
+        }
+        return status;
+}
+
+/* Function: run_program
+ * Does: Runs the UM until it halts. A fault is reported and the process
+ *       fails
+ * Paramters: um_vm
+ * Returns: none
+ */
+void run_prog(um_vm vm)
+{
+        if (vm_run(vm) == VM_FAULTED) {
+                vm_report_trap(stderr, vm);
+                exit(EXIT_FAILURE);
+        }
+}
@@ -0,0 +1,68 @@
+#ifndef VM_INTERFACE_INCLUDED
+#define VM_INTERFACE_INCLUDED
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <seq.h>
+#include <uarray.h>
+
+#include "io_dev.h"
+#include "mem_interface.h"
+#include "decode.h"
+#include "access_map.h"
+#include "latency.h"
+#include "trap.h"
+#include "callgraph.h"
+
+/* Why run_for returned */
+typedef enum vm_status {
+        VM_YIELDED = 0,         /* used up its instruction budget */
+        VM_HALTED,              /* halted or ran off the end of segment 0 */
+        VM_BLOCKED,             /* next is input with none ready, or
+                                   output with no room (io_room) */
+        VM_FAULTED              /* stopped at a failing instruction */
+} vm_status;
+
+/* Instructions run_prog runs at a time, so that the counters another
+ * thread may be watching never fall far behind
+ */
+#define VM_SLICE (1 << 24)
+
+/* One complete UM. Instances share nothing, so several can run at once on
+ * different threads, and one can be stopped on one thread and resumed on
+ * another. The counters are only written by the thread running the UM and
+ * may be read (relaxed) from any other. The threads of one UM (threads.h)
+ * are instances too, but share the memory and I/O device of the first.
+ */
+typedef struct um_vm {
+        um_mem mem;
+        UArray_T registers;
+        uint32_t prog_count;
+        io_dev io;
+        decoded_prog prog;
+        uint64_t instructions;
+        uint64_t remaining;             /* of the budget of a run under way */
+        uint64_t jumps;                 /* load_program within segment 0 */
+        uint64_t replacements;          /* load_program of new code */
+        bool ext;                       /* opcodes 14 and 15 allowed */
+        access_map access;              /* run_ref records loads and stores */
+        latency_stats latency;          /* timed at each input and output */
+        call_graph calls;               /* told of each jump in segment 0 */
+        trap_cause trap;                /* why it faulted */
+        bool threaded;                  /* EXT_SPAWN, EXT_JOIN, EXT_CAS */
+        uint32_t thread_id;             /* 0 unless spawned */
+        struct um_threads *threads;     /* NULL until the first spawn */
+} *um_vm;
+
+um_vm vm_new(FILE *program, FILE *in, FILE *out);
+um_vm vm_adopt(um_mem mem, decoded_prog prog, FILE *in, FILE *out);
+um_vm vm_thread(um_vm vm, uint32_t id, uint32_t pc);
+void vm_free(um_vm *vm);
+vm_status run_for(um_vm vm, uint64_t budget);
+vm_status run_ref(um_vm vm, uint64_t budget);
+um_vm vm_faulted_thread(um_vm vm);
+void vm_report_trap(FILE *out, um_vm vm);
+vm_status vm_run(um_vm vm);
+void run_prog(um_vm vm);
+
+#endif
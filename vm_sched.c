@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "vm_sched.h"
+#include "vm_interface.h"
+#include "io_dev.h"
+
+/* A VM handed to the scheduler, and where it is up to */
+struct um_job {
+        um_vm vm;
+        unsigned priority;
+        uint64_t budget;        /* 0 means no limit */
+        uint64_t start;         /* vm->instructions when submitted */
+        vm_status status;
+        bool done;
+        bool parked;            /* blocked on I/O, not in any queue */
+        bool notified;          /* finished has been called */
+        sched_finished finished; /* NULL for none */
+        void *cl;
+        um_job next;
+};
+
+/* Runnable jobs wait in one FIFO per priority. Everything here is guarded
+ * by lock; the VMs themselves are only touched by the worker running them.
+ */
+struct sched {
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t finished;
+        um_job head[SCHED_PRIORITIES];
+        um_job tail[SCHED_PRIORITIES];
+        bool shutdown;
+        unsigned num_threads;
+        pthread_t *threads;
+};
+
+static void enqueue(sched s, um_job job)
+{
+        job->next = NULL;
+        if (s->tail[job->priority] == NULL) {
+                s->head[job->priority] = job;
+        } else {
+                s->tail[job->priority]->next = job;
+        }
+        s->tail[job->priority] = job;
+        pthread_cond_signal(&s->work);
+}
+
+static um_job dequeue(sched s)
+{
+        for (int p = SCHED_PRIORITIES - 1; p >= 0; p--) {
+                um_job job = s->head[p];
+
+                if (job != NULL) {
+                        s->head[p] = job->next;
+                        if (s->head[p] == NULL) {
+                                s->tail[p] = NULL;
+                        }
+                        return job;
+                }
+        }
+        return NULL;
+}
+
+/* Tells the job's hook, if any, that it has finished. Called unlocked,
+ * so the hook may take its time; sched_wait waits for it
+ */
+static void notify(sched s, um_job job)
+{
+        job->finished(job->vm, job->status, job->cl);
+
+        pthread_mutex_lock(&s->lock);
+        job->notified = true;
+        pthread_cond_broadcast(&s->finished);
+        pthread_mutex_unlock(&s->lock);
+}
+
+static void finish(sched s, um_job job, vm_status status)
+{
+        job->status = status;
+        job->done = true;
+        job->notified = job->finished == NULL;
+        pthread_cond_broadcast(&s->finished);
+}
+
+/* Function: worker
+ * Does: Runs one slice at a time of the highest priority runnable job,
+ *       putting it back in its queue, parking it until input arrives or
+ *       its output is taken, or finishing it, depending on why the slice
+ *       ended
+ * Paramters: void* (the sched)
+ * Returns: NULL
+ */
+static void *worker(void *cl)
+{
+        sched s = cl;
+
+        pthread_mutex_lock(&s->lock);
+        for (;;) {
+                um_job job;
+
+                while ((job = dequeue(s)) == NULL && !s->shutdown) {
+                        pthread_cond_wait(&s->work, &s->lock);
+                }
+                if (job == NULL) {
+                        break;
+                }
+                pthread_mutex_unlock(&s->lock);
+
+                uint64_t slice = SCHED_SLICE;
+                uint64_t used = job->vm->instructions - job->start;
+                if (job->budget != 0 && job->budget - used < slice) {
+                        slice = job->budget - used;
+                }
+                vm_status status = run_for(job->vm, slice);
+                used = job->vm->instructions - job->start;
+
+                pthread_mutex_lock(&s->lock);
+                switch (status) {
+                        case VM_YIELDED :
+                                if (job->budget != 0 && used >= job->budget) {
+                                        finish(s, job, VM_YIELDED);
+                                } else {
+                                        enqueue(s, job);
+                                }
+                                break;
+                        case VM_BLOCKED :
+                                /* Input may have been fed, or output
+                                 * taken, since run_for looked
+                                 */
+                                if (io_ready(job->vm->io) &&
+                                    io_room(job->vm->io)) {
+                                        enqueue(s, job);
+                                } else {
+                                        job->parked = true;
+                                }
+                                break;
+                        default :
+                                finish(s, job, status);
+                                break;
+                }
+                if (job->done && !job->notified) {
+                        pthread_mutex_unlock(&s->lock);
+                        notify(s, job);
+                        pthread_mutex_lock(&s->lock);
+                }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        return NULL;
+}
+
+/* Function: sched_new
+ * Does: Starts a scheduler with a fixed number of worker threads
+ * Paramters: unsigned
+ * Returns: sched
+ */
+sched sched_new(unsigned num_threads)
+{
+        sched s = calloc(1, sizeof(*s));
+
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->work, NULL);
+        pthread_cond_init(&s->finished, NULL);
+        s->num_threads = num_threads == 0 ? 1 : num_threads;
+        s->threads = malloc(s->num_threads * sizeof(*s->threads));
+
+        for (unsigned i = 0; i < s->num_threads; i++) {
+                pthread_create(&s->threads[i], NULL, worker, s);
+        }
+
+        return s;
+}
+
+/* Function: sched_free
+ * Does: Lets the workers finish every runnable job, then stops them.
+ *       Jobs still parked on input are left as they are
+ * Paramters: sched*
+ * Returns: None
+ */
+void sched_free(sched *s)
+{
+        pthread_mutex_lock(&(*s)->lock);
+        (*s)->shutdown = true;
+        pthread_cond_broadcast(&(*s)->work);
+        pthread_mutex_unlock(&(*s)->lock);
+
+        for (unsigned i = 0; i < (*s)->num_threads; i++) {
+                pthread_join((*s)->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&(*s)->lock);
+        pthread_cond_destroy(&(*s)->work);
+        pthread_cond_destroy(&(*s)->finished);
+        free((*s)->threads);
+        free(*s);
+        *s = NULL;
+}
+
+/* Function: sched_submit
+ * Does: Queues a VM to run at a priority, for at most budget instructions
+ *       from now (0 for no limit). The VM belongs to the scheduler until
+ *       sched_wait returns
+ * Paramters: sched, um_vm, unsigned, uint64_t
+ * Returns: um_job
+ */
+um_job sched_submit(sched s, um_vm vm, unsigned priority, uint64_t budget)
+{
+        um_job job = calloc(1, sizeof(*job));
+
+        job->vm = vm;
+        job->priority = priority < SCHED_PRIORITIES ? priority
+                                                    : SCHED_PRIORITIES - 1;
+        job->budget = budget;
+        job->start = vm->instructions;
+
+        pthread_mutex_lock(&s->lock);
+        enqueue(s, job);
+        pthread_mutex_unlock(&s->lock);
+
+        return job;
+}
+
+static void wake(sched s, um_job job)
+{
+        if (job->parked) {
+                job->parked = false;
+                enqueue(s, job);
+        }
+}
+
+/* Function: sched_feed
+ * Does: Hands input bytes to a job's VM, waking it if it was parked.
+ *       The VM must have been made without an input file
+ * Paramters: sched, um_job, const void*, size_t
+ * Returns: None
+ */
+void sched_feed(sched s, um_job job, const void *bytes, size_t length)
+{
+        pthread_mutex_lock(&s->lock);
+        io_feed(job->vm->io, bytes, length);
+        wake(s, job);
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Function: sched_close_input
+ * Does: Ends a job's input, so that it reads end of file once the bytes
+ *       already fed are used up
+ * Paramters: sched, um_job
+ * Returns: None
+ */
+void sched_close_input(sched s, um_job job)
+{
+        pthread_mutex_lock(&s->lock);
+        io_close_input(job->vm->io);
+        wake(s, job);
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Function: sched_take_output
+ * Does: Takes up to max bytes of a job's output, waiting until there is
+ *       some, and wakes the job if it was parked for want of room. The VM
+ *       must have been made without an output file; its output ends once
+ *       the job's hook calls io_close_output
+ * Paramters: sched, um_job, void*, size_t
+ * Returns: size_t (0 once its output has ended and all of it is taken)
+ */
+size_t sched_take_output(sched s, um_job job, void *bytes, size_t max)
+{
+        size_t length = io_take(job->vm->io, bytes, max);
+
+        pthread_mutex_lock(&s->lock);
+        if (io_ready(job->vm->io) && io_room(job->vm->io)) {
+                wake(s, job);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        return length;
+}
+
+/* Function: sched_on_finish
+ * Does: Has a function called as soon as a job finishes, on the worker
+ *       that finished it (or at once, here, if it already has), so that a
+ *       caller waiting on something else (its output, say) can be told
+ * Paramters: sched, um_job, sched_finished, void*
+ * Returns: None
+ */
+void sched_on_finish(sched s, um_job job, sched_finished finished, void *cl)
+{
+        pthread_mutex_lock(&s->lock);
+        job->finished = finished;
+        job->cl = cl;
+        if (job->done) {
+                pthread_mutex_unlock(&s->lock);
+                notify(s, job);
+                return;
+        }
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Function: sched_wait
+ * Does: Waits for a job to halt, fault or use up its budget (VM_YIELDED),
+ *       and for its sched_on_finish hook, then releases the job. The VM
+ *       goes back to the caller
+ * Paramters: sched, um_job
+ * Returns: vm_status
+ */
+vm_status sched_wait(sched s, um_job job)
+{
+        pthread_mutex_lock(&s->lock);
+        while (!job->done || !job->notified) {
+                pthread_cond_wait(&s->finished, &s->lock);
+        }
+        vm_status status = job->status;
+        pthread_mutex_unlock(&s->lock);
+
+        free(job);
+        return status;
+}
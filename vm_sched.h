@@ -0,0 +1,34 @@
+#ifndef VM_SCHED_INCLUDED
+#define VM_SCHED_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vm_interface.h"
+
+/* Priorities run from 0 (lowest) to SCHED_PRIORITIES - 1 (highest) */
+#define SCHED_PRIORITIES 4
+
+/* Instructions a VM runs before the scheduler looks at the queue again */
+#define SCHED_SLICE 65536
+
+typedef struct sched *sched;
+typedef struct um_job *um_job;
+
+/* Called on the worker that finishes a job, once it has and before
+ * sched_wait returns, with the closure given to sched_on_finish
+ */
+typedef void (*sched_finished)(um_vm vm, vm_status status, void *cl);
+
+sched sched_new(unsigned num_threads);
+void sched_free(sched *s);
+
+um_job sched_submit(sched s, um_vm vm, unsigned priority, uint64_t budget);
+void sched_feed(sched s, um_job job, const void *bytes, size_t length);
+void sched_close_input(sched s, um_job job);
+size_t sched_take_output(sched s, um_job job, void *bytes, size_t max);
+void sched_on_finish(sched s, um_job job, sched_finished finished,
+                     void *cl);
+vm_status sched_wait(sched s, um_job job);
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "write_barrier.h"
+#include "trap.h"
+
+/* The region currently guarded by this thread. A faulting store is always
+ * delivered to the thread that made it, so each thread running a UM keeps
+ * its own barrier.
+ */
+static __thread struct barrier {
+        uint32_t *words;
+        uint32_t num_words;
+        size_t bytes;
+        wb_invalidate_fn invalidate;
+        void *cl;
+        bool frozen;                    /* stores trap instead */
+} current;
+
+static struct sigaction old_action;
+static wb_fault_fn fallback_fn = NULL;
+static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+static size_t page_size = 0;
+
+/* Function: wb_page_size
+ * Does: Returns the size of a host page
+ * Paramters: None
+ * Returns: size_t
+ */
+size_t wb_page_size()
+{
+        if (page_size == 0) {
+                page_size = (size_t)sysconf(_SC_PAGESIZE);
+        }
+        return page_size;
+}
+
+static size_t round_to_pages(uint32_t num_words)
+{
+        size_t page = wb_page_size();
+        size_t bytes = (size_t)num_words * sizeof(uint32_t);
+
+        if (bytes == 0) {
+                bytes = 1;
+        }
+        return (bytes + page - 1) & ~(page - 1);
+}
+
+/* Function: wb_alloc_words
+ * Does: Allocates zeroed, page-aligned storage for a number of words, so
+ *       that it can later be protected without touching any neighbour
+ * Paramters: uint32_t
+ * Returns: uint32_t*
+ */
+uint32_t *wb_alloc_words(uint32_t num_words)
+{
+        void *words = mmap(NULL, round_to_pages(num_words),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+        if (words == MAP_FAILED) {
+                fprintf(stderr, "Error: Could not allocate segment\n");
+                exit(EXIT_FAILURE);
+        }
+        return words;
+}
+
+/* Function: wb_free_words
+ * Does: Releases storage from wb_alloc_words, disarming it if guarded
+ * Paramters: uint32_t*, uint32_t
+ * Returns: None
+ */
+void wb_free_words(uint32_t *words, uint32_t num_words)
+{
+        if (current.words == words) {
+                current.words = NULL;
+        }
+        munmap(words, round_to_pages(num_words));
+}
+
+/* Store into a guarded page: open the page, tell the cache which words went
+ * stale and let the store restart, or trap if the words are frozen. Faults
+ * elsewhere go to the fallback, then back to whoever handled SIGSEGV
+ * before us.
+ */
+static void wb_handler(int sig, siginfo_t *info, void *context)
+{
+        uintptr_t addr = (uintptr_t)info->si_addr;
+        uintptr_t base = (uintptr_t)current.words;
+        (void)context;
+
+        if (current.words != NULL && addr >= base &&
+            addr < base + current.bytes) {
+                if (current.frozen) {
+                        trap_raise(TRAP_SHARED_CODE);
+                }
+
+                uintptr_t page = addr & ~(uintptr_t)(page_size - 1);
+                uint32_t first = (page - base) / sizeof(uint32_t);
+                uint32_t count = page_size / sizeof(uint32_t);
+
+                mprotect((void *)page, page_size, PROT_READ | PROT_WRITE);
+                if (first < current.num_words) {
+                        if (count > current.num_words - first) {
+                                count = current.num_words - first;
+                        }
+                        current.invalidate(current.cl, first, count);
+                }
+                return;
+        }
+        if (fallback_fn != NULL && fallback_fn(info->si_addr)) {
+                return;
+        }
+
+        sigaction(sig, &old_action, NULL);
+}
+
+static void install_handler()
+{
+        struct sigaction action;
+
+        wb_page_size();
+        action.sa_sigaction = wb_handler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &old_action);
+}
+
+/* Function: wb_arm
+ * Does: Makes the words read-only so that the next store to any of their
+ *       pages on this thread reports those pages through invalidate. The
+ *       pages open says to leave writable stay as they are, so arming
+ *       again costs them no fault
+ * Paramters: uint32_t*, uint32_t, wb_invalidate_fn, wb_open_fn (NULL if
+ *            every page is guarded), void*
+ * Returns: None
+ */
+void wb_arm(uint32_t *words, uint32_t num_words, wb_invalidate_fn invalidate,
+            wb_open_fn open, void *cl)
+{
+        pthread_once(&install_once, install_handler);
+
+        current.words = words;
+        current.num_words = num_words;
+        current.bytes = round_to_pages(num_words);
+        current.invalidate = invalidate;
+        current.cl = cl;
+        current.frozen = false;
+
+        if (open == NULL) {
+                mprotect(words, current.bytes, PROT_READ);
+                return;
+        }
+
+        /* Closes each run of pages between open ones with one call */
+        uint32_t step = page_size / sizeof(uint32_t);
+        uint32_t run = 0;
+
+        for (uint32_t first = 0; first < num_words; first += step) {
+                if (open(cl, first)) {
+                        wb_protect_words(run, first - run);
+                        run = first + step;
+                }
+        }
+        if (run < num_words) {
+                wb_protect_words(run, num_words - run);
+        }
+}
+
+/* Function: wb_freeze
+ * Does: Makes every store into the words guarded on this thread trap
+ *       (TRAP_SHARED_CODE) until they are next armed, closing again any
+ *       page left open. For a segment 0 that other threads are running
+ *       from their own decoded copies, which a store could not reach
+ * Paramters: None
+ * Returns: None
+ */
+void wb_freeze()
+{
+        if (current.words == NULL) {
+                return;
+        }
+        current.frozen = true;
+        mprotect(current.words, current.bytes, PROT_READ);
+}
+
+/* Function: wb_protect_words
+ * Does: Closes the pages holding a range of guarded words again, once the
+ *       cache has caught up with them
+ * Paramters: uint32_t, uint32_t
+ * Returns: None
+ */
+void wb_protect_words(uint32_t first, uint32_t count)
+{
+        if (current.words == NULL || count == 0) {
+                return;
+        }
+
+        uintptr_t base = (uintptr_t)current.words;
+        uintptr_t lo = (base + (uintptr_t)first * sizeof(uint32_t)) &
+                       ~(uintptr_t)(page_size - 1);
+        uintptr_t hi = base + ((uintptr_t)first + count) * sizeof(uint32_t);
+
+        mprotect((void *)lo, hi - lo, PROT_READ);
+}
+
+/* Function: wb_set_fallback
+ * Does: Installs the handler if need be and offers it the faults that are
+ *       not the barrier's
+ * Paramters: wb_fault_fn
+ * Returns: None
+ */
+void wb_set_fallback(wb_fault_fn fallback)
+{
+        pthread_once(&install_once, install_handler);
+        fallback_fn = fallback;
+}
+
+/* Function: wb_detach
+ * Does: Stops reporting stores for this thread. The words stay read-only
+ *       so that the owner can arm them again later, possibly on another
+ *       thread
+ * Paramters: None
+ * Returns: None
+ */
+void wb_detach()
+{
+        current.words = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef WRITE_BARRIER_INCLUDED
+#define WRITE_BARRIER_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Called (from the SIGSEGV handler) with the range of words on a page that
+ * has just been written to. Must only touch plain memory.
+ */
+typedef void (*wb_invalidate_fn)(void *cl, uint32_t first, uint32_t count);
+
+/* Says whether the page starting at word first is to be left writable
+ * when the words are armed
+ */
+typedef bool (*wb_open_fn)(void *cl, uint32_t first);
+
+/* Offered (from the SIGSEGV handler) any fault outside the barrier.
+ * Returns false if it is not one it knows.
+ */
+typedef bool (*wb_fault_fn)(void *addr);
+
+/* Segment 0's words come from wb_alloc_words (mem_interface.c); the
+ * decoded program arms the barrier over them and detaches it when parked
+ * (decode_attach, decode_detach, decode_refresh in decode.c), and the UM
+ * freezes it once its segment 0 is shared (vm_interface.c, threads.c)
+ */
+size_t wb_page_size();
+uint32_t *wb_alloc_words(uint32_t num_words);
+void wb_free_words(uint32_t *words, uint32_t num_words);
+
+void wb_arm(uint32_t *words, uint32_t num_words, wb_invalidate_fn invalidate,
+            wb_open_fn open, void *cl);
+void wb_protect_words(uint32_t first, uint32_t count);
+void wb_freeze();
+void wb_detach();
+void wb_set_fallback(wb_fault_fn fallback);
+
+#endif